@@ -9,11 +9,31 @@
 #include <fcntl.h>              
 #include <unistd.h>             
 #include <errno.h>              
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/ioctl.h>          
 #include <sys/mman.h>           
 #include <sys/socket.h>         
+#include <sys/uio.h>
 #include <arpa/inet.h>          
 #include <linux/videodev2.h>    
+#include <linux/sockios.h>
+#include "jpeg.h"
+#include "motion.h"
+#include "ring.h"
+#include "protocol.h"
+#include "encoder.h"
+#include "pixconv.h"
+#include "preview.h"
+#include "rawcodec.h"
+#include "roi.h"
+#include "watchdog.h"
+#include "exposure.h"
+#include "spool.h"
+#include "stripe.h"
+#include "fec.h"
+#include "replica.h"
 
 /* Defines the device path, resolution, and server connection details. */
 #define DEVICE "/dev/video0"
@@ -21,268 +41,2525 @@
 #define HEIGHT 480
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 8080
+/* Most storage servers given with -s. The client stays on one server until it fails, then moves to the next. */
+#define MAX_SERVERS 8
+/* Default number of frames captured before the client exits (-n; 0 runs until SIGINT or SIGTERM). */
 #define FRAME_COUNT 10
+/* Bounds for the requantization scale (percent of the camera's own quantization tables) used to meet a target frame size. */
+#define REQUANT_SCALE_MIN 100
+#define REQUANT_SCALE_MAX 800
+/* Default interval (seconds) between keepalive frames when motion gating suppresses a static scene. */
+#define KEEPALIVE_SECONDS 10
+/* Default memory cap (MB) and maximum number of frames of the pre-event ring. The memory is allocated once at startup. */
+#define PREROLL_MEMORY_MB 32
+#define PREROLL_MAX_FRAMES 1024
+/* Default JPEG quality used with -q when none is given, for cameras that only offer raw formats (YUYV, UYVY, NV12). */
+#define ENCODER_QUALITY 85
+/* Default frame rate and JPEG quality of the live preview stream, and the amount of unsent data in the socket (bytes)
+   above which the connection counts as congested and preview frames are dropped. */
+#define PREVIEW_FPS 5
+#define PREVIEW_QUALITY 60
+#define PREVIEW_MAX_QUEUED (64 * 1024)
 
-/* Tracks memory buffers shared with the camera driver. Stores the user-space pointer and length for each buffer to enable data access. */
+/* Capture restarts after a source change: attempts, and pause between them while the new signal settles. */
+#define RESTART_ATTEMPTS 5
+#define RESTART_RETRY_MS 100
+
+/* Offline spool: default size (MB) of the spool file (one per camera), and default rate (frames per second) at which
+   spooled frames are replayed alongside the live stream once the server is back. */
+#define SPOOL_MB 64
+#define SPOOL_PATH "spool_cam%u.bin"
+#define CATCHUP_FPS 15
+/* Reconnection: pause after the first failed attempt (doubled at every further failure, up to the maximum), time
+   allowed for a connection to complete, and time a blocked send may take before the server counts as gone. */
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 10000
+#define CONNECT_TIMEOUT_MS 2000
+#define SEND_TIMEOUT_S 5
+/* Default time (ms) the oldest unacknowledged frame may wait for its acknowledgement before the server counts as failed. */
+#define ACK_TIMEOUT_MS 1000
+/* Default memory (MB) and maximum number of frames of the resend history: the frames sent last, which are sent again
+   after a reconnection unless the server reports it stored them. It must cover the socket buffers of both ends. */
+#define RESEND_MEMORY_MB 16
+#define RESEND_MAX_FRAMES 1024
+/* Replication fan-out (-D): default time (ms) a replica may lag behind the primary server before it is declared dead
+   and stops holding frames in the resend history. */
+#define REPLICA_MAX_LAG_MS 2000
+/* Longest wait for the camera while the client is offline or catching up, so reconnecting and replaying keep going. */
+#define NETWORK_POLL_MS 50
+
+/* Tracks memory buffers shared with the camera driver. Stores the user-space pointer and length for each buffer to enable data access.
+   Multi-planar buffers (NV12M, YUV420M) have one mapping per plane; single-planar buffers only use the first. */
 struct buffer_info {
-    void *start;
-    size_t length;
+    void *start[VIDEO_MAX_PLANES];
+    size_t length[VIDEO_MAX_PLANES];
+};
+
+struct buffer_info *buffers;
+unsigned int n_buffers;
+enum v4l2_buf_type buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // Becomes V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE for devices that only offer the multi-planar API
+unsigned int n_planes = 1; // Memory planes per buffer
+unsigned int plane_stride[VIDEO_MAX_PLANES]; // Bytes per line of each plane, as chosen by the driver
+int source_events = 0; // Set when the driver reports source changes (V4L2_EVENT_SOURCE_CHANGE)
+long source_changes = 0; // Capture restarts after a change of resolution or format
+struct watchdog watchdog; // Detects stalled capture and picks the recovery step
+long frames_zero_copy = 0; // Multi-planar frames sent straight from the driver's planes
+double target_fps = 0; // Frame rate held by exposure control (0 leaves exposure to the camera)
+struct exposure_control exposure; // Measures the frame interval and adjusts exposure and gain
+int fd_cam = -1; // File descriptor for the camera device
+int fd_sock = -1; // File descriptor for the network socket
+/* Storage servers, in order of preference (SERVER_IP:SERVER_PORT unless -s is given). */
+struct server_address {
+    char host[64];
+    int port;
 };
+struct server_address servers[MAX_SERVERS];
+int n_servers = 0;
+int current_server = 0; // Server connected to, or to be tried next
+int servers_tried = 0; // Failed attempts in the current round over the list; the backoff only starts after a full round
+int connected_server = -1; // Server of the last successful connection
+int connected = 0; // Set while the server connection is up; frames are spooled otherwise
+int connecting = 0; // Set while a non-blocking connection attempt is in progress on fd_sock
+/* Steps of a connection attempt, each completed from the capture loop as the socket becomes ready, so a server that
+   is slow to answer never blocks capture. */
+enum connect_step { CONNECT_TCP, CONNECT_HANDSHAKE, CONNECT_REPLAY, CONNECT_STRIPES };
+int connect_step = CONNECT_TCP; // Step of the attempt in progress
+int64_t connect_deadline_us = 0; // Time the current step must be done by, or make progress by (replay)
+uint8_t handshake_reply[sizeof(struct hello_reply) + sizeof(struct resume_reply)]; // Answers to the handshake, as they arrive
+size_t handshake_len = 0, handshake_received = 0;
+/* Frames of the history sent again on a resumed connection, as far as the socket takes them without blocking: the
+   next one, and the message type, header and filename of that frame with the bytes of its message already sent. */
+uint64_t replay_next = 0;
+uint8_t replay_prefix[sizeof(int) + sizeof(struct frame_header) + 64];
+size_t replay_prefix_len = 0;
+size_t replay_offset = 0;
+int replay_frames = 0; // Frames the resume sends again
+uint8_t replay_tail[sizeof(int) + sizeof(struct stripe_join)]; // Sent after them: the announcement of the stripe group
+size_t replay_tail_len = 0, replay_tail_sent = 0;
+int64_t reconnect_at_us = 0; // Monotonic time of the next connection attempt
+int64_t reconnect_delay_us = RECONNECT_MIN_MS * 1000LL;
+int64_t offline_since_us = 0; // Monotonic time the connection was lost (0 while connected)
+struct spool spool; // Frames waiting for the server, in a mapped file
+pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes spool updates from the capture and encoder threads
+long spool_mb = SPOOL_MB;
+double catchup_fps = CATCHUP_FPS;
+long reconnects = 0;
+long frames_spooled = 0; // Frames written to the spool, replayed from it, and lost (spool disabled, or frame too large)
+long frames_replayed = 0;
+long frames_lost = 0;
+uint64_t session_id = 0; // Random identifier of this run, which numbers its frames together with capture_sequence
+struct frame_ring resend; // Frames sent recently, in send order, in case the connection loses them
+long resend_memory_mb = RESEND_MEMORY_MB;
+uint64_t resend_first = 0; // Number of the oldest frame in the resend history; frames are numbered in the order they were sent
+int64_t *resend_sent_us = NULL; // Time each entry of the history was sent to the primary server, by entry slot
+uint64_t primary_acked = 0; // Number of the first frame the primary server has not acknowledged
+long frames_resent = 0;
+int ack_timeout_ms = ACK_TIMEOUT_MS;
+int64_t ack_wait_since_us = 0; // Time since which the oldest unacknowledged frame waits (0 if none)
+uint8_t ack_buffer[sizeof(struct frame_ack)]; // Acknowledgement being received, and its bytes so far
+size_t ack_received = 0;
+long ack_timeouts = 0; // Servers given up because acknowledgements stopped
+long failovers = 0; // Moves to another server, with the time from failure detection to the resumed stream
+int64_t failover_since_us = 0;
+int64_t failover_total_us = 0;
+int64_t failover_longest_us = 0;
+long failover_replayed = 0; // Unacknowledged frames sent again to the new server
+/* Striped connections (-N): the recorded frames are spread over that many extra connections to the server, while the
+   server connection keeps the resume, the acknowledgements and the preview stream. */
+int stripe_count = 0;
+struct stripe_set stripes;
+uint64_t stripe_group = 0; // Numbers the stripe groups of this session, one per connection to the server
+uint64_t stripe_order = 0; // Order of the last frame given to the stripes in the current group
+/* Striped connections of the connection attempt in progress, opened without blocking once the history is sent again. */
+enum stripe_opening_state { OPENING_CONNECT, OPENING_ANSWER, OPENING_READY };
+struct stripe_opening {
+    int fd;
+    int state;
+    uint8_t reply[sizeof(struct hello_reply)]; // Answer to the stream negotiation (compressed streams only)
+    size_t received;
+} openings[MAX_STRIPES];
+int openings_count = 0;
+/* Replica servers (-D), sent every frame from the resend history (see replica.h). */
+struct replica_set replicas = { .ctx.max_lag_ms = REPLICA_MAX_LAG_MS };
+long frame_count = FRAME_COUNT; // Frames to capture before exiting (0: until a signal asks to stop)
+volatile sig_atomic_t stop_requested = 0; // Set by SIGINT or SIGTERM: the capture loop ends and the client shuts down
+long frames_kept_at_exit = 0; // Unacknowledged frames of the history written to the spool at exit
+long target_frame_bytes = 0; // Target size of an MJPEG frame on the wire (0 sends frames unchanged)
+int requant_scale = REQUANT_SCALE_MIN; // Quantization scale currently chosen by the frame size controller
+unsigned int frame_width = WIDTH; // Geometry and pixel format actually negotiated with the driver
+unsigned int frame_height = HEIGHT;
+unsigned int frame_pixfmt = V4L2_PIX_FMT_MJPEG;
+int motion_threshold = -1; // Minimum activity score (hundredths of a grey level) for a frame to be sent; -1 disables gating
+int keepalive_seconds = KEEPALIVE_SECONDS;
+long frames_suppressed = 0;
+unsigned int camera_id = 0; // Identifies this camera to the server, which keeps one stream index per camera
+int preroll_seconds = 0; // Seconds of video before an event that are kept in memory and sent when it triggers
+int postroll_seconds = 0; // Seconds of video still sent after the last activity of an event
+long preroll_memory_mb = PREROLL_MEMORY_MB;
+struct frame_ring preroll; // Recent suppressed frames, flushed when an event starts
+int64_t event_until_us = 0; // Capture time at which the current event's post-roll ends
+uint64_t capture_sequence = 0; // Number of frames dequeued from the driver so far
+int encode_quality = 0; // JPEG quality for raw frames encoded in software (0 sends raw frames as they are)
+int encoder_threads = 0; // Encoder threads (0 uses one per online CPU)
+int encoder_running = 0;
+int preview_factor = 0; // Downscale factor of the live preview stream (0 disables it)
+double preview_fps = PREVIEW_FPS;
+long previews_sent = 0;
+long previews_dropped = 0;
+int preview_udp = 0; // Set by -u: previews go over UDP with parity fragments, to the server's port number
+int udp_sock = -1;
+struct fec_sender preview_fec;
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER; // Keeps messages from the capture and encoder threads whole on the socket
+uint32_t compression_method = COMPRESSION_NONE; // Lossless compression of raw payloads, once accepted by the server
+struct roi roi_request; // Region of interest given with -r (zero width sends whole frames)
+struct roi roi; // The same region fitted to the negotiated frame
+int roi_software = 0; // Set when the driver cannot crop to the region, so frames are cropped after capture
+int keyframe_interval = 0; // Inter-frame coding: a self-contained keyframe every this many raw frames (0 disables it)
+long delta_frames = 0;
+int keyframe_required = 0; // Set when the server lost the reference of the next delta frame: the next raw frame is a keyframe
+long delta_frames_skipped = 0; // Delta frames not sent again on a resumed stream, as the server lacks their keyframe
+uint64_t raw_bytes_in = 0; // Raw payload bytes before and after compression, for the final report
+uint64_t raw_bytes_out = 0;
+
+/* Wrapper function for the ioctl system call. Retries the call automatically if interrupted by a system signal (EINTR), increasing robustness. */
+static int xioctl(int fh, int request, void *arg) {
+    int r;
+    do {
+    /*It is the system call that enables sending control and configuration commands to a device driver, performing operations that cannot be handled by standard read or write calls.
+    In my project, I use it to set the video format, manage memory buffers, and start or stop the streaming.*/
+        r = ioctl(fh, request, arg);
+
+    } while (-1 == r && errno == EINTR); // Retry if  ioctl interrupted by signal
+    return r;
+}
+
+/**
+ * @brief Current time of the monotonic clock in microseconds, for deadlines that must not jump with the wall clock.
+ */
+int64_t monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Closes a connection that failed, so frames go to the spool until a server is reachable again.
+ * Called with send_lock held. Frames the server did not acknowledge stay in the resend history. The next attempt goes
+ * to the next server of the list straight away.
+ */
+void drop_connection(const char *reason) {
+    fprintf(stderr, "[NET] Connection to %s:%d lost (%s); spooling frames.\n", servers[current_server].host,
+            servers[current_server].port, reason);
+    close(fd_sock);
+    fd_sock = -1;
+    stripe_close(&stripes, 0);
+    connected = 0;
+    ack_received = 0;
+    ack_wait_since_us = 0;
+    offline_since_us = monotonic_us();
+    failover_since_us = offline_since_us;
+    current_server = (current_server + 1) % n_servers;
+    servers_tried = 0;
+    reconnect_at_us = n_servers > 1 ? offline_since_us : offline_since_us + reconnect_delay_us;
+}
+
+/**
+ * @brief Builds what precedes the payload in a frame message: message type, extended frame header and filename.
+ * The filename is derived from the session and sequence number, so a frame sent again after a reconnection overwrites
+ * its own file at the server instead of being stored twice.
+ * @param out Room for sizeof(int) + sizeof(struct frame_header) + 64 bytes.
+ * @return Bytes written to out.
+ */
+size_t frame_message_prefix(const struct frame_header *meta, long file_size, uint8_t *out) {
+    char filename[64];
+    struct frame_header header;
+    size_t offsets[3];
+    int msg = MSG_FRAME;
+
+    /* Uses .raw extension as the data matches the camera sensor output (MJPEG/YUYV) without a container. */
+    snprintf(filename, sizeof(filename), "frame_%016llx_%06llu.raw", (unsigned long long)meta->session,
+             (unsigned long long)meta->sequence);
+
+    /* Describes the frame: capture metadata, geometry and pixel format (recorded at capture), payload size.
+       The timestamp is the original capture time, even for frames sent late from the pre-event ring. */
+    header = *meta;
+    header.size = file_size;
+    header.name_len = strlen(filename);
+
+    /* Plane layout of raw frames, whatever path they took (cropping changes it, encoding turns the frame into one JPEG). */
+    header.planes = pixconv_plane_offsets(header.pixelformat, header.width, header.height, offsets);
+    memset(header.plane_offset, 0, sizeof(header.plane_offset));
+    if (header.planes == 0)
+        header.planes = 1;
+    for (uint32_t i = 0; i < header.planes; i++)
+        header.plane_offset[i] = (uint32_t)offsets[i];
+
+    memcpy(out, &msg, sizeof(msg));
+    memcpy(out + sizeof(msg), &header, sizeof(header));
+    memcpy(out + sizeof(msg) + sizeof(header), filename, header.name_len);
+    return sizeof(msg) + sizeof(header) + header.name_len;
+}
+
+/**
+ * @brief Writes one frame message on the socket: message type, extended frame header, filename, then the payload.
+ * The payload may be scattered over several pieces (the planes of a multi-planar buffer), which are sent in order with
+ * writev() straight from where they are, so no contiguous copy of the frame is ever made.
+ * Called with send_lock held.
+ * @return Payload size on success, -1 if the connection failed (errno tells why).
+ */
+long write_frame_message(const struct iovec *pieces, int count, const struct frame_header *meta) {
+    uint8_t prefix[sizeof(int) + sizeof(struct frame_header) + 64];
+    struct iovec iov[VIDEO_MAX_PLANES + 1];
+    long file_size = 0;
+
+    for (int i = 0; i < count; i++) {
+        iov[i + 1] = pieces[i];
+        file_size += pieces[i].iov_len;
+    }
+
+    /* The header goes out in the same writev() as the payload, which lets the server prepare for the incoming stream. */
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = frame_message_prefix(meta, file_size, prefix);
+    count++;
+    
+    /* Loops until every piece is sent; after a partial write the remaining pieces are advanced past what went out.
+       A send that times out fails too: a server that stops reading counts as gone. */
+    struct iovec *next = iov;
+    long total_sent = 0;
+    long total = (long)iov[0].iov_len + file_size;
+    while (total_sent < total) {
+        ssize_t sent = writev(fd_sock, next, count - (int)(next - iov)); // sends as many pieces as the socket takes
+        if (sent < 0)
+            return -1;
+        total_sent += sent;
+        while (sent > 0 && (size_t)sent >= next->iov_len) {
+            sent -= next->iov_len;
+            next++;
+        }
+        if (sent > 0) {
+            next->iov_base = (char *)next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+    return file_size;
+}
+
+/**
+ * @brief Hands a frame to the striped connections, numbered with its order in the stripe group.
+ * Only this copy gets the order: the resend history keeps the frame as it is, since frames sent again after a
+ * reconnection go on the server connection, before the new group starts. Called with send_lock held.
+ * @return Payload size on success, -1 if a striped connection failed.
+ */
+long send_striped(const struct iovec *pieces, int count, const struct frame_header *meta) {
+    uint8_t prefix[sizeof(int) + sizeof(struct frame_header) + 64];
+    struct frame_header header = *meta;
+    long file_size = 0;
+
+    for (int i = 0; i < count; i++)
+        file_size += pieces[i].iov_len;
+    header.order = ++stripe_order;
+    size_t prefix_len = frame_message_prefix(&header, file_size, prefix);
+    return stripe_send(&stripes, prefix, prefix_len, pieces, count) == 0 ? file_size : -1;
+}
+
+/**
+ * @brief Copies a frame just sent to the primary server into the resend history, where the replicas send it from.
+ * Called with send_lock held. When the history is full, the oldest frames are evicted, acknowledged or not.
+ */
+void resend_push(const struct iovec *pieces, int count, const struct frame_header *meta) {
+    unsigned int before = resend.count;
+
+    if (ring_pushv(&resend, pieces, count, meta) < 0)
+        return;
+    resend_first += before + 1 - resend.count;
+    const struct ring_entry *entry = ring_at(&resend, resend.count - 1);
+    resend_sent_us[entry - resend.entries] = monotonic_us();
+    if (ack_wait_since_us == 0)
+        ack_wait_since_us = resend_sent_us[entry - resend.entries];
+}
+
+/**
+ * @brief Finds a frame in the resend history, newest first (a server's last frame is normally near the end).
+ * A session of 0 matches any session, for the last frame of an index written by an older client.
+ * @return Position of the frame in the history (0 is the oldest), -1 if it is not there.
+ */
+long resend_find(uint64_t session, uint64_t sequence, int64_t capture_us) {
+    for (unsigned int i = resend.count; i-- > 0;) {
+        const struct ring_entry *entry = ring_at(&resend, i);
+        if (entry->header.sequence == sequence && entry->header.capture_us == capture_us &&
+            (session == 0 || entry->header.session == session))
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds the keyframe a frame of the history is decoded from: the last entry at or before position i that is
+ * not a delta frame (a frame that is not a delta is its own keyframe). Called with send_lock held.
+ * @return Position of the keyframe in the history, -1 if the history no longer holds it.
+ */
+long resend_keyframe(unsigned int i) {
+    for (long k = i; k >= 0; k--)
+        if (ring_at(&resend, (unsigned int)k)->header.compression != COMPRESSION_LZ_XOR)
+            return k;
+    return -1;
+}
+
+/**
+ * @brief Returns the compression methods the frames of the history may be coded with, which a replica must accept.
+ */
+uint32_t history_compression() {
+    uint32_t methods = compression_method != COMPRESSION_NONE ? 1u << compression_method : 0;
+
+    if (keyframe_interval > 0)
+        methods |= 1u << COMPRESSION_LZ_XOR;
+    return methods;
+}
+
+/**
+ * @brief Drops the frames every holder of the history has acknowledged: the primary server and each replica that is
+ * not declared dead. Called with send_lock held.
+ * With inter-frame coding, the keyframe of the oldest frame still unacknowledged is kept with the frames after it,
+ * acknowledged or not, so a server that has none of them (after a failover) can be sent the stream from a keyframe.
+ */
+void resend_trim() {
+    uint64_t keep = replicas_acked(&replicas, primary_acked);
+
+    if (keyframe_interval > 0 && keep > resend_first && resend.count > 0) {
+        uint64_t last = resend_first + resend.count - 1; // When all are acknowledged, the next frame may be a delta on it
+        long key = resend_keyframe((unsigned int)((keep < last ? keep : last) - resend_first));
+        if (key >= 0)
+            keep = resend_first + key;
+    }
+    while (resend.count > 0 && resend_first < keep) {
+        ring_drop_oldest(&resend);
+        resend_first++;
+    }
+}
+
+/**
+ * @brief Handles network transmission of image data.
+ * Sent frames are also copied to the resend history, as a frame the kernel accepted can still be lost with the
+ * connection; the server tells which ones it stored when the client reconnects (see resume_session()). That copy is
+ * the only one made: replicas are sent the frame from there (see replica.c).
+ * @return 0 once the frame is sent, -1 if the client is offline or the connection failed (the frame was not sent).
+ */
+int send_planes_via_network(const struct iovec *pieces, int count, const struct frame_header *meta) {
+    pthread_mutex_lock(&send_lock);
+    if (!connected) {
+        pthread_mutex_unlock(&send_lock);
+        return -1;
+    }
+    long file_size = stripes.count > 0 ? send_striped(pieces, count, meta) : write_frame_message(pieces, count, meta);
+    if (file_size < 0) {
+        drop_connection(stripes.count > 0 ? "a striped connection failed" : strerror(errno));
+        pthread_mutex_unlock(&send_lock);
+        return -1;
+    }
+    if (resend.data != NULL)
+        resend_push(pieces, count, meta);
+    pthread_mutex_unlock(&send_lock);
+    printf("[CLIENT] Successfully transmitted frame %llu (%ld bytes)\n", (unsigned long long)meta->sequence, file_size);
+    return 0;
+}
+
+/**
+ * @brief Sends a frame held in one contiguous buffer.
+ * @return 0 once the frame is sent, -1 if it was not.
+ */
+int send_frame_via_network(const void *p, int size, const struct frame_header *meta) {
+    struct iovec piece = { (void *)p, (size_t)size };
+    return send_planes_via_network(&piece, 1, meta);
+}
+
+/**
+ * @brief Keeps a frame that could not be sent in the offline spool, to be replayed once the server is back.
+ */
+void spool_frame(const struct iovec *pieces, int count, const struct frame_header *meta) {
+    pthread_mutex_lock(&spool_lock);
+    if (spool.map != NULL && spool_append(&spool, pieces, count, meta) == 0)
+        frames_spooled++;
+    else
+        frames_lost++;
+    pthread_mutex_unlock(&spool_lock);
+}
+
+/**
+ * @brief Tells whether frames currently reach the server in capture order: connected, with nothing left to replay.
+ * Delta frames are only coded then, as the server decodes each one against the frame stored just before it.
+ */
+int stream_in_order() {
+    return connected && (spool.map == NULL || spool.file->count == 0);
+}
+
+/**
+ * @brief Sends a preview over UDP to the server currently in use, as data and parity datagrams (see fec.h). Nothing
+ * waits for the recorded stream or for the TCP connection: a lost datagram is rebuilt from parity or its frame dropped.
+ */
+void send_preview_udp(const struct frame_header *header, const uint8_t *jpeg) {
+    struct sockaddr_in address;
+    struct iovec pieces[2] = {{(void *)header, sizeof(*header)}, {(void *)jpeg, header->size}};
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(servers[current_server].port);
+    if (inet_pton(AF_INET, servers[current_server].host, &address.sin_addr) <= 0 ||
+        fec_encode(&preview_fec, header->camera_id, pieces, 2) < 0) {
+        previews_dropped++;
+        return;
+    }
+    if (fec_send(&preview_fec, udp_sock, &address) < 0) {
+        previews_dropped++; // The datagrams that left still count as sent by the FEC counters
+        return;
+    }
+    previews_sent++;
+}
+
+/**
+ * @brief Sends a downscaled JPEG copy of a frame on the preview stream, at most preview_fps times per second.
+ * The recorded stream has priority on the connection: a preview is dropped when the socket still holds more than
+ * PREVIEW_MAX_QUEUED unsent bytes, or when a recorded frame is being sent at that very moment. Recorded frames are
+ * never dropped; they simply wait for the connection. Over UDP (-u), previews do not share the connection at all.
+ */
+void send_preview(const void *p, int size, const struct frame_header *meta) {
+    static struct preview_encoder encoder; // Work buffers reused across previews
+    static int64_t last_preview_us = 0;
+    struct frame_header header;
+    const char *filename = "preview.jpg";
+    int msg = MSG_FRAME;
+    int queued = 0;
+
+    if ((!connected && !preview_udp) || meta->capture_us - last_preview_us < (int64_t)(1000000 / preview_fps))
+        return; // Previews are for live viewing: they are never spooled
+    last_preview_us = meta->capture_us;
+
+    /* SIOCOUTQ reports the bytes not yet acknowledged by the server: a growing backlog means the link is saturated. */
+    if (!preview_udp && ioctl(fd_sock, SIOCOUTQ, &queued) == 0 && queued > PREVIEW_MAX_QUEUED) {
+        previews_dropped++;
+        return;
+    }
+
+    long jpeg_size = preview_encode(&encoder, p, size, meta->pixelformat, (int)meta->width, (int)meta->height,
+                                    preview_factor, PREVIEW_QUALITY);
+    if (jpeg_size < 0) {
+        fprintf(stderr, "[CLIENT] Preview of frame %llu could not be encoded\n", (unsigned long long)meta->sequence);
+        return;
+    }
+
+    header = *meta;
+    header.stream = STREAM_PREVIEW;
+    header.pixelformat = V4L2_PIX_FMT_MJPEG;
+    header.width = encoder.width;
+    header.height = encoder.height;
+    header.size = jpeg_size;
+    header.name_len = strlen(filename);
+    if (preview_udp) {
+        header.name_len = 0;
+        send_preview_udp(&header, encoder.out);
+        return;
+    }
+
+    /* Never waits for the encoder threads: if one of them is sending, this preview is skipped. */
+    if (pthread_mutex_trylock(&send_lock) != 0) {
+        previews_dropped++;
+        return;
+    }
+    if (!connected) {
+        pthread_mutex_unlock(&send_lock);
+        return;
+    }
+    if (send(fd_sock, &msg, sizeof(msg), 0) != sizeof(msg) || send(fd_sock, &header, sizeof(header), 0) != sizeof(header) ||
+        send(fd_sock, filename, header.name_len, 0) != (ssize_t)header.name_len) {
+        drop_connection(strerror(errno));
+        pthread_mutex_unlock(&send_lock);
+        return;
+    }
+    long total_sent = 0;
+    while (total_sent < jpeg_size) {
+        int sent = send(fd_sock, encoder.out + total_sent, jpeg_size - total_sent, 0);
+        if (sent < 0) {
+            drop_connection(strerror(errno));
+            pthread_mutex_unlock(&send_lock);
+            return;
+        }
+        total_sent += sent;
+    }
+    pthread_mutex_unlock(&send_lock);
+    previews_sent++;
+}
+
+/**
+ * @brief Shrinks an MJPEG frame towards target_frame_bytes before transmission.
+ * The frame is requantized in the DCT domain (entropy decode, coarser quantization, entropy re-encode), which is far cheaper than a pixel-domain transcode.
+ * On success *p and *size are redirected to the smaller copy; otherwise the original frame is kept.
+ */
+void fit_frame_to_target(const void **p, int *size) {
+    static uint8_t *requant_buf = NULL; // Output buffer reused across frames
+    static size_t requant_cap = 0;
+    struct jpeg_image img;
+
+    /* Frames already within the budget are sent untouched as long as the controller is at its finest scale. */
+    if (*size <= target_frame_bytes && requant_scale == REQUANT_SCALE_MIN)
+        return;
+
+    if (jpeg_decode(*p, *size, &img) < 0)
+        return;
+    jpeg_requantize(&img, requant_scale);
+    long out_size = jpeg_encode(&img, &requant_buf, &requant_cap);
+    jpeg_free(&img);
+    if (out_size < 0)
+        return;
+
+    /* Adjusts the scale for the next frame: coarser quickly while over budget, finer slowly once there is headroom. */
+    if (out_size > target_frame_bytes && requant_scale < REQUANT_SCALE_MAX)
+        requant_scale += requant_scale / 4;
+    else if (out_size < target_frame_bytes * 85 / 100 && requant_scale > REQUANT_SCALE_MIN)
+        requant_scale -= requant_scale / 8;
+    if (requant_scale > REQUANT_SCALE_MAX) requant_scale = REQUANT_SCALE_MAX;
+    if (requant_scale < REQUANT_SCALE_MIN) requant_scale = REQUANT_SCALE_MIN;
+
+    if (out_size < *size) {
+        *p = requant_buf;
+        *size = (int)out_size;
+    }
+}
+
+/**
+ * @brief Compresses a raw frame losslessly with the method agreed with the server (see rawcodec.h).
+ * With inter-frame coding, frames between keyframes are sent as the XOR with the previously sent frame, which is
+ * almost entirely zero for a static scene. The previously sent frame is kept whatever its coding, so motion gating
+ * and pre-roll flushes, which only change which frames are sent, never break the chain. Frames going to the offline
+ * spool, and the first frame after it is drained, are keyframes: replayed and live frames are interleaved at the server.
+ * On success *p and *size are redirected to the compressed copy and header->compression is set; otherwise the frame
+ * is sent uncompressed, which the server also treats as a keyframe.
+ */
+void compress_raw_frame(const void **p, int *size, struct frame_header *header) {
+    static struct raw_compressor compressor; // Hash table and delta buffer reused across frames
+    static uint8_t *packed = NULL;
+    static size_t packed_cap = 0;
+    static uint8_t *reference = NULL; // Last raw frame sent, the base of the next delta frame
+    static size_t reference_size = 0, reference_cap = 0;
+    static int since_keyframe = 0;
+    static int reference_in_order = 0; // The reference went straight to the server, so it is the last frame stored there
+    size_t needed = rawcodec_bound(*size);
+    long packed_size = -1;
+    int in_order = stream_in_order();
+
+    if (keyframe_required) {
+        keyframe_required = 0;
+        reference_in_order = 0;
+    }
+    int inter = keyframe_interval > 0 && reference_size == (size_t)*size && since_keyframe < keyframe_interval &&
+                in_order && reference_in_order;
+
+    if (needed > packed_cap) {
+        uint8_t *grown = realloc(packed, needed);
+        if (grown != NULL) {
+            packed = grown;
+            packed_cap = needed;
+        }
+    }
+    if (packed_cap >= needed) {
+        if (inter)
+            packed_size = rawcodec_compress_inter(&compressor, *p, reference, *size, header->pixelformat, packed, packed_cap);
+        else
+            packed_size = rawcodec_compress(&compressor, *p, *size, compression_method, header->pixelformat, packed, packed_cap);
+    }
+
+    if (keyframe_interval > 0) {
+        since_keyframe = packed_size >= 0 && inter ? since_keyframe + 1 : 1;
+        if ((size_t)*size > reference_cap) {
+            uint8_t *grown = realloc(reference, *size);
+            if (grown == NULL) {
+                reference_size = 0; // No reference: the next frame is a keyframe
+                since_keyframe = keyframe_interval;
+            } else {
+                reference = grown;
+                reference_cap = *size;
+            }
+        }
+        if ((size_t)*size <= reference_cap) {
+            memcpy(reference, *p, *size);
+            reference_size = *size;
+            reference_in_order = in_order;
+        }
+    }
+    if (packed_size < 0)
+        return;
+
+    raw_bytes_in += *size;
+    raw_bytes_out += packed_size;
+    header->compression = ((const struct rawcodec_header *)packed)->method;
+    if (header->compression == COMPRESSION_LZ_XOR)
+        delta_frames++;
+    *p = packed;
+    *size = (int)packed_size;
+}
+
+/**
+ * @brief Sends a frame, requantizing it first when a target size is configured so it fits the available bandwidth.
+ * Raw frames are handed to the encoder pool when software encoding is enabled; the pool calls this function again
+ * with the resulting JPEG, in capture order. Raw frames sent as they are get compressed losslessly if enabled.
+ * A frame that cannot be sent goes to the offline spool.
+ */
+void transmit_frame(const void *p, int size, const struct frame_header *meta) {
+    struct frame_header header = *meta;
+
+    if (encoder_running && meta->pixelformat != V4L2_PIX_FMT_MJPEG) {
+        encoder_submit(p, size, meta);
+        return;
+    }
+    if (target_frame_bytes > 0)
+        fit_frame_to_target(&p, &size);
+    const void *raw = p;
+    int raw_size = size;
+    if (compression_method != COMPRESSION_NONE && meta->pixelformat != V4L2_PIX_FMT_MJPEG)
+        compress_raw_frame(&p, &size, &header);
+    if (send_frame_via_network(p, size, &header) == 0)
+        return;
+
+    /* A delta frame needs the frame before it, which the connection may have lost: it is spooled self-contained. */
+    if (header.compression == COMPRESSION_LZ_XOR) {
+        raw_bytes_in -= raw_size;
+        raw_bytes_out -= size;
+        delta_frames--;
+        header = *meta;
+        p = raw;
+        size = raw_size;
+        compress_raw_frame(&p, &size, &header);
+    }
+    struct iovec piece = { (void *)p, (size_t)size };
+    spool_frame(&piece, 1, &header);
+}
+
+/**
+ * @brief Converts the driver timestamp of a buffer to wall-clock microseconds.
+ * Most drivers stamp buffers with CLOCK_MONOTONIC, which is shifted by the current offset between the two clocks.
+ */
+int64_t capture_time_us(const struct v4l2_buffer *buf) {
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+
+    int64_t real_us = (int64_t)real.tv_sec * 1000000 + real.tv_nsec / 1000;
+    int64_t stamp_us = (int64_t)buf->timestamp.tv_sec * 1000000 + buf->timestamp.tv_usec;
+    if (stamp_us == 0 || (buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        return real_us;
+    return stamp_us + real_us - ((int64_t)mono.tv_sec * 1000000 + mono.tv_nsec / 1000);
+}
+
+/**
+ * @brief Sends every frame held in the pre-event ring, oldest first, with their original capture metadata.
+ */
+void flush_preroll() {
+    for (unsigned int i = 0; i < preroll.count; i++) {
+        const struct ring_entry *entry = ring_at(&preroll, i);
+        transmit_frame(ring_payload(&preroll, entry), (int)entry->header.size, &entry->header);
+    }
+    ring_clear(&preroll);
+}
+
+/**
+ * @brief Decides whether a frame is worth transmitting when motion gating is enabled.
+ * Compares the frame's 1/8-scale luma plane with the previous frame's. An active frame starts (or extends) an event:
+ * the buffered pre-roll is flushed first, and frames keep being sent until postroll_seconds after the last activity.
+ * Outside events frames are suppressed and kept in the pre-event ring, except that one frame is always sent
+ * every keepalive_seconds so the server knows the camera is alive.
+ * The score is recorded in meta->activity, so the server can index it without analysing the frame again.
+ * @return 1 if the frame must be sent now, 0 if it was suppressed.
+ */
+int frame_has_activity(const void *p, int size, struct frame_header *meta) {
+    static struct motion_detector detector;
+    static int64_t last_sent_us = 0;
+    int64_t capture_us = meta->capture_us;
+
+    int score = motion_score(&detector, p, size, frame_pixfmt, (int)meta->width, (int)meta->height);
+    meta->activity = score < 0 ? ACTIVITY_UNKNOWN : score;
+
+    /* Frames that cannot be analysed count as active, so a detector failure never hides video. */
+    if (score < 0 || score >= motion_threshold) {
+        if (capture_us >= event_until_us && preroll.count > 0)
+            flush_preroll();
+        event_until_us = capture_us + (int64_t)postroll_seconds * 1000000;
+        last_sent_us = capture_us;
+        return 1;
+    }
+
+    /* Post-roll of an ongoing event, or keepalive. The ring only ever holds frames newer than the last one sent, so frames arrive in capture order. */
+    if (capture_us < event_until_us || capture_us - last_sent_us >= (int64_t)keepalive_seconds * 1000000) {
+        ring_clear(&preroll);
+        last_sent_us = capture_us;
+        return 1;
+    }
+
+    /* Static frame: kept for a possible pre-roll, trimmed to the configured number of seconds. */
+    if (preroll_seconds > 0) {
+        ring_push(&preroll, p, size, meta);
+        ring_drop_before(&preroll, capture_us - (int64_t)preroll_seconds * 1000000);
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the geometry of a format, which lives in fmt.pix or fmt.pix_mp depending on the buffer type.
+ */
+void format_geometry(const struct v4l2_format *fmt, uint32_t *width, uint32_t *height, uint32_t *pixelformat) {
+    if (fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        *width = fmt->fmt.pix_mp.width;
+        *height = fmt->fmt.pix_mp.height;
+        *pixelformat = fmt->fmt.pix_mp.pixelformat;
+    } else {
+        *width = fmt->fmt.pix.width;
+        *height = fmt->fmt.pix.height;
+        *pixelformat = fmt->fmt.pix.pixelformat;
+    }
+}
+
+/**
+ * @brief Sets the frame size requested by a format. Plane strides are left for the driver to choose.
+ */
+void set_format_size(struct v4l2_format *fmt, uint32_t width, uint32_t height) {
+    if (fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        fmt->fmt.pix_mp.width = width;
+        fmt->fmt.pix_mp.height = height;
+        memset(fmt->fmt.pix_mp.plane_fmt, 0, sizeof(fmt->fmt.pix_mp.plane_fmt));
+    } else {
+        fmt->fmt.pix.width = width;
+        fmt->fmt.pix.height = height;
+        fmt->fmt.pix.bytesperline = 0;
+    }
+}
+
+/**
+ * @brief Records the format negotiated with the driver: the geometry of the frames and, for multi-planar buffers,
+ * the number of planes and their strides. NV12M and YUV420M frames are sent with their planes one after the other,
+ * which is exactly the contiguous NV12 and I420 layout, so they are described as such from here on.
+ */
+void use_format(const struct v4l2_format *fmt) {
+    uint32_t pixelformat;
+
+    format_geometry(fmt, &frame_width, &frame_height, &pixelformat);
+    frame_pixfmt = pixelformat;
+    n_planes = 1;
+    if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+        return;
+
+    n_planes = fmt->fmt.pix_mp.num_planes;
+    for (unsigned int i = 0; i < n_planes; i++)
+        plane_stride[i] = fmt->fmt.pix_mp.plane_fmt[i].bytesperline;
+    if (pixelformat == V4L2_PIX_FMT_NV12M && n_planes == 2)
+        frame_pixfmt = V4L2_PIX_FMT_NV12;
+    else if (pixelformat == V4L2_PIX_FMT_YUV420M && n_planes == 3)
+        frame_pixfmt = V4L2_PIX_FMT_YUV420;
+    else if (n_planes != 1) {
+        fprintf(stderr, "Unsupported multi-planar pixel format %.4s with %u planes\n", (const char *)&pixelformat, n_planes);
+        exit(1);
+    }
+}
+
+/**
+ * @brief Asks the driver to crop the sensor image to the region of interest (VIDIOC_S_SELECTION), so frames arrive
+ * already cropped and no CPU time is spent on them. The region, in pixels of the negotiated frame, is mapped onto the
+ * default crop rectangle; the format is then set to the size of the crop so that the driver does not scale it back up.
+ * On success fmt and roi hold what the driver actually chose.
+ * @return 0 if the driver now delivers the region, -1 if it cannot (the full frame is restored).
+ */
+int crop_in_driver(struct v4l2_format *fmt) {
+    struct v4l2_selection bounds, sel;
+    struct v4l2_format cropped = *fmt;
+
+    memset(&bounds, 0, sizeof(bounds));
+    bounds.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    bounds.target = V4L2_SEL_TGT_CROP_DEFAULT;
+    if (xioctl(fd_cam, VIDIOC_G_SELECTION, &bounds) == -1 || bounds.r.width == 0 || bounds.r.height == 0)
+        return -1; // No cropping support at all (ENOTTY or EINVAL)
+
+    sel = bounds;
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.r.left = bounds.r.left + (int)((int64_t)roi.x * bounds.r.width / frame_width);
+    sel.r.top = bounds.r.top + (int)((int64_t)roi.y * bounds.r.height / frame_height);
+    sel.r.width = (uint32_t)((int64_t)roi.width * bounds.r.width / frame_width);
+    sel.r.height = (uint32_t)((int64_t)roi.height * bounds.r.height / frame_height);
+    if (xioctl(fd_cam, VIDIOC_S_SELECTION, &sel) == -1)
+        return -1;
+
+    /* The driver may have rounded the rectangle; the frame keeps the scale the full frame had. */
+    uint32_t width, height, pixelformat, expected;
+    format_geometry(fmt, &width, &height, &expected);
+    set_format_size(&cropped, (uint32_t)((int64_t)sel.r.width * frame_width / bounds.r.width),
+                    (uint32_t)((int64_t)sel.r.height * frame_height / bounds.r.height));
+    if (xioctl(fd_cam, VIDIOC_S_FMT, &cropped) == 0) {
+        format_geometry(&cropped, &width, &height, &pixelformat);
+        if (pixelformat == expected && width * bounds.r.width == sel.r.width * frame_width &&
+            height * bounds.r.height == sel.r.height * frame_height) {
+            *fmt = cropped;
+            roi.x = (int)((int64_t)(sel.r.left - bounds.r.left) * frame_width / bounds.r.width);
+            roi.y = (int)((int64_t)(sel.r.top - bounds.r.top) * frame_height / bounds.r.height);
+            roi.width = (int)width;
+            roi.height = (int)height;
+            return 0;
+        }
+    }
+
+    /* The driver crops but would scale the region back to another size: software cropping is cheaper than that. */
+    sel.r = bounds.r;
+    if (xioctl(fd_cam, VIDIOC_S_SELECTION, &sel) == -1 || xioctl(fd_cam, VIDIOC_S_FMT, fmt) == -1) {
+        perror("Error restoring the full frame after cropping");
+        exit(1);
+    }
+    return -1;
+}
+
+/**
+ * @brief Prepares a buffer descriptor for QUERYBUF, QBUF or DQBUF. Multi-planar buffers describe their planes in a
+ * separate array, which the driver fills in with the offset, length and bytes used of every plane.
+ */
+void describe_buffer(struct v4l2_buffer *buf, struct v4l2_plane *planes, unsigned int index) {
+    memset(buf, 0, sizeof(*buf));
+    buf->type = buf_type; // Specifies buffer type
+    buf->memory = V4L2_MEMORY_MMAP; // Specifies memory mapping I/O method
+    buf->index = index;
+    if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        memset(planes, 0, VIDEO_MAX_PLANES * sizeof(*planes));
+        buf->m.planes = planes;
+        buf->length = VIDEO_MAX_PLANES; // Size of the planes array
+    }
+}
+
+/**
+ * @brief Negotiates the frame format with the driver and applies the region of interest to it.
+ * Used at start-up and again after a source change, when the driver may only offer other sizes or formats.
+ * @return 0 on success, -1 if the driver rejects the format or the region does not fit the frame.
+ */
+int negotiate_format() {
+    struct v4l2_format fmt; // Image format structure
+
+    /* Configures the image format, setting width, height, and pixel format. MJPEG is preferred for compression and smaller network transfer size. */
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = buf_type; // Specifies we are configuring video capture settings
+    if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        fmt.fmt.pix_mp.width = WIDTH; // Sets image width
+        fmt.fmt.pix_mp.height = HEIGHT; // Sets image height
+        fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_MJPEG; // Sets pixel format to MJPEG; the driver substitutes what it has (NV12M, ...)
+        fmt.fmt.pix_mp.field = V4L2_FIELD_INTERLACED; // Sets field type
+    } else {
+        fmt.fmt.pix.width = WIDTH; // Sets image width
+        fmt.fmt.pix.height = HEIGHT; // Sets image height
+        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG; // Sets pixel format to MJPEG
+        fmt.fmt.pix.field = V4L2_FIELD_INTERLACED; // Sets field type
+    }
+
+    /* A crop left by an earlier negotiation would shrink the full frame the region is mapped onto. */
+    if (roi_request.width > 0) {
+        struct v4l2_selection sel;
+        memset(&sel, 0, sizeof(sel));
+        sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+        if (xioctl(fd_cam, VIDIOC_G_SELECTION, &sel) == 0) {
+            sel.target = V4L2_SEL_TGT_CROP;
+            xioctl(fd_cam, VIDIOC_S_SELECTION, &sel);
+        }
+    }
+
+    /* Applies these settings to the hardware driver via ioctl. */
+    if (xioctl(fd_cam, VIDIOC_S_FMT, &fmt) == -1) {
+        perror("Error setting Pixel Format (MJPEG might not be supported)");
+        return -1;
+    }
+
+    /* The driver may adjust the requested format; the negotiated values are what the frames will contain. */
+    use_format(&fmt);
+
+    /* A region of interest is cropped by the driver when it can, otherwise by the client right after capture.
+       It is always derived from the region requested on the command line, as the frame may have changed size. */
+    roi = roi_request;
+    roi_software = 0;
+    if (roi.width > 0) {
+        if (roi_align(frame_pixfmt, frame_width, frame_height, &roi) < 0) {
+            fprintf(stderr, "Region of interest is outside the %ux%u frame\n", frame_width, frame_height);
+            return -1;
+        }
+        if (crop_in_driver(&fmt) == 0) {
+            use_format(&fmt);
+            printf("[INFO] Driver crops frames to %dx%d at (%d,%d).\n", roi.width, roi.height, roi.x, roi.y);
+        } else {
+            roi_software = 1;
+            printf("[INFO] Cropping frames to %dx%d at (%d,%d) in software%s.\n", roi.width, roi.height, roi.x, roi.y,
+                   frame_pixfmt == V4L2_PIX_FMT_MJPEG ? " (origin aligned to the JPEG MCU grid)" : "");
+        }
+    }
+
+    /* The frame rate is requested again after every negotiation, as a new format may come with the driver's default. */
+    if (target_fps > 0)
+        exposure_init(&exposure, fd_cam, buf_type, target_fps);
+    return 0;
+}
+
+/**
+ * @brief Allocates the driver's buffers and maps them into the process.
+ * @return 0 on success, -1 on error (buffers mapped so far stay recorded, so release_buffers() can undo them).
+ */
+int map_buffers() {
+    struct v4l2_requestbuffers req; // Buffer request structure
+
+    /* Requests allocation of 4 buffers in kernel memory. This enables 'streaming I/O', which is more efficient than read/write by avoiding data copies between kernel and user space. */
+    memset(&req, 0, sizeof(req));
+    req.count = 4; // Requests 4 buffers from driver
+    req.type = buf_type; // Specifies buffer type
+    req.memory = V4L2_MEMORY_MMAP; // Specifies memory mapping I/O method
+
+    // Sends request to driver to allocate buffers.
+    if (xioctl(fd_cam, VIDIOC_REQBUFS, &req) == -1) {
+        perror("Error requesting buffer allocation");
+        return -1;
+    }
+
+    /* Allocates array to track these buffers. */
+    buffers = calloc(req.count, sizeof(*buffers));
+    if (buffers == NULL) {
+        perror("Buffer table allocation failed");
+        return -1;
+    }
+    
+    /* Iterates through each driver-allocated buffer to map it into process memory. */
+    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+        struct v4l2_buffer buf;
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        
+        describe_buffer(&buf, planes, n_buffers);
+
+        /* Queries the driver for details (offset and length) of the buffer at this index. */
+        if (xioctl(fd_cam, VIDIOC_QUERYBUF, &buf) == -1) {
+            perror("Query buffer error");
+            return -1;
+        }
+
+        /* Maps device memory (buf.m.offset) directly to a user-space pointer (buffers[n_buffers].start) using mmap. This implements the 'Zero-Copy' mechanism.
+           Each plane of a multi-planar buffer has its own offset and is mapped separately. */
+        for (unsigned int p = 0; p < n_planes; p++) {
+            size_t length = buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ? planes[p].length : buf.length;
+            off_t offset = buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ? planes[p].m.mem_offset : buf.m.offset;
+
+            void *start = mmap(NULL, length, // Maps buffer into user space
+                               PROT_READ | PROT_WRITE, MAP_SHARED, // permissions reading/writing and shared mapping
+                               fd_cam, offset); // offset provided by driver
+
+            if (MAP_FAILED == start) {
+                perror("Memory Map failed");
+                n_buffers++; // Planes mapped so far in this buffer are released too
+                return -1;
+            }
+            buffers[n_buffers].start[p] = start;
+            buffers[n_buffers].length[p] = length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Unmaps the buffers and gives them back to the driver (REQBUFS with a count of 0), which is required before
+ * the format can change.
+ */
+void release_buffers() {
+    struct v4l2_requestbuffers req;
+
+    for (unsigned int i = 0; buffers != NULL && i < n_buffers; i++)
+        for (unsigned int p = 0; p < VIDEO_MAX_PLANES; p++)
+            if (buffers[i].start[p] != NULL)
+                munmap(buffers[i].start[p], buffers[i].length[p]);
+    free(buffers);
+    buffers = NULL;
+    n_buffers = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.count = 0;
+    req.type = buf_type;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd_cam, VIDIOC_REQBUFS, &req) == -1)
+        perror("Error releasing buffers");
+}
+
+/**
+ * @brief Opens the video device, selects the buffer API it offers and subscribes to its source change events.
+ * @return 0 on success, -1 if the device cannot be opened (unplugged, or not enumerated yet after a reset).
+ */
+int open_camera() {
+    struct v4l2_capability cap; // Device capabilities
+    struct v4l2_event_subscription sub; // Event subscription request
+
+    /* Opens the video device in Read/Write mode. O_NONBLOCK flag ensures calls return immediately if data is not ready, preventing program freeze. */
+    fd_cam = open(DEVICE, O_RDWR | O_NONBLOCK, 0);
+    if (fd_cam < 0) { 
+        perror("Failed to open video device"); 
+        return -1; 
+    }
+
+    /* Devices that deliver planar formats with one memory area per plane (often ISPs and SoC capture units, which are
+       also the fastest) only offer the multi-planar API, with its own buffer type. */
+    memset(&cap, 0, sizeof(cap));
+    if (xioctl(fd_cam, VIDIOC_QUERYCAP, &cap) == 0) {
+        uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+        if (!(caps & V4L2_CAP_VIDEO_CAPTURE) && (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE))
+            buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    }
+
+    /* HDMI capture devices and hotplugged sensors report new resolutions and formats with a source change event,
+       signalled through the exception set of select(). Devices without events simply never raise it. */
+    memset(&sub, 0, sizeof(sub));
+    sub.type = V4L2_EVENT_SOURCE_CHANGE;
+    source_events = xioctl(fd_cam, VIDIOC_SUBSCRIBE_EVENT, &sub) == 0;
+    return 0;
+}
+
+/**
+ * @brief Configures the V4L2 device and sets up Memory Mapping.
+ */
+void init_camera() {
+    if (open_camera() < 0 || negotiate_format() < 0 || map_buffers() < 0)
+        exit(1);
+}
+
+/**
+ * @brief Initializes the capture process by queuing buffers and enabling the stream.
+ */
+void start_capturing() {
+    enum v4l2_buf_type type;
+    
+    /* Enqueues all empty buffers into the driver's incoming queue, providing memory locations for storing video frames. */
+    for (unsigned int i = 0; i < n_buffers; ++i) {
+        struct v4l2_buffer buf;
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        describe_buffer(&buf, planes, i);
+        
+        if (xioctl(fd_cam, VIDIOC_QBUF, &buf) == -1) //put the buffer in the driver queue
+            perror("Queue Buffer error");
+    }
+
+    /* Sends STREAMON command to hardware to begin capturing images and filling queued buffers. */
+    type = buf_type;
+    if (xioctl(fd_cam, VIDIOC_STREAMON, &type) == -1) // start streaming
+        perror("Stream ON error");
+}
+
+/**
+ * @brief Starts the software JPEG encoder when raw frames must be encoded, or makes its frame slots large enough for
+ * the current geometry when it already runs (after a source change).
+ */
+void prepare_encoder() {
+    size_t raw_size = pixconv_frame_size(frame_pixfmt, frame_width, frame_height);
+
+    /* Cameras without MJPEG fall back to a raw format in S_FMT; their frames are then encoded in software, one frame per thread. */
+    if (encode_quality <= 0 || raw_size == 0)
+        return;
+    if (encoder_running) {
+        if (encoder_resize(raw_size) < 0)
+            perror("Encoder resize failed");
+        return;
+    }
+    int threads = encoder_threads > 0 ? encoder_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (encoder_start(threads, encode_quality, raw_size, transmit_frame) < 0) {
+        perror("Encoder start failed");
+        exit(1);
+    }
+    encoder_running = 1;
+    printf("[INFO] Encoding raw frames to JPEG (quality %d) on %d threads.\n", encode_quality, threads);
+}
+
+/**
+ * @brief Negotiates the format, maps new buffers and starts streaming again, once the old buffers are released.
+ * @return 0 on success, -1 on error (the buffers are then released again).
+ */
+int rebuild_capture() {
+    if (negotiate_format() < 0 || map_buffers() < 0) {
+        release_buffers();
+        return -1;
+    }
+    prepare_encoder();
+    start_capturing();
+    return 0;
+}
+
+/**
+ * @brief Rebuilds the capture after a source change without leaving the process: STREAMOFF, buffers released,
+ * format negotiated again, buffers reallocated and mapped, STREAMON. Frames captured from then on carry the new
+ * geometry and format in their headers; the server, the motion detector and the inter-frame coder all start afresh
+ * when the geometry of a camera's frames changes.
+ * A few attempts are made, as some sources need a moment to settle after a change; if they all fail, the watchdog
+ * takes over with its own recovery steps.
+ */
+void restart_capture() {
+    enum v4l2_buf_type type = buf_type;
+    struct v4l2_dv_timings timings;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (xioctl(fd_cam, VIDIOC_STREAMOFF, &type) == -1)
+        perror("Stream OFF error");
+    release_buffers();
+
+    for (int attempt = 1; attempt <= RESTART_ATTEMPTS; attempt++) {
+        /* Digital video receivers (HDMI) only switch to the new signal once its detected timings are applied. */
+        memset(&timings, 0, sizeof(timings));
+        if (xioctl(fd_cam, VIDIOC_QUERY_DV_TIMINGS, &timings) == 0)
+            xioctl(fd_cam, VIDIOC_S_DV_TIMINGS, &timings);
+
+        if (rebuild_capture() == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            source_changes++;
+            printf("[INFO] Source changed to %ux%u %.4s, capture restarted in %.1f ms.\n", frame_width, frame_height,
+                   (const char *)&frame_pixfmt,
+                   (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+            watchdog_defer(&watchdog, monotonic_us(), WATCHDOG_RECOVERY_MS * 1000LL);
+            return;
+        }
+        usleep(RESTART_RETRY_MS * 1000);
+    }
+    fprintf(stderr, "Capture could not be restarted after a source change\n");
+}
+
+/**
+ * @brief Dequeues the pending events of the camera and restarts the capture when the source changed resolution or format.
+ */
+void handle_events() {
+    struct v4l2_event event;
+    int changed = 0;
+
+    memset(&event, 0, sizeof(event));
+    while (xioctl(fd_cam, VIDIOC_DQEVENT, &event) == 0) {
+        if (event.type == V4L2_EVENT_SOURCE_CHANGE && (event.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION))
+            changed = 1;
+    }
+    if (changed)
+        restart_capture();
+}
+
+/**
+ * @brief Locates the planes of a dequeued multi-planar buffer. When the frame goes out unchanged (no cropping, preview,
+ * motion gating, encoding or compression) and the driver left no padding at the end of the lines, the planes are
+ * returned in pieces to be sent as they are. Otherwise they are copied, without the padding, into one contiguous frame.
+ * @return 1 if pieces holds the planes to send, 0 if *frame and *size point to the contiguous copy, -1 if a plane
+ * holds less than a whole frame or the copy cannot be allocated.
+ */
+int gather_planes(const struct v4l2_buffer *buf, struct iovec *pieces, const void **frame, int *size) {
+    static uint8_t *contiguous = NULL; // Reused from frame to frame
+    static size_t contiguous_cap = 0;
+    size_t offsets[4], stride[VIDEO_MAX_PLANES], rows[VIDEO_MAX_PLANES];
+    size_t total = pixconv_frame_size(frame_pixfmt, frame_width, frame_height);
+    int tight = 1;
+    int transformed = roi_software || preview_factor > 0 || motion_threshold >= 0 || encoder_running ||
+                      compression_method != COMPRESSION_NONE;
+
+    pixconv_plane_offsets(frame_pixfmt, frame_width, frame_height, offsets);
+    offsets[n_planes] = total;
+    for (unsigned int p = 0; p < n_planes; p++) {
+        const struct v4l2_plane *plane = &buf->m.planes[p];
+        size_t length = offsets[p + 1] - offsets[p];
+        rows[p] = p == 0 ? frame_height : (frame_height + 1) / 2;
+        size_t line = length / rows[p];
+        stride[p] = plane_stride[p] > line ? plane_stride[p] : line;
+        if (plane->bytesused < plane->data_offset || plane->bytesused - plane->data_offset < stride[p] * (rows[p] - 1) + line)
+            return -1;
+        pieces[p].iov_base = (uint8_t *)buffers[buf->index].start[p] + plane->data_offset;
+        pieces[p].iov_len = length;
+        tight &= stride[p] == line;
+    }
+    if (tight && !transformed)
+        return 1;
+
+    if (total > contiguous_cap) {
+        uint8_t *grown = realloc(contiguous, total);
+        if (grown == NULL)
+            return -1;
+        contiguous = grown;
+        contiguous_cap = total;
+    }
+    for (unsigned int p = 0; p < n_planes; p++) {
+        size_t line = pieces[p].iov_len / rows[p];
+        for (size_t row = 0; row < rows[p]; row++)
+            memcpy(contiguous + offsets[p] + row * line, (const uint8_t *)pieces[p].iov_base + row * stride[p], line);
+    }
+    *frame = contiguous;
+    *size = (int)total;
+    return 0;
+}
+
+/**
+ * @brief Retrieves a filled buffer, processes it, and returns it to the driver.
+ */
+int read_frame() {
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    
+    describe_buffer(&buf, planes, 0);
+
+    /* Dequeues a buffer from the driver's outgoing queue containing a valid video frame. Returns EAGAIN if no buffer is ready due to non-blocking mode. */
+    if (xioctl(fd_cam, VIDIOC_DQBUF, &buf) == -1) {
+        if (errno == EAGAIN) return 0; 
+        perror("Dequeue Buffer error");
+        return -1;
+    }
+
+    /* Passes the pointer to raw image data (buffers[buf.index].start) to the network function. Uses buf.bytesused for exact frame size. */
+    const void *frame = buffers[buf.index].start[0];
+    int frame_size = buf.bytesused;
+    struct iovec pieces[VIDEO_MAX_PLANES];
+    int zero_copy = 0;
+    struct frame_header meta;
+
+    if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        frame = (const uint8_t *)buffers[buf.index].start[0] + planes[0].data_offset;
+        frame_size = planes[0].bytesused - planes[0].data_offset;
+        if (n_planes > 1)
+            zero_copy = gather_planes(&buf, pieces, &frame, &frame_size);
+    }
+    if (zero_copy < 0) {
+        fprintf(stderr, "Incomplete multi-planar frame dropped\n");
+        if (xioctl(fd_cam, VIDIOC_QBUF, &buf) == -1)
+            perror("Re-Queue Buffer error");
+        return 1;
+    }
+
+    /* Captures the frame metadata now; it travels with the frame even if it is sent later from the pre-event ring. */
+    memset(&meta, 0, sizeof(meta));
+    meta.sequence = capture_sequence++;
+    meta.capture_us = capture_time_us(&buf);
+    meta.camera_id = camera_id;
+    meta.activity = ACTIVITY_UNKNOWN;
+    meta.width = frame_width;
+    meta.height = frame_height;
+    meta.pixelformat = frame_pixfmt;
+    meta.stream = STREAM_RECORD;
+    meta.session = session_id;
+
+    /* Driver timestamps give the real frame interval, unaffected by how late this loop picked the frame up. */
+    if (target_fps > 0)
+        exposure_frame(&exposure, fd_cam, meta.capture_us);
+
+    /* Nothing needs to look at the pixels: the planes go to the socket straight from the driver's buffers. */
+    if (zero_copy) {
+        if (send_planes_via_network(pieces, n_planes, &meta) < 0)
+            spool_frame(pieces, n_planes, &meta);
+        else
+            frames_zero_copy++;
+        if (xioctl(fd_cam, VIDIOC_QBUF, &buf) == -1)
+            perror("Re-Queue Buffer error");
+        return 1;
+    }
+
+    /* Everything downstream (preview, motion gating, encoding, compression) only sees the region of interest.
+       A frame that cannot be cropped (a corrupt MJPEG frame) is sent whole. */
+    if (roi_software) {
+        static struct roi_cropper cropper; // Cropped copy of the frame, reused from frame to frame
+        long cropped = roi_crop(&cropper, frame, frame_size, frame_pixfmt, frame_width, frame_height, &roi);
+        if (cropped > 0) {
+            frame = cropper.out;
+            frame_size = (int)cropped;
+            meta.width = cropper.width;
+            meta.height = cropper.height;
+        }
+    }
+
+    /* The live preview shows every scene, static or not, so it is taken before motion gating. */
+    if (preview_factor > 0)
+        send_preview(frame, frame_size, &meta);
+
+    /* With motion gating enabled, frames of a static scene are returned to the driver without being sent. */
+    if (motion_threshold >= 0 && !frame_has_activity(frame, frame_size, &meta)) {
+        frames_suppressed++;
+        if (xioctl(fd_cam, VIDIOC_QBUF, &buf) == -1)
+            perror("Re-Queue Buffer error");
+        return 1;
+    }
+
+    transmit_frame(frame, frame_size, &meta);
+
+    /* Enqueues the buffer back to the driver for reuse, maintaining the circular buffer cycle. */
+    if (xioctl(fd_cam, VIDIOC_QBUF, &buf) == -1) 
+        perror("Re-Queue Buffer error");
+    
+    return 1;
+}
+
+/**
+ * @brief Frame interval announced by the driver (VIDIOC_G_PARM), or 0 if it does not report one.
+ */
+int64_t nominal_interval_us() {
+    struct v4l2_streamparm parm;
+
+    memset(&parm, 0, sizeof(parm));
+    parm.type = buf_type;
+    if (xioctl(fd_cam, VIDIOC_G_PARM, &parm) == -1 || parm.parm.capture.timeperframe.denominator == 0)
+        return 0;
+    return (int64_t)parm.parm.capture.timeperframe.numerator * 1000000 / parm.parm.capture.timeperframe.denominator;
+}
+
+/**
+ * @brief Takes the recovery step chosen by the watchdog for a stalled capture. Each step undoes more state than the
+ * previous one: restarting the stream unsticks most drivers, reallocating the buffers fixes queues that lost track of
+ * them, and reopening the device recovers from USB resets and unplug/replug cycles, however long they last.
+ */
+void recover_capture(int step) {
+    enum v4l2_buf_type type = buf_type;
+    static const char *names[] = { "", "restarting the stream", "reallocating the buffers", "reopening the device" };
+
+    fprintf(stderr, "[WATCHDOG] No frame for %lld ms, %s.\n",
+            (long long)((monotonic_us() - watchdog.outage_start_us) / 1000), names[step]);
+
+    if (fd_cam >= 0 && xioctl(fd_cam, VIDIOC_STREAMOFF, &type) == -1)
+        perror("Stream OFF error");
+
+    switch (step) {
+    case WATCHDOG_RESTREAM:
+        start_capturing(); // STREAMOFF took every buffer back from the driver; they are queued again
+        break;
+    case WATCHDOG_REALLOCATE:
+        release_buffers();
+        if (rebuild_capture() < 0)
+            fprintf(stderr, "[WATCHDOG] Buffer reallocation failed\n");
+        break;
+    default:
+        if (fd_cam >= 0) {
+            release_buffers();
+            close(fd_cam);
+            fd_cam = -1;
+        }
+        if (open_camera() == 0 && rebuild_capture() < 0) {
+            close(fd_cam);
+            fd_cam = -1;
+        }
+        if (fd_cam < 0)
+            fprintf(stderr, "[WATCHDOG] Device not available, next attempt in %lld ms\n",
+                    (long long)(watchdog.backoff_us / 1000));
+        break;
+    }
+}
+
+/**
+ * @brief Builds the request that agrees on the options of this camera's stream with the server (MSG_HELLO).
+ * @param out Room for sizeof(int) + sizeof(struct hello) bytes.
+ * @return Bytes written to out.
+ */
+size_t hello_request(uint8_t *out) {
+    int msg = MSG_HELLO;
+    struct hello hello;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.version = PROTOCOL_VERSION;
+    hello.camera_id = camera_id;
+    hello.compression = 1u << compression_method;
+    if (keyframe_interval > 0)
+        hello.compression |= 1u << COMPRESSION_LZ_XOR;
+    memcpy(out, &msg, sizeof(msg));
+    memcpy(out + sizeof(msg), &hello, sizeof(hello));
+    return sizeof(msg) + sizeof(hello);
+}
+
+/**
+ * @brief Applies the server's answer to MSG_HELLO: compression is only used if the server accepts the requested
+ * method; otherwise frames are sent uncompressed.
+ */
+void accept_hello_reply(const struct hello_reply *reply) {
+    if (!(reply->compression & (1u << compression_method))) {
+        printf("[INFO] Server does not accept compression method %u; raw frames are sent uncompressed.\n", compression_method);
+        compression_method = COMPRESSION_NONE;
+    }
+    if (keyframe_interval > 0 && (compression_method == COMPRESSION_NONE || !(reply->compression & (1u << COMPRESSION_LZ_XOR)))) {
+        printf("[INFO] Server does not accept inter-frame coding; every frame is sent whole.\n");
+        keyframe_interval = 0;
+    }
+}
+
+/**
+ * @brief Builds the message attaching a connection to the stripe group of the current connection (MSG_STRIPE).
+ * Index 0, the server connection, announces the group: the stripe group number moves on.
+ * @param out Room for sizeof(int) + sizeof(struct stripe_join) bytes.
+ * @return Bytes written to out.
+ */
+size_t stripe_join_message(unsigned int index, uint8_t *out) {
+    struct stripe_join join;
+    int msg = MSG_STRIPE;
+
+    memset(&join, 0, sizeof(join));
+    join.session = session_id;
+    join.group = index == 0 ? ++stripe_group : stripe_group;
+    join.camera_id = camera_id;
+    join.count = stripe_count;
+    join.index = index;
+    memcpy(out, &msg, sizeof(msg));
+    memcpy(out + sizeof(msg), &join, sizeof(join));
+    return sizeof(msg) + sizeof(join);
+}
 
-struct buffer_info *buffers;
-unsigned int n_buffers;
-int fd_cam = -1; // File descriptor for the camera device
-int fd_sock = -1; // File descriptor for the network socket
-int frame_number = 0;
+/**
+ * @brief Resumes the stream on a new connection from the server's answer to MSG_RESUME, which reports the last frame
+ * it stored for this camera: every frame sent after that one, found in the resend history, is to be sent again in its
+ * original order (see replay_history()).
+ * If that frame is not in the history (nothing of it was stored, or the server's last frame predates the history),
+ * the whole history is sent again. As acknowledged frames leave the history, on a server that has none of them (after a
+ * failover) this sends exactly the frames the previous server did not acknowledge, from the keyframe of the first one
+ * when it is a delta frame (see resend_trim()). Delta frames whose keyframe is no longer in the history cannot be
+ * decoded there: they are skipped up to the next keyframe, and if none is left the next frame captured is a keyframe.
+ */
+void resume_session(const struct resume_reply *reply) {
+    unsigned int first = 0;
 
-/* Wrapper function for the ioctl system call. Retries the call automatically if interrupted by a system signal (EINTR), increasing robustness. */
-static int xioctl(int fh, int request, void *arg) {
-    int r;
-    do {
-    /*It is the system call that enables sending control and configuration commands to a device driver, performing operations that cannot be handled by standard read or write calls.
-    In my project, I use it to set the video format, manage memory buffers, and start or stop the streaming.*/
-        r = ioctl(fh, request, arg);
+    /* No other thread sends before the connection is marked up, so the history only loses frames meanwhile, when
+       replicas acknowledge them. The frames a replica still holds were acknowledged by the previous server already. */
+    pthread_mutex_lock(&send_lock);
+    long found = reply->status != RESUME_NONE ? resend_find(reply->session, reply->sequence, reply->capture_us) : -1;
+    if (found >= 0)
+        first = (unsigned int)found + 1;
+    else {
+        if (primary_acked > resend_first)
+            first = primary_acked - resend_first < resend.count ? (unsigned int)(primary_acked - resend_first) : resend.count;
+        long key = first < resend.count ? resend_keyframe(first) : -1;
+        if (key >= 0)
+            first = (unsigned int)key;
+        while (key < 0 && first < resend.count && ring_at(&resend, first)->header.compression == COMPRESSION_LZ_XOR) {
+            first++;
+            delta_frames_skipped++;
+        }
+        if (first == resend.count)
+            keyframe_required = 1; // The last frame sent, the reference of the next delta frame, is not there
+    }
+    primary_acked = resend_first + first;
+    resend_trim();
+    replay_next = primary_acked;
+    replay_prefix_len = 0;
+    replay_frames = (int)(resend_first + resend.count - replay_next);
+    replay_tail_len = replay_tail_sent = 0;
+    if (stripe_count > 0)
+        replay_tail_len = stripe_join_message(0, replay_tail);
+    pthread_mutex_unlock(&send_lock);
+    if (resend.count > 0)
+        printf("[NET] Session %016llx resumed: server holds frame %llu, %d recent frames to send again.\n",
+               (unsigned long long)session_id, (unsigned long long)reply->sequence, replay_frames);
+}
 
-    } while (-1 == r && errno == EINTR); // Retry if  ioctl interrupted by signal
-    return r;
+/**
+ * @brief Sends the frames resume_session() chose, as far as the socket takes them without blocking; the frame in
+ * progress is resumed where the previous call stopped. The announcement of the stripe group follows them.
+ * @return 1 once everything is sent, 0 if some is left, -1 if the connection failed.
+ */
+int replay_history() {
+    pthread_mutex_lock(&send_lock);
+    while (replay_next < resend_first + resend.count) {
+        if (replay_next < resend_first) {
+            pthread_mutex_unlock(&send_lock);
+            errno = ENOBUFS; // Evicted from the history meanwhile
+            return -1;
+        }
+        const struct ring_entry *entry = ring_at(&resend, (unsigned int)(replay_next - resend_first));
+        if (replay_prefix_len == 0) {
+            replay_prefix_len = frame_message_prefix(&entry->header, (long)entry->header.size, replay_prefix);
+            replay_offset = 0;
+        }
+        ssize_t sent = ring_send_part(&resend, fd_sock, entry, replay_prefix, replay_prefix_len, replay_offset);
+        if (sent < 0) {
+            pthread_mutex_unlock(&send_lock);
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        connect_deadline_us = monotonic_us() + SEND_TIMEOUT_S * 1000000LL; // The server is reading
+        replay_offset += sent;
+        if (replay_offset < replay_prefix_len + entry->header.size)
+            continue;
+        replay_next++;
+        replay_prefix_len = 0;
+        frames_resent++;
+    }
+    pthread_mutex_unlock(&send_lock);
+    while (replay_tail_sent < replay_tail_len) {
+        ssize_t sent = send(fd_sock, replay_tail + replay_tail_sent, replay_tail_len - replay_tail_sent,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        replay_tail_sent += sent;
+    }
+    return 1;
 }
 
 /**
- * @brief Handles network transmission of image data.
- * Implements the client-side protocol: sends metadata first, followed by raw image data.
+ * @brief Closes the striped connections still being opened, after a failed connection attempt.
  */
-void send_frame_via_network(const void *p, int size) {
-    char filename[64];
-    
-    /* Generates a sequential filename for each frame. Uses .raw extension as the data matches the camera sensor output (MJPEG/YUYV) without a container. */
-    sprintf(filename, "frame_%04d.raw", frame_number++);
-    
-    int name_len = strlen(filename);
-    long file_size = size;
+void close_openings() {
+    for (int i = 0; i < openings_count; i++)
+        if (openings[i].fd >= 0)
+            close(openings[i].fd);
+    openings_count = 0;
+}
 
-    /* Sends filename length, filename string, and image payload size. This header enables the server to prepare for the incoming stream. */
-    send(fd_sock, &name_len, sizeof(name_len), 0); // send the length of the filename to the server
-    send(fd_sock, filename, name_len, 0); // send the filename string to the server
-    send(fd_sock, &file_size, sizeof(file_size), 0); // send the size of the image payload to the server
-    
-    /* Assumes pointer 'p' points to valid image data. Loops to send all bytes to the server socket, continuing until total_sent matches file size. */
-    long total_sent = 0;
-    while(total_sent < file_size) {
-        int sent = send(fd_sock, p + total_sent, file_size - total_sent, 0); // sends a portion of the image data from the 'p' pointer
-        if(sent < 0) { 
-            perror("[CLIENT] Network send error"); 
-            break; 
+/**
+ * @brief Starts the striped connections of the group announced on the server connection, without blocking.
+ * Frames sent again by replay_history() are already on the server connection, ahead of the announcement, so the
+ * server has stored them by the time it starts ordering the group's frames.
+ * @return 0 on success, -1 if a connection could not be started.
+ */
+int start_stripes() {
+    struct sockaddr_in address;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(servers[current_server].port);
+    inet_pton(AF_INET, servers[current_server].host, &address.sin_addr);
+    for (openings_count = 0; openings_count < stripe_count; openings_count++) {
+        struct stripe_opening *o = &openings[openings_count];
+        o->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (o->fd < 0)
+            return -1;
+        fcntl(o->fd, F_SETFL, O_NONBLOCK);
+        o->state = OPENING_CONNECT;
+        o->received = 0;
+        if (connect(o->fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+            openings_count++;
+            return -1;
         }
-        total_sent += sent;
     }
-    printf("[CLIENT] Successfully transmitted %s (%d bytes)\n", filename, size);
+    return 0;
 }
 
 /**
- * @brief Configures the V4L2 device and sets up Memory Mapping.
+ * @brief Advances a striped connection being opened. Once connected it sends, at once, the stream negotiation (the
+ * server keeps the options per connection) and its MSG_STRIPE. The options were agreed on the server connection:
+ * they are only checked here, never changed, as frames already coded with them may go on any connection.
+ * @return 0 while it goes on, -1 if it failed.
  */
-void init_camera() {
-    struct v4l2_format fmt; // Image format structure
-    struct v4l2_requestbuffers req; // Buffer request structure
+int advance_opening(struct stripe_opening *o, unsigned int index, int readable, int writable) {
+    uint8_t request[2 * sizeof(int) + sizeof(struct hello) + sizeof(struct stripe_join)];
+    struct hello_reply reply;
+    size_t length = 0;
+    int error = 0;
+    socklen_t error_length = sizeof(error);
 
-    /* Opens the video device in Read/Write mode. O_NONBLOCK flag ensures calls return immediately if data is not ready, preventing program freeze. */
-    fd_cam = open(DEVICE, O_RDWR | O_NONBLOCK, 0);
-    if (fd_cam < 0) { 
-        perror("Failed to open video device"); 
-        exit(1); 
+    if (o->state == OPENING_CONNECT && writable) {
+        if (getsockopt(o->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+            errno = error ? error : errno;
+            return -1;
+        }
+        if (compression_method != COMPRESSION_NONE)
+            length = hello_request(request);
+        length += stripe_join_message(index, request + length);
+        /* A fresh socket always has room for a few dozen bytes. */
+        if (send(o->fd, request, length, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)length)
+            return -1;
+        o->state = compression_method != COMPRESSION_NONE ? OPENING_ANSWER : OPENING_READY;
+    } else if (o->state == OPENING_ANSWER && readable) {
+        ssize_t got = recv(o->fd, o->reply + o->received, sizeof(o->reply) - o->received, MSG_DONTWAIT);
+        if (got == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (got < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        if ((o->received += got) < sizeof(o->reply))
+            return 0;
+        memcpy(&reply, o->reply, sizeof(reply));
+        uint32_t wanted = 1u << compression_method | (keyframe_interval > 0 ? 1u << COMPRESSION_LZ_XOR : 0);
+        if ((reply.compression & wanted) != wanted) {
+            errno = EPROTO; // The same server answered otherwise on the server connection
+            return -1;
+        }
+        o->state = OPENING_READY;
     }
+    return 0;
+}
 
-    /* Configures the image format, setting width, height, and pixel format. MJPEG is preferred for compression and smaller network transfer size. */
-    memset(&fmt, 0, sizeof(fmt));
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // Specifies we are configuring video capture settings
-    fmt.fmt.pix.width = WIDTH; // Sets image width
-    fmt.fmt.pix.height = HEIGHT; // Sets image height
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG; // Sets pixel format to MJPEG
-    fmt.fmt.pix.field = V4L2_FIELD_INTERLACED; // Sets field type
+/**
+ * @brief Advances the striped connections being opened; once all are ready, they go back to blocking mode with the
+ * send timeout, for their sender threads, and the connection is put in service.
+ * @return 1 once the stripes are started, 0 while some are being opened, -1 if one failed.
+ */
+int open_stripes(const fd_set *readable, const fd_set *writable) {
+    struct timeval timeout = { SEND_TIMEOUT_S, 0 };
+    int fds[MAX_STRIPES];
+    int ready = 0;
 
-    /* Applies these settings to the hardware driver via ioctl. */
-    if (xioctl(fd_cam, VIDIOC_S_FMT, &fmt) == -1) {
-        perror("Error setting Pixel Format (MJPEG might not be supported)");
-        exit(1);
+    for (int i = 0; i < openings_count; i++) {
+        struct stripe_opening *o = &openings[i];
+        if (advance_opening(o, i + 1, readable != NULL && FD_ISSET(o->fd, readable),
+                            writable != NULL && FD_ISSET(o->fd, writable)) < 0) {
+            perror("[NET] Striped connection failed");
+            return -1;
+        }
+        if (o->state == OPENING_READY)
+            ready++;
     }
+    if (ready < openings_count)
+        return 0;
 
-    /* Requests allocation of 4 buffers in kernel memory. This enables 'streaming I/O', which is more efficient than read/write by avoiding data copies between kernel and user space. */
-    memset(&req, 0, sizeof(req));
-    req.count = 4; // Requests 4 buffers from driver
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // Specifies buffer type
-    req.memory = V4L2_MEMORY_MMAP; // Specifies memory mapping I/O method
+    for (int i = 0; i < openings_count; i++) {
+        fds[i] = openings[i].fd;
+        fcntl(fds[i], F_SETFL, 0);
+        setsockopt(fds[i], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    openings_count = 0; // The set owns the sockets now, or closed them
+    stripe_order = 0;
+    return stripe_start(&stripes, fds, stripe_count) == 0 ? 1 : -1;
+}
 
-    // Sends request to driver to allocate buffers.
-    if (xioctl(fd_cam, VIDIOC_REQBUFS, &req) == -1) {
-        perror("Error requesting buffer allocation");
-        exit(1);
+/**
+ * @brief Reads the acknowledgements the server sent so far (without waiting) and forgets the acknowledged frames.
+ * An acknowledgement covers its frame and every frame sent before it, as the server stores frames in arrival order.
+ */
+void read_acks() {
+    for (;;) {
+        ssize_t got = recv(fd_sock, ack_buffer + ack_received, sizeof(ack_buffer) - ack_received, MSG_DONTWAIT);
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            pthread_mutex_lock(&send_lock);
+            if (connected)
+                drop_connection(got == 0 ? "closed by the server" : strerror(errno));
+            pthread_mutex_unlock(&send_lock);
+            return;
+        }
+        if (got < 0)
+            return;
+        ack_received += got;
+        if (ack_received < sizeof(ack_buffer))
+            continue;
+        ack_received = 0;
+
+        struct frame_ack ack;
+        memcpy(&ack, ack_buffer, sizeof(ack));
+        pthread_mutex_lock(&send_lock);
+        long found = resend_find(ack.session, ack.sequence, ack.capture_us);
+        if (found >= 0 && resend_first + found + 1 > primary_acked) {
+            primary_acked = resend_first + found + 1;
+            resend_trim();
+            ack_wait_since_us = primary_acked < resend_first + resend.count ? monotonic_us() : 0;
+        }
+        pthread_mutex_unlock(&send_lock);
     }
+}
 
-    /* Allocates array to track these buffers. */
-    buffers = calloc(req.count, sizeof(*buffers));
+/**
+ * @brief Gives up on the connection attempt in progress and schedules the next one: right away on the next server
+ * of the list, or, once every server failed in turn, after a pause that grows each time.
+ */
+void connect_failed(const char *reason) {
+    int64_t delay = 0;
+
+    if (reconnects == 0 && offline_since_us == 0)
+        offline_since_us = monotonic_us(); // Server unreachable from the start
+    if (++servers_tried >= n_servers) {
+        servers_tried = 0;
+        delay = reconnect_delay_us;
+        reconnect_delay_us = reconnect_delay_us * 2 < RECONNECT_MAX_MS * 1000LL ? reconnect_delay_us * 2 : RECONNECT_MAX_MS * 1000LL;
+    }
+    fprintf(stderr, "[NET] Connection to %s:%d failed (%s); retrying in %lld ms.\n", servers[current_server].host,
+            servers[current_server].port, reason, (long long)(delay / 1000));
+    close(fd_sock);
+    fd_sock = -1;
+    close_openings();
+    connecting = 0;
+    current_server = (current_server + 1) % n_servers;
+    reconnect_at_us = monotonic_us() + delay;
+}
+
+/**
+ * @brief Starts a connection to the server without blocking, so capture goes on while it completes.
+ */
+void start_connect() {
+    struct sockaddr_in serv_addr;
+
+    /* Creates a standard TCP socket. */
+    if ((fd_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) { 
+        perror("Socket creation error"); 
+        exit(1); 
+    }
     
-    /* Iterates through each driver-allocated buffer to map it into process memory. */
-    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-        struct v4l2_buffer buf;
-        
-        memset(&buf, 0, sizeof(buf));
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = n_buffers;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(servers[current_server].port);
+    
+    /* Converts IP address string to binary form. */
+    if(inet_pton(AF_INET, servers[current_server].host, &serv_addr.sin_addr) <= 0) { 
+        perror("Invalid IP Address"); 
+        exit(1); 
+    }
+    
+    /* The connection completes in the background; select() reports the socket writable when it is done. */
+    fcntl(fd_sock, F_SETFL, O_NONBLOCK);
+    connecting = 1;
+    connect_step = CONNECT_TCP;
+    connect_deadline_us = monotonic_us() + CONNECT_TIMEOUT_MS * 1000LL;
+    if (connect(fd_sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 && errno != EINPROGRESS)
+        connect_failed(strerror(errno));
+}
 
-        /* Queries the driver for details (offset and length) of the buffer at this index. */
-        if (xioctl(fd_cam, VIDIOC_QUERYBUF, &buf) == -1) {
-            perror("Query buffer error");
-            exit(1);
+/**
+ * @brief Puts the connection in service once the handshake is done and the history sent again. Frames are then sent
+ * from the capture and encoder threads, so the socket goes back to blocking mode, with a send timeout so a server that
+ * stops reading is detected.
+ */
+void connection_up() {
+    struct timeval timeout = { SEND_TIMEOUT_S, 0 };
+    int resent = replay_frames;
+
+    fcntl(fd_sock, F_SETFL, 0);
+    setsockopt(fd_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    connecting = 0;
+    ack_wait_since_us = resent > 0 ? monotonic_us() : 0;
+
+    pthread_mutex_lock(&send_lock);
+    connected = 1;
+    pthread_mutex_unlock(&send_lock);
+    reconnect_delay_us = RECONNECT_MIN_MS * 1000LL;
+    servers_tried = 0;
+    if (offline_since_us != 0) {
+        reconnects++;
+        printf("[NET] Connected to %s:%d after %.1f s offline; %llu spooled frames to catch up.\n",
+               servers[current_server].host, servers[current_server].port, (monotonic_us() - offline_since_us) / 1e6,
+               spool.map != NULL ? (unsigned long long)spool.file->count : 0ULL);
+        offline_since_us = 0;
+    }
+
+    /* Failover time runs from the detection of the failure to the stream resumed on another server. */
+    if (failover_since_us != 0 && connected_server >= 0 && connected_server != current_server) {
+        int64_t took = monotonic_us() - failover_since_us;
+        failovers++;
+        failover_total_us += took;
+        if (took > failover_longest_us)
+            failover_longest_us = took;
+        failover_replayed += resent;
+        printf("[NET] Failed over from %s:%d to %s:%d in %lld ms; %d unacknowledged frames replayed.\n",
+               servers[connected_server].host, servers[connected_server].port, servers[current_server].host,
+               servers[current_server].port, (long long)(took / 1000), resent);
+    }
+    failover_since_us = 0;
+    connected_server = current_server;
+}
+
+/**
+ * @brief Once the TCP connection is up, sends both handshake requests at once, as replicas do: the stream negotiation
+ * (MSG_HELLO) if compression is requested, and MSG_RESUME. The socket stays non-blocking: the answers are read by
+ * read_handshake() as they come.
+ */
+void connect_established() {
+    uint8_t request[2 * sizeof(int) + sizeof(struct hello) + sizeof(struct resume)];
+    struct resume resume;
+    size_t request_len = 0;
+    int msg = MSG_RESUME;
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (getsockopt(fd_sock, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+        connect_failed(strerror(error ? error : errno));
+        return;
+    }
+    if (compression_method != COMPRESSION_NONE)
+        request_len = hello_request(request);
+    memset(&resume, 0, sizeof(resume));
+    resume.session = session_id;
+    resume.camera_id = camera_id;
+    memcpy(request + request_len, &msg, sizeof(msg));
+    memcpy(request + request_len + sizeof(msg), &resume, sizeof(resume));
+    request_len += sizeof(msg) + sizeof(resume);
+
+    /* A fresh socket always has room for a few dozen bytes. */
+    if (send(fd_sock, request, request_len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)request_len) {
+        connect_failed("handshake not sent");
+        return;
+    }
+    connect_step = CONNECT_HANDSHAKE;
+    handshake_len = (compression_method != COMPRESSION_NONE ? sizeof(struct hello_reply) : 0) + sizeof(struct resume_reply);
+    handshake_received = 0;
+    connect_deadline_us = monotonic_us() + SEND_TIMEOUT_S * 1000000LL;
+}
+
+/**
+ * @brief Sends more of the history on a resumed connection. Once all of it is sent, the striped connections are
+ * opened if there are to be any; otherwise the connection is put in service.
+ */
+void replay_step() {
+    int done = replay_history();
+    if (done < 0)
+        connect_failed(strerror(errno));
+    else if (done > 0 && stripe_count == 0)
+        connection_up();
+    else if (done > 0) {
+        connect_step = CONNECT_STRIPES;
+        connect_deadline_us = monotonic_us() + (CONNECT_TIMEOUT_MS + SEND_TIMEOUT_S * 1000LL) * 1000;
+        if (start_stripes() < 0)
+            connect_failed(strerror(errno));
+    }
+}
+
+/**
+ * @brief Reads the server's answers to the handshake, without waiting. Once both are in, the stream options are
+ * applied and the frames the server lacks start being sent again.
+ */
+void read_handshake() {
+    struct hello_reply hello_reply;
+    struct resume_reply reply;
+
+    ssize_t got = recv(fd_sock, handshake_reply + handshake_received, handshake_len - handshake_received, MSG_DONTWAIT);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        connect_failed(got == 0 ? "closed during the handshake (server too old?)" : strerror(errno));
+        return;
+    }
+    if (got < 0 || (handshake_received += got) < handshake_len)
+        return;
+    if (handshake_len > sizeof(reply)) {
+        memcpy(&hello_reply, handshake_reply, sizeof(hello_reply));
+        accept_hello_reply(&hello_reply);
+    }
+    memcpy(&reply, handshake_reply + handshake_len - sizeof(reply), sizeof(reply));
+    resume_session(&reply);
+    connect_step = CONNECT_REPLAY;
+    connect_deadline_us = monotonic_us() + SEND_TIMEOUT_S * 1000000LL;
+    replay_step();
+}
+
+/**
+ * @brief Advances a connection attempt: the TCP connection completes once the socket is writable, the handshake
+ * answers are read once it is readable, the history is sent again as it becomes writable, then the striped
+ * connections are opened the same way. Every step must be done within its deadline; sending the history must make
+ * progress within it.
+ * @param readable, writable Sets select() returned, with the sockets of connect_fds() (NULL when it returned none).
+ */
+void finish_connect(const fd_set *readable, const fd_set *writable) {
+    static const char *const timeouts[] = { "timed out", "no answer to the handshake", "resending frames stalled",
+                                            "striped connections not opened in time" };
+    int ready = fd_sock >= 0 && (connect_step == CONNECT_HANDSHAKE ? readable != NULL && FD_ISSET(fd_sock, readable)
+                                                                   : writable != NULL && FD_ISSET(fd_sock, writable));
+
+    if (ready && connect_step == CONNECT_TCP)
+        connect_established();
+    else if (ready && connect_step == CONNECT_HANDSHAKE)
+        read_handshake();
+    else if (ready && connect_step == CONNECT_REPLAY)
+        replay_step();
+    else if (connect_step == CONNECT_STRIPES) {
+        int opened = open_stripes(readable, writable);
+        if (opened < 0)
+            connect_failed("striped connections not opened");
+        else if (opened > 0)
+            connection_up();
+    }
+    if (connecting && monotonic_us() >= connect_deadline_us)
+        connect_failed(timeouts[connect_step]);
+}
+
+/**
+ * @brief Adds the sockets of the connection attempt in progress to the sets of a select(), each in the one its
+ * current step waits for.
+ * @return The new nfds.
+ */
+int connect_fds(fd_set *readable, fd_set *writable, int nfds) {
+    if (connect_step == CONNECT_STRIPES) {
+        for (int i = 0; i < openings_count; i++) {
+            if (openings[i].state == OPENING_CONNECT)
+                FD_SET(openings[i].fd, writable);
+            else if (openings[i].state == OPENING_ANSWER)
+                FD_SET(openings[i].fd, readable);
+            if (openings[i].fd >= nfds)
+                nfds = openings[i].fd + 1;
         }
+        return nfds;
+    }
+    FD_SET(fd_sock, connect_step == CONNECT_HANDSHAKE ? readable : writable);
+    return fd_sock >= nfds ? fd_sock + 1 : nfds;
+}
 
-        buffers[n_buffers].length = buf.length;
-        
-        /* Maps device memory (buf.m.offset) directly to a user-space pointer (buffers[n_buffers].start) using mmap. This implements the 'Zero-Copy' mechanism. */
-        buffers[n_buffers].start = mmap(NULL, buf.length, // Maps buffer into user space
-                                      PROT_READ | PROT_WRITE, MAP_SHARED, // permissions reading/writing and shared mapping
-                                      fd_cam, buf.m.offset); // offset provided by driver
-    
-        if (MAP_FAILED == buffers[n_buffers].start) {
-            perror("Memory Map failed");
-            exit(1);
+/**
+ * @brief Replays spooled frames, oldest first, at catchup_fps on average while live frames keep flowing.
+ */
+void drain_spool() {
+    static int64_t last_us = 0;
+    static double credit = 0; // Frames that may be replayed now
+    int64_t now = monotonic_us();
+
+    if (spool.map == NULL || spool.file->count == 0) {
+        last_us = now;
+        credit = 0;
+        return;
+    }
+    /* Short bursts are allowed, as this runs between camera frames (or every NETWORK_POLL_MS) rather than on a timer. */
+    credit += (now - last_us) * catchup_fps / 1e6;
+    if (credit > 1 + catchup_fps * NETWORK_POLL_MS / 1000.0)
+        credit = 1 + catchup_fps * NETWORK_POLL_MS / 1000.0;
+    last_us = now;
+
+    while (credit >= 1) {
+        /* Held while the record is sent, so an encoder thread spooling a frame cannot evict it meanwhile. */
+        pthread_mutex_lock(&spool_lock);
+        const struct spool_record *rec = spool_oldest(&spool);
+        int sent = rec != NULL ? send_frame_via_network(rec + 1, (int)rec->header.size, &rec->header) : -1;
+        if (sent == 0) {
+            spool_drop_oldest(&spool);
+            frames_replayed++;
+            if (spool.file->count == 0)
+                printf("[NET] Spool drained: %ld frames replayed so far.\n", frames_replayed);
         }
+        pthread_mutex_unlock(&spool_lock);
+        if (sent < 0)
+            break;
+        credit -= 1;
     }
 }
 
 /**
- * @brief Initializes the capture process by queuing buffers and enabling the stream.
+ * @brief Keeps the connection going: watches acknowledgements, starts and completes connection attempts while offline,
+ * and replays the spool.
+ * @param readable, writable Sets select() returned (NULL when it returned none).
  */
-void start_capturing() {
-    enum v4l2_buf_type type;
-    
-    /* Enqueues all empty buffers into the driver's incoming queue, providing memory locations for storing video frames. */
-    for (int i = 0; i < n_buffers; ++i) {
-        struct v4l2_buffer buf;
-        memset(&buf, 0, sizeof(buf));
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // Specifies buffer type
-        buf.memory = V4L2_MEMORY_MMAP; // Specifies memory mapping I/O method
-        buf.index = i;
-        
-        if (xioctl(fd_cam, VIDIOC_QBUF, &buf) == -1) //put the buffer in the driver queue
-            perror("Queue Buffer error");
+void network_poll(const fd_set *readable, const fd_set *writable) {
+    /* A server that accepts frames but stops storing them (hung, or its disk stalled) is as good as gone. */
+    if (connected && ack_wait_since_us != 0 && monotonic_us() - ack_wait_since_us > ack_timeout_ms * 1000LL) {
+        pthread_mutex_lock(&send_lock);
+        if (connected) {
+            ack_timeouts++;
+            drop_connection("no acknowledgement in time");
+        }
+        pthread_mutex_unlock(&send_lock);
+    }
+    /* A striped connection that failed while idle is noticed here rather than at the next frame. */
+    if (connected && stripe_failed(&stripes)) {
+        pthread_mutex_lock(&send_lock);
+        if (connected)
+            drop_connection("a striped connection failed");
+        pthread_mutex_unlock(&send_lock);
     }
+    if (connecting)
+        finish_connect(readable, writable);
+    else if (!connected && monotonic_us() >= reconnect_at_us)
+        start_connect();
+    if (connected)
+        drain_spool();
+}
 
-    /* Sends STREAMON command to hardware to begin capturing images and filling queued buffers. */
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (xioctl(fd_cam, VIDIOC_STREAMON, &type) == -1) // start streaming
-        perror("Stream ON error");
+/**
+ * @brief Gives the primary server up to ack_timeout_ms to acknowledge the frames sent last, before the client exits.
+ */
+void wait_for_acks() {
+    int64_t deadline_us = monotonic_us() + ack_timeout_ms * 1000LL;
+
+    while (connected && primary_acked < resend_first + resend.count && monotonic_us() < deadline_us) {
+        fd_set readable;
+        struct timeval tv = { 0, NETWORK_POLL_MS * 1000 };
+        FD_ZERO(&readable);
+        FD_SET(fd_sock, &readable);
+        if (select(fd_sock + 1, &readable, NULL, NULL, &tv) > 0)
+            read_acks();
+    }
 }
 
 /**
- * @brief Retrieves a filled buffer, processes it, and returns it to the driver.
+ * @brief Writes the frames of the history the primary server has not acknowledged to the spool, so the next run sends
+ * them (a frame stored just before the connection closed is then sent twice, and stored under the same name).
+ * Spooled frames must decode on their own, so delta frames are rebuilt against the frames before them, starting from
+ * the keyframe the history keeps (see resend_trim()), and compressed again as keyframes.
  */
-int read_frame() {
-    struct v4l2_buffer buf;
-    
-    memset(&buf, 0, sizeof(buf));
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // Specifies buffer type
-    buf.memory = V4L2_MEMORY_MMAP; // Specifies memory mapping I/O method
+void spool_unacknowledged() {
+    struct raw_compressor compressor;
+    uint8_t *frame = NULL, *residual = NULL, *packed = NULL;
+    size_t frame_size = 0;
+    int have_frame = 0;
 
-    /* Dequeues a buffer from the driver's outgoing queue containing a valid video frame. Returns EAGAIN if no buffer is ready due to non-blocking mode. */
-    if (xioctl(fd_cam, VIDIOC_DQBUF, &buf) == -1) {
-        if (errno == EAGAIN) return 0; 
-        perror("Dequeue Buffer error");
-        return -1;
+    pthread_mutex_lock(&send_lock);
+    unsigned int first = primary_acked > resend_first ? (unsigned int)(primary_acked - resend_first) : 0;
+    if (first >= resend.count) {
+        pthread_mutex_unlock(&send_lock);
+        return;
     }
+    memset(&compressor, 0, sizeof(compressor));
+    long key = resend_keyframe(first);
+    for (unsigned int i = key >= 0 ? (unsigned int)key : first; i < resend.count; i++) {
+        const struct ring_entry *entry = ring_at(&resend, i);
+        const uint8_t *payload = ring_payload(&resend, entry);
+        struct frame_header header = entry->header;
+        struct iovec piece = { (void *)payload, header.size };
+        int is_delta = header.compression == COMPRESSION_LZ_XOR;
+        int next_is_delta = i + 1 < resend.count && ring_at(&resend, i + 1)->header.compression == COMPRESSION_LZ_XOR;
 
-    /* Passes the pointer to raw image data (buffers[buf.index].start) to the network function. Uses buf.bytesused for exact frame size. */
-    send_frame_via_network(buffers[buf.index].start, buf.bytesused);
+        /* Keeps the decoded frame while the next one is a delta on it. */
+        if (is_delta || next_is_delta) {
+            size_t size = header.compression == COMPRESSION_NONE ? header.size : rawcodec_raw_size(payload, header.size);
+            if (size != frame_size) {
+                free(frame);
+                free(residual);
+                free(packed);
+                frame = malloc(size);
+                residual = malloc(size);
+                packed = malloc(rawcodec_bound(size));
+                frame_size = size;
+                have_frame = 0;
+            }
+            if (frame == NULL || residual == NULL || packed == NULL) {
+                have_frame = 0;
+                frame_size = 0;
+            } else if (!is_delta && header.compression == COMPRESSION_NONE) {
+                memcpy(frame, payload, size);
+                have_frame = 1;
+            } else if (!is_delta)
+                have_frame = rawcodec_decompress(payload, header.size, frame, size) == (long)size;
+            else if (have_frame && rawcodec_decompress(payload, header.size, residual, size) == (long)size)
+                rawcodec_xor(frame, residual, size);
+            else
+                have_frame = 0;
+        }
+        if (i < first)
+            continue;
+        if (is_delta) {
+            if (!have_frame) {
+                frames_lost++; // Its keyframe left the history
+                continue;
+            }
+            long packed_size = rawcodec_compress(&compressor, frame, frame_size, compression_method, header.pixelformat,
+                                                 packed, rawcodec_bound(frame_size));
+            header.compression = packed_size >= 0 ? ((const struct rawcodec_header *)packed)->method : COMPRESSION_NONE;
+            piece.iov_base = packed_size >= 0 ? (void *)packed : (void *)frame;
+            piece.iov_len = packed_size >= 0 ? (size_t)packed_size : frame_size;
+            header.size = (uint32_t)piece.iov_len;
+        }
+        long spooled = frames_spooled;
+        spool_frame(&piece, 1, &header);
+        frames_kept_at_exit += frames_spooled - spooled;
+    }
+    pthread_mutex_unlock(&send_lock);
+    rawcodec_free(&compressor);
+    free(frame);
+    free(residual);
+    free(packed);
+}
 
-    /* Enqueues the buffer back to the driver for reuse, maintaining the circular buffer cycle. */
-    if (xioctl(fd_cam, VIDIOC_QBUF, &buf) == -1) 
-        perror("Re-Queue Buffer error");
-    
-    return 1;
+/**
+ * @brief Asks the capture loop to stop (SIGINT, SIGTERM). A second signal terminates the client at once.
+ */
+void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+/**
+ * @brief Establishes the network connection, trying each server in turn and waiting up to CONNECT_TIMEOUT_MS for
+ * each. If none can be reached, capture starts anyway: frames are spooled and the connection is retried in the background.
+ */
+void init_network() {
+    /* A send on a connection closed by the server must fail with EPIPE, not kill the client. */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int attempt = 0; attempt < n_servers && !connected; attempt++) {
+        start_connect();
+        while (connecting) {
+            fd_set readable, writable;
+            int64_t wait_us = connect_deadline_us - monotonic_us();
+            struct timeval tv = { wait_us > 0 ? wait_us / 1000000 : 0, wait_us > 0 ? wait_us % 1000000 : 0 };
+            FD_ZERO(&readable);
+            FD_ZERO(&writable);
+            int r = select(connect_fds(&readable, &writable, 0), &readable, &writable, NULL, &tv);
+            finish_connect(r > 0 ? &readable : NULL, r > 0 ? &writable : NULL);
+        }
+    }
+    if (!connected)
+        printf("[NET] No server reachable; frames are spooled until one answers.\n");
+
+    /* Replicas get the same chance to be there for the first frame; those that are not keep being retried. */
+    replicas_start(&replicas);
 }
 
 /**
  * @brief Main loop synchronizing capture and transmission using select().
+ * The wait for each frame is bounded by the watchdog's deadline; a missed deadline triggers the next recovery step.
  */
 void main_loop() {
-    int count = FRAME_COUNT;
+    long count = frame_count;
+
+    watchdog_init(&watchdog, nominal_interval_us(), monotonic_us());
     
-    while (count > 0) {
-        fd_set fds;
+    while ((frame_count == 0 || count > 0) && !stop_requested) {
+        fd_set fds, events, writable;
         struct timeval tv;
-        int r;
+        int r, nfds;
 
-        /* Uses select system call to wait efficiently. Avoids busy waiting by sleeping until the camera file descriptor is ready or timeout expires. */
+        /* Uses select system call to wait efficiently. Avoids busy waiting by sleeping until the camera file descriptor is ready or the watchdog deadline expires.
+           While the device is closed (between reopen attempts) it only waits for the deadline. */
         FD_ZERO(&fds); // Clears the set
-        FD_SET(fd_cam, &fds); // Adds camera fd to the set
+        FD_ZERO(&events); // Pending V4L2 events are reported as exceptions
+        if (fd_cam >= 0) {
+            FD_SET(fd_cam, &fds); // Adds camera fd to the set
+            if (source_events)
+                FD_SET(fd_cam, &events);
+        }
+
+        /* A connection attempt in progress waits for its sockets as its current step needs (see connect_fds()); a
+           connected socket becomes readable when acknowledgements arrive. */
+        FD_ZERO(&writable);
+        nfds = fd_cam >= 0 ? fd_cam + 1 : 0;
+        if (connecting)
+            nfds = connect_fds(&fds, &writable, nfds);
+        else if (connected) {
+            FD_SET(fd_sock, &fds);
+            if (fd_sock >= nfds)
+                nfds = fd_sock + 1;
+        }
+        int replicas_busy = 0;
+        nfds = replicas_fds(&replicas, &fds, &writable, nfds, &replicas_busy);
 
-        tv.tv_sec = 2; // Sets timeout to 2 seconds
-        tv.tv_usec = 0; // Sets microseconds to 0
+        int64_t wait_us = watchdog_remaining(&watchdog, monotonic_us());
+        if ((!stream_in_order() || ack_wait_since_us != 0 || replicas_busy) && wait_us > NETWORK_POLL_MS * 1000LL)
+            wait_us = NETWORK_POLL_MS * 1000LL; // Offline, catching up or awaiting acknowledgements: none of it waits for frames
+        tv.tv_sec = wait_us / 1000000; // Waits at most until the deadline of the next frame
+        tv.tv_usec = wait_us % 1000000;
 
-        r = select(fd_cam + 1, &fds, NULL, NULL, &tv); // Waits for camera fd to be ready or timeout
+        r = select(nfds, &fds, &writable, &events, &tv); // Waits for camera fd to be ready or timeout
 
-        if (-1 == r) { 
+        if (-1 == r && errno != EINTR) { 
             perror("Select system call error"); 
             break; 
         }
-        if (0 == r) { 
-            fprintf(stderr, "Select timeout: Camera is not producing data.\n"); 
-            continue; 
+
+        if (r > 0 && fd_cam >= 0 && FD_ISSET(fd_cam, &events)) {
+            /* A source change rebuilds the buffers, so the frame that may also be ready is left for the new stream. */
+            handle_events();
+        } else if (r > 0 && fd_cam >= 0 && FD_ISSET(fd_cam, &fds)) {
+            /* Calls read_frame to process data if select returns a positive number indicating readiness. */
+            int step = watchdog.level;
+            int got = read_frame();
+            if (got > 0) {
+                int64_t outage = watchdog_frame(&watchdog, monotonic_us());
+                if (outage > 0)
+                    fprintf(stderr, "[WATCHDOG] Capture resumed after %lld ms without frames (recovery step %d).\n",
+                            (long long)(outage / 1000), step);
+                count--;
+            } else if (got < 0) {
+                usleep(10000); // A wedged driver may fail every dequeue at once; the watchdog deals with it
+            }
+        }
+
+        if (r <= 0) {
+            FD_ZERO(&fds); // The sets are only meaningful after a successful select()
+            FD_ZERO(&writable);
         }
+        if (connected && FD_ISSET(fd_sock, &fds))
+            read_acks();
+        network_poll(&fds, &writable);
+        replicas_poll(&replicas, &fds, &writable);
 
-        /* Calls read_frame to process data if select returns a positive number indicating readiness. */
-        if (read_frame()) 
-            count--; 
+        int step = watchdog_check(&watchdog, monotonic_us());
+        if (step > 0)
+            recover_capture(step);
     }
 }
 
-/**
- * @brief Establishes the network connection.
- */
-void init_network() {
-    struct sockaddr_in serv_addr;
-    
-    /* Creates a standard TCP socket. */
-    if ((fd_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) { 
-        perror("Socket creation error"); 
-        exit(1); 
+int main(int argc, char *argv[]) {
+    int opt;
+
+    /* Parses command-line options. -t sets the target bytes per MJPEG frame, enabling DCT-domain requantization.
+       -m enables motion gating with the given threshold in grey levels, -k sets the keepalive interval in seconds,
+       -p and -o set the pre-roll and post-roll of events in seconds, -M caps the pre-roll memory in MB,
+       -c sets the camera identifier used by the server to keep a separate index per camera,
+       -q enables software JPEG encoding of raw frames at the given quality and -e sets the number of encoder threads,
+       -P enables the live preview stream downscaled by the given factor (2, 4, 8 or 16) and -R sets its frame rate,
+       -z compresses raw frames losslessly (1: LZ, 2: luma/chroma delta prediction then LZ),
+       -K sends raw frames as differences with the previous frame, with a keyframe every given number of frames,
+       -r x,y,width,height only keeps that region of the frame, cropped by the driver if possible,
+       -f holds the given frame rate in low light by shortening the exposure and raising the gain,
+       -S sets the size in MB of the offline spool that keeps frames while the server is unreachable (0 disables it)
+       and -C the rate in frames per second at which spooled frames are replayed once it is back,
+       -U sets the memory in MB of the history of sent frames, sent again if a connection loses them (0 disables it),
+       -s gives the storage servers as a comma-separated list of address:port, in order of preference, and -A the time
+       in ms after which a server that does not acknowledge frames counts as failed,
+       -D gives replica servers (address:port, comma-separated) that also receive every frame, and -L the time in ms a
+       replica may lag behind before it is declared dead,
+       -N stripes the recorded frames over the given number of extra connections to the server,
+       -u sends the preview stream over UDP with the given parity (none, xor:<data fragments per parity fragment> or
+       rs:<parity fragments per block>) and -l drops the given percentage of its datagrams, optionally in bursts of the
+       given mean length (percent[,burst]), to test the parity,
+       -n sets the number of frames to capture before exiting (0 captures until SIGINT or SIGTERM). */
+    while ((opt = getopt(argc, argv, "t:m:k:p:o:M:c:q:e:P:R:z:K:r:f:S:C:U:s:A:D:L:N:u:l:n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            frame_count = atol(optarg);
+            if (frame_count < 0) {
+                fprintf(stderr, "Frame count must be 0 (until interrupted) or more\n");
+                exit(1);
+            }
+            break;
+        case 't':
+            target_frame_bytes = atol(optarg);
+            break;
+        case 'm':
+            motion_threshold = (int)(atof(optarg) * 100);
+            break;
+        case 'k':
+            keepalive_seconds = atoi(optarg);
+            break;
+        case 'p':
+            preroll_seconds = atoi(optarg);
+            break;
+        case 'o':
+            postroll_seconds = atoi(optarg);
+            break;
+        case 'M':
+            preroll_memory_mb = atol(optarg);
+            break;
+        case 'c':
+            camera_id = (unsigned int)atoi(optarg);
+            break;
+        case 'q':
+            encode_quality = atoi(optarg) > 0 ? atoi(optarg) : ENCODER_QUALITY;
+            break;
+        case 'e':
+            encoder_threads = atoi(optarg);
+            break;
+        case 'P':
+            preview_factor = atoi(optarg);
+            break;
+        case 'R':
+            preview_fps = atof(optarg);
+            break;
+        case 'z':
+            compression_method = (uint32_t)atoi(optarg);
+            break;
+        case 'K':
+            keyframe_interval = atoi(optarg);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%d,%d,%d,%d", &roi_request.x, &roi_request.y, &roi_request.width, &roi_request.height) != 4 ||
+                roi_request.x < 0 || roi_request.y < 0 || roi_request.width <= 0 || roi_request.height <= 0) {
+                fprintf(stderr, "Region of interest must be given as x,y,width,height\n");
+                exit(1);
+            }
+            break;
+        case 'f':
+            target_fps = atof(optarg);
+            break;
+        case 'S':
+            spool_mb = atol(optarg);
+            break;
+        case 'C':
+            catchup_fps = atof(optarg);
+            break;
+        case 'U':
+            resend_memory_mb = atol(optarg);
+            break;
+        case 's':
+            for (char *item = strtok(optarg, ","); item != NULL; item = strtok(NULL, ",")) {
+                char *colon = strrchr(item, ':');
+                if (n_servers == MAX_SERVERS || colon == NULL || colon - item >= (long)sizeof(servers[0].host) ||
+                    atoi(colon + 1) <= 0) {
+                    fprintf(stderr, "Servers must be given as address:port[,address:port...] (at most %d)\n", MAX_SERVERS);
+                    exit(1);
+                }
+                memcpy(servers[n_servers].host, item, colon - item);
+                servers[n_servers].host[colon - item] = '\0';
+                servers[n_servers].port = atoi(colon + 1);
+                n_servers++;
+            }
+            break;
+        case 'A':
+            ack_timeout_ms = atoi(optarg) > 0 ? atoi(optarg) : ACK_TIMEOUT_MS;
+            break;
+        case 'D':
+            for (char *item = strtok(optarg, ","); item != NULL; item = strtok(NULL, ",")) {
+                if (replica_add(&replicas, item) < 0) {
+                    fprintf(stderr, "Replicas must be given as address:port[,address:port...] (at most %d)\n", MAX_REPLICAS);
+                    exit(1);
+                }
+            }
+            break;
+        case 'L':
+            replicas.ctx.max_lag_ms = atoi(optarg) > 0 ? atoi(optarg) : REPLICA_MAX_LAG_MS;
+            break;
+        case 'N':
+            stripe_count = atoi(optarg);
+            if (stripe_count < 0 || stripe_count > MAX_STRIPES) {
+                fprintf(stderr, "Frames can be striped over at most %d connections\n", MAX_STRIPES);
+                exit(1);
+            }
+            break;
+        case 'u':
+            if (fec_parse(&preview_fec, optarg) < 0) {
+                fprintf(stderr, "Preview parity must be none, xor:1 to xor:%d or rs:1 to rs:%d\n", FEC_RS_BLOCK,
+                        FEC_MAX_PARITY);
+                exit(1);
+            }
+            preview_udp = 1;
+            break;
+        case 'l': {
+            double burst = 1;
+            const char *comma = strchr(optarg, ',');
+            if (comma != NULL)
+                burst = atof(comma + 1);
+            fec_simulate_loss(&preview_fec, atof(optarg), burst);
+            break;
+        }
+        default:
+            fprintf(stderr, "Usage: %s [-t target_bytes_per_frame] [-m motion_threshold] [-k keepalive_seconds]\n"
+                            "          [-p preroll_seconds] [-o postroll_seconds] [-M preroll_memory_mb] [-c camera_id]\n"
+                            "          [-q jpeg_quality] [-e encoder_threads] [-P preview_factor] [-R preview_fps]\n"
+                            "          [-z compression_method] [-K keyframe_interval]\n"
+                            "          [-r x,y,width,height] [-f frames_per_second] [-S spool_mb] [-C catchup_fps]\n"
+                            "          [-U resend_memory_mb] [-s address:port,...] [-A ack_timeout_ms]\n"
+                            "          [-D address:port,...] [-L replica_max_lag_ms] [-N striped_connections]\n"
+                            "          [-u none|xor:group|rs:parity] [-l loss_percent[,burst]] [-n frame_count]\n", argv[0]);
+            exit(1);
+        }
     }
-    
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(SERVER_PORT);
-    
-    /* Converts IP address string to binary form. */
-    if(inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr) <= 0) { 
-        perror("Invalid IP Address"); 
-        exit(1); 
+
+    /* The preview is downscaled by repeated halving, so its factor must be a power of two. */
+    if (preview_factor != 0 && (preview_factor < 2 || preview_factor > 16 || (preview_factor & (preview_factor - 1)))) {
+        fprintf(stderr, "Preview factor must be 2, 4, 8 or 16\n");
+        exit(1);
     }
-    
-    /* Attempts to establish a connection to the server. */
-    if (connect(fd_sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection Failed");
+    if (preview_fps <= 0)
+        preview_fps = PREVIEW_FPS;
+    if (preview_udp && (udp_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("UDP socket creation failed");
         exit(1);
     }
-}
+    if (compression_method > COMPRESSION_LZ_DELTA) {
+        fprintf(stderr, "Compression method must be 0 (none), 1 (LZ) or 2 (delta + LZ)\n");
+        exit(1);
+    }
+    /* Delta frames are only worth sending compressed; LZ is enabled by default for them. */
+    if (keyframe_interval > 0 && compression_method == COMPRESSION_NONE)
+        compression_method = COMPRESSION_LZ;
 
-int main() {
-    /* Establishes connection to the storage server. */
+    /* Preallocates the pre-event ring, so its memory is bounded and no allocation happens while capturing. */
+    if (motion_threshold >= 0 && preroll_seconds > 0 &&
+        ring_init(&preroll, (size_t)preroll_memory_mb << 20, PREROLL_MAX_FRAMES) < 0) {
+        perror("Pre-roll buffer allocation failed");
+        exit(1);
+    }
+
+    if (catchup_fps <= 0)
+        catchup_fps = CATCHUP_FPS;
+    if (n_servers == 0) {
+        snprintf(servers[0].host, sizeof(servers[0].host), "%s", SERVER_IP);
+        servers[0].port = SERVER_PORT;
+        n_servers = 1;
+    }
+
+    /* Names this run: frames are identified by session and sequence number when a connection is resumed. */
+    int fd_random = open("/dev/urandom", O_RDONLY);
+    if (fd_random < 0 || read(fd_random, &session_id, sizeof(session_id)) != sizeof(session_id))
+        session_id = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid();
+    if (fd_random >= 0)
+        close(fd_random);
+    if (resend_memory_mb > 0 && (ring_init(&resend, (size_t)resend_memory_mb << 20, RESEND_MAX_FRAMES) < 0 ||
+                                 (resend_sent_us = calloc(RESEND_MAX_FRAMES, sizeof(*resend_sent_us))) == NULL)) {
+        perror("Resend history allocation failed");
+        exit(1);
+    }
+    if (replicas.count > 0 && resend.data == NULL) {
+        fprintf(stderr, "Replicas are sent frames from the resend history, which -U 0 disables\n");
+        exit(1);
+    }
+    replicas.ctx.history = &resend;
+    replicas.ctx.history_first = &resend_first;
+    replicas.ctx.sent_us = resend_sent_us;
+    replicas.ctx.lock = &send_lock;
+    replicas.ctx.session = session_id;
+    replicas.ctx.camera_id = camera_id;
+    replicas.ctx.compression = history_compression;
+    replicas.ctx.trim = resend_trim;
+    replicas.ctx.find = resend_find;
+    replicas.ctx.message_prefix = frame_message_prefix;
+
+    /* Maps the offline spool; frames left in it by a previous run are replayed once the server answers. */
+    if (spool_mb > 0) {
+        char spool_path[64];
+        snprintf(spool_path, sizeof(spool_path), SPOOL_PATH, camera_id);
+        if (spool_open(&spool, spool_path, (size_t)spool_mb << 20) < 0)
+            exit(1);
+        if (spool.file->count > 0)
+            printf("[INFO] %llu frames left in %s by a previous run will be replayed.\n",
+                   (unsigned long long)spool.file->count, spool_path);
+    }
+
+    /* Establishes connection to the storage server, and agrees on compression if requested. */
     init_network(); 
 
     /* Configures the camera driver and maps memory buffers. */
     init_camera();    
 
+    /* Starts the JPEG encoder if the camera only delivers raw frames and -q was given. */
+    prepare_encoder();
+
     /* Signals the camera to start streaming frames to buffers. */
     start_capturing();
     
-    printf("[INFO] Starting capture loop for %d frames...\n", FRAME_COUNT);
+    /* SIGINT and SIGTERM end the capture loop, which then shuts down like after the last frame. Without SA_RESTART,
+       select() returns at once; a second signal kills the client (SA_RESETHAND). */
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = request_stop;
+    stop_action.sa_flags = SA_RESETHAND;
+    sigemptyset(&stop_action.sa_mask);
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+
+    if (frame_count > 0)
+        printf("[INFO] Starting capture loop for %ld frames...\n", frame_count);
+    else
+        printf("[INFO] Starting capture loop until interrupted...\n");
     
     /* Enters the loop to consume frames and send them via network. */
     main_loop();      
+    if (stop_requested)
+        printf("[INFO] Stop requested, shutting down.\n");
     
+    if (motion_threshold >= 0)
+        printf("[INFO] Motion gating suppressed %ld static frames.\n", frames_suppressed);
+    if (raw_bytes_in > 0)
+        printf("[INFO] Lossless compression: %llu raw bytes sent as %llu (%.2fx), %ld delta frames.\n",
+               (unsigned long long)raw_bytes_in, (unsigned long long)raw_bytes_out, (double)raw_bytes_in / raw_bytes_out,
+               delta_frames);
+    if (watchdog.outages > 0)
+        printf("[INFO] Watchdog: %ld capture outages, %.1f s without frames in total, longest %.1f s.\n", watchdog.outages,
+               watchdog.outage_total_us / 1e6, watchdog.outage_longest_us / 1e6);
+    if (target_fps > 0 && exposure.frames_total > 0)
+        printf("[INFO] Frame rate: target %.2f fps, measured %.2f fps, %ld of %ld frames late, %ld exposure adjustments, "
+               "%ld returns to auto exposure.\n", 1e6 / exposure.target_us, 1e6 / exposure.interval_us,
+               exposure.frames_slow, exposure.frames_total, exposure.adjustments, exposure.releases);
+    if (source_changes > 0)
+        printf("[INFO] Capture restarted %ld times after a source change.\n", source_changes);
+    if (frames_zero_copy > 0)
+        printf("[INFO] %ld multi-planar frames sent straight from the driver's planes.\n", frames_zero_copy);
+    if (preview_factor > 0)
+        printf("[INFO] Preview stream: %ld frames sent, %ld dropped under congestion.\n", previews_sent, previews_dropped);
+    if (preview_udp)
+        printf("[INFO] UDP previews: %ld datagrams sent, %ld parity datagrams coded, %ld dropped by the loss simulator.\n",
+               preview_fec.datagrams, preview_fec.parity_datagrams, preview_fec.simulated_losses);
     printf("[INFO] Operations finished. Closing resources.\n");
 
-    /* Closes file descriptors for a clean shutdown. */
-    close(fd_sock);
+    /* Waits for the frames still being encoded, then closes file descriptors for a clean shutdown.
+       Frames still in the spool stay in its file for the next run. */
+    if (encoder_running)
+        encoder_flush();
+    /* The frames still being sent on striped connections are completed before the server connection closes, and the
+       frames the server has not acknowledged by then are kept in the spool. */
+    stripe_close(&stripes, 1);
+    wait_for_acks();
+    replicas_drain(&replicas);
+    spool_unacknowledged();
+    if (frames_kept_at_exit > 0)
+        printf("[INFO] %ld frames not acknowledged by the server were written to the spool for the next run.\n",
+               frames_kept_at_exit);
+    if (reconnects > 0 || frames_spooled > 0 || frames_lost > 0)
+        printf("[INFO] Network: %ld reconnections, %ld frames sent again, %ld frames spooled, %ld replayed, "
+               "%ld evicted from the full spool, %ld lost, %llu left in the spool.\n", reconnects, frames_resent,
+               frames_spooled, frames_replayed, spool.evicted, frames_lost,
+               spool.map != NULL ? (unsigned long long)spool.file->count : 0ULL);
+    if (delta_frames_skipped > 0)
+        printf("[INFO] Resume: %ld delta frames not sent again, their keyframe having left the history.\n",
+               delta_frames_skipped);
+    if (failovers > 0 || ack_timeouts > 0)
+        printf("[INFO] Failover: %ld moves to another server (%ld after acknowledgement timeouts), %.0f ms on average, "
+               "longest %.0f ms, %ld unacknowledged frames replayed.\n", failovers, ack_timeouts,
+               failovers > 0 ? failover_total_us / 1e3 / failovers : 0.0, failover_longest_us / 1e3, failover_replayed);
+    replicas_report(&replicas);
+    for (int i = 0; i < stripe_count; i++)
+        printf("[INFO] Striped connection %d: %ld frames, %.1f MB.\n", i + 1, stripes.stripes[i].frames,
+               stripes.stripes[i].bytes / 1e6);
+    spool_close(&spool);
+    if (fd_sock >= 0)
+        close(fd_sock);
+    if (udp_sock >= 0)
+        close(udp_sock);
     close(fd_cam);
     
     return 0;
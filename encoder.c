@@ -0,0 +1,384 @@
+/**
+ * @file encoder.c
+ * @brief Raw frame to JPEG encoder: 4:2:0 conversion by the pixconv kernels, SSE float AAN forward DCT with fused
+ * quantization, and a pool of threads that encode successive frames in parallel and deliver them in capture order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <emmintrin.h>
+#include <linux/videodev2.h>
+#include "encoder.h"
+#include "pixconv.h"
+
+/* Frame slots per encoder thread. Two keep every thread busy while the previous frame is being sent. */
+#define SLOTS_PER_WORKER 2
+
+/* Zigzag position -> natural (row-major) position of each coefficient. */
+static const uint8_t natural_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* Example tables of ITU-T T.81 Annex K.1, in natural order, for quality 50. */
+static const uint8_t base_luma[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,  12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,  14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,  24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,  72, 92, 95, 98, 112, 100, 103,  99,
+};
+static const uint8_t base_chroma[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,  18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,  47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+/* Output scale of each AAN DCT coefficient: cos(k * pi / 16) * sqrt(2) for k > 0. */
+static const float aan_scale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+};
+
+/* JFIF APP0 segment, so that every decoder interprets the three components as YCbCr. */
+static const uint8_t jfif_segment[18] = {
+    0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+};
+
+/* Quantization table scaled for a quality setting, in zigzag order for the file and as DCT divisors for the encoder. */
+struct quant_table {
+    uint16_t zigzag[64];
+    float divisor[64];      // 1 / (q * aan_scale[u] * aan_scale[v] * 8), indexed [v * 8 + u] (the DCT output is transposed)
+    uint8_t source[64];     // Index into the transposed DCT output of each zigzag position
+};
+
+static void build_quant_table(const uint8_t base[64], int quality, struct quant_table *t) {
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+
+    for (int k = 0; k < 64; k++) {
+        int n = natural_order[k];
+        int u = n / 8, v = n % 8;
+        long q = ((long)base[n] * scale + 50) / 100;
+        q = q < 1 ? 1 : q > 255 ? 255 : q;
+        t->zigzag[k] = (uint16_t)q;
+        t->divisor[v * 8 + u] = 1.0f / ((float)q * aan_scale[u] * aan_scale[v] * 8.0f);
+        t->source[k] = (uint8_t)(v * 8 + u);
+    }
+}
+
+/* Replicates the last sample of a row into the padding that completes the last MCU. */
+static void pad_row(uint8_t *row, int width, int padded) {
+    memset(row + width, row[width - 1], padded - width);
+}
+
+/* --- FORWARD DCT --- */
+
+/**
+ * One-dimensional AAN DCT (as in the IJG float implementation) applied to 8 registers of 4 lanes.
+ * The registers are the rows of the block, so each lane goes through the transform of one column.
+ */
+static inline void dct8(__m128 d[8]) {
+    __m128 tmp0 = _mm_add_ps(d[0], d[7]), tmp7 = _mm_sub_ps(d[0], d[7]);
+    __m128 tmp1 = _mm_add_ps(d[1], d[6]), tmp6 = _mm_sub_ps(d[1], d[6]);
+    __m128 tmp2 = _mm_add_ps(d[2], d[5]), tmp5 = _mm_sub_ps(d[2], d[5]);
+    __m128 tmp3 = _mm_add_ps(d[3], d[4]), tmp4 = _mm_sub_ps(d[3], d[4]);
+
+    /* Even part. */
+    __m128 tmp10 = _mm_add_ps(tmp0, tmp3), tmp13 = _mm_sub_ps(tmp0, tmp3);
+    __m128 tmp11 = _mm_add_ps(tmp1, tmp2), tmp12 = _mm_sub_ps(tmp1, tmp2);
+    d[0] = _mm_add_ps(tmp10, tmp11);
+    d[4] = _mm_sub_ps(tmp10, tmp11);
+    __m128 z1 = _mm_mul_ps(_mm_add_ps(tmp12, tmp13), _mm_set1_ps(0.707106781f));
+    d[2] = _mm_add_ps(tmp13, z1);
+    d[6] = _mm_sub_ps(tmp13, z1);
+
+    /* Odd part. */
+    tmp10 = _mm_add_ps(tmp4, tmp5);
+    tmp11 = _mm_add_ps(tmp5, tmp6);
+    tmp12 = _mm_add_ps(tmp6, tmp7);
+    __m128 z5 = _mm_mul_ps(_mm_sub_ps(tmp10, tmp12), _mm_set1_ps(0.382683433f));
+    __m128 z2 = _mm_add_ps(_mm_mul_ps(tmp10, _mm_set1_ps(0.541196100f)), z5);
+    __m128 z4 = _mm_add_ps(_mm_mul_ps(tmp12, _mm_set1_ps(1.306562965f)), z5);
+    __m128 z3 = _mm_mul_ps(tmp11, _mm_set1_ps(0.707106781f));
+    __m128 z11 = _mm_add_ps(tmp7, z3), z13 = _mm_sub_ps(tmp7, z3);
+    d[5] = _mm_add_ps(z13, z2);
+    d[3] = _mm_sub_ps(z13, z2);
+    d[1] = _mm_add_ps(z11, z4);
+    d[7] = _mm_sub_ps(z11, z4);
+}
+
+/**
+ * Transforms and quantizes one 8x8 block of samples into 64 zigzag-ordered coefficients.
+ * Columns are transformed first (left and right halves of the block in separate registers), the block is transposed
+ * with four 4x4 transposes, and the same column transform then acts on the rows. Quantization is a multiplication
+ * by precomputed reciprocals that also remove the AAN output scaling.
+ */
+static void fdct_quantize(const uint8_t *src, int stride, const struct quant_table *q, int16_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i center = _mm_set1_epi16(128);
+    __m128 l[8], r[8];
+    int16_t transposed[64];
+
+    for (int i = 0; i < 8; i++) {
+        __m128i row = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + i * stride)), zero), center);
+        l[i] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(row, row), 16));
+        r[i] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(row, row), 16));
+    }
+    dct8(l);
+    dct8(r);
+
+    /* After the transpose, t[x] holds vertical frequencies 0..3 of column x and t[8 + x] frequencies 4..7. */
+    __m128 t[16] = { l[0], l[1], l[2], l[3], r[0], r[1], r[2], r[3], l[4], l[5], l[6], l[7], r[4], r[5], r[6], r[7] };
+    _MM_TRANSPOSE4_PS(t[0], t[1], t[2], t[3]);
+    _MM_TRANSPOSE4_PS(t[4], t[5], t[6], t[7]);
+    _MM_TRANSPOSE4_PS(t[8], t[9], t[10], t[11]);
+    _MM_TRANSPOSE4_PS(t[12], t[13], t[14], t[15]);
+    dct8(t);
+    dct8(t + 8);
+
+    /* t[v] and t[8 + v] now hold horizontal frequency v for vertical frequencies 0..3 and 4..7. */
+    for (int v = 0; v < 8; v++) {
+        __m128i a = _mm_cvtps_epi32(_mm_mul_ps(t[v], _mm_loadu_ps(q->divisor + v * 8)));
+        __m128i b = _mm_cvtps_epi32(_mm_mul_ps(t[8 + v], _mm_loadu_ps(q->divisor + v * 8 + 4)));
+        _mm_storeu_si128((__m128i *)(transposed + v * 8), _mm_packs_epi32(a, b));
+    }
+    for (int k = 0; k < 64; k++)
+        out[k] = transposed[q->source[k]];
+}
+
+/* Sets up a three-component 4:2:0 image, keeping the existing coefficient planes when the geometry is unchanged. */
+static int prepare_image(struct jpeg_image *img, int width, int height) {
+    if (img->comp[0].coef && img->width == width && img->height == height && img->ncomp == 3)
+        return 0;
+
+    jpeg_free(img);
+    memset(img, 0, sizeof(*img));
+    img->width = width;
+    img->height = height;
+    img->ncomp = 3;
+    img->hmax = img->vmax = 2;
+    img->mcus_x = (width + 15) / 16;
+    img->mcus_y = (height + 15) / 16;
+    for (int i = 0; i < 3; i++) {
+        struct jpeg_component *c = &img->comp[i];
+        int factor = i == 0 ? 2 : 1;
+        c->id = i + 1;
+        c->h = c->v = factor;
+        c->tq = c->td = c->ta = i == 0 ? 0 : 1;
+        c->blocks_w = img->mcus_x * factor;
+        c->blocks_h = img->mcus_y * factor;
+        c->coef = malloc((size_t)c->blocks_w * c->blocks_h * 64 * sizeof(int16_t));
+        if (!c->coef) return -1;
+    }
+    img->extra = malloc(sizeof(jfif_segment));
+    if (!img->extra) return -1;
+    memcpy(img->extra, jfif_segment, sizeof(jfif_segment));
+    img->extra_size = sizeof(jfif_segment);
+    return 0;
+}
+
+int encoder_frame_to_image(const uint8_t *frame, uint32_t pixelformat, int width, int height, int quality, struct jpeg_image *img) {
+    struct quant_table luma_q, chroma_q;
+
+    if (width <= 0 || height <= 0 || width % 2 || width > 65535 || height > 65535) return -1;
+    if (pixconv_frame_size(pixelformat, width, height) == 0) return -1;
+    if (prepare_image(img, width, height) < 0) return -1;
+
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    build_quant_table(base_luma, quality, &luma_q);
+    build_quant_table(base_chroma, quality, &chroma_q);
+    memcpy(img->qt[0], luma_q.zigzag, sizeof(luma_q.zigzag));
+    memcpy(img->qt[1], chroma_q.zigzag, sizeof(chroma_q.zigzag));
+
+    /* One MCU row at a time: 16 luma rows and 8 rows of each chroma plane, padded to whole blocks. */
+    int luma_w = img->mcus_x * 16, chroma_w = img->mcus_x * 8;
+    uint8_t *strip = malloc((size_t)luma_w * 16 + (size_t)chroma_w * 16);
+    if (!strip) return -1;
+    uint8_t *cb = strip + (size_t)luma_w * 16;
+    uint8_t *cr = cb + (size_t)chroma_w * 8;
+
+    for (int my = 0; my < img->mcus_y; my++) {
+        int rows = height - my * 16 < 16 ? height - my * 16 : 16;
+        int chroma_rows = (rows + 1) / 2;
+        pixconv_rows_to_i420(pixelformat, frame, width, height, my * 16, rows, strip, luma_w, cb, cr, chroma_w);
+
+        /* Columns right of the frame repeat its last column, rows below it repeat its last row. */
+        for (int r = 0; r < 16; r++) {
+            uint8_t *row = strip + (size_t)r * luma_w;
+            if (r < rows) pad_row(row, width, luma_w);
+            else memcpy(row, row - luma_w, luma_w);
+        }
+        for (int r = 0; r < 8; r++) {
+            uint8_t *cb_row = cb + (size_t)r * chroma_w, *cr_row = cr + (size_t)r * chroma_w;
+            if (r < chroma_rows) {
+                pad_row(cb_row, width / 2, chroma_w);
+                pad_row(cr_row, width / 2, chroma_w);
+            } else {
+                memcpy(cb_row, cb_row - chroma_w, chroma_w);
+                memcpy(cr_row, cr_row - chroma_w, chroma_w);
+            }
+        }
+
+        for (int bx = 0; bx < img->comp[0].blocks_w; bx++) {
+            int16_t *top = img->comp[0].coef + ((size_t)(my * 2) * img->comp[0].blocks_w + bx) * 64;
+            fdct_quantize(strip + bx * 8, luma_w, &luma_q, top);
+            fdct_quantize(strip + 8 * luma_w + bx * 8, luma_w, &luma_q, top + (size_t)img->comp[0].blocks_w * 64);
+        }
+        for (int bx = 0; bx < img->mcus_x; bx++) {
+            size_t block = ((size_t)my * img->mcus_x + bx) * 64;
+            fdct_quantize(cb + bx * 8, chroma_w, &chroma_q, img->comp[1].coef + block);
+            fdct_quantize(cr + bx * 8, chroma_w, &chroma_q, img->comp[2].coef + block);
+        }
+    }
+    free(strip);
+    return 0;
+}
+
+/* --- ENCODER THREAD POOL --- */
+
+/* A frame waiting to be encoded, being encoded, or encoded and waiting for its turn to be delivered. */
+struct encoder_slot {
+    uint8_t *frame;
+    size_t size;
+    struct frame_header meta;
+    uint8_t *out;           // Encoded frame, reused across frames
+    size_t out_cap;
+    long out_size;
+    int done;
+};
+
+static struct encoder_slot *slots;
+static unsigned int slot_count;
+static uint64_t submitted, dispatched, delivered; // Frame counters: slot of frame n is n % slot_count
+static int delivering;
+static int encode_quality;
+static size_t slot_capacity;
+static encoder_deliver_fn deliver_frame;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Delivers every encoded frame that is next in order. Called with the lock held by the thread that finished a frame;
+ * only one thread delivers at a time, and frames completed meanwhile by other threads are picked up by the same loop.
+ */
+static void deliver_in_order(void) {
+    if (delivering) return;
+    delivering = 1;
+    while (delivered < dispatched && slots[delivered % slot_count].done) {
+        struct encoder_slot *slot = &slots[delivered % slot_count];
+        pthread_mutex_unlock(&pool_lock);
+        if (slot->out_size > 0)
+            deliver_frame(slot->out, (int)slot->out_size, &slot->meta);
+        pthread_mutex_lock(&pool_lock);
+        slot->done = 0;
+        delivered++;
+        pthread_cond_broadcast(&slot_free);
+    }
+    delivering = 0;
+}
+
+static void *encoder_thread(void *arg) {
+    struct jpeg_image img; // Coefficient planes reused from frame to frame
+
+    (void)arg;
+    memset(&img, 0, sizeof(img));
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (dispatched == submitted)
+            pthread_cond_wait(&work_ready, &pool_lock);
+        struct encoder_slot *slot = &slots[dispatched++ % slot_count];
+        pthread_mutex_unlock(&pool_lock);
+
+        slot->out_size = -1;
+        if (encoder_frame_to_image(slot->frame, slot->meta.pixelformat, (int)slot->meta.width, (int)slot->meta.height,
+                                   encode_quality, &img) == 0)
+            slot->out_size = jpeg_encode(&img, &slot->out, &slot->out_cap);
+        if (slot->out_size < 0)
+            fprintf(stderr, "[ENCODER] Frame %llu could not be encoded\n", (unsigned long long)slot->meta.sequence);
+        slot->meta.pixelformat = V4L2_PIX_FMT_MJPEG;
+
+        pthread_mutex_lock(&pool_lock);
+        slot->done = 1;
+        deliver_in_order();
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+int encoder_start(int workers, int quality, size_t max_frame_size, encoder_deliver_fn deliver) {
+    int started = 0;
+
+    if (workers < 1) workers = 1;
+    slot_count = (unsigned int)workers * SLOTS_PER_WORKER;
+    slots = calloc(slot_count, sizeof(*slots));
+    if (!slots) return -1;
+    for (unsigned int i = 0; i < slot_count; i++) {
+        slots[i].frame = malloc(max_frame_size);
+        if (!slots[i].frame) return -1;
+    }
+    slot_capacity = max_frame_size;
+    encode_quality = quality;
+    deliver_frame = deliver;
+
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, encoder_thread, NULL) != 0) {
+            perror("[ENCODER] Thread creation failed");
+            continue;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+    return started > 0 ? 0 : -1;
+}
+
+int encoder_resize(size_t max_frame_size) {
+    if (max_frame_size <= slot_capacity) return 0;
+
+    /* Once every frame is delivered the workers are all waiting for new work, so no slot is in use. */
+    encoder_flush();
+    for (unsigned int i = 0; i < slot_count; i++) {
+        uint8_t *grown = realloc(slots[i].frame, max_frame_size);
+        if (!grown) return -1;
+        slots[i].frame = grown;
+    }
+    slot_capacity = max_frame_size;
+    return 0;
+}
+
+void encoder_submit(const void *frame, size_t size, const struct frame_header *meta) {
+    size_t expected = pixconv_frame_size(meta->pixelformat, (int)meta->width, (int)meta->height);
+
+    if (expected == 0 || size < expected || size > slot_capacity) {
+        fprintf(stderr, "[ENCODER] Dropping frame %llu: %zu bytes do not match a supported %ux%u raw frame\n",
+                (unsigned long long)meta->sequence, size, meta->width, meta->height);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    while (submitted - delivered >= slot_count)
+        pthread_cond_wait(&slot_free, &pool_lock);
+    struct encoder_slot *slot = &slots[submitted % slot_count];
+    pthread_mutex_unlock(&pool_lock);
+
+    /* The slot is free, so no worker touches it until it is published below. */
+    memcpy(slot->frame, frame, size);
+    slot->size = size;
+    slot->meta = *meta;
+
+    pthread_mutex_lock(&pool_lock);
+    submitted++;
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void encoder_flush(void) {
+    pthread_mutex_lock(&pool_lock);
+    while (delivered != submitted)
+        pthread_cond_wait(&slot_free, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
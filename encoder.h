@@ -0,0 +1,55 @@
+/**
+ * @file encoder.h
+ * @brief Software baseline JPEG encoder for cameras that only deliver raw frames (YUYV, UYVY or NV12), with a pool of encoder threads.
+ *
+ * The pixel-domain front end (4:2:0 conversion, forward DCT and quantization) is vectorized and produces
+ * a coefficient image; jpeg_encode() then entropy-codes it with Huffman tables optimized for the frame.
+ */
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "jpeg.h"
+#include "protocol.h"
+
+/* Called with every encoded frame, in submission order and never from two threads at once. */
+typedef void (*encoder_deliver_fn)(const void *jpeg, int size, const struct frame_header *meta);
+
+/**
+ * @brief Turns a raw frame (V4L2 pixel format supported by pixconv.h) into a 4:2:0 coefficient image at the given
+ * quality (1-100, as in the IJG tables).
+ * The coefficient planes of img are reused when the geometry has not changed; zero-initialize img before first use
+ * and release it with jpeg_free().
+ * @return 0 on success, -1 on unsupported format, invalid geometry or allocation failure.
+ */
+int encoder_frame_to_image(const uint8_t *frame, uint32_t pixelformat, int width, int height, int quality, struct jpeg_image *img);
+
+/**
+ * @brief Starts the encoder threads.
+ * @param workers Number of threads (frames are encoded in parallel, one frame per thread).
+ * @param max_frame_size Largest raw frame that will be submitted; the frame buffers are allocated once here.
+ * @return 0 on success, -1 on error.
+ */
+int encoder_start(int workers, int quality, size_t max_frame_size, encoder_deliver_fn deliver);
+
+/**
+ * @brief Grows the frame buffers so that raw frames of up to max_frame_size bytes can be submitted, after the camera
+ * changed resolution. Waits for the frames in flight first; never shrinks the buffers.
+ * @return 0 on success, -1 on allocation failure (the previous size still applies).
+ */
+int encoder_resize(size_t max_frame_size);
+
+/**
+ * @brief Copies a raw frame (format, geometry and capture metadata in meta) into a free slot and queues it for encoding.
+ * Blocks while every slot is busy, which throttles the capture loop to the encoding throughput.
+ */
+void encoder_submit(const void *frame, size_t size, const struct frame_header *meta);
+
+/**
+ * @brief Waits until every submitted frame has been encoded and delivered.
+ */
+void encoder_flush(void);
+
+#endif
@@ -0,0 +1,192 @@
+/**
+ * @file exposure.c
+ * @brief Frame-rate controller: interval measurement from driver timestamps and V4L2 exposure/gain control.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include "exposure.h"
+
+/* ioctl() restarted when interrupted by a signal. */
+static int xioctl(int fd, unsigned long request, void *arg) {
+    int r;
+    do {
+        r = ioctl(fd, request, arg);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+/* Looks up an integer, boolean or menu control; disabled controls count as missing. */
+static void query_range(int fd, uint32_t id, struct exposure_range *range) {
+    struct v4l2_queryctrl query;
+
+    memset(range, 0, sizeof(*range));
+    memset(&query, 0, sizeof(query));
+    query.id = id;
+    if (xioctl(fd, VIDIOC_QUERYCTRL, &query) == -1 || (query.flags & V4L2_CTRL_FLAG_DISABLED))
+        return;
+    range->available = 1;
+    range->min = query.minimum;
+    range->max = query.maximum;
+    range->step = query.step > 0 ? query.step : 1;
+}
+
+static int get_control(int fd, uint32_t id, int32_t *value) {
+    struct v4l2_control control = { id, 0 };
+    if (xioctl(fd, VIDIOC_G_CTRL, &control) == -1) return -1;
+    *value = control.value;
+    return 0;
+}
+
+static int set_control(int fd, uint32_t id, int32_t value) {
+    struct v4l2_control control = { id, value };
+    if (xioctl(fd, VIDIOC_S_CTRL, &control) == -1) {
+        perror("[FPS] Setting a camera control failed");
+        return -1;
+    }
+    return 0;
+}
+
+/* Clamps a value to a control's range and rounds it to the control's step. */
+static int32_t fit(const struct exposure_range *range, double value) {
+    if (value < range->min) value = range->min;
+    if (value > range->max) value = range->max;
+    return range->min + (int32_t)((value - range->min) / range->step) * range->step;
+}
+
+void exposure_init(struct exposure_control *ec, int fd, uint32_t buf_type, double fps) {
+    struct v4l2_streamparm parm;
+    int32_t mode;
+
+    ec->target_us = (int64_t)(1e6 / fps);
+    ec->interval_us = ec->target_us;
+    ec->last_us = 0;
+    ec->frames = 0;
+    ec->manual = 0;
+    ec->stable_since_us = 0;
+
+    /* Frame rate request; drivers round it to one they support. */
+    memset(&parm, 0, sizeof(parm));
+    parm.type = buf_type;
+    parm.parm.capture.timeperframe.numerator = 1000;
+    parm.parm.capture.timeperframe.denominator = (uint32_t)(fps * 1000);
+    if (xioctl(fd, VIDIOC_S_PARM, &parm) == 0 && parm.parm.capture.timeperframe.denominator > 0) {
+        ec->target_us = (int64_t)parm.parm.capture.timeperframe.numerator * 1000000 / parm.parm.capture.timeperframe.denominator;
+        ec->interval_us = ec->target_us;
+    }
+
+    query_range(fd, V4L2_CID_EXPOSURE_AUTO_PRIORITY, &ec->priority);
+    query_range(fd, V4L2_CID_EXPOSURE_AUTO, &ec->mode);
+    query_range(fd, V4L2_CID_EXPOSURE_ABSOLUTE, &ec->exposure);
+    query_range(fd, V4L2_CID_GAIN, &ec->gain);
+
+    /* UVC cameras usually run in aperture priority mode, which is their auto exposure. */
+    ec->auto_mode = V4L2_EXPOSURE_APERTURE_PRIORITY;
+    if (ec->mode.available && get_control(fd, V4L2_CID_EXPOSURE_AUTO, &mode) == 0 && mode != V4L2_EXPOSURE_MANUAL)
+        ec->auto_mode = mode;
+
+    /* The setting the device came with, restored with auto exposure. Once cleared, it stays so across renegotiations. */
+    if (ec->priority.available && !ec->priority_cleared &&
+        get_control(fd, V4L2_CID_EXPOSURE_AUTO_PRIORITY, &ec->priority_value) < 0)
+        ec->priority.available = 0;
+}
+
+/* Gives the exposure back to the camera: auto exposure, and exposure_auto_priority as it was. */
+static int release_control(struct exposure_control *ec, int fd) {
+    if (ec->manual && (!ec->mode.available || set_control(fd, V4L2_CID_EXPOSURE_AUTO, ec->auto_mode) < 0))
+        return -1;
+    ec->manual = 0;
+    if (ec->priority_cleared && set_control(fd, V4L2_CID_EXPOSURE_AUTO_PRIORITY, ec->priority_value) == 0)
+        ec->priority_cleared = 0;
+    return 0;
+}
+
+/* Sets a shorter manual exposure and raises the gain by the same ratio (as far as it goes) to keep the brightness. */
+static void shorten_exposure(struct exposure_control *ec, int fd, double fps) {
+    int32_t old_exposure = ec->exposure_value, old_gain = ec->gain_value;
+    /* EXPOSURE_ABSOLUTE counts 100 us units; an exposure longer than 90% of the frame interval cannot hold the rate. */
+    double cap = ec->target_us / 100.0 * 0.9;
+    double next = old_exposure > cap ? cap : old_exposure * EXPOSURE_STEP;
+
+    ec->exposure_value = fit(&ec->exposure, next);
+    if (ec->exposure_value >= old_exposure && ec->manual) {
+        printf("[FPS] measured %.2f fps (target %.2f): exposure already at its minimum\n", fps, 1e6 / ec->target_us);
+        return;
+    }
+    if (!ec->manual && ec->mode.available && set_control(fd, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL) < 0)
+        return;
+    ec->manual = 1;
+    set_control(fd, V4L2_CID_EXPOSURE_ABSOLUTE, ec->exposure_value);
+
+    if (ec->gain.available && ec->exposure_value > 0) {
+        double ratio = (double)old_exposure / ec->exposure_value;
+        /* Gain units are device-specific; from the minimum there is nothing to scale, so a share of the range is added. */
+        double gain = old_gain > ec->gain.min ? ec->gain.min + (old_gain - ec->gain.min) * ratio
+                                              : ec->gain.min + (ec->gain.max - ec->gain.min) * (ratio - 1) / 4;
+        ec->gain_value = fit(&ec->gain, gain);
+        set_control(fd, V4L2_CID_GAIN, ec->gain_value);
+    }
+    ec->adjustments++;
+    printf("[FPS] measured %.2f fps (target %.2f): exposure %d -> %d (x100 us), gain %d -> %d\n", fps,
+           1e6 / ec->target_us, old_exposure, ec->exposure_value, old_gain, ec->gain_value);
+}
+
+void exposure_frame(struct exposure_control *ec, int fd, int64_t timestamp_us) {
+    int64_t gap = timestamp_us - ec->last_us;
+
+    /* Exponential average over about 8 frames; gaps of more than ten intervals are outages, not exposure. */
+    if (ec->last_us != 0 && gap > 0 && gap < 10 * ec->target_us) {
+        ec->interval_us += (gap - ec->interval_us) / 8;
+        ec->frames++;
+        ec->frames_total++;
+        if (gap > ec->target_us * EXPOSURE_TOLERANCE)
+            ec->frames_slow++;
+    }
+    ec->last_us = timestamp_us;
+    if (ec->frames < EXPOSURE_WINDOW)
+        return;
+    ec->frames = 0;
+
+    double fps = 1e6 / ec->interval_us;
+    if (ec->interval_us > ec->target_us * EXPOSURE_TOLERANCE) {
+        ec->stable_since_us = 0;
+        /* First and cheapest step: auto exposure keeps working but may not lower the frame rate any more. */
+        if (ec->priority.available && !ec->priority_cleared && ec->priority_value != 0 &&
+            set_control(fd, V4L2_CID_EXPOSURE_AUTO_PRIORITY, 0) == 0) {
+            ec->priority_cleared = 1;
+            ec->adjustments++;
+            printf("[FPS] measured %.2f fps (target %.2f): exposure_auto_priority=0, auto exposure may not lower the "
+                   "frame rate\n", fps, 1e6 / ec->target_us);
+            return;
+        }
+        if (!ec->exposure.available) {
+            if (!ec->warned)
+                printf("[FPS] measured %.2f fps (target %.2f): the camera has no exposure control\n", fps, 1e6 / ec->target_us);
+            ec->warned = 1;
+            return;
+        }
+        /* Starts from the exposure auto mode had chosen, so the first manual step changes the picture as little as possible. */
+        if (!ec->manual) {
+            if (get_control(fd, V4L2_CID_EXPOSURE_ABSOLUTE, &ec->exposure_value) < 0)
+                ec->exposure_value = ec->exposure.max;
+            if (!ec->gain.available || get_control(fd, V4L2_CID_GAIN, &ec->gain_value) < 0)
+                ec->gain_value = ec->gain.min;
+        }
+        shorten_exposure(ec, fd, fps);
+        return;
+    }
+
+    /* At the target rate under the controller's settings: after a while, the camera's own get another chance. */
+    if (ec->manual || ec->priority_cleared) {
+        if (ec->stable_since_us == 0) {
+            ec->stable_since_us = timestamp_us;
+        } else if (timestamp_us - ec->stable_since_us >= EXPOSURE_RELEASE_S * 1000000LL && release_control(ec, fd) == 0) {
+            ec->stable_since_us = 0;
+            ec->releases++;
+            printf("[FPS] measured %.2f fps for %d s: auto exposure and its priority setting restored\n", fps, EXPOSURE_RELEASE_S);
+        }
+    }
+}
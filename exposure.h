@@ -0,0 +1,62 @@
+/**
+ * @file exposure.h
+ * @brief Frame-rate stabilisation: keeps a webcam at its configured frame rate in low light by controlling exposure.
+ *
+ * Many UVC cameras lengthen the exposure beyond the frame interval when the scene gets dark, silently halving the
+ * frame rate. The controller measures the real interval between driver timestamps and, when it stays above the target,
+ * takes cheapest-first steps: exposure_auto_priority is cleared (auto exposure may no longer lower the frame rate),
+ * then exposure is set manually below the frame interval, with the gain raised to keep the brightness. After a long
+ * enough period at the target rate, auto exposure and exposure_auto_priority are given back, so a brighter scene is not
+ * stuck with the controller's settings.
+ */
+
+#ifndef EXPOSURE_H
+#define EXPOSURE_H
+
+#include <stdint.h>
+
+/* Frames per decision, tolerated excess of the measured interval over the target, exposure reduction per step,
+   and seconds at the target rate before auto exposure is tried again. */
+#define EXPOSURE_WINDOW 30
+#define EXPOSURE_TOLERANCE 1.10
+#define EXPOSURE_STEP 0.8
+#define EXPOSURE_RELEASE_S 60
+
+/* Range of an integer V4L2 control; available is 0 when the device does not have it. */
+struct exposure_range {
+    int available;
+    int32_t min, max, step;
+};
+
+/* Controller state. Zero-initialize before first use; the counters survive exposure_init(). */
+struct exposure_control {
+    int64_t target_us;          // Configured frame interval
+    int64_t interval_us;        // Smoothed measured interval between driver timestamps
+    int64_t last_us;            // Timestamp of the previous frame
+    int frames;                 // Frames measured since the last decision
+    struct exposure_range priority, mode, exposure, gain;
+    int32_t auto_mode;          // Exposure mode the device was in, restored when control is given back
+    int32_t priority_value;     // exposure_auto_priority as the device had it, restored likewise
+    int priority_cleared;       // Set while the controller keeps exposure_auto_priority at 0
+    int manual;                 // Set while exposure and gain are set by the controller
+    int32_t exposure_value, gain_value;
+    int64_t stable_since_us;    // Start of the current run at the target rate in manual mode (0 if none)
+    int warned;                 // The "no exposure control" warning was printed
+    long frames_total, frames_slow;
+    long adjustments, releases; // Steps taken (exposure_auto_priority cleared, manual exposure) and returns to auto
+};
+
+/**
+ * @brief Requests the frame rate (VIDIOC_S_PARM) and finds the exposure and gain controls; nothing else is changed
+ * until the measured rate falls short.
+ * buf_type is the capture buffer type (single- or multi-planar). Called after every format negotiation, as a new
+ * format may reset the frame rate.
+ */
+void exposure_init(struct exposure_control *ec, int fd, uint32_t buf_type, double fps);
+
+/**
+ * @brief Accounts for a frame with its driver timestamp and, every EXPOSURE_WINDOW frames, adjusts the controls.
+ */
+void exposure_frame(struct exposure_control *ec, int fd, int64_t timestamp_us);
+
+#endif
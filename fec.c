@@ -0,0 +1,520 @@
+/**
+ * @file fec.c
+ * @brief UDP transport with forward error correction. Parity is computed in GF(2^8) over whole fragments: XOR parity
+ * is the sum of the data fragments of a block, Reed-Solomon parity is a sum weighted by a row of a Cauchy matrix, any
+ * square part of which is invertible, so any parity fragments of a block rebuild as many missing data fragments.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "fec.h"
+
+/* Logarithm and exponential tables of GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1. The exponential table is
+   doubled, so the product of two elements needs no modulo. */
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init(void) {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++)
+        gf_exp[i] = gf_exp[i - 255];
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return a == 0 || b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/**
+ * @brief dst += c * src over a fragment. The products by c are tabulated once, so each byte costs one lookup.
+ */
+static void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, int length) {
+    uint8_t row[256];
+
+    if (c == 0)
+        return;
+    if (c == 1) {
+        for (int i = 0; i < length; i++)
+            dst[i] ^= src[i];
+        return;
+    }
+    for (int v = 0; v < 256; v++)
+        row[v] = gf_mul(c, (uint8_t)v);
+    for (int i = 0; i < length; i++)
+        dst[i] ^= row[src[i]];
+}
+
+/**
+ * @brief Weight of data fragment i of a block in its parity fragment j. The Cauchy matrix element 1 / (x_j + y_i) uses
+ * x_j = FEC_RS_BLOCK + j and y_i = i, all distinct since a block has at most FEC_RS_BLOCK data fragments.
+ */
+static uint8_t coefficient(int fec, int j, int i) {
+    return fec == FEC_XOR ? 1 : gf_inv((uint8_t)((FEC_RS_BLOCK + j) ^ i));
+}
+
+/**
+ * @brief Inverts an n x n matrix in GF(2^8) by Gauss-Jordan elimination.
+ * @return 0 on success, -1 if it is singular.
+ */
+static int gf_invert(uint8_t m[FEC_MAX_PARITY][FEC_MAX_PARITY], uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY], int n) {
+    for (int r = 0; r < n; r++)
+        for (int c = 0; c < n; c++)
+            inv[r][c] = r == c;
+    for (int c = 0; c < n; c++) {
+        int pivot = c;
+        while (pivot < n && m[pivot][c] == 0)
+            pivot++;
+        if (pivot == n)
+            return -1;
+        for (int k = 0; k < n; k++) {
+            uint8_t t = m[c][k]; m[c][k] = m[pivot][k]; m[pivot][k] = t;
+            t = inv[c][k]; inv[c][k] = inv[pivot][k]; inv[pivot][k] = t;
+        }
+        uint8_t scale = gf_inv(m[c][c]);
+        for (int k = 0; k < n; k++) {
+            m[c][k] = gf_mul(m[c][k], scale);
+            inv[c][k] = gf_mul(inv[c][k], scale);
+        }
+        for (int r = 0; r < n; r++) {
+            uint8_t f = m[r][c];
+            if (r == c || f == 0)
+                continue;
+            for (int k = 0; k < n; k++) {
+                m[r][k] ^= gf_mul(f, m[c][k]);
+                inv[r][k] ^= gf_mul(f, inv[c][k]);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Blocks of a message, and the data fragments of block b. */
+static int block_count(const struct udp_fragment *l) {
+    return (l->data + l->block - 1) / l->block;
+}
+
+static int block_size(const struct udp_fragment *l, int b) {
+    int first = b * l->block;
+    return l->data - first < l->block ? l->data - first : l->block;
+}
+
+static int fragment_count(const struct udp_fragment *l) {
+    return l->data + block_count(l) * l->parity;
+}
+
+static uint64_t next_random(struct fec_sender *s) {
+    /* xorshift64*: quality is plenty for dropping packets, and it needs no lock. */
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return s->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static void seed(struct fec_sender *s) {
+    if (s->rng == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        s->rng = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16) ^ 1;
+        /* A restarted client must not reuse the frame numbers of its previous run, which the server may remember. */
+        s->frame = (uint32_t)next_random(s);
+    }
+}
+
+int fec_parse(struct fec_sender *s, const char *spec) {
+    int value = 0;
+
+    pthread_once(&gf_once, gf_init);
+    seed(s);
+    if (strcmp(spec, "none") == 0) {
+        s->fec = FEC_NONE;
+        return 0;
+    }
+    if (sscanf(spec, "xor:%d", &value) == 1 && value >= 1 && value <= FEC_RS_BLOCK) {
+        s->fec = FEC_XOR;
+        s->group = value;
+        return 0;
+    }
+    if (sscanf(spec, "rs:%d", &value) == 1 && value >= 1 && value <= FEC_MAX_PARITY) {
+        s->fec = FEC_RS;
+        s->parity = value;
+        return 0;
+    }
+    return -1;
+}
+
+void fec_simulate_loss(struct fec_sender *s, double percent, double burst) {
+    seed(s);
+    s->loss = percent < 0 ? 0 : percent > 90 ? 0.9 : percent / 100;
+    s->burst = burst < 1 ? 1 : burst;
+}
+
+/**
+ * @brief Tells whether the loss simulator drops the next datagram. In the two-state (Gilbert-Elliott) model a burst
+ * starts with probability loss / (burst * (1 - loss)) and ends with probability 1 / burst, so that the long-run loss
+ * rate is the one asked for and bursts last burst datagrams on average.
+ */
+static int simulate_loss(struct fec_sender *s) {
+    if (s->loss <= 0)
+        return 0;
+    double u = (next_random(s) >> 11) * (1.0 / 9007199254740992.0);
+    if (s->losing)
+        s->losing = u >= 1 / s->burst;
+    else
+        s->losing = u < s->loss / (s->burst * (1 - s->loss));
+    return s->losing;
+}
+
+int fec_encode(struct fec_sender *s, uint32_t camera_id, const struct iovec *pieces, int count) {
+    struct udp_fragment layout;
+    size_t size = 0;
+
+    for (int i = 0; i < count; i++)
+        size += pieces[i].iov_len;
+    if (size == 0 || size > FEC_MAX_MESSAGE)
+        return -1;
+
+    /* Fragments are as large as a datagram allows, then evened out so the last one is padded by fewer bytes
+       than there are fragments. */
+    memset(&layout, 0, sizeof(layout));
+    layout.magic = UDP_MAGIC;
+    layout.camera_id = camera_id;
+    layout.frame = ++s->frame;
+    layout.size = (uint32_t)size;
+    layout.data = (uint16_t)((size + FEC_FRAGMENT - 1) / FEC_FRAGMENT);
+    layout.fec = (uint8_t)s->fec;
+    int length = (int)((size + layout.data - 1) / layout.data);
+    if (s->fec == FEC_XOR) {
+        layout.block = (uint16_t)(s->group < layout.data ? s->group : layout.data);
+        layout.parity = 1;
+    } else if (s->fec == FEC_RS) {
+        int blocks = (layout.data + FEC_RS_BLOCK - 1) / FEC_RS_BLOCK;
+        layout.block = (uint16_t)((layout.data + blocks - 1) / blocks);
+        layout.parity = (uint8_t)s->parity;
+    } else {
+        layout.block = layout.data;
+    }
+
+    int total = fragment_count(&layout);
+    if (s->capacity < (size_t)total * FEC_DATAGRAM) {
+        uint8_t *bigger = realloc(s->packets, (size_t)total * FEC_DATAGRAM);
+        if (bigger == NULL) {
+            perror("[FEC] Datagram buffer allocation failed");
+            return -1;
+        }
+        s->packets = bigger;
+        s->capacity = (size_t)total * FEC_DATAGRAM;
+    }
+
+    /* Data fragments: the message cut into consecutive pieces, the last one padded with zeros. */
+    int fragment = 0;
+    int offset = 0;
+    for (int i = 0; i < total; i++) {
+        layout.index = (uint16_t)i;
+        memcpy(s->packets + (size_t)i * FEC_DATAGRAM, &layout, sizeof(layout));
+    }
+    for (int i = 0; i < count; i++) {
+        const uint8_t *src = pieces[i].iov_base;
+        size_t left = pieces[i].iov_len;
+        while (left > 0) {
+            size_t n = (size_t)(length - offset) < left ? (size_t)(length - offset) : left;
+            memcpy(s->packets + (size_t)fragment * FEC_DATAGRAM + sizeof(layout) + offset, src, n);
+            src += n;
+            left -= n;
+            offset += (int)n;
+            if (offset == length) {
+                fragment++;
+                offset = 0;
+            }
+        }
+    }
+    if (offset > 0)
+        memset(s->packets + (size_t)fragment * FEC_DATAGRAM + sizeof(layout) + offset, 0, length - offset);
+
+    /* Parity fragments, block by block. */
+    for (int b = 0; b < block_count(&layout); b++) {
+        for (int j = 0; j < layout.parity; j++) {
+            uint8_t *dst = s->packets + (size_t)(layout.data + b * layout.parity + j) * FEC_DATAGRAM + sizeof(layout);
+            memset(dst, 0, length);
+            for (int i = 0; i < block_size(&layout, b); i++)
+                gf_mul_add(dst, s->packets + (size_t)(b * layout.block + i) * FEC_DATAGRAM + sizeof(layout),
+                           coefficient(s->fec, j, i), length);
+        }
+    }
+
+    s->count = total;
+    s->length = (int)sizeof(layout) + length;
+    s->frames++;
+    s->parity_datagrams += total - layout.data;
+    return 0;
+}
+
+int fec_send(struct fec_sender *s, int fd, const struct sockaddr_in *to) {
+    struct mmsghdr msgs[FEC_BATCH];
+    struct iovec iov[FEC_BATCH];
+    int next = 0;
+
+    while (next < s->count) {
+        int n = 0;
+        while (n < FEC_BATCH && next < s->count) {
+            uint8_t *packet = s->packets + (size_t)next++ * FEC_DATAGRAM;
+            if (simulate_loss(s)) {
+                s->simulated_losses++;
+                continue;
+            }
+            iov[n].iov_base = packet;
+            iov[n].iov_len = s->length;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_name = (void *)to;
+            msgs[n].msg_hdr.msg_namelen = sizeof(*to);
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            n++;
+        }
+        for (int done = 0; done < n;) {
+            int sent = sendmmsg(fd, msgs + done, n - done, 0);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return -1;
+            done += sent;
+            s->datagrams += sent;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Rebuilds the missing data fragments of a block, if enough of its parity fragments arrived.
+ * The parity fragments used are overwritten: they are not needed once the frame is delivered.
+ * @return 0 when the block is complete, -1 if too many fragments are missing.
+ */
+static int recover_block(struct fec_slot *slot, int b) {
+    const struct udp_fragment *l = &slot->layout;
+    int first = b * l->block;
+    int size = block_size(l, b);
+    int missing[FEC_MAX_PARITY], rows[FEC_MAX_PARITY];
+    int lost = 0, found = 0;
+    uint8_t m[FEC_MAX_PARITY][FEC_MAX_PARITY], inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+
+    for (int i = 0; i < size; i++) {
+        if (slot->have[first + i])
+            continue;
+        if (lost == l->parity)
+            return -1;
+        missing[lost++] = i;
+    }
+    if (lost == 0)
+        return 0;
+    for (int j = 0; j < l->parity && found < lost; j++)
+        if (slot->have[l->data + b * l->parity + j])
+            rows[found++] = j;
+    if (found < lost)
+        return -1;
+
+    /* Each parity fragment used, less the weighted data fragments that arrived, is a weighted sum of the missing ones:
+       lost equations in lost unknowns, solved with the inverse of their weights. */
+    uint8_t *rhs[FEC_MAX_PARITY];
+    for (int r = 0; r < lost; r++) {
+        rhs[r] = slot->buffer + (size_t)(l->data + b * l->parity + rows[r]) * slot->length;
+        for (int i = 0; i < size; i++)
+            if (slot->have[first + i])
+                gf_mul_add(rhs[r], slot->buffer + (size_t)(first + i) * slot->length, coefficient(l->fec, rows[r], i),
+                           slot->length);
+        for (int c = 0; c < lost; c++)
+            m[r][c] = coefficient(l->fec, rows[r], missing[c]);
+    }
+    if (gf_invert(m, inv, lost) < 0)
+        return -1;
+    for (int c = 0; c < lost; c++) {
+        uint8_t *dst = slot->buffer + (size_t)(first + missing[c]) * slot->length;
+        memset(dst, 0, slot->length);
+        for (int r = 0; r < lost; r++)
+            gf_mul_add(dst, rhs[r], inv[c][r], slot->length);
+        slot->have[first + missing[c]] = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Delivers the frame of a slot if all its data fragments are there, or can be rebuilt.
+ */
+static void try_complete(struct fec_receiver *r, struct fec_slot *slot) {
+    const struct udp_fragment *l = &slot->layout;
+    int data = 0;
+
+    /* A block is recoverable only if as many fragments arrived as it has data fragments, so no frame can be before. */
+    if (slot->received < l->data)
+        return;
+    for (int i = 0; i < l->data; i++)
+        data += slot->have[i];
+    if (data < l->data) {
+        /* Rebuilding starts only once every block can be rebuilt, so no work is wasted on a frame that will be dropped. */
+        for (int b = 0; b < block_count(l); b++) {
+            int lost = 0, parity = 0;
+            for (int i = 0; i < block_size(l, b); i++)
+                lost += !slot->have[b * l->block + i];
+            for (int j = 0; j < l->parity; j++)
+                parity += slot->have[l->data + b * l->parity + j];
+            if (lost > parity)
+                return;
+        }
+        for (int b = 0; b < block_count(l); b++)
+            if (recover_block(slot, b) < 0)
+                return;
+        r->recovered++;
+    }
+    slot->done = 1;
+    r->frames++;
+    r->deliver(slot->buffer, l->size, r->arg);
+}
+
+/**
+ * @brief Finds the slot of a frame, or takes one for it: a free one, else the oldest finished one, else the oldest
+ * frame still incomplete, which is dropped.
+ */
+static struct fec_slot *find_slot(struct fec_receiver *r, const struct udp_fragment *f) {
+    struct fec_slot *free_slot = NULL, *oldest_done = NULL, *oldest = NULL;
+
+    for (int i = 0; i < FEC_SLOTS; i++) {
+        struct fec_slot *slot = &r->slots[i];
+        if (!slot->used) {
+            free_slot = free_slot ? free_slot : slot;
+            continue;
+        }
+        if (slot->camera_id == f->camera_id && slot->frame == f->frame)
+            return slot;
+        if (slot->done && (oldest_done == NULL || slot->first_us < oldest_done->first_us))
+            oldest_done = slot;
+        if (!slot->done && (oldest == NULL || slot->first_us < oldest->first_us))
+            oldest = slot;
+    }
+    if (free_slot != NULL)
+        return free_slot;
+    if (oldest_done != NULL)
+        return oldest_done;
+    r->dropped++;
+    return oldest;
+}
+
+static void accept_fragment(struct fec_receiver *r, const uint8_t *datagram, int size, int64_t now_us) {
+    struct udp_fragment f;
+    int length = size - (int)sizeof(f);
+
+    if (length <= 0) {
+        r->invalid++;
+        return;
+    }
+    memcpy(&f, datagram, sizeof(f));
+    if (f.magic != UDP_MAGIC || f.data == 0 || f.block == 0 || f.block > f.data || f.fec > FEC_RS ||
+        f.parity > FEC_MAX_PARITY || (f.fec == FEC_NONE) != (f.parity == 0) || (f.fec == FEC_XOR && f.parity != 1) ||
+        (f.fec == FEC_RS && f.block > FEC_RS_BLOCK) || f.size > FEC_MAX_MESSAGE ||
+        f.size > (uint32_t)f.data * length || f.size <= (uint32_t)(f.data - 1) * length || f.index >= fragment_count(&f)) {
+        r->invalid++;
+        return;
+    }
+
+    struct fec_slot *slot = find_slot(r, &f);
+    if (!slot->used || slot->camera_id != f.camera_id || slot->frame != f.frame) {
+        size_t needed = (size_t)fragment_count(&f) * length;
+        if (slot->capacity < needed) {
+            uint8_t *bigger = realloc(slot->buffer, needed);
+            if (bigger == NULL) {
+                perror("[FEC] Reassembly buffer allocation failed");
+                slot->used = 0;
+                return;
+            }
+            slot->buffer = bigger;
+            slot->capacity = needed;
+        }
+        if (slot->have_capacity < (size_t)fragment_count(&f)) {
+            uint8_t *have = realloc(slot->have, fragment_count(&f));
+            if (have == NULL) {
+                perror("[FEC] Reassembly buffer allocation failed");
+                slot->used = 0;
+                return;
+            }
+            slot->have = have;
+            slot->have_capacity = fragment_count(&f);
+        }
+        slot->used = 1;
+        slot->done = 0;
+        slot->camera_id = f.camera_id;
+        slot->frame = f.frame;
+        slot->layout = f;
+        slot->length = length;
+        slot->received = 0;
+        slot->first_us = now_us;
+        memset(slot->have, 0, fragment_count(&f));
+    }
+    if (slot->done)
+        return; // Parity not needed, or a fragment that came too late
+    const struct udp_fragment *l = &slot->layout;
+    if (l->size != f.size || l->data != f.data || l->block != f.block || l->parity != f.parity || l->fec != f.fec ||
+        slot->length != length) {
+        r->invalid++;
+        return;
+    }
+    if (slot->have[f.index])
+        return;
+    memcpy(slot->buffer + (size_t)f.index * length, datagram + sizeof(f), length);
+    slot->have[f.index] = 1;
+    slot->received++;
+    try_complete(r, slot);
+}
+
+int fec_receive(struct fec_receiver *r, int fd) {
+    struct mmsghdr msgs[FEC_BATCH];
+    struct iovec iov[FEC_BATCH];
+    struct timespec ts;
+
+    pthread_once(&gf_once, gf_init);
+    for (int i = 0; i < FEC_BATCH; i++) {
+        iov[i].iov_base = r->batch[i];
+        iov[i].iov_len = FEC_DATAGRAM;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    /* Waits for the first datagram only, then takes whatever else is already queued. */
+    int n = recvmmsg(fd, msgs, FEC_BATCH, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        n = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t now_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    for (int i = 0; i < n; i++) {
+        r->datagrams++;
+        accept_fragment(r, r->batch[i], (int)msgs[i].msg_len, now_us);
+    }
+
+    /* Frames still incomplete at their deadline are given up: waiting longer would only show them late. */
+    for (int i = 0; i < FEC_SLOTS; i++) {
+        struct fec_slot *slot = &r->slots[i];
+        if (slot->used && !slot->done && now_us - slot->first_us > r->deadline_us) {
+            slot->done = 1;
+            r->dropped++;
+        }
+    }
+    return 0;
+}
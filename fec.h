@@ -0,0 +1,114 @@
+/**
+ * @file fec.h
+ * @brief UDP transport with forward error correction, for the live preview stream.
+ *
+ * Over TCP, one lost packet holds back every byte behind it until it is retransmitted, which on a lossy link turns
+ * into preview frames arriving hundreds of milliseconds late. A preview is only worth showing if it is recent, so here
+ * each one is sent as independent datagrams (see struct udp_fragment) with parity fragments that let the receiver
+ * rebuild lost ones without asking for anything. A frame that cannot be rebuilt by its deadline is simply dropped:
+ * the next one is on its way. Datagrams are sent and received in batches with sendmmsg() and recvmmsg().
+ *
+ * The sender includes a loss simulator (Gilbert-Elliott: random losses, or bursts of them), to exercise the parity on
+ * loopback.
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "protocol.h"
+
+/* Largest datagram, so fragments fit an Ethernet frame (1500 bytes, less the IP and UDP headers) unfragmented. */
+#define FEC_DATAGRAM 1472
+#define FEC_FRAGMENT (FEC_DATAGRAM - (int)sizeof(struct udp_fragment))
+/* Largest message and parity, and the block size of Reed-Solomon parity (block plus parity must stay below 256). */
+#define FEC_MAX_MESSAGE (2 << 20)
+#define FEC_MAX_PARITY 16
+#define FEC_RS_BLOCK 128
+/* Datagrams per sendmmsg() or recvmmsg() call. */
+#define FEC_BATCH 64
+/* Frames being reassembled at once. */
+#define FEC_SLOTS 16
+
+/* Sending side. Zero-initialize, then set the coding with fec_parse(). */
+struct fec_sender {
+    int fec;                    // FEC_NONE, FEC_XOR or FEC_RS
+    int group;                  // FEC_XOR: data fragments per parity fragment
+    int parity;                 // FEC_RS: parity fragments per block
+    double loss;                // Simulated loss rate (0 to 1) and mean length of a burst of losses, in datagrams
+    double burst;
+    int losing;                 // The simulator is in a burst
+    uint64_t rng;
+    uint32_t frame;
+    uint8_t *packets;           // Datagrams of the last message, FEC_DATAGRAM bytes apart
+    size_t capacity;
+    int count;
+    int length;                 // Bytes of each of them
+    long frames;                // Counters since the start
+    long datagrams;
+    long parity_datagrams;
+    long simulated_losses;
+};
+
+/* Receiving side. Zero-initialize, then set deadline_us. */
+struct fec_slot {
+    int used;
+    int done;                   // Delivered or dropped: late fragments of the frame are ignored
+    uint32_t camera_id, frame;
+    struct udp_fragment layout; // Header of the first fragment received, which all others must match
+    int length;                 // Bytes of each fragment
+    uint8_t *buffer;            // Fragments, data then parity
+    size_t capacity;
+    uint8_t *have;              // One flag per fragment
+    size_t have_capacity;
+    int received;
+    int64_t first_us;           // Arrival of the first fragment, from which the deadline runs
+};
+
+struct fec_receiver {
+    int64_t deadline_us;        // Time a frame may take to arrive complete (or recoverable) before it is dropped
+    struct fec_slot slots[FEC_SLOTS];
+    void (*deliver)(const uint8_t *message, size_t size, void *arg);
+    void *arg;
+    long frames;                // Frames delivered, of which recovered with parity
+    long recovered;
+    long dropped;               // Frames given up: deadline passed, or evicted by newer frames
+    long datagrams;
+    long invalid;               // Datagrams not matching the format
+    uint8_t batch[FEC_BATCH][FEC_DATAGRAM]; // Receive buffers of one recvmmsg() call
+};
+
+/**
+ * @brief Sets the coding of a sender from "none", "xor:<data fragments per parity>" or "rs:<parity per block>".
+ * @return 0 on success, -1 if the description is invalid.
+ */
+int fec_parse(struct fec_sender *s, const char *spec);
+
+/**
+ * @brief Sets the loss simulator: rate in percent and mean burst length in datagrams (1 for independent losses).
+ */
+void fec_simulate_loss(struct fec_sender *s, double percent, double burst);
+
+/**
+ * @brief Cuts a message (the concatenated pieces) into data and parity datagrams, left in s->packets.
+ * @return 0 on success, -1 if the message is too large or memory is short.
+ */
+int fec_encode(struct fec_sender *s, uint32_t camera_id, const struct iovec *pieces, int count);
+
+/**
+ * @brief Sends the datagrams of the last encoded message, less the ones the loss simulator drops.
+ * @return 0 on success, -1 if the socket failed.
+ */
+int fec_send(struct fec_sender *s, int fd, const struct sockaddr_in *to);
+
+/**
+ * @brief Receives a batch of datagrams (waiting up to the socket's receive timeout), delivers the frames they
+ * complete, and drops the frames whose deadline passed.
+ * @return 0 on success (including a timeout), -1 if the socket failed.
+ */
+int fec_receive(struct fec_receiver *r, int fd);
+
+#endif
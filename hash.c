@@ -0,0 +1,131 @@
+/**
+ * @file hash.c
+ * @brief 64-bit payload hash in the style of XXH3: eight independent lanes updated with SSE2 32x32->64 multiplies.
+ *
+ * Each 64-byte stripe is XORed with a key, and the low and high halves of every 64-bit word are multiplied together
+ * (PMULUDQ) and added to the lane; the raw word is added to the neighbouring lane so no input bit is lost.
+ * The lanes are scrambled every HASH_SCRAMBLE stripes and folded together with 64x64->128 multiplies at the end.
+ */
+
+#include <string.h>
+#include <emmintrin.h>
+#include "hash.h"
+
+/* Stripes accumulated between two scrambles of the lanes (1 KB of input). */
+#define HASH_SCRAMBLE 16
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+
+/* Per-lane keys (arbitrary constants with well-mixed bits, like the secret of XXH3). They are XORed into the input,
+   never used as multipliers, so they need not be odd; changing them would change every stored hash. */
+static const uint64_t lane_key[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+void hash64_init(struct hash64_state *state) {
+    static const uint64_t seed[8] = {
+        PRIME32_1, PRIME64_1, PRIME64_2, PRIME64_3, 0x85EBCA77C2B2AE63ULL, 0x27D4EB2F165667C5ULL, PRIME64_2, PRIME32_1,
+    };
+
+    memcpy(state->acc, seed, sizeof(state->acc));
+    state->pending_len = 0;
+    state->stripes = 0;
+    state->total = 0;
+}
+
+/* Accumulates one 64-byte stripe into the eight lanes, two lanes per SSE2 register. */
+static inline void accumulate(__m128i acc[4], const uint8_t *stripe) {
+    for (int i = 0; i < 4; i++) {
+        __m128i data = _mm_loadu_si128((const __m128i *)stripe + i);
+        __m128i key = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)lane_key + i));
+        __m128i key_hi = _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i product = _mm_mul_epu32(key, key_hi);
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+    }
+}
+
+/* Folds the high bits of each lane back into its low bits, so long inputs do not saturate the multiplications. */
+static inline void scramble(__m128i acc[4]) {
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+
+    for (int i = 0; i < 4; i++) {
+        __m128i a = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)lane_key + (i + 2) % 4));
+        /* 64-bit by 32-bit multiply built from two PMULUDQ. */
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+}
+
+/* Consumes whole stripes from data, keeping the lanes in registers for the duration of the call. */
+static void consume(struct hash64_state *state, const uint8_t *data, size_t stripes) {
+    __m128i acc[4];
+
+    for (int i = 0; i < 4; i++) acc[i] = _mm_loadu_si128((const __m128i *)state->acc + i);
+    for (size_t s = 0; s < stripes; s++) {
+        accumulate(acc, data + s * HASH_STRIPE);
+        if (++state->stripes % HASH_SCRAMBLE == 0) scramble(acc);
+    }
+    for (int i = 0; i < 4; i++) _mm_storeu_si128((__m128i *)state->acc + i, acc[i]);
+}
+
+void hash64_update(struct hash64_state *state, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    state->total += len;
+    if (state->pending_len > 0) {
+        size_t take = HASH_STRIPE - state->pending_len;
+        if (take > len) take = len;
+        memcpy(state->pending + state->pending_len, p, take);
+        state->pending_len += take;
+        p += take;
+        len -= take;
+        if (state->pending_len < HASH_STRIPE) return;
+        consume(state, state->pending, 1);
+        state->pending_len = 0;
+    }
+
+    consume(state, p, len / HASH_STRIPE);
+    p += len - len % HASH_STRIPE;
+    state->pending_len = len % HASH_STRIPE;
+    memcpy(state->pending, p, state->pending_len);
+}
+
+static uint64_t fold128(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+uint64_t hash64_final(struct hash64_state *state) {
+    /* The trailing partial stripe is zero-padded; mixing in the total length keeps padded inputs apart. */
+    if (state->pending_len > 0) {
+        memset(state->pending + state->pending_len, 0, HASH_STRIPE - state->pending_len);
+        consume(state, state->pending, 1);
+        state->pending_len = 0;
+    }
+
+    uint64_t h = state->total * PRIME64_1;
+    for (int i = 0; i < 4; i++)
+        h += fold128(state->acc[2 * i] ^ lane_key[2 * i + 1], state->acc[2 * i + 1] ^ lane_key[(2 * i + 4) % 8]);
+    return avalanche(h);
+}
+
+uint64_t hash64(const void *data, size_t len) {
+    struct hash64_state state;
+
+    hash64_init(&state);
+    hash64_update(&state, data, len);
+    return hash64_final(&state);
+}
@@ -0,0 +1,44 @@
+/**
+ * @file hash.h
+ * @brief Fast non-cryptographic 64-bit hash of frame payloads, computed incrementally as the data arrives.
+ *
+ * Used to recognise byte-identical frames at ingest. It is not collision resistant against a deliberate attacker,
+ * but accidental collisions between two different 64-bit digests of frames of the same size are negligible.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes consumed per accumulation step: eight 64-bit lanes. */
+#define HASH_STRIPE 64
+
+/* Incremental hashing state. Initialize with hash64_init() before use. */
+struct hash64_state {
+    uint64_t acc[8];
+    uint8_t pending[HASH_STRIPE];   // Bytes waiting for a complete stripe
+    size_t pending_len;
+    uint64_t stripes;               // Stripes accumulated so far
+    uint64_t total;                 // Total number of bytes hashed
+};
+
+void hash64_init(struct hash64_state *state);
+
+/**
+ * @brief Adds len bytes to the hash. Data may be split into chunks of any size; the result does not depend on the split.
+ */
+void hash64_update(struct hash64_state *state, const void *data, size_t len);
+
+/**
+ * @brief Returns the hash of all the data added so far.
+ */
+uint64_t hash64_final(struct hash64_state *state);
+
+/**
+ * @brief Hashes a complete buffer in one call.
+ */
+uint64_t hash64(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,825 @@
+/**
+ * @file impair.c
+ * @brief Network impairment proxy for benchmarks. Sits between the client and a server and forwards TCP connections
+ * and UDP datagrams through a link with a bandwidth cap, latency, jitter, loss and stalls, which can change on a
+ * schedule. What the link did (throughput, queued bytes, losses, stalls) is reported every interval.
+ *
+ * No root and no traffic control are needed: the proxy is an ordinary program on a port of its own. The client is
+ * simply pointed at it instead of the server (e.g. ./client -s 127.0.0.1:9090).
+ *
+ * The link is modelled as one queue per direction, shared by every flow, drained by a token bucket at the given rate:
+ *  - Delay and jitter set the time each piece of data becomes eligible to leave. Jitter never reorders a flow, as a
+ *    TCP stream cannot be reordered through a proxy, nor the datagrams of a direction; flows are independent of each
+ *    other and of the datagrams, as on a real link.
+ *  - A lost UDP datagram is dropped. TCP data cannot be lost between two sockets; a loss holds its data back by the
+ *    retransmission timeout instead, with everything behind it in its flow, which is what a loss costs a TCP stream.
+ *  - The queue holds at most -q KB per direction. Beyond that the proxy stops reading, so TCP flow control pushes back
+ *    on the sender like a saturated link would (its SIOCOUTQ grows); UDP datagrams are dropped (tail drop).
+ *  - A stall stops all forwarding; data waits in the queue, then in the sender.
+ *
+ * Runs are reproducible: random losses and jitter come from a generator seeded with -x (1 by default).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+/* Proxied TCP connections at once. */
+#define MAX_CONNECTIONS 64
+/* Phases of a schedule. */
+#define MAX_PHASES 256
+/* Default queue limit per direction (KB), report interval (s) and seed of the random generator. */
+#define QUEUE_KB 256
+#define REPORT_S 1.0
+#define SEED 1
+/* Largest read from a socket, and the segment size used to turn a loss rate into a chance per read. */
+#define CHUNK_BYTES 65536
+#define SEGMENT_BYTES 1448
+/* Delay added to TCP data hit by a loss: the minimum retransmission timeout of Linux. */
+#define TCP_RTO_MS 200
+/* Burst the token bucket allows above the rate (ms of traffic at that rate). */
+#define BURST_MS 5
+/* Time a connection to the server may take before the client's connection is closed. */
+#define CONNECT_TIMEOUT_MS 2000
+
+/* Conditions of the link from a given time on. */
+struct phase {
+    double start_s;             // Seconds since the proxy started
+    double rate_kbps;           // Bandwidth cap per direction (kbit/s), 0 for none
+    double delay_ms;            // One-way latency added in each direction
+    double jitter_ms;           // Latency varies uniformly by up to this much either way
+    double loss;                // Loss rate (0 to 1) of UDP datagrams and TCP segments
+    int stall;                  // Nothing is forwarded during this phase
+    int repeat;                 // Not a phase: the schedule starts over at start_s
+};
+
+struct link;
+
+/* Data waiting in a direction of the link, in arrival order. */
+struct chunk {
+    struct chunk *next;
+    int64_t release_us;         // Time it may leave, after latency, jitter and loss
+    size_t length, offset;
+    uint8_t data[];
+};
+
+struct queue {
+    struct chunk *head, *tail;
+    size_t bytes;
+    int64_t last_release_us;    // Latest release time given, so jitter never reorders the queue
+    struct link *link;          // Direction of the link the queue belongs to
+};
+
+/* One direction of a proxied connection. */
+struct flow {
+    int from, to;
+    struct queue queue;
+    int eof;                    // The sender closed its side: shut the receiver's down once the queue is empty
+    int shut;
+};
+
+struct connection {
+    int used;
+    int connecting;             // The connection to the server is in progress: nothing is read or forwarded yet
+    int64_t connect_deadline_us;
+    struct flow flows[2];       // Client to server, then server to client
+};
+
+/* A direction of the link: token bucket, queue limit and counters, shared by its flows and datagrams. */
+struct link {
+    const char *name;
+    double tokens;
+    uint64_t bytes;             // Bytes forwarded since the start, and since the last report
+    uint64_t interval_bytes;
+    long tcp_losses;            // TCP reads held back by a loss
+    long datagrams;
+    long udp_losses;
+    long udp_overflows;         // Datagrams dropped because the queue was full
+    size_t queued;              // Bytes in the queues of this direction, and the most over the last interval
+    size_t queued_max;
+};
+
+struct phase phases[MAX_PHASES];
+int phase_count = 0;
+int phase_now = -1;
+double schedule_offset_s = 0; // Start of the current round of a repeating schedule
+
+struct connection connections[MAX_CONNECTIONS];
+struct link links[2] = {{.name = "up"}, {.name = "down"}};
+struct queue udp_queues[2];     // Datagrams to the server, then to the client
+int udp_fds[2] = {-1, -1};      // Socket facing the client (the proxy's port), socket facing the server
+struct sockaddr_in udp_client;  // Last address a datagram came from on the proxy's port, which replies go back to
+int udp_client_known = 0;
+struct sockaddr_in server_address;
+
+size_t queue_limit = (size_t)QUEUE_KB << 10;
+int64_t start_us;
+int64_t stalled_us = 0;         // Time spent stalled
+long connections_total = 0;
+uint64_t rng;
+volatile sig_atomic_t stop = 0;
+
+static int64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Uniform in [0, 1), xorshift64*. */
+static double uniform(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return ((rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+/**
+ * @brief Reads a schedule file. Each line gives the time (s) a phase starts, then the conditions that change, which
+ * the others keep from the phase before: rate=<kbit/s> (0 for no cap), delay=<ms>, jitter=<ms>, loss=<percent>, and
+ * "stall" if nothing may pass during the phase. A line "<time> repeat" starts the schedule over at that time.
+ * @return 0 on success, -1 if the file cannot be read or a line is invalid.
+ */
+static int read_schedule(const char *path, const struct phase *initial) {
+    char line[256];
+    int number = 0;
+    struct phase current = *initial;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror("Cannot open the schedule");
+        return -1;
+    }
+    phase_count = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = '\0';
+        char *token = strtok(line, " \t\r\n");
+        if (token == NULL)
+            continue;
+        struct phase p = current;
+        char *end;
+        p.start_s = strtod(token, &end);
+        p.stall = 0;
+        if (*end != '\0' || p.start_s < 0 || (phase_count > 0 && p.start_s <= phases[phase_count - 1].start_s)) {
+            fprintf(stderr, "%s:%d: invalid or out-of-order start time\n", path, number);
+            fclose(f);
+            return -1;
+        }
+        if (phase_count == MAX_PHASES - 1 || (phase_count > 0 && phases[phase_count - 1].repeat)) {
+            fprintf(stderr, "%s:%d: too many phases, or a phase after the repeat\n", path, number);
+            fclose(f);
+            return -1;
+        }
+        while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+            if (strcmp(token, "stall") == 0)
+                p.stall = 1;
+            else if (strcmp(token, "repeat") == 0)
+                p.repeat = 1;
+            else if (sscanf(token, "rate=%lf", &p.rate_kbps) == 1 || sscanf(token, "delay=%lf", &p.delay_ms) == 1 ||
+                     sscanf(token, "jitter=%lf", &p.jitter_ms) == 1)
+                ;
+            else if (sscanf(token, "loss=%lf", &p.loss) == 1)
+                p.loss /= 100;
+            else {
+                fprintf(stderr, "%s:%d: unknown setting %s\n", path, number, token);
+                fclose(f);
+                return -1;
+            }
+        }
+        if (p.rate_kbps < 0 || p.delay_ms < 0 || p.jitter_ms < 0 || p.loss < 0 || p.loss > 1) {
+            fprintf(stderr, "%s:%d: negative value or loss above 100%%\n", path, number);
+            fclose(f);
+            return -1;
+        }
+        phases[phase_count++] = p;
+        current = p;
+    }
+    fclose(f);
+    if (phase_count == 0 || phases[0].start_s > 0) {
+        /* The conditions given on the command line hold until the first phase. */
+        memmove(phases + 1, phases, phase_count * sizeof(phases[0]));
+        phases[0] = *initial;
+        phase_count++;
+    }
+    if (phases[0].repeat) {
+        fprintf(stderr, "%s: the schedule cannot repeat at its start\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static const struct phase *current_phase(void) {
+    return &phases[phase_now];
+}
+
+static void print_phase(double t, const struct phase *p) {
+    printf("[IMPAIR] %7.1f s: ", t);
+    if (p->stall)
+        printf("stall\n");
+    else if (p->rate_kbps > 0)
+        printf("rate %.0f kbit/s, delay %.0f ms, jitter %.0f ms, loss %.2f%%\n", p->rate_kbps, p->delay_ms, p->jitter_ms,
+               p->loss * 100);
+    else
+        printf("no rate cap, delay %.0f ms, jitter %.0f ms, loss %.2f%%\n", p->delay_ms, p->jitter_ms, p->loss * 100);
+}
+
+/**
+ * @brief Moves to the phase of the current time, starting the schedule over at a "repeat" line.
+ * @return Time (us) of the next phase change, or INT64_MAX if there is none.
+ */
+static int64_t update_phase(int64_t now_us) {
+    double t = (now_us - start_us) / 1e6;
+    int next = phase_now + 1;
+
+    while (next < phase_count && schedule_offset_s + phases[next].start_s <= t) {
+        if (phases[next].repeat) {
+            schedule_offset_s += phases[next].start_s;
+            next = 0;
+            continue;
+        }
+        next++;
+    }
+    if (next - 1 != phase_now) {
+        phase_now = next - 1;
+        print_phase(t, current_phase());
+    }
+    if (phase_now + 1 < phase_count)
+        return start_us + (int64_t)((schedule_offset_s + phases[phase_now + 1].start_s) * 1e6);
+    return INT64_MAX;
+}
+
+static void queue_push(struct queue *q, struct chunk *c) {
+    c->next = NULL;
+    if (q->tail != NULL)
+        q->tail->next = c;
+    else
+        q->head = c;
+    q->tail = c;
+    q->bytes += c->length;
+    q->link->queued += c->length;
+    if (q->link->queued > q->link->queued_max)
+        q->link->queued_max = q->link->queued;
+}
+
+static void queue_pop(struct queue *q) {
+    struct chunk *c = q->head;
+    q->head = c->next;
+    if (q->head == NULL)
+        q->tail = NULL;
+    q->bytes -= c->length;
+    q->link->queued -= c->length;
+    free(c);
+}
+
+static void queue_clear(struct queue *q) {
+    while (q->head != NULL)
+        queue_pop(q);
+}
+
+/**
+ * @brief Time data arriving now may leave, and whether a loss hits it.
+ * @param q Queue the data goes to, whose order it keeps.
+ * @param tcp TCP data, which a loss holds back (with what follows it in the queue); a lost datagram is dropped instead.
+ * @param segments Segments the data stands for: it is hit if any of them is lost.
+ * @param lost Set if the data was hit by a loss.
+ */
+static int64_t release_time(struct queue *q, int tcp, int64_t now_us, int segments, int *lost) {
+    const struct phase *p = current_phase();
+    double delay_ms = p->delay_ms + (p->jitter_ms > 0 ? (uniform() * 2 - 1) * p->jitter_ms : 0);
+    int64_t release = now_us + (int64_t)((delay_ms > 0 ? delay_ms : 0) * 1000);
+
+    *lost = p->loss > 0 && uniform() < 1 - pow(1 - p->loss, segments);
+    if (*lost && tcp)
+        release += TCP_RTO_MS * 1000LL;
+    if (*lost && !tcp)
+        return release; // Dropped: the queue's order is not affected
+    if (release < q->last_release_us)
+        release = q->last_release_us;
+    q->last_release_us = release;
+    return release;
+}
+
+static void refill(struct link *link, int64_t elapsed_us) {
+    const struct phase *p = current_phase();
+    if (p->rate_kbps <= 0)
+        return;
+    double rate = p->rate_kbps * 125; // bytes per second
+    double depth = rate * BURST_MS / 1000 > 2 * SEGMENT_BYTES ? rate * BURST_MS / 1000 : 2 * SEGMENT_BYTES;
+    link->tokens += rate * elapsed_us / 1e6;
+    if (link->tokens > depth)
+        link->tokens = depth;
+}
+
+/**
+ * @brief Tells how many bytes the link lets through now, out of wanted, given the phase and the token bucket.
+ * @param atomic The bytes go as a whole (a datagram) or not at all.
+ * @param wake Lowered to the time more tokens will be there, if too few are.
+ */
+static size_t allowance(struct link *link, size_t wanted, int atomic, int64_t now_us, int64_t *wake) {
+    const struct phase *p = current_phase();
+    if (p->stall)
+        return 0; // The phase change wakes the loop up
+    if (p->rate_kbps <= 0)
+        return wanted;
+    size_t least = atomic || wanted < SEGMENT_BYTES ? wanted : SEGMENT_BYTES;
+    if (link->tokens >= least)
+        return atomic || (size_t)link->tokens >= wanted ? wanted : (size_t)link->tokens;
+    int64_t at = now_us + (int64_t)((least - link->tokens) / (p->rate_kbps * 125) * 1e6) + 1;
+    if (at < *wake)
+        *wake = at;
+    return 0;
+}
+
+static void close_connection(struct connection *c) {
+    close(c->flows[0].from);
+    close(c->flows[0].to);
+    queue_clear(&c->flows[0].queue);
+    queue_clear(&c->flows[1].queue);
+    c->used = 0;
+}
+
+/**
+ * @brief Forwards the data of a flow that is due and that the link lets through.
+ * @return 0, or -1 if the connection failed.
+ */
+static int forward(struct flow *flow, struct link *link, int64_t now_us, int64_t *wake, int *blocked) {
+    struct queue *q = &flow->queue;
+
+    *blocked = 0;
+    while (q->head != NULL) {
+        struct chunk *c = q->head;
+        if (c->release_us > now_us) {
+            if (c->release_us < *wake)
+                *wake = c->release_us;
+            return 0;
+        }
+        size_t n = allowance(link, c->length - c->offset, 0, now_us, wake);
+        if (n == 0)
+            return 0;
+        ssize_t sent = send(flow->to, c->data + c->offset, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                *blocked = 1;
+                return 0;
+            }
+            return -1;
+        }
+        if (current_phase()->rate_kbps > 0)
+            link->tokens -= sent;
+        link->bytes += sent;
+        link->interval_bytes += sent;
+        c->offset += sent;
+        if (c->offset == c->length)
+            queue_pop(q);
+    }
+    if (flow->eof && !flow->shut) {
+        shutdown(flow->to, SHUT_WR);
+        flow->shut = 1;
+    }
+    return 0;
+}
+
+static void forward_datagrams(int dir, int64_t now_us, int64_t *wake) {
+    struct queue *q = &udp_queues[dir];
+    struct link *link = &links[dir];
+
+    while (q->head != NULL) {
+        struct chunk *c = q->head;
+        if (c->release_us > now_us) {
+            if (c->release_us < *wake)
+                *wake = c->release_us;
+            return;
+        }
+        if (allowance(link, c->length, 1, now_us, wake) == 0)
+            return;
+        if (dir == 0)
+            sendto(udp_fds[1], c->data, c->length, MSG_DONTWAIT, (struct sockaddr *)&server_address,
+                   sizeof(server_address));
+        else if (udp_client_known)
+            sendto(udp_fds[0], c->data, c->length, MSG_DONTWAIT, (struct sockaddr *)&udp_client, sizeof(udp_client));
+        if (current_phase()->rate_kbps > 0)
+            link->tokens -= c->length;
+        link->bytes += c->length;
+        link->interval_bytes += c->length;
+        queue_pop(q);
+    }
+}
+
+/**
+ * @brief Reads what a flow's sender has, up to the queue limit of the direction (shared by all its flows), and queues
+ * it with its release time.
+ * @return 0, or -1 if the connection failed.
+ */
+static int take(struct flow *flow, struct link *link, int64_t now_us) {
+    size_t room = link->queued < queue_limit ? queue_limit - link->queued : 0;
+    size_t want = room < CHUNK_BYTES ? room : CHUNK_BYTES;
+    struct chunk *c;
+    int lost;
+
+    if (want == 0)
+        return 0; // Other flows filled the queue since the poll
+    c = malloc(sizeof(*c) + want);
+    if (c == NULL) {
+        perror("Queue allocation failed");
+        return -1;
+    }
+    ssize_t n = recv(flow->from, c->data, want, MSG_DONTWAIT);
+    if (n <= 0) {
+        free(c);
+        if (n == 0) {
+            flow->eof = 1;
+            return 0;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    c->length = n;
+    c->offset = 0;
+    c->release_us = release_time(&flow->queue, 1, now_us, (int)((n + SEGMENT_BYTES - 1) / SEGMENT_BYTES), &lost);
+    if (lost)
+        link->tcp_losses++;
+    queue_push(&flow->queue, c);
+    return 0;
+}
+
+static void take_datagrams(int dir, int64_t now_us) {
+    uint8_t buffer[65536];
+    struct sockaddr_in from;
+    struct link *link = &links[dir];
+    int lost;
+
+    for (int i = 0; i < 64; i++) {
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(udp_fds[dir], buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+        if (n < 0)
+            return;
+        if (dir == 0) {
+            udp_client = from;
+            udp_client_known = 1;
+        }
+        link->datagrams++;
+        if (link->queued + n > queue_limit) {
+            link->udp_overflows++;
+            continue;
+        }
+        /* Datagrams keep their order too: a later one never leaves before an earlier one. */
+        int64_t release = release_time(&udp_queues[dir], 0, now_us, 1, &lost);
+        if (lost) {
+            link->udp_losses++;
+            continue;
+        }
+        struct chunk *c = malloc(sizeof(*c) + n);
+        if (c == NULL)
+            return;
+        memcpy(c->data, buffer, n);
+        c->length = n;
+        c->offset = 0;
+        c->release_us = release;
+        queue_push(&udp_queues[dir], c);
+    }
+}
+
+/**
+ * @brief Accepts a client and starts its connection to the server without waiting for it: the loop completes it
+ * when the socket becomes writable (see finish_connection()), so the other flows keep going meanwhile.
+ */
+static void accept_connection(int listen_fd, int64_t now_us) {
+    int client = accept(listen_fd, NULL, NULL);
+    if (client < 0)
+        return;
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server >= 0)
+        fcntl(server, F_SETFL, O_NONBLOCK);
+    if (server < 0 ||
+        (connect(server, (struct sockaddr *)&server_address, sizeof(server_address)) < 0 && errno != EINPROGRESS)) {
+        perror("[IMPAIR] Connection to the server failed");
+        if (server >= 0)
+            close(server);
+        close(client);
+        return;
+    }
+    /* The link decides when data leaves: the proxy must not hold small writes back on top of it. */
+    int one = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        struct connection *c = &connections[i];
+        if (c->used)
+            continue;
+        memset(c, 0, sizeof(*c));
+        c->used = 1;
+        c->connecting = 1;
+        c->connect_deadline_us = now_us + CONNECT_TIMEOUT_MS * 1000LL;
+        c->flows[0].from = client;
+        c->flows[0].to = server;
+        c->flows[1].from = server;
+        c->flows[1].to = client;
+        c->flows[0].queue.link = &links[0];
+        c->flows[1].queue.link = &links[1];
+        return;
+    }
+    fprintf(stderr, "[IMPAIR] Too many connections, refusing one.\n");
+    close(server);
+    close(client);
+}
+
+/**
+ * @brief Completes the connection to the server once its socket is writable; the client's connection is closed if
+ * it failed.
+ */
+static void finish_connection(struct connection *c) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (getsockopt(c->flows[1].from, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+        fprintf(stderr, "[IMPAIR] Connection to the server failed: %s\n", strerror(error != 0 ? error : errno));
+        close_connection(c);
+        return;
+    }
+    c->connecting = 0;
+    connections_total++;
+}
+
+static void report(FILE *csv, double t, double interval_s) {
+    printf("[IMPAIR] %7.1f s:", t);
+    for (int d = 0; d < 2; d++) {
+        struct link *l = &links[d];
+        printf(" %s %.2f Mbit/s (queue up to %zu KB)%s", l->name, l->interval_bytes * 8 / interval_s / 1e6,
+               l->queued_max >> 10, d == 0 ? "," : "");
+    }
+    printf(", TCP data held back by losses %ld/%ld, UDP lost %ld/%ld, UDP overflows %ld/%ld%s\n", links[0].tcp_losses,
+           links[1].tcp_losses, links[0].udp_losses, links[1].udp_losses, links[0].udp_overflows,
+           links[1].udp_overflows, current_phase()->stall ? ", stalled" : "");
+    if (csv != NULL) {
+        fprintf(csv, "%.3f,%d,%llu,%llu,%zu,%zu,%ld,%ld,%ld,%ld,%ld,%ld,%d\n", t, phase_now,
+                (unsigned long long)links[0].interval_bytes, (unsigned long long)links[1].interval_bytes,
+                links[0].queued_max, links[1].queued_max, links[0].tcp_losses, links[1].tcp_losses,
+                links[0].udp_losses, links[1].udp_losses, links[0].udp_overflows, links[1].udp_overflows,
+                current_phase()->stall);
+        fflush(csv);
+    }
+    for (int d = 0; d < 2; d++) {
+        links[d].interval_bytes = 0;
+        links[d].queued_max = links[d].queued;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b rate_kbps] [-d delay_ms] [-j jitter_ms] [-l loss_percent] [-q queue_kb]\n"
+                    "          [-S schedule_file] [-i report_seconds] [-o report.csv] [-x seed]\n"
+                    "          <listen_port> <server_address:port>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct phase initial;
+    const char *schedule = NULL;
+    const char *csv_path = NULL;
+    double report_s = REPORT_S;
+    int opt;
+
+    /* -b caps the bandwidth of each direction (kbit/s), -d and -j set the one-way latency and its jitter (ms), -l the
+       loss rate (percent) and -q the queue of each direction (KB); -S reads a schedule of changing conditions, which
+       start from these. -i sets the report interval (s), -o also writes the reports to a CSV file and -x seeds the
+       random losses and jitter. */
+    memset(&initial, 0, sizeof(initial));
+    rng = SEED;
+    while ((opt = getopt(argc, argv, "b:d:j:l:q:S:i:o:x:")) != -1) {
+        switch (opt) {
+        case 'b':
+            initial.rate_kbps = atof(optarg);
+            break;
+        case 'd':
+            initial.delay_ms = atof(optarg);
+            break;
+        case 'j':
+            initial.jitter_ms = atof(optarg);
+            break;
+        case 'l':
+            initial.loss = atof(optarg) / 100;
+            break;
+        case 'q':
+            queue_limit = (size_t)atol(optarg) << 10;
+            break;
+        case 'S':
+            schedule = optarg;
+            break;
+        case 'i':
+            report_s = atof(optarg);
+            break;
+        case 'o':
+            csv_path = optarg;
+            break;
+        case 'x':
+            rng = strtoull(optarg, NULL, 0) | 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || report_s <= 0 || queue_limit == 0 || initial.loss < 0 || initial.loss > 1)
+        usage(argv[0]);
+
+    int port = atoi(argv[optind]);
+    char host[64];
+    const char *colon = strrchr(argv[optind + 1], ':');
+    if (colon == NULL || colon - argv[optind + 1] >= (long)sizeof(host))
+        usage(argv[0]);
+    memcpy(host, argv[optind + 1], colon - argv[optind + 1]);
+    host[colon - argv[optind + 1]] = '\0';
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &server_address.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid server address %s\n", host);
+        return 1;
+    }
+
+    if (schedule != NULL) {
+        if (read_schedule(schedule, &initial) < 0)
+            return 1;
+    } else {
+        phases[0] = initial;
+        phase_count = 1;
+    }
+
+    FILE *csv = NULL;
+    if (csv_path != NULL) {
+        if ((csv = fopen(csv_path, "w")) == NULL) {
+            perror("Cannot create the report file");
+            return 1;
+        }
+        fprintf(csv, "time_s,phase,up_bytes,down_bytes,up_queue_max,down_queue_max,up_tcp_losses,down_tcp_losses,"
+                     "up_udp_losses,down_udp_losses,up_udp_overflows,down_udp_overflows,stall\n");
+    }
+
+    /* The proxy's port, for TCP and UDP alike, and a UDP socket facing the server. */
+    struct sockaddr_in address;
+    int reuse = 1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    udp_fds[0] = socket(AF_INET, SOCK_DGRAM, 0);
+    udp_fds[1] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listen_fd < 0 || udp_fds[0] < 0 || udp_fds[1] < 0) {
+        perror("Socket creation failed");
+        return 1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, 16) < 0 ||
+        bind(udp_fds[0], (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("Bind failed");
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    printf("[IMPAIR] Forwarding port %d to %s:%d (TCP and UDP), queue %zu KB per direction.\n", port, host,
+           ntohs(server_address.sin_port), queue_limit >> 10);
+
+    udp_queues[0].link = &links[0];
+    udp_queues[1].link = &links[1];
+    start_us = monotonic_us();
+    int64_t last_us = start_us;
+    int64_t report_at = start_us + (int64_t)(report_s * 1e6);
+    int64_t last_report_us = start_us;
+    int first = 0; // Connection served first, rotated so every connection gets its share of a capped link
+    struct pollfd fds[3 + 2 * MAX_CONNECTIONS];
+    struct connection *owners[3 + 2 * MAX_CONNECTIONS];
+
+    while (!stop) {
+        int64_t now = monotonic_us();
+        int64_t wake = update_phase(now);
+        if (current_phase()->stall)
+            stalled_us += now - last_us;
+        for (int d = 0; d < 2; d++)
+            refill(&links[d], now - last_us);
+        last_us = now;
+
+        /* Forwards what is due, then listens for more where the queues have room. */
+        int n = 0;
+        fds[n].fd = listen_fd;
+        fds[n].events = POLLIN;
+        owners[n++] = NULL;
+        for (int d = 0; d < 2; d++) {
+            forward_datagrams(d, now, &wake);
+            fds[n].fd = udp_fds[d];
+            fds[n].events = POLLIN;
+            owners[n++] = NULL;
+        }
+        for (int k = 0; k < MAX_CONNECTIONS; k++) {
+            struct connection *c = &connections[(first + k) % MAX_CONNECTIONS];
+            int blocked[2];
+            if (!c->used)
+                continue;
+            if (c->connecting) {
+                if (now >= c->connect_deadline_us) {
+                    fprintf(stderr, "[IMPAIR] Connection to the server timed out.\n");
+                    close_connection(c);
+                    continue;
+                }
+                if (c->connect_deadline_us < wake)
+                    wake = c->connect_deadline_us;
+                fds[n].fd = -1; // The client waits, its data stays in its socket
+                fds[n].events = 0;
+                owners[n++] = c;
+                fds[n].fd = c->flows[1].from;
+                fds[n].events = POLLOUT;
+                owners[n++] = c;
+                continue;
+            }
+            if (forward(&c->flows[0], &links[0], now, &wake, &blocked[0]) < 0 ||
+                forward(&c->flows[1], &links[1], now, &wake, &blocked[1]) < 0 ||
+                (c->flows[0].shut && c->flows[1].shut)) {
+                close_connection(c);
+                continue;
+            }
+            for (int d = 0; d < 2; d++) {
+                struct flow *f = &c->flows[d];
+                /* A socket neither read from nor written to any more is left out, or its hangup would wake the loop. */
+                fds[n].fd = f->eof && c->flows[1 - d].shut ? -1 : f->from;
+                fds[n].events = !f->eof && links[d].queued < queue_limit ? POLLIN : 0;
+                if (blocked[1 - d])
+                    fds[n].events |= POLLOUT; // This socket is also where the other direction is blocked
+                owners[n++] = c;
+            }
+        }
+        first = (first + 1) % MAX_CONNECTIONS;
+
+        if (report_at < wake)
+            wake = report_at;
+        int timeout = wake == INT64_MAX ? -1 : wake <= now ? 0 : (int)((wake - now + 999) / 1000);
+        if (poll(fds, n, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        now = monotonic_us();
+        if (fds[0].revents & POLLIN)
+            accept_connection(listen_fd, now);
+        for (int d = 0; d < 2; d++)
+            if (fds[1 + d].revents & POLLIN)
+                take_datagrams(d, now);
+        for (int i = 3; i < n; i += 2) {
+            struct connection *c = owners[i];
+            if (c->connecting) {
+                if (fds[i + 1].revents & (POLLOUT | POLLERR | POLLHUP))
+                    finish_connection(c);
+                continue;
+            }
+            for (int d = 0; d < 2 && c->used; d++) {
+                struct flow *f = &c->flows[d];
+                short revents = fds[i + d].revents;
+                if ((revents & POLLIN) && (fds[i + d].events & POLLIN) && take(f, &links[d], now) < 0) {
+                    close_connection(c);
+                    break;
+                }
+                /* A socket that failed or was reset can neither send nor receive: what it sent still goes on, what
+                   was queued for it is given up. */
+                if ((revents & (POLLERR | POLLHUP)) && !(revents & POLLIN)) {
+                    struct flow *back = &c->flows[1 - d];
+                    f->eof = 1;
+                    queue_clear(&back->queue);
+                    back->eof = back->shut = 1;
+                }
+            }
+        }
+
+        if (now >= report_at) {
+            report(csv, (now - start_us) / 1e6, (now - last_report_us) / 1e6);
+            last_report_us = now;
+            report_at = now + (int64_t)(report_s * 1e6);
+        }
+    }
+
+    printf("[IMPAIR] Done after %.1f s: %ld connections, %.1f s stalled.\n", (monotonic_us() - start_us) / 1e6,
+           connections_total, stalled_us / 1e6);
+    for (int d = 0; d < 2; d++)
+        printf("[IMPAIR] %s: %.1f MB forwarded, %ld TCP reads held back by losses, %ld datagrams (%ld lost, %ld "
+               "dropped on a full queue).\n", links[d].name, links[d].bytes / 1e6, links[d].tcp_losses,
+               links[d].datagrams, links[d].udp_losses, links[d].udp_overflows);
+    if (csv != NULL)
+        fclose(csv);
+    return 0;
+}
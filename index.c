@@ -0,0 +1,267 @@
+/**
+ * @file index.c
+ * @brief Stream index storage: fixed-size records in <name>.idx, thumbnails in <name>.thm and activity summaries in <name>.sec / <name>.min.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "index.h"
+
+/* Interval length and file suffix of each summary level. */
+static const int summary_seconds[INDEX_SUMMARY_LEVELS] = { 1, 60 };
+static const char *summary_suffix[INDEX_SUMMARY_LEVELS] = { "sec", "min" };
+
+/* Number of summary records read per system call while scanning. */
+#define SCAN_BATCH 512
+
+/* Byte offset of the record at the given position. */
+static off_t record_offset(int64_t position) {
+    return (off_t)sizeof(struct index_header) + (off_t)position * sizeof(struct index_record);
+}
+
+/**
+ * Opens the summary file of one level. The last interval on disk becomes the open one again,
+ * so frames arriving after a restart keep accumulating into it (its sum is approximated from the stored mean).
+ */
+static int open_summary(struct stream_index *idx, const char *name, int level) {
+    char path[256];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s.%s", name, summary_suffix[level]);
+    idx->summary_fd[level] = open(path, O_RDWR | O_CREAT, 0644);
+    if (idx->summary_fd[level] < 0 || fstat(idx->summary_fd[level], &st) < 0) return -1;
+
+    idx->summary_count[level] = st.st_size / (off_t)sizeof(struct activity_summary);
+    if (idx->summary_count[level] > 0) {
+        struct activity_summary *open = &idx->open[level];
+        off_t last = (off_t)(idx->summary_count[level] - 1) * sizeof(*open);
+        if (pread(idx->summary_fd[level], open, sizeof(*open), last) != sizeof(*open)) return -1;
+        idx->activity_scored[level] = open->frames;
+        idx->activity_sum[level] = (uint64_t)open->mean_activity * open->frames;
+    }
+    return 0;
+}
+
+struct stream_index *index_open(const char *name) {
+    char path[256];
+    struct index_header header;
+    struct stat st;
+
+    struct stream_index *idx = calloc(1, sizeof(*idx));
+    if (idx == NULL) return NULL;
+    for (int level = 0; level < INDEX_SUMMARY_LEVELS; level++) idx->summary_fd[level] = -1;
+
+    snprintf(path, sizeof(path), "%s.idx", name);
+    idx->fd = open(path, O_RDWR | O_CREAT, 0644);
+    snprintf(path, sizeof(path), "%s.thm", name);
+    idx->thumb_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (idx->fd < 0 || idx->thumb_fd < 0 || fstat(idx->fd, &st) < 0 ||
+        open_summary(idx, name, INDEX_SUMMARY_SECOND) < 0 || open_summary(idx, name, INDEX_SUMMARY_MINUTE) < 0) {
+        perror("[INDEX] Error opening index files");
+        goto fail;
+    }
+
+    /* A new index gets a header; an existing one must match the record layout of this build. */
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        header.magic = INDEX_MAGIC;
+        header.version = INDEX_VERSION;
+        header.record_size = sizeof(struct index_record);
+        if (pwrite(idx->fd, &header, sizeof(header), 0) != sizeof(header)) {
+            perror("[INDEX] Error writing index header");
+            goto fail;
+        }
+        st.st_size = sizeof(header);
+    } else if (pread(idx->fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != INDEX_MAGIC ||
+               header.version != INDEX_VERSION || header.record_size != sizeof(struct index_record)) {
+        fprintf(stderr, "[INDEX] %s.idx has an incompatible format\n", name);
+        goto fail;
+    }
+
+    /* A torn record left by a crash is ignored and overwritten by the next append. */
+    idx->count = (st.st_size - (off_t)sizeof(header)) / (off_t)sizeof(struct index_record);
+    pthread_mutex_init(&idx->lock, NULL);
+    return idx;
+
+fail:
+    if (idx->fd >= 0) close(idx->fd);
+    if (idx->thumb_fd >= 0) close(idx->thumb_fd);
+    for (int level = 0; level < INDEX_SUMMARY_LEVELS; level++) {
+        if (idx->summary_fd[level] >= 0) close(idx->summary_fd[level]);
+    }
+    free(idx);
+    return NULL;
+}
+
+/**
+ * Folds one frame into the open interval of a summary level, starting a new interval when the frame's time has moved past it.
+ * The open interval is rewritten in place on every frame, so searches always see up-to-date summaries.
+ * Frames with a time earlier than the open interval (clock adjustments) are counted in the open interval.
+ */
+static void update_summary(struct stream_index *idx, int level, int64_t time_us, int32_t activity, int64_t position) {
+    struct activity_summary *open = &idx->open[level];
+    int64_t length = (int64_t)summary_seconds[level] * 1000000;
+    int64_t start = time_us - time_us % length;
+
+    if (idx->summary_count[level] == 0 || start > open->start_us) {
+        memset(open, 0, sizeof(*open));
+        open->start_us = start;
+        open->first_position = position;
+        idx->activity_sum[level] = 0;
+        idx->activity_scored[level] = 0;
+        idx->summary_count[level]++;
+    }
+
+    open->frames++;
+    if (activity >= 0) {
+        idx->activity_sum[level] += (uint64_t)activity;
+        idx->activity_scored[level]++;
+        open->mean_activity = (uint16_t)(idx->activity_sum[level] / idx->activity_scored[level]);
+        if (activity > open->max_activity) open->max_activity = (uint16_t)(activity > 65535 ? 65535 : activity);
+    }
+
+    off_t offset = (off_t)(idx->summary_count[level] - 1) * sizeof(*open);
+    if (pwrite(idx->summary_fd[level], open, sizeof(*open), offset) != sizeof(*open))
+        perror("[INDEX] Error writing activity summary");
+}
+
+int64_t index_append(struct stream_index *idx, const struct index_record *rec) {
+    int64_t position = -1;
+
+    pthread_mutex_lock(&idx->lock);
+    if (pwrite(idx->fd, rec, sizeof(*rec), record_offset(idx->count)) == sizeof(*rec)) {
+        position = idx->count++;
+        int64_t time_us = rec->capture_us ? rec->capture_us : rec->timestamp_us;
+        for (int level = 0; level < INDEX_SUMMARY_LEVELS; level++)
+            update_summary(idx, level, time_us, rec->activity, position);
+    } else {
+        perror("[INDEX] Error appending record");
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return position;
+}
+
+int index_search_activity(struct stream_index *idx, int level, int64_t from_us, int64_t to_us, int min_activity,
+                          struct activity_summary *out, int max_results) {
+    struct activity_summary batch[SCAN_BATCH];
+    int found = 0;
+
+    if (level < 0 || level >= INDEX_SUMMARY_LEVELS) return -1;
+
+    pthread_mutex_lock(&idx->lock);
+    int64_t count = idx->summary_count[level];
+    pthread_mutex_unlock(&idx->lock);
+
+    /* Summaries are in time order, so the scan stops at the first interval past the range. */
+    for (int64_t i = 0; i < count && found < max_results; i += SCAN_BATCH) {
+        size_t want = (size_t)(count - i < SCAN_BATCH ? count - i : SCAN_BATCH);
+        ssize_t got = pread(idx->summary_fd[level], batch, want * sizeof(batch[0]), (off_t)i * sizeof(batch[0]));
+        if (got < 0) return -1;
+
+        for (size_t j = 0; j < (size_t)got / sizeof(batch[0]) && found < max_results; j++) {
+            if (batch[j].start_us >= to_us) return found;
+            if (batch[j].start_us + (int64_t)summary_seconds[level] * 1000000 <= from_us) continue;
+            if (batch[j].max_activity >= min_activity) out[found++] = batch[j];
+        }
+    }
+    return found;
+}
+
+/* Reads and updates also take the lock, so a reader never observes a half-updated record. */
+int index_read(struct stream_index *idx, int64_t position, struct index_record *rec) {
+    int result = -1;
+
+    pthread_mutex_lock(&idx->lock);
+    if (position >= 0 && position < idx->count &&
+        pread(idx->fd, rec, sizeof(*rec), record_offset(position)) == sizeof(*rec))
+        result = 0;
+    pthread_mutex_unlock(&idx->lock);
+    return result;
+}
+
+int index_update(struct stream_index *idx, int64_t position, const struct index_record *rec) {
+    int result = 0;
+
+    pthread_mutex_lock(&idx->lock);
+    if (pwrite(idx->fd, rec, sizeof(*rec), record_offset(position)) != sizeof(*rec)) {
+        perror("[INDEX] Error updating record");
+        result = -1;
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return result;
+}
+
+/* Column updates read the current record under the lock, so two workers updating different columns lose nothing. */
+int index_update_thumbnail(struct stream_index *idx, int64_t position, const struct index_record *rec) {
+    struct index_record current;
+    int result = -1;
+
+    pthread_mutex_lock(&idx->lock);
+    if (position >= 0 && position < idx->count &&
+        pread(idx->fd, &current, sizeof(current), record_offset(position)) == sizeof(current)) {
+        current.thumb_offset = rec->thumb_offset;
+        current.thumb_width = rec->thumb_width;
+        current.thumb_height = rec->thumb_height;
+        current.luma_mean = rec->luma_mean;
+        current.luma_min = rec->luma_min;
+        current.luma_max = rec->luma_max;
+        current.luma_contrast = rec->luma_contrast;
+        current.flags |= rec->flags & INDEX_HAS_THUMBNAIL;
+        if (pwrite(idx->fd, &current, sizeof(current), record_offset(position)) == sizeof(current))
+            result = 0;
+        else
+            perror("[INDEX] Error updating record");
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return result;
+}
+
+int index_update_payload(struct stream_index *idx, int64_t position, uint64_t size, uint64_t hash, uint32_t flags) {
+    struct index_record current;
+    int result = -1;
+
+    pthread_mutex_lock(&idx->lock);
+    if (position >= 0 && position < idx->count &&
+        pread(idx->fd, &current, sizeof(current), record_offset(position)) == sizeof(current)) {
+        current.size = size;
+        current.hash = hash;
+        current.flags |= flags;
+        if (pwrite(idx->fd, &current, sizeof(current), record_offset(position)) == sizeof(current))
+            result = 0;
+        else
+            perror("[INDEX] Error updating record");
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return result;
+}
+
+int index_store_thumbnail(struct stream_index *idx, struct index_record *rec, const uint8_t *rgb, int width, int height) {
+    size_t size = (size_t)width * height * 3;
+    int result = -1;
+
+    /* The end-of-file offset and the write are taken under the lock so concurrent workers never interleave. */
+    pthread_mutex_lock(&idx->lock);
+    off_t offset = lseek(idx->thumb_fd, 0, SEEK_END);
+    if (offset >= 0 && pwrite(idx->thumb_fd, rgb, size, offset) == (ssize_t)size) {
+        rec->thumb_offset = (uint64_t)offset;
+        rec->thumb_width = (uint16_t)width;
+        rec->thumb_height = (uint16_t)height;
+        rec->flags |= INDEX_HAS_THUMBNAIL;
+        result = 0;
+    } else {
+        perror("[INDEX] Error storing thumbnail");
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return result;
+}
+
+int index_load_thumbnail(struct stream_index *idx, const struct index_record *rec, uint8_t *rgb) {
+    size_t size = (size_t)rec->thumb_width * rec->thumb_height * 3;
+
+    if (!(rec->flags & INDEX_HAS_THUMBNAIL)) return -1;
+    return pread(idx->thumb_fd, rgb, size, (off_t)rec->thumb_offset) == (ssize_t)size ? 0 : -1;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file index.h
+ * @brief Append-only stream index kept by the server. One fixed-size record per stored frame, in arrival order.
+ *
+ * The index lives in <name>.idx; 1/8-scale thumbnails are appended to <name>.thm next to it.
+ * Fixed-size records make random access by position a single pread().
+ * Per-second and per-minute activity summaries (<name>.sec and <name>.min) are maintained on every append,
+ * so finding events means scanning a few kilobytes of summaries instead of decoding frames.
+ */
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "protocol.h"
+
+#define INDEX_MAGIC 0x58444953 // "SIDX" in little-endian byte order
+#define INDEX_VERSION 4
+
+/* Record flags. */
+#define INDEX_HAS_THUMBNAIL 0x1
+#define INDEX_DUPLICATE 0x2     // Byte-identical to an earlier frame: no file of its own, see reference
+#define INDEX_COMPRESSED 0x4    // The file holds a losslessly compressed raw payload (see rawcodec.h)
+#define INDEX_DELTA 0x8         // Inter-coded: the payload is the XOR with the previous record's frame (see reader.h)
+#define INDEX_KEYFRAME 0x10     // Self-contained frame of an inter-coded stream, where decoding of the following deltas starts
+#define INDEX_OPTIMIZED 0x20    // Seen by the optimizer (see optimizer.h), which rewrote the file if that made it smaller
+
+/* Activity summary levels and their interval lengths in seconds. */
+#define INDEX_SUMMARY_SECOND 0
+#define INDEX_SUMMARY_MINUTE 1
+#define INDEX_SUMMARY_LEVELS 2
+
+/* File header, written once when the index is created. */
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+/* Per-frame record. */
+struct index_record {
+    char filename[128];         // Name of the stored frame file
+    int64_t timestamp_us;       // Time the frame was stored (microseconds since the epoch)
+    int64_t capture_us;         // Capture time reported by the client (0 for legacy clients)
+    uint64_t sequence;          // Capture sequence number reported by the client
+    uint64_t size;              // Payload size in bytes, that of the file once optimized (duplicates keep the size received)
+    uint64_t thumb_offset;      // Offset of the RGB thumbnail in the .thm file
+    uint16_t thumb_width, thumb_height;
+    uint8_t luma_mean, luma_min, luma_max, luma_contrast;
+    int32_t activity;           // Motion score against the previous frame (see motion.h), ACTIVITY_UNKNOWN if not computed
+    uint32_t flags;
+    uint64_t hash;              // 64-bit hash of the payload as received (see hash.h), or of the file once optimized
+    int64_t reference;          // For duplicates, position of the record whose file holds the payload; -1 otherwise
+};
+
+/* Open index. The lock serializes appends and thumbnail writes from concurrent connections and workers. */
+struct stream_index {
+    int fd;
+    int thumb_fd;
+    int64_t count;
+    pthread_mutex_t lock;
+    int summary_fd[INDEX_SUMMARY_LEVELS];
+    int64_t summary_count[INDEX_SUMMARY_LEVELS];
+    struct activity_summary open[INDEX_SUMMARY_LEVELS]; // Interval currently being accumulated (the last record of each file)
+    uint64_t activity_sum[INDEX_SUMMARY_LEVELS];
+    uint32_t activity_scored[INDEX_SUMMARY_LEVELS];
+};
+
+/**
+ * @brief Opens (or creates) the index and thumbnail files for the given base name.
+ * @return The index handle, or NULL on error.
+ */
+struct stream_index *index_open(const char *name);
+
+/**
+ * @brief Appends a record and folds its activity score into the per-second and per-minute summaries.
+ * @return Position of the new record, or -1 on error.
+ */
+int64_t index_append(struct stream_index *idx, const struct index_record *rec);
+
+/**
+ * @brief Reads the record at the given position.
+ * @return 0 on success, -1 if the position is out of range or the read failed.
+ */
+int index_read(struct stream_index *idx, int64_t position, struct index_record *rec);
+
+/**
+ * @brief Overwrites the record at the given position (used to fill in columns computed after ingest).
+ */
+int index_update(struct stream_index *idx, int64_t position, const struct index_record *rec);
+
+/**
+ * @brief Stores the thumbnail location, the luma statistics and INDEX_HAS_THUMBNAIL of rec in the record at the given
+ * position, leaving its other columns as they are now (the optimizer may have updated them since rec was read).
+ */
+int index_update_thumbnail(struct stream_index *idx, int64_t position, const struct index_record *rec);
+
+/**
+ * @brief Sets the size and hash of the record at the given position and adds flags to it, leaving its other columns
+ * as they are now (used by the optimizer after rewriting a frame file).
+ */
+int index_update_payload(struct stream_index *idx, int64_t position, uint64_t size, uint64_t hash, uint32_t flags);
+
+/**
+ * @brief Appends an RGB thumbnail and stores its location in rec (the caller then updates the record).
+ * @return 0 on success, -1 on error.
+ */
+int index_store_thumbnail(struct stream_index *idx, struct index_record *rec, const uint8_t *rgb, int width, int height);
+
+/**
+ * @brief Reads a thumbnail previously stored with index_store_thumbnail() into rgb (width * height * 3 bytes).
+ */
+int index_load_thumbnail(struct stream_index *idx, const struct index_record *rec, uint8_t *rgb);
+
+/**
+ * @brief Scans the summaries of one level for intervals in [from_us, to_us) whose peak activity reaches min_activity.
+ * @return Number of intervals copied to out (at most max_results), or -1 on error.
+ */
+int index_search_activity(struct stream_index *idx, int level, int64_t from_us, int64_t to_us, int min_activity,
+                          struct activity_summary *out, int max_results);
+
+#endif
@@ -0,0 +1,962 @@
+/**
+ * @file jpeg.c
+ * @brief Baseline JPEG entropy decoder and encoder operating on quantized DCT coefficients.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+
+/* Marker codes used by the parser and the writer. */
+#define M_SOF0 0xC0
+#define M_SOF1 0xC1
+#define M_DHT  0xC4
+#define M_RST0 0xD0
+#define M_SOI  0xD8
+#define M_EOI  0xD9
+#define M_SOS  0xDA
+#define M_DQT  0xDB
+#define M_DRI  0xDD
+#define M_COM  0xFE
+
+/* Huffman tables are resolved through a 9-bit lookahead table; only longer codes take the slow canonical path. */
+#define HUFF_LOOKAHEAD 9
+
+/* Each block can expand to at most ~430 bytes after byte stuffing. Reserving 512 bytes per block keeps the hot path free of bounds checks. */
+#define BLOCK_OUTPUT_RESERVE 512
+
+/* Huffman table as stored in a DHT segment: number of codes for each length (1..16) followed by the symbols. */
+struct huff_spec {
+    uint8_t bits[17];
+    uint8_t vals[256];
+};
+
+/* Decoding form of a Huffman table. */
+struct huff_dec {
+    int32_t maxcode[18];
+    int32_t valoffset[17];
+    uint8_t vals[256];
+    uint16_t lookup[1 << HUFF_LOOKAHEAD]; // (code length << 8) | symbol, 0 if the code is longer than the lookahead
+};
+
+/* Encoding form of a Huffman table. */
+struct huff_enc {
+    uint16_t code[256];
+    uint8_t size[256];
+};
+
+/* Standard tables from ITU-T T.81 Annex K.3. UVC cameras omit DHT segments from MJPEG frames and implicitly rely on these. */
+static const struct huff_spec std_tables[4] = {
+    { /* DC luminance */
+        { 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+        { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b }
+    },
+    { /* AC luminance */
+        { 0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125 },
+        { 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+          0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+          0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+          0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+          0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+          0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+          0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+          0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+          0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+          0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+          0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+          0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+          0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+          0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa }
+    },
+    { /* DC chrominance */
+        { 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+        { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b }
+    },
+    { /* AC chrominance */
+        { 0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 119 },
+        { 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+          0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+          0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+          0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+          0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+          0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+          0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+          0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+          0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+          0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+          0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+          0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+          0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+          0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa }
+    }
+};
+
+/* --- TABLE CONSTRUCTION --- */
+
+/* Builds the canonical decoding tables (T.81 Annex C and F.2.2.3) from a DHT specification. Rejects tables whose codes overflow their length. */
+static int build_decoder(const struct huff_spec *spec, struct huff_dec *dec) {
+    int code = 0;
+    int k = 0;
+
+    memset(dec->lookup, 0, sizeof(dec->lookup));
+    for (int len = 1; len <= 16; len++) {
+        dec->valoffset[len] = k - code;
+        for (int i = 0; i < spec->bits[len]; i++, k++, code++) {
+            if (k >= 256) return -1;
+            if (len <= HUFF_LOOKAHEAD) {
+                int shift = HUFF_LOOKAHEAD - len;
+                for (int j = 0; j < (1 << shift); j++)
+                    dec->lookup[(code << shift) | j] = (uint16_t)((len << 8) | spec->vals[k]);
+            }
+        }
+        if (code > (1 << len)) return -1;
+        dec->maxcode[len] = spec->bits[len] ? code - 1 : -1;
+        code <<= 1;
+    }
+    dec->maxcode[17] = INT32_MAX; // Sentinel so the slow path always terminates
+    memcpy(dec->vals, spec->vals, sizeof(dec->vals));
+    return 0;
+}
+
+/* Assigns canonical codes to the symbols of a specification. */
+static void build_encoder(const struct huff_spec *spec, struct huff_enc *enc) {
+    int code = 0;
+    int k = 0;
+
+    memset(enc, 0, sizeof(*enc));
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < spec->bits[len]; i++, k++, code++) {
+            enc->code[spec->vals[k]] = (uint16_t)code;
+            enc->size[spec->vals[k]] = (uint8_t)len;
+        }
+        code <<= 1;
+    }
+}
+
+/**
+ * Generates an optimal length-limited Huffman table from symbol frequencies, following T.81 Annex K.2.
+ * freq[256] is a reserved pseudo-symbol which guarantees that no real code consists only of 1-bits.
+ * Skewed frequencies (which a crafted frame can produce) give codes longer than the 32 bits libjpeg allows for; with
+ * 257 symbols no code is longer than 256 bits, and every length is folded back to 16 bits the same way.
+ */
+static void build_optimal_spec(const long freq_in[256], struct huff_spec *spec) {
+    long freq[257];
+    int codesize[257];
+    int others[257];
+    int bits[257];
+    int max_codesize = 0;
+
+    memcpy(freq, freq_in, 256 * sizeof(long));
+    freq[256] = 1;
+    memset(codesize, 0, sizeof(codesize));
+    memset(bits, 0, sizeof(bits));
+    for (int i = 0; i < 257; i++) others[i] = -1;
+
+    /* Repeatedly merges the two least frequent subtrees, tracking code lengths through the 'others' chains. */
+    for (;;) {
+        int c1 = -1, c2 = -1;
+        long v1 = 0, v2 = 0;
+
+        for (int i = 0; i < 257; i++) {
+            if (freq[i] && (c1 < 0 || freq[i] <= v1)) {
+                v1 = freq[i];
+                c1 = i;
+            }
+        }
+        for (int i = 0; i < 257; i++) {
+            if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= v2)) {
+                v2 = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    for (int i = 0; i < 257; i++) {
+        if (codesize[i]) bits[codesize[i]]++;
+        if (codesize[i] > max_codesize) max_codesize = codesize[i];
+    }
+
+    /* JPEG limits codes to 16 bits. Longer codes are folded back by moving leaves up the tree (Figure K.3). */
+    for (int i = max_codesize; i > 16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    /* Removes the pseudo-symbol, which always owns the longest code. */
+    int longest = 16;
+    while (bits[longest] == 0) longest--;
+    bits[longest]--;
+
+    memset(spec, 0, sizeof(*spec));
+    for (int i = 1; i <= 16; i++) spec->bits[i] = (uint8_t)bits[i];
+
+    int k = 0;
+    for (int len = 1; len <= max_codesize; len++) {
+        for (int sym = 0; sym < 256; sym++) {
+            if (codesize[sym] == len) spec->vals[k++] = (uint8_t)sym;
+        }
+    }
+}
+
+/* --- ENTROPY DECODING --- */
+
+/* Reads the entropy-coded segment MSB first, removing stuffed zero bytes. Stops at markers and feeds zero bits instead. */
+struct bit_reader {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t acc;
+    int nbits;
+};
+
+static void br_fill(struct bit_reader *br) {
+    while (br->nbits <= 56) {
+        unsigned int b = 0;
+        if (br->p < br->end) {
+            b = *br->p;
+            if (b == 0xFF) {
+                if (br->p + 1 < br->end && br->p[1] == 0x00) br->p += 2;
+                else b = 0; // A marker ends the segment: it is left in place for the restart logic
+            } else {
+                br->p++;
+            }
+        }
+        br->acc |= (uint64_t)b << (56 - br->nbits);
+        br->nbits += 8;
+    }
+}
+
+static inline unsigned int br_get(struct bit_reader *br, int n) {
+    unsigned int v = (unsigned int)(br->acc >> (64 - n));
+    br->acc <<= n;
+    br->nbits -= n;
+    return v;
+}
+
+static inline int decode_symbol(struct bit_reader *br, const struct huff_dec *dec) {
+    unsigned int look = (unsigned int)(br->acc >> (64 - HUFF_LOOKAHEAD));
+    unsigned int entry = dec->lookup[look];
+
+    if (entry) {
+        br->acc <<= entry >> 8;
+        br->nbits -= entry >> 8;
+        return entry & 0xFF;
+    }
+
+    /* Slow path: the code is longer than the lookahead window. */
+    for (int len = HUFF_LOOKAHEAD + 1; len <= 16; len++) {
+        int32_t code = (int32_t)(br->acc >> (64 - len));
+        if (code <= dec->maxcode[len]) {
+            br->acc <<= len;
+            br->nbits -= len;
+            return dec->vals[(code + dec->valoffset[len]) & 0xFF];
+        }
+    }
+    return -1;
+}
+
+/* Reads s additional bits and sign-extends them as described in T.81 F.2.2.1. */
+static inline int receive_extend(struct bit_reader *br, int s) {
+    int v = (int)br_get(br, s);
+    if (v < (1 << (s - 1))) v += 1 - (1 << s);
+    return v;
+}
+
+/* Decodes one block into blk. With store_ac == 0 only blk[0] is written and AC coefficients are skipped. */
+static int decode_block(struct bit_reader *br, const struct huff_dec *dc, const struct huff_dec *ac, int *pred, int16_t *blk, int store_ac) {
+    br_fill(br);
+    int s = decode_symbol(br, dc);
+    if (s < 0 || s > 11) return -1;
+    if (s) *pred += receive_extend(br, s);
+    blk[0] = (int16_t)*pred;
+
+    for (int k = 1; k < 64;) {
+        br_fill(br);
+        int rs = decode_symbol(br, ac);
+        if (rs < 0) return -1;
+        int r = rs >> 4;
+        s = rs & 15;
+        if (s == 0) {
+            if (r != 15) break; // End of block
+            k += 16;            // Run of sixteen zeros
+            continue;
+        }
+        k += r;
+        if (k > 63 || s > 11) return -1;
+        if (store_ac) blk[k] = (int16_t)receive_extend(br, s);
+        else br_get(br, s);
+        k++;
+    }
+    return 0;
+}
+
+/* Consumes an RSTn marker at a restart boundary and discards the padding bits of the previous interval. */
+static int br_restart(struct bit_reader *br) {
+    br->acc = 0;
+    br->nbits = 0;
+    while (br->p + 1 < br->end && br->p[0] == 0xFF && br->p[1] == 0xFF) br->p++;
+    if (br->p + 1 >= br->end || br->p[0] != 0xFF || (br->p[1] & 0xF8) != M_RST0) return -1;
+    br->p += 2;
+    return 0;
+}
+
+/* --- HEADER PARSING --- */
+
+static inline int read_u16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static int parse_dqt(struct jpeg_image *img, const uint8_t *p, int len) {
+    while (len > 0) {
+        int pq = p[0] >> 4;
+        int tq = p[0] & 15;
+        int need = 1 + 64 * (pq ? 2 : 1);
+        if (tq > 3 || len < need) return -1;
+        for (int i = 0; i < 64; i++)
+            img->qt[tq][i] = pq ? (uint16_t)read_u16(p + 1 + 2 * i) : p[1 + i];
+        p += need;
+        len -= need;
+    }
+    return 0;
+}
+
+static int parse_dht(struct huff_spec dc[4], struct huff_spec ac[4], const uint8_t *p, int len) {
+    while (len >= 17) {
+        int tc = p[0] >> 4;
+        int th = p[0] & 15;
+        int count = 0;
+        if (tc > 1 || th > 3) return -1;
+
+        struct huff_spec *spec = tc ? &ac[th] : &dc[th];
+        memset(spec, 0, sizeof(*spec));
+        for (int i = 1; i <= 16; i++) {
+            spec->bits[i] = p[i];
+            count += p[i];
+        }
+        if (count > 256 || len < 17 + count) return -1;
+        memcpy(spec->vals, p + 17, count);
+        p += 17 + count;
+        len -= 17 + count;
+    }
+    return 0;
+}
+
+static int parse_sof(struct jpeg_image *img, const uint8_t *p, int len) {
+    if (len < 6 || p[0] != 8) return -1; // Only 8-bit precision is supported
+    img->height = read_u16(p + 1);
+    img->width = read_u16(p + 3);
+    img->ncomp = p[5];
+    if (img->width == 0 || img->height == 0) return -1;
+    if (img->ncomp < 1 || img->ncomp > JPEG_MAX_COMPONENTS || len < 6 + 3 * img->ncomp) return -1;
+
+    img->hmax = img->vmax = 1;
+    for (int i = 0; i < img->ncomp; i++) {
+        struct jpeg_component *c = &img->comp[i];
+        c->id = p[6 + 3 * i];
+        c->h = p[7 + 3 * i] >> 4;
+        c->v = p[7 + 3 * i] & 15;
+        c->tq = p[8 + 3 * i];
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4 || c->tq > 3) return -1;
+        if (c->h > img->hmax) img->hmax = c->h;
+        if (c->v > img->vmax) img->vmax = c->v;
+    }
+    return 0;
+}
+
+static int append_extra(struct jpeg_image *img, const uint8_t *segment, size_t size) {
+    uint8_t *grown = realloc(img->extra, img->extra_size + size);
+    if (!grown) return -1;
+    memcpy(grown + img->extra_size, segment, size);
+    img->extra = grown;
+    img->extra_size += size;
+    return 0;
+}
+
+/* Sampling factors used inside an MCU. A single-component scan is non-interleaved, so its MCU is one block. */
+static inline int mcu_h(const struct jpeg_image *img, int c) {
+    return img->ncomp == 1 ? 1 : img->comp[c].h;
+}
+
+static inline int mcu_v(const struct jpeg_image *img, int c) {
+    return img->ncomp == 1 ? 1 : img->comp[c].v;
+}
+
+/* Computes the MCU grid and allocates (or reuses) the coefficient planes. */
+static int setup_planes(struct jpeg_image *img) {
+    if (img->ncomp == 1) {
+        img->mcus_x = (img->width + 7) / 8;
+        img->mcus_y = (img->height + 7) / 8;
+    } else {
+        img->mcus_x = (img->width + 8 * img->hmax - 1) / (8 * img->hmax);
+        img->mcus_y = (img->height + 8 * img->vmax - 1) / (8 * img->vmax);
+    }
+
+    for (int i = 0; i < img->ncomp; i++) {
+        struct jpeg_component *c = &img->comp[i];
+        c->blocks_w = img->mcus_x * mcu_h(img, i);
+        c->blocks_h = img->mcus_y * mcu_v(img, i);
+        size_t count = (size_t)c->blocks_w * c->blocks_h * (img->dc_only ? 1 : 64);
+        c->coef = calloc(count, sizeof(int16_t));
+        if (!c->coef) return -1;
+    }
+    return 0;
+}
+
+/* Decodes the interleaved scan that follows SOS, MCU by MCU, honouring restart intervals. */
+static int decode_scan(struct jpeg_image *img, const struct huff_dec *dc, const struct huff_dec *ac, const uint8_t *p, const uint8_t *end) {
+    struct bit_reader br = { p, end, 0, 0 };
+    int pred[JPEG_MAX_COMPONENTS] = { 0 };
+    int mcu = 0;
+
+    for (int my = 0; my < img->mcus_y; my++) {
+        for (int mx = 0; mx < img->mcus_x; mx++) {
+            if (img->restart_interval && mcu && mcu % img->restart_interval == 0) {
+                if (br_restart(&br) < 0) return -1;
+                memset(pred, 0, sizeof(pred));
+            }
+            for (int ci = 0; ci < img->ncomp; ci++) {
+                struct jpeg_component *c = &img->comp[ci];
+                for (int by = 0; by < mcu_v(img, ci); by++) {
+                    for (int bx = 0; bx < mcu_h(img, ci); bx++) {
+                        size_t index = (size_t)(my * mcu_v(img, ci) + by) * c->blocks_w + mx * mcu_h(img, ci) + bx;
+                        int16_t *blk = c->coef + (img->dc_only ? index : index * 64);
+                        if (decode_block(&br, &dc[c->td], &ac[c->ta], &pred[ci], blk, !img->dc_only) < 0)
+                            return -1;
+                    }
+                }
+            }
+            mcu++;
+        }
+    }
+    return 0;
+}
+
+static int parse_sos(struct jpeg_image *img, const struct huff_spec dc_spec[4], const struct huff_spec ac_spec[4],
+                     const uint8_t *p, int len, const uint8_t *scan, const uint8_t *end) {
+    struct huff_dec *dc_tables = malloc(4 * sizeof(struct huff_dec));
+    struct huff_dec *ac_tables = malloc(4 * sizeof(struct huff_dec));
+    int ns = p[0];
+    int result = -1;
+
+    if (!dc_tables || !ac_tables) goto out;
+
+    /* Only a single scan containing every frame component (baseline sequential) is supported. */
+    if (img->ncomp == 0 || ns != img->ncomp || len < 4 + 2 * ns) goto out;
+    for (int i = 0; i < ns; i++) {
+        int cid = p[1 + 2 * i];
+        int tables = p[2 + 2 * i];
+        if (img->comp[i].id != cid) goto out;
+        img->comp[i].td = tables >> 4;
+        img->comp[i].ta = tables & 15;
+        if (img->comp[i].td > 3 || img->comp[i].ta > 3) goto out;
+        if (build_decoder(&dc_spec[img->comp[i].td], &dc_tables[img->comp[i].td]) < 0) goto out;
+        if (build_decoder(&ac_spec[img->comp[i].ta], &ac_tables[img->comp[i].ta]) < 0) goto out;
+    }
+    if (p[1 + 2 * ns] != 0 || p[2 + 2 * ns] != 63 || p[3 + 2 * ns] != 0) goto out;
+
+    if (setup_planes(img) < 0) goto out;
+    result = decode_scan(img, dc_tables, ac_tables, scan, end);
+
+out:
+    free(dc_tables);
+    free(ac_tables);
+    return result;
+}
+
+/* Shared implementation of jpeg_decode() and jpeg_decode_dc(). */
+static int decode_frame(const uint8_t *data, size_t size, struct jpeg_image *img, int dc_only) {
+    struct huff_spec dc_spec[4], ac_spec[4];
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    int have_sof = 0;
+
+    memset(img, 0, sizeof(*img));
+    img->dc_only = dc_only;
+
+    /* Tables 0 and 1 default to the standard luminance and chrominance tables; DHT segments override them. */
+    memset(dc_spec, 0, sizeof(dc_spec));
+    memset(ac_spec, 0, sizeof(ac_spec));
+    dc_spec[0] = std_tables[0];
+    ac_spec[0] = std_tables[1];
+    dc_spec[1] = std_tables[2];
+    ac_spec[1] = std_tables[3];
+
+    if (size < 4 || p[0] != 0xFF || p[1] != M_SOI) return -1;
+    p += 2;
+
+    /* Walks the marker segments until the start of scan. */
+    while (p + 4 <= end) {
+        if (p[0] != 0xFF) goto fail;
+        if (p[1] == 0xFF) { // Fill byte preceding a marker
+            p++;
+            continue;
+        }
+
+        int marker = p[1];
+        int len = read_u16(p + 2);
+        const uint8_t *seg = p + 4;
+        if (len < 2 || seg + len - 2 > end) goto fail;
+
+        switch (marker) {
+        case M_SOF0:
+        case M_SOF1:
+            if (parse_sof(img, seg, len - 2) < 0) goto fail;
+            have_sof = 1;
+            break;
+        case M_DQT:
+            if (parse_dqt(img, seg, len - 2) < 0) goto fail;
+            break;
+        case M_DHT:
+            if (parse_dht(dc_spec, ac_spec, seg, len - 2) < 0) goto fail;
+            break;
+        case M_DRI:
+            if (len < 4) goto fail;
+            img->restart_interval = read_u16(seg);
+            break;
+        case M_SOS:
+            if (!have_sof || len < 6) goto fail;
+            if (parse_sos(img, dc_spec, ac_spec, seg, len - 2, seg + len - 2, end) < 0) goto fail;
+            return 0;
+        case M_COM:
+            if (append_extra(img, p, len + 2) < 0) goto fail;
+            break;
+        default:
+            /* Progressive, lossless and arithmetic-coded frames are rejected; application segments are preserved. */
+            if (marker >= 0xC2 && marker <= 0xCF) goto fail;
+            if (marker >= 0xE0 && marker <= 0xEF && append_extra(img, p, len + 2) < 0) goto fail;
+            break;
+        }
+        p = seg + len - 2;
+    }
+
+fail:
+    jpeg_free(img);
+    return -1;
+}
+
+int jpeg_decode(const uint8_t *data, size_t size, struct jpeg_image *img) {
+    return decode_frame(data, size, img, 0);
+}
+
+int jpeg_decode_dc(const uint8_t *data, size_t size, struct jpeg_image *img) {
+    return decode_frame(data, size, img, 1);
+}
+
+static inline uint8_t clamp_u8(int v) {
+    return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+/* Mean sample value of the block: the DC term equals eight times the level-shifted average (T.81 A.3.3). */
+static inline int dc_sample(const struct jpeg_image *img, int ci, int x, int y) {
+    const struct jpeg_component *c = &img->comp[ci];
+    int bx = x * c->h / img->hmax;
+    int by = y * c->v / img->vmax;
+    int dc = c->coef[(size_t)by * c->blocks_w + bx] * img->qt[c->tq][0];
+    return clamp_u8(128 + (dc >= 0 ? (dc + 4) / 8 : -((-dc + 4) / 8)));
+}
+
+void jpeg_dc_thumbnail(const struct jpeg_image *img, uint8_t *luma, uint8_t *rgb) {
+    int width = (img->width + 7) / 8;
+    int height = (img->height + 7) / 8;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int Y = dc_sample(img, 0, x, y);
+            if (luma) *luma++ = (uint8_t)Y;
+            if (!rgb) continue;
+            if (img->ncomp < 3) {
+                rgb[0] = rgb[1] = rgb[2] = (uint8_t)Y;
+            } else {
+                /* JFIF YCbCr to RGB conversion in 16.16 fixed point. */
+                int cb = dc_sample(img, 1, x, y) - 128;
+                int cr = dc_sample(img, 2, x, y) - 128;
+                rgb[0] = clamp_u8(Y + ((91881 * cr + 32768) >> 16));
+                rgb[1] = clamp_u8(Y - ((22554 * cb + 46802 * cr - 32768) >> 16));
+                rgb[2] = clamp_u8(Y + ((116130 * cb + 32768) >> 16));
+            }
+            rgb += 3;
+        }
+    }
+}
+
+void jpeg_dc_i420(const struct jpeg_image *img, int width, int height, uint8_t *y, uint8_t *u, uint8_t *v) {
+    int chroma_w = width / 2, chroma_h = (height + 1) / 2;
+
+    for (int row = 0; row < height; row++)
+        for (int x = 0; x < width; x++)
+            *y++ = (uint8_t)dc_sample(img, 0, x, row);
+    for (int row = 0; row < chroma_h; row++) {
+        for (int x = 0; x < chroma_w; x++) {
+            *u++ = img->ncomp < 3 ? 128 : (uint8_t)dc_sample(img, 1, 2 * x, 2 * row);
+            *v++ = img->ncomp < 3 ? 128 : (uint8_t)dc_sample(img, 2, 2 * x, 2 * row);
+        }
+    }
+}
+
+void jpeg_free(struct jpeg_image *img) {
+    for (int i = 0; i < JPEG_MAX_COMPONENTS; i++) {
+        free(img->comp[i].coef);
+        img->comp[i].coef = NULL;
+    }
+    free(img->extra);
+    img->extra = NULL;
+    img->extra_size = 0;
+}
+
+/* --- REQUANTIZATION --- */
+
+void jpeg_requantize(struct jpeg_image *img, int scale_percent) {
+    uint16_t scaled[4][64];
+
+    if (scale_percent <= 100 || img->dc_only) return;
+
+    /* Coarser tables are derived first, since several components usually share one table. Baseline limits entries to 8 bits. */
+    for (int t = 0; t < 4; t++) {
+        for (int k = 0; k < 64; k++) {
+            long q = ((long)img->qt[t][k] * scale_percent + 50) / 100;
+            scaled[t][k] = (uint16_t)(q < 1 ? 1 : q > 255 ? 255 : q);
+            if (scaled[t][k] < img->qt[t][k]) scaled[t][k] = img->qt[t][k];
+        }
+    }
+
+    /* Each coefficient is dequantized with the old step and rounded to the nearest multiple of the new step. */
+    for (int ci = 0; ci < img->ncomp; ci++) {
+        struct jpeg_component *c = &img->comp[ci];
+        const uint16_t *q_old = img->qt[c->tq];
+        const uint16_t *q_new = scaled[c->tq];
+        size_t blocks = (size_t)c->blocks_w * c->blocks_h;
+
+        for (size_t b = 0; b < blocks; b++) {
+            int16_t *blk = c->coef + b * 64;
+            for (int k = 0; k < 64; k++) {
+                if (blk[k] == 0 || q_old[k] == q_new[k]) continue;
+                int v = blk[k] * q_old[k];
+                int half = q_new[k] / 2;
+                blk[k] = (int16_t)(v >= 0 ? (v + half) / q_new[k] : -((-v + half) / q_new[k]));
+            }
+        }
+    }
+    memcpy(img->qt, scaled, sizeof(scaled));
+}
+
+/* --- CROPPING --- */
+
+int jpeg_crop(const struct jpeg_image *src, int x, int y, int width, int height, struct jpeg_image *dst) {
+    int mcu_w = src->ncomp == 1 ? 8 : 8 * src->hmax;
+    int mcu_hgt = src->ncomp == 1 ? 8 : 8 * src->vmax;
+
+    memset(dst, 0, sizeof(*dst));
+    if (src->dc_only || x < 0 || y < 0 || width <= 0 || height <= 0 || x >= src->width || y >= src->height) return -1;
+
+    /* The origin moves back to the MCU grid; the far edges stay where requested, the last MCU being padded as usual. */
+    int x0 = x / mcu_w * mcu_w, y0 = y / mcu_hgt * mcu_hgt;
+    int x1 = x + width < src->width ? x + width : src->width;
+    int y1 = y + height < src->height ? y + height : src->height;
+
+    dst->width = x1 - x0;
+    dst->height = y1 - y0;
+    dst->ncomp = src->ncomp;
+    dst->hmax = src->hmax;
+    dst->vmax = src->vmax;
+    memcpy(dst->qt, src->qt, sizeof(dst->qt));
+    for (int i = 0; i < src->ncomp; i++) {
+        dst->comp[i] = src->comp[i];
+        dst->comp[i].coef = NULL;
+    }
+    if (src->extra_size > 0 && append_extra(dst, src->extra, src->extra_size) < 0) goto fail;
+    if (setup_planes(dst) < 0) goto fail;
+
+    /* Whole block rows are copied; DC values are stored absolute, so no prediction needs fixing up. */
+    for (int i = 0; i < dst->ncomp; i++) {
+        const struct jpeg_component *from = &src->comp[i];
+        struct jpeg_component *to = &dst->comp[i];
+        int bx = x0 / mcu_w * mcu_h(src, i), by = y0 / mcu_hgt * mcu_v(src, i);
+        for (int row = 0; row < to->blocks_h; row++) {
+            memcpy(to->coef + (size_t)row * to->blocks_w * 64,
+                   from->coef + ((size_t)(by + row) * from->blocks_w + bx) * 64,
+                   (size_t)to->blocks_w * 64 * sizeof(int16_t));
+        }
+    }
+    return 0;
+
+fail:
+    jpeg_free(dst);
+    return -1;
+}
+
+/* --- ENTROPY ENCODING --- */
+
+/* Writes bits MSB first into a growable buffer, inserting a stuffed zero after every 0xFF byte. */
+struct bit_writer {
+    uint8_t *buf;
+    size_t size;
+    size_t cap;
+    uint64_t acc;
+    int nbits;
+};
+
+static int bw_reserve(struct bit_writer *bw, size_t extra) {
+    if (bw->cap - bw->size >= extra) return 0;
+    size_t cap = bw->cap ? bw->cap : 65536;
+    while (cap - bw->size < extra) cap *= 2;
+    uint8_t *grown = realloc(bw->buf, cap);
+    if (!grown) return -1;
+    bw->buf = grown;
+    bw->cap = cap;
+    return 0;
+}
+
+static inline void bw_put(struct bit_writer *bw, unsigned int code, int len) {
+    bw->acc = (bw->acc << len) | code;
+    bw->nbits += len;
+    while (bw->nbits >= 8) {
+        uint8_t byte = (uint8_t)(bw->acc >> (bw->nbits - 8));
+        bw->buf[bw->size++] = byte;
+        if (byte == 0xFF) bw->buf[bw->size++] = 0x00;
+        bw->nbits -= 8;
+    }
+}
+
+/* Pads the final byte with 1-bits, as required before a marker. */
+static void bw_flush(struct bit_writer *bw) {
+    if (bw->nbits > 0) bw_put(bw, (1u << (8 - bw->nbits)) - 1, 8 - bw->nbits);
+    bw->acc = 0;
+}
+
+static void bw_bytes(struct bit_writer *bw, const void *data, size_t size) {
+    memcpy(bw->buf + bw->size, data, size);
+    bw->size += size;
+}
+
+static void bw_marker(struct bit_writer *bw, int marker, int len) {
+    uint8_t m[4] = { 0xFF, (uint8_t)marker, (uint8_t)(len >> 8), (uint8_t)len };
+    bw_bytes(bw, m, len ? 4 : 2);
+}
+
+/* Number of bits needed to represent |v| (the JPEG magnitude category). */
+static inline int magnitude_bits(int v) {
+    if (v < 0) v = -v;
+    return v ? 32 - __builtin_clz((unsigned int)v) : 0;
+}
+
+/* Statistics pass: accumulates the symbols a block would emit. */
+static void count_block(const int16_t *blk, int *pred, long *dc_freq, long *ac_freq) {
+    int diff = blk[0] - *pred;
+    int run = 0;
+
+    *pred = blk[0];
+    dc_freq[magnitude_bits(diff)]++;
+    for (int k = 1; k < 64; k++) {
+        if (blk[k] == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            ac_freq[0xF0]++;
+            run -= 16;
+        }
+        ac_freq[(run << 4) | magnitude_bits(blk[k])]++;
+        run = 0;
+    }
+    if (run) ac_freq[0x00]++;
+}
+
+static void emit_block(struct bit_writer *bw, const int16_t *blk, int *pred, const struct huff_enc *dc, const struct huff_enc *ac) {
+    int diff = blk[0] - *pred;
+    int s = magnitude_bits(diff);
+    int run = 0;
+
+    *pred = blk[0];
+    bw_put(bw, dc->code[s], dc->size[s]);
+    if (s) bw_put(bw, (unsigned int)(diff < 0 ? diff - 1 : diff) & ((1u << s) - 1), s);
+
+    for (int k = 1; k < 64; k++) {
+        int v = blk[k];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            bw_put(bw, ac->code[0xF0], ac->size[0xF0]);
+            run -= 16;
+        }
+        s = magnitude_bits(v);
+        int rs = (run << 4) | s;
+        bw_put(bw, ac->code[rs], ac->size[rs]);
+        bw_put(bw, (unsigned int)(v < 0 ? v - 1 : v) & ((1u << s) - 1), s);
+        run = 0;
+    }
+    if (run) bw_put(bw, ac->code[0x00], ac->size[0x00]);
+}
+
+/**
+ * Walks every block in MCU order. With bw == NULL it only gathers symbol statistics;
+ * otherwise it emits the entropy-coded segment including RST markers.
+ */
+static int entropy_pass(const struct jpeg_image *img, struct bit_writer *bw, long dc_freq[4][256], long ac_freq[4][256],
+                        const struct huff_enc *dc, const struct huff_enc *ac) {
+    int pred[JPEG_MAX_COMPONENTS] = { 0 };
+    int blocks_per_mcu = 0;
+    int mcu = 0;
+
+    for (int ci = 0; ci < img->ncomp; ci++) blocks_per_mcu += mcu_h(img, ci) * mcu_v(img, ci);
+
+    for (int my = 0; my < img->mcus_y; my++) {
+        for (int mx = 0; mx < img->mcus_x; mx++) {
+            if (img->restart_interval && mcu && mcu % img->restart_interval == 0) {
+                if (bw) {
+                    bw_flush(bw);
+                    if (bw_reserve(bw, 2) < 0) return -1;
+                    bw_marker(bw, M_RST0 + ((mcu / img->restart_interval - 1) & 7), 0);
+                }
+                memset(pred, 0, sizeof(pred));
+            }
+            if (bw && bw_reserve(bw, (size_t)blocks_per_mcu * BLOCK_OUTPUT_RESERVE) < 0) return -1;
+
+            for (int ci = 0; ci < img->ncomp; ci++) {
+                const struct jpeg_component *c = &img->comp[ci];
+                for (int by = 0; by < mcu_v(img, ci); by++) {
+                    for (int bx = 0; bx < mcu_h(img, ci); bx++) {
+                        size_t index = (size_t)(my * mcu_v(img, ci) + by) * c->blocks_w + mx * mcu_h(img, ci) + bx;
+                        const int16_t *blk = c->coef + index * 64;
+                        if (bw) emit_block(bw, blk, &pred[ci], &dc[c->td], &ac[c->ta]);
+                        else count_block(blk, &pred[ci], dc_freq[c->td], ac_freq[c->ta]);
+                    }
+                }
+            }
+            mcu++;
+        }
+    }
+    if (bw) bw_flush(bw);
+    return 0;
+}
+
+static void write_dht(struct bit_writer *bw, int tc, int th, const struct huff_spec *spec) {
+    int count = 0;
+    for (int i = 1; i <= 16; i++) count += spec->bits[i];
+
+    bw_marker(bw, M_DHT, 2 + 17 + count);
+    uint8_t tcth = (uint8_t)((tc << 4) | th);
+    bw_bytes(bw, &tcth, 1);
+    bw_bytes(bw, spec->bits + 1, 16);
+    bw_bytes(bw, spec->vals, count);
+}
+
+long jpeg_encode(const struct jpeg_image *img, uint8_t **out, size_t *out_cap) {
+    static const int max_header = 4096;
+    long dc_freq[4][256], ac_freq[4][256];
+    struct huff_spec dc_spec[4], ac_spec[4];
+    struct huff_enc *dc = malloc(4 * sizeof(struct huff_enc));
+    struct huff_enc *ac = malloc(4 * sizeof(struct huff_enc));
+    struct bit_writer bw = { *out, 0, *out_cap, 0, 0 };
+    int used_dc = 0, used_ac = 0, used_qt = 0, wide_qt = 0;
+    long result = -1;
+
+    if (!dc || !ac || img->dc_only) goto out;
+
+    /* First pass: gathers symbol statistics and derives optimal tables for every table slot in use. */
+    memset(dc_freq, 0, sizeof(dc_freq));
+    memset(ac_freq, 0, sizeof(ac_freq));
+    entropy_pass(img, NULL, dc_freq, ac_freq, NULL, NULL);
+    for (int i = 0; i < img->ncomp; i++) {
+        used_dc |= 1 << img->comp[i].td;
+        used_ac |= 1 << img->comp[i].ta;
+        used_qt |= 1 << img->comp[i].tq;
+    }
+    for (int t = 0; t < 4; t++) {
+        if (used_dc & (1 << t)) {
+            build_optimal_spec(dc_freq[t], &dc_spec[t]);
+            build_encoder(&dc_spec[t], &dc[t]);
+        }
+        if (used_ac & (1 << t)) {
+            build_optimal_spec(ac_freq[t], &ac_spec[t]);
+            build_encoder(&ac_spec[t], &ac[t]);
+        }
+        if (used_qt & (1 << t)) {
+            for (int k = 0; k < 64; k++) wide_qt |= img->qt[t][k] > 255;
+        }
+    }
+
+    /* Header: SOI, preserved application segments, DQT, SOF, DHT, DRI and SOS. */
+    if (bw_reserve(&bw, max_header + img->extra_size) < 0) goto out;
+    bw_marker(&bw, M_SOI, 0);
+    bw_bytes(&bw, img->extra, img->extra_size);
+
+    for (int t = 0; t < 4; t++) {
+        if (!(used_qt & (1 << t))) continue;
+        uint8_t pqtq = (uint8_t)((wide_qt << 4) | t);
+        bw_marker(&bw, M_DQT, 2 + 1 + 64 * (wide_qt ? 2 : 1));
+        bw_bytes(&bw, &pqtq, 1);
+        for (int k = 0; k < 64; k++) {
+            uint8_t q[2] = { (uint8_t)(img->qt[t][k] >> 8), (uint8_t)img->qt[t][k] };
+            bw_bytes(&bw, wide_qt ? q : q + 1, wide_qt ? 2 : 1);
+        }
+    }
+
+    /* 16-bit quantization tables are not allowed in baseline frames, so the extended sequential marker is used instead. */
+    bw_marker(&bw, wide_qt ? M_SOF1 : M_SOF0, 8 + 3 * img->ncomp);
+    uint8_t sof[6] = { 8, (uint8_t)(img->height >> 8), (uint8_t)img->height,
+                       (uint8_t)(img->width >> 8), (uint8_t)img->width, (uint8_t)img->ncomp };
+    bw_bytes(&bw, sof, sizeof(sof));
+    for (int i = 0; i < img->ncomp; i++) {
+        const struct jpeg_component *c = &img->comp[i];
+        uint8_t desc[3] = { (uint8_t)c->id, (uint8_t)((c->h << 4) | c->v), (uint8_t)c->tq };
+        bw_bytes(&bw, desc, sizeof(desc));
+    }
+
+    for (int t = 0; t < 4; t++) {
+        if (used_dc & (1 << t)) write_dht(&bw, 0, t, &dc_spec[t]);
+        if (used_ac & (1 << t)) write_dht(&bw, 1, t, &ac_spec[t]);
+    }
+
+    if (img->restart_interval) {
+        uint8_t dri[2] = { (uint8_t)(img->restart_interval >> 8), (uint8_t)img->restart_interval };
+        bw_marker(&bw, M_DRI, 4);
+        bw_bytes(&bw, dri, sizeof(dri));
+    }
+
+    bw_marker(&bw, M_SOS, 6 + 2 * img->ncomp);
+    uint8_t ns = (uint8_t)img->ncomp;
+    bw_bytes(&bw, &ns, 1);
+    for (int i = 0; i < img->ncomp; i++) {
+        uint8_t sel[2] = { (uint8_t)img->comp[i].id, (uint8_t)((img->comp[i].td << 4) | img->comp[i].ta) };
+        bw_bytes(&bw, sel, sizeof(sel));
+    }
+    uint8_t spectral[3] = { 0, 63, 0 };
+    bw_bytes(&bw, spectral, sizeof(spectral));
+
+    /* Second pass: emits the entropy-coded segment with the optimized tables. */
+    if (entropy_pass(img, &bw, NULL, NULL, dc, ac) < 0) goto out;
+    if (bw_reserve(&bw, 2) < 0) goto out;
+    bw_marker(&bw, M_EOI, 0);
+    result = (long)bw.size;
+
+out:
+    *out = bw.buf;
+    *out_cap = bw.cap;
+    free(dc);
+    free(ac);
+    return result;
+}
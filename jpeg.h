@@ -0,0 +1,99 @@
+/**
+ * @file jpeg.h
+ * @brief Dependency-free baseline JPEG entropy codec working in the DCT coefficient domain.
+ *
+ * Frames coming from the camera in MJPEG mode are decoded only as far as their quantized DCT coefficients.
+ * No inverse DCT is performed, so operations such as Huffman re-optimization are lossless and cheap.
+ */
+
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JPEG_MAX_COMPONENTS 3
+
+/* Describes one colour component of the frame together with its decoded coefficient plane. */
+struct jpeg_component {
+    int id;                 // Component identifier from the SOF marker
+    int h, v;               // Horizontal and vertical sampling factors
+    int tq;                 // Quantization table selector
+    int td, ta;             // DC and AC Huffman table selectors from the SOS marker
+    int blocks_w, blocks_h; // Size of the block grid, including the padding needed to complete the last MCU
+    int16_t *coef;          // blocks_w * blocks_h * 64 quantized coefficients, each block in zigzag order (1 per block when dc_only)
+};
+
+/* In-memory representation of a baseline JPEG frame in the coefficient domain. */
+struct jpeg_image {
+    int width, height;
+    int ncomp;
+    struct jpeg_component comp[JPEG_MAX_COMPONENTS];
+    uint16_t qt[4][64];     // Quantization tables in zigzag order
+    int hmax, vmax;         // Largest sampling factors, which define the MCU size
+    int mcus_x, mcus_y;     // Number of MCUs per row and per column
+    int restart_interval;   // MCUs between RST markers (0 if the frame has no restart markers)
+    int dc_only;            // Set by jpeg_decode_dc(): only the DC coefficient of each block is kept
+    uint8_t *extra;         // APPn and COM segments copied verbatim from the source frame
+    size_t extra_size;
+};
+
+/**
+ * @brief Entropy-decodes a baseline JPEG frame into quantized DCT coefficients.
+ * Frames without DHT segments (common for UVC MJPEG) use the standard Annex K tables.
+ * @return 0 on success, -1 if the frame is malformed or not baseline sequential.
+ */
+int jpeg_decode(const uint8_t *data, size_t size, struct jpeg_image *img);
+
+/**
+ * @brief Entropy-decodes a frame keeping only the DC coefficient of each block.
+ * AC coefficients are parsed but not stored, so this is enough for 1/8-scale images at a fraction of the memory traffic of a full decode.
+ * @return 0 on success, -1 if the frame is malformed or not baseline sequential.
+ */
+int jpeg_decode_dc(const uint8_t *data, size_t size, struct jpeg_image *img);
+
+/**
+ * @brief Renders the 1/8-scale image of a DC-only decode.
+ * Each output pixel is the average of one 8x8 luma block; chroma is taken from the co-sited chroma block.
+ * Both buffers hold ceil(width / 8) * ceil(height / 8) pixels; luma receives the Y plane and rgb (3 bytes per pixel) the colour image.
+ * Either pointer may be NULL.
+ */
+void jpeg_dc_thumbnail(const struct jpeg_image *img, uint8_t *luma, uint8_t *rgb);
+
+/**
+ * @brief Renders the 1/8-scale image of a DC-only decode as planar I420, for re-encoding at low resolution.
+ * width and height (at most ceil(width / 8) and ceil(height / 8) of the frame) select the top-left part to render;
+ * the chroma planes have (width / 2) x ((height + 1) / 2) samples taken from the co-sited chroma blocks.
+ * Grayscale frames get neutral chroma.
+ */
+void jpeg_dc_i420(const struct jpeg_image *img, int width, int height, uint8_t *y, uint8_t *u, uint8_t *v);
+
+/**
+ * @brief Entropy-encodes a coefficient image using Huffman tables optimized for its own statistics.
+ * The output buffer (*out, of capacity *out_cap) is grown with realloc when needed, so it can be reused across frames.
+ * @return Number of bytes written, or -1 on allocation failure.
+ */
+long jpeg_encode(const struct jpeg_image *img, uint8_t **out, size_t *out_cap);
+
+/**
+ * @brief Requantizes the image in the DCT domain with every quantization table scaled by scale_percent.
+ * Coefficients are rescaled to the coarser tables with rounding, so no pixel-domain transcoding is needed.
+ * Values of 100 or less leave the image unchanged.
+ */
+void jpeg_requantize(struct jpeg_image *img, int scale_percent);
+
+/**
+ * @brief Copies a rectangle of a fully decoded image into dst, losslessly (whole blocks are copied, nothing is re-quantized).
+ * The top-left corner is moved up and left to the MCU grid (16x8 pixels for 4:2:2, 16x16 for 4:2:0), so the result may
+ * start a few pixels before x and y; the right and bottom edges are the requested ones, clipped to the frame.
+ * dst is overwritten; release it with jpeg_free().
+ * @return 0 on success, -1 if the rectangle is empty or outside the frame, or on allocation failure.
+ */
+int jpeg_crop(const struct jpeg_image *src, int x, int y, int width, int height, struct jpeg_image *dst);
+
+/**
+ * @brief Releases the memory owned by a decoded image.
+ */
+void jpeg_free(struct jpeg_image *img);
+
+#endif
@@ -0,0 +1,111 @@
+/**
+ * @file motion.c
+ * @brief Motion detection on 1/8-scale luma planes, using SSE2 sum-of-absolute-differences.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+#include <linux/videodev2.h>
+#include "jpeg.h"
+#include "motion.h"
+#include "pixconv.h"
+
+/* Makes sure both planes can hold width x height samples; a change of geometry discards the reference plane. */
+static int prepare_planes(struct motion_detector *md, int width, int height) {
+    size_t needed = (size_t)width * height;
+
+    if (width != md->width || height != md->height) md->have_prev = 0;
+    md->width = width;
+    md->height = height;
+    if (needed <= md->capacity) return 0;
+
+    uint8_t *prev = realloc(md->prev, needed);
+    if (prev) md->prev = prev;
+    uint8_t *cur = realloc(md->cur, needed);
+    if (cur) md->cur = cur;
+    if (!prev || !cur) return -1;
+    md->capacity = needed;
+    md->have_prev = 0;
+    return 0;
+}
+
+/* Produces the luma plane of an MJPEG frame from its DC coefficients, without any inverse DCT. */
+static int luma_from_mjpeg(struct motion_detector *md, const uint8_t *frame, size_t size) {
+    struct jpeg_image img;
+
+    if (jpeg_decode_dc(frame, size, &img) < 0) return -1;
+    int result = prepare_planes(md, (img.width + 7) / 8, (img.height + 7) / 8);
+    if (result == 0) jpeg_dc_thumbnail(&img, md->cur, NULL);
+    jpeg_free(&img);
+    return result;
+}
+
+/**
+ * Averages 8x8 blocks of the luma of a raw frame (YUYV, UYVY or NV12). Each band of 8 rows is first extracted to a
+ * grayscale strip by the pixconv kernels; PSADBW against zero then sums 8 samples of a block row per instruction.
+ */
+static int luma_from_raw(struct motion_detector *md, const uint8_t *frame, size_t size, uint32_t pixelformat, int width, int height) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t expected = pixconv_frame_size(pixelformat, width, height);
+    int bw = width / 8;
+    int bh = height / 8;
+
+    if (expected == 0 || expected > size || bw == 0 || bh == 0 || width % 2) return -1;
+    if (prepare_planes(md, bw, bh) < 0) return -1;
+    if ((size_t)width * 8 > md->strip_capacity) {
+        uint8_t *strip = realloc(md->strip, (size_t)width * 8);
+        if (!strip) return -1;
+        md->strip = strip;
+        md->strip_capacity = (size_t)width * 8;
+    }
+
+    for (int by = 0; by < bh; by++) {
+        pixconv_rows_to_gray(pixelformat, frame, width, height, by * 8, 8, md->strip, width);
+        for (int bx = 0; bx < bw; bx++) {
+            __m128i acc = zero;
+            for (int y = 0; y < 8; y++) {
+                __m128i pixels = _mm_loadl_epi64((const __m128i *)(md->strip + (size_t)y * width + bx * 8));
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(pixels, zero));
+            }
+            md->cur[by * bw + bx] = (uint8_t)((_mm_cvtsi128_si32(acc) + 32) / 64);
+        }
+    }
+    return 0;
+}
+
+/* Sum of absolute differences between two planes, 16 samples per PSADBW. */
+static unsigned long plane_sad(const uint8_t *a, const uint8_t *b, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    unsigned long sad = (unsigned long)_mm_cvtsi128_si64(acc) + (unsigned long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+    for (; i < n; i++) sad += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    return sad;
+}
+
+int motion_score(struct motion_detector *md, const void *frame, size_t size, uint32_t pixelformat, int width, int height) {
+    int result;
+
+    if (pixelformat == V4L2_PIX_FMT_MJPEG || pixelformat == V4L2_PIX_FMT_JPEG)
+        result = luma_from_mjpeg(md, frame, size);
+    else
+        result = luma_from_raw(md, frame, size, pixelformat, width, height);
+    if (result < 0) return -1;
+
+    size_t n = (size_t)md->width * md->height;
+    int score = MOTION_SCORE_MAX;
+    if (md->have_prev) score = (int)(plane_sad(md->cur, md->prev, n) * 100 / n);
+
+    /* The current plane becomes the reference for the next frame. */
+    uint8_t *tmp = md->prev;
+    md->prev = md->cur;
+    md->cur = tmp;
+    md->have_prev = 1;
+    return score;
+}
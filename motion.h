@@ -0,0 +1,34 @@
+/**
+ * @file motion.h
+ * @brief Lightweight motion detector comparing 1/8-scale luma planes of successive frames.
+ */
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Score reported for the first frame, or after a change of geometry, when there is nothing to compare against. */
+#define MOTION_SCORE_MAX 25500
+
+/* Keeps the luma plane of the previous frame. Zero-initialize before first use. */
+struct motion_detector {
+    uint8_t *prev;
+    uint8_t *cur;
+    int width, height;      // Size of the 1/8-scale luma planes
+    size_t capacity;
+    int have_prev;
+    uint8_t *strip;         // Grayscale rows of raw frames being reduced
+    size_t strip_capacity;
+};
+
+/**
+ * @brief Computes the activity score of a frame: the mean absolute difference between its 1/8-scale luma plane
+ * and the previous frame's, in hundredths of a grey level (0 = identical, 25500 = black to white everywhere).
+ * MJPEG frames are reduced via their DC coefficients; raw frames (YUYV, UYVY, NV12) by averaging 8x8 blocks of luma samples.
+ * @return The score, or -1 if the frame could not be analysed (unsupported format or corrupt data).
+ */
+int motion_score(struct motion_detector *md, const void *frame, size_t size, uint32_t pixelformat, int width, int height);
+
+#endif
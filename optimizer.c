@@ -0,0 +1,247 @@
+/**
+ * @file optimizer.c
+ * @brief Cold-storage optimizer. Re-encodes stored frames with Huffman tables fitted to each frame (entropy decode and re-encode only, no DCT).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "jpeg.h"
+#include "hash.h"
+#include "optimizer.h"
+
+/* Number of pending frames the queue can hold. Frames arriving while it is full are found later by the index scan. */
+#define QUEUE_SIZE 1024
+/* Records read per step of the index scan, and pause between scans once every index has been read to its end. */
+#define SCAN_BATCH 256
+#define RESCAN_S 10
+/* Log file recording the size of every frame before and after optimization. */
+#define SAVINGS_LOG "optimizer.log"
+
+struct optimizer_job {
+    struct stream_index *idx;
+    int64_t position;
+};
+
+static struct optimizer_job queue[QUEUE_SIZE];
+static unsigned int queue_head, queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static int budget_percent;
+static long long total_before, total_after;
+
+/* Indexes scanned for frames left behind, and the position up to which each one was scanned. */
+static struct stream_index *const *scan_indexes;
+static int scan_count;
+static int64_t *scan_positions;
+
+void optimizer_submit(struct stream_index *idx, int64_t position) {
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail - queue_head < QUEUE_SIZE) {
+        queue[queue_tail % QUEUE_SIZE].idx = idx;
+        queue[queue_tail % QUEUE_SIZE].position = position;
+        queue_tail++;
+        pthread_cond_signal(&queue_ready);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static double thread_cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads a whole frame into memory and remembers its size and modification time, so a concurrent overwrite can be detected later. */
+static uint8_t *load_file(const char *filename, size_t *size, struct stat *st) {
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) return NULL;
+
+    uint8_t *data = NULL;
+    if (fstat(fileno(fp), st) == 0 && st->st_size > 0) {
+        data = malloc(st->st_size);
+        if (data && fread(data, 1, st->st_size, fp) != (size_t)st->st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    *size = data ? (size_t)st->st_size : 0;
+    fclose(fp);
+    return data;
+}
+
+/**
+ * @brief Optimizes a single stored frame in place, then records in the index that it was seen, with the size and hash
+ * of the new file if it was rewritten. Duplicates (no file of their own) and compressed raw frames are skipped.
+ * The new version is written to a temporary file and renamed over the original, so readers never observe a partial frame.
+ */
+static void optimize_record(struct stream_index *idx, int64_t position, uint8_t **out, size_t *out_cap) {
+    struct index_record rec;
+    struct jpeg_image img;
+    struct stat before, now;
+    size_t size;
+    char tmp_name[300];
+
+    if (index_read(idx, position, &rec) < 0 || (rec.flags & (INDEX_OPTIMIZED | INDEX_DUPLICATE | INDEX_COMPRESSED)))
+        return;
+    const char *filename = rec.filename;
+    uint8_t *data = load_file(filename, &size, &before);
+    long optimized = -1;
+
+    /* Frames that are not baseline JPEG (e.g. YUYV payloads) are left untouched, as are missing files. */
+    if (data != NULL && jpeg_decode(data, size, &img) == 0) {
+        optimized = jpeg_encode(&img, out, out_cap);
+        jpeg_free(&img);
+    }
+    free(data);
+    if (optimized < 0 || (size_t)optimized >= size) {
+        index_update_payload(idx, position, rec.size, rec.hash, INDEX_OPTIMIZED);
+        return;
+    }
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.opt", filename);
+    FILE *fp = fopen(tmp_name, "wb");
+    if (fp == NULL) {
+        perror("[OPTIMIZER] Error creating temporary file");
+        return;
+    }
+    size_t written = fwrite(*out, 1, optimized, fp);
+    if (fclose(fp) != 0 || written != (size_t)optimized) {
+        unlink(tmp_name);
+        return;
+    }
+
+    /* Skips the replacement if the frame was rewritten by the receiver while it was being optimized; the scan of the
+       index comes back to it. */
+    if (stat(filename, &now) != 0 || now.st_size != before.st_size ||
+        now.st_mtim.tv_sec != before.st_mtim.tv_sec || now.st_mtim.tv_nsec != before.st_mtim.tv_nsec) {
+        unlink(tmp_name);
+        return;
+    }
+    if (rename(tmp_name, filename) != 0) {
+        perror("[OPTIMIZER] Error replacing frame");
+        unlink(tmp_name);
+        return;
+    }
+    index_update_payload(idx, position, (uint64_t)optimized, hash64(*out, optimized), INDEX_OPTIMIZED);
+
+    /* Records the savings, both per frame in the log and as running totals. */
+    total_before += size;
+    total_after += optimized;
+    FILE *log = fopen(SAVINGS_LOG, "a");
+    if (log) {
+        fprintf(log, "%s %zu %ld\n", filename, size, optimized);
+        fclose(log);
+    }
+    printf("[OPTIMIZER] %s: %zu -> %ld bytes (total saved %lld bytes, %.1f%%)\n", filename, size, optimized,
+           total_before - total_after, 100.0 * (total_before - total_after) / total_before);
+}
+
+/**
+ * @brief Reads up to SCAN_BATCH records of the indexes from where the scan stands, for a frame not yet optimized.
+ * The scan goes on past the records it reads, so a record is found again only if the scan starts over.
+ * @return 1 with *job set if one was found, 0 if none was (*scanned tells whether any record was read).
+ */
+static int scan_step(struct optimizer_job *job, int *scanned) {
+    struct index_record rec;
+    int budget = SCAN_BATCH;
+
+    *scanned = 0;
+    for (int i = 0; i < scan_count && budget > 0; i++) {
+        struct stream_index *idx = scan_indexes[i];
+        if (idx == NULL)
+            continue;
+        while (budget > 0 && scan_positions[i] < idx->count) {
+            int64_t position = scan_positions[i]++;
+            budget--;
+            *scanned = 1;
+            if (index_read(idx, position, &rec) == 0 &&
+                !(rec.flags & (INDEX_OPTIMIZED | INDEX_DUPLICATE | INDEX_COMPRESSED))) {
+                job->idx = idx;
+                job->position = position;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Worker loop. Runs under SCHED_IDLE so it only uses cores nobody else wants,
+ * and sleeps after each frame so that its CPU time stays within the configured budget.
+ * Queued frames come first; with none, the indexes are scanned, and once they are all read to their end the scan
+ * starts over every RESCAN_S seconds (or when a frame is queued), so a frame left behind is only delayed.
+ */
+static void *optimizer_thread(void *arg) {
+    struct sched_param param = { 0 };
+    uint8_t *out = NULL;
+    size_t out_cap = 0;
+    struct optimizer_job job;
+
+    (void)arg;
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+        setpriority(PRIO_PROCESS, 0, 19); // Falls back to the lowest nice level of the calling thread
+
+    while (1) {
+        int found = 0, scanned = 0;
+        double cpu_start = thread_cpu_seconds();
+
+        pthread_mutex_lock(&queue_lock);
+        if (queue_head != queue_tail) {
+            job = queue[queue_head % QUEUE_SIZE];
+            queue_head++;
+            found = 1;
+        }
+        pthread_mutex_unlock(&queue_lock);
+        if (!found)
+            found = scan_step(&job, &scanned);
+        if (!found && !scanned) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += RESCAN_S;
+            pthread_mutex_lock(&queue_lock);
+            if (queue_head == queue_tail)
+                pthread_cond_timedwait(&queue_ready, &queue_lock, &deadline);
+            pthread_mutex_unlock(&queue_lock);
+            for (int i = 0; i < scan_count; i++)
+                scan_positions[i] = 0;
+            continue;
+        }
+
+        if (found)
+            optimize_record(job.idx, job.position, &out, &out_cap);
+        double cpu_used = thread_cpu_seconds() - cpu_start;
+
+        /* Idles for long enough that busy / (busy + idle) equals the budget. */
+        double pause = cpu_used * (100 - budget_percent) / budget_percent;
+        if (pause > 0) {
+            struct timespec ts = { (time_t)pause, (long)((pause - (time_t)pause) * 1e9) };
+            while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+        }
+    }
+    return NULL;
+}
+
+int optimizer_start(int cpu_budget, struct stream_index *const *indexes, int count) {
+    pthread_t thread;
+
+    budget_percent = cpu_budget < 1 ? 1 : cpu_budget > 100 ? 100 : cpu_budget;
+    scan_indexes = indexes;
+    scan_positions = calloc(count, sizeof(*scan_positions));
+    scan_count = scan_positions != NULL ? count : 0;
+    if (pthread_create(&thread, NULL, optimizer_thread, NULL) != 0) {
+        perror("[OPTIMIZER] Thread creation failed");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
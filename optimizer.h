@@ -0,0 +1,31 @@
+/**
+ * @file optimizer.h
+ * @brief Background stage that losslessly shrinks stored MJPEG frames by re-encoding them with optimized Huffman tables.
+ *
+ * New frames are queued as they are stored. Frames the queue had no room for, and frames still waiting when the server
+ * stopped, are found again in the stream indexes: when the queue is empty, the thread scans them for records without
+ * INDEX_OPTIMIZED. The record of a rewritten frame gets the size and hash of its new file.
+ */
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdint.h>
+#include "index.h"
+
+/**
+ * @brief Starts the optimizer thread.
+ * @param cpu_budget Maximum share of one core (in percent) the thread may consume.
+ * @param indexes Stream indexes scanned for frames left behind, count entries (NULL for an index not open yet, which
+ * is scanned once it is).
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+int optimizer_start(int cpu_budget, struct stream_index *const *indexes, int count);
+
+/**
+ * @brief Queues the frame stored at the given index position for re-encoding. Never blocks: if the queue is full the
+ * frame is left for the scan of the index.
+ */
+void optimizer_submit(struct stream_index *idx, int64_t position);
+
+#endif
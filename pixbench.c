@@ -0,0 +1,115 @@
+/**
+ * @file pixbench.c
+ * @brief Benchmark of the pixel conversion kernels and of the preview downscaler. Every level supported by the CPU is
+ * checked against the scalar reference (outputs must be bit-identical) and its throughput is reported in GB/s of input.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/videodev2.h>
+#include "pixconv.h"
+
+/* Default frame geometry (1080p) and measurement time per kernel. */
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_SECONDS 0.5
+
+static const struct {
+    const char *name;
+    uint32_t fourcc;
+} formats[] = {
+    { "YUYV", V4L2_PIX_FMT_YUYV },
+    { "UYVY", V4L2_PIX_FMT_UYVY },
+    { "NV12", V4L2_PIX_FMT_NV12 },
+    { "plane", V4L2_PIX_FMT_GREY }, // Luma plane, only for the downscaler
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Conversion modes: to I420 (three planes in out), to grayscale, or 2x2 downscale of a width x height plane. */
+#define MODE_I420 0
+#define MODE_GRAY 1
+#define MODE_HALVE 2
+
+/* Runs one conversion of the whole frame. */
+static void convert(uint32_t fourcc, int mode, const uint8_t *frame, int width, int height, uint8_t *out) {
+    int chroma_w = width / 2;
+    uint8_t *u = out + (size_t)width * height;
+    uint8_t *v = u + (size_t)chroma_w * ((height + 1) / 2);
+
+    if (mode == MODE_HALVE)
+        pixconv_halve(frame, width, out, width / 2, width / 2, height / 2);
+    else if (mode == MODE_GRAY)
+        pixconv_rows_to_gray(fourcc, frame, width, height, 0, height, out, width);
+    else
+        pixconv_rows_to_i420(fourcc, frame, width, height, 0, height, out, width, u, v, chroma_w);
+}
+
+int main(int argc, char *argv[]) {
+    int width = argc > 2 ? atoi(argv[1]) : BENCH_WIDTH;
+    int height = argc > 2 ? atoi(argv[2]) : BENCH_HEIGHT;
+    int best = pixconv_best_level();
+    int failures = 0;
+
+    if (width <= 0 || height <= 0 || width % 2) {
+        fprintf(stderr, "Usage: %s [width height]   (width must be even)\n", argv[0]);
+        return 1;
+    }
+
+    size_t frame_size = (size_t)width * height * 2;
+    size_t out_size = (size_t)width * height * 2;
+    uint8_t *frame = malloc(frame_size);
+    uint8_t *reference = malloc(out_size);
+    uint8_t *out = malloc(out_size);
+    if (!frame || !reference || !out) {
+        perror("Allocation failed");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < frame_size; i++) frame[i] = (uint8_t)rand();
+
+    printf("%dx%d, best level on this CPU: %s\n", width, height, pixconv_level_name(best));
+    printf("%-14s %-8s %10s %10s\n", "kernel", "level", "GB/s", "check");
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        int plane = formats[f].fourcc == V4L2_PIX_FMT_GREY;
+        size_t input = plane ? (size_t)width * height : pixconv_frame_size(formats[f].fourcc, width, height);
+        for (int mode = plane ? MODE_HALVE : MODE_I420; mode <= (plane ? MODE_HALVE : MODE_GRAY); mode++) {
+            static const char *mode_names[] = { "I420", "gray", "half" };
+            char kernel[32];
+            snprintf(kernel, sizeof(kernel), "%s->%s", formats[f].name, mode_names[mode]);
+
+            pixconv_select(PIXCONV_SCALAR);
+            memset(reference, 0, out_size);
+            convert(formats[f].fourcc, mode, frame, width, height, reference);
+
+            for (int level = PIXCONV_SCALAR; level <= best; level++) {
+                pixconv_select(level);
+                memset(out, 0, out_size);
+                convert(formats[f].fourcc, mode, frame, width, height, out);
+                int same = memcmp(out, reference, out_size) == 0;
+                failures += !same;
+
+                long runs = 0;
+                double start = now_seconds(), elapsed;
+                do {
+                    convert(formats[f].fourcc, mode, frame, width, height, out);
+                    runs++;
+                } while ((elapsed = now_seconds() - start) < BENCH_SECONDS);
+                printf("%-14s %-8s %10.2f %10s\n", kernel, pixconv_level_name(level), runs * input / elapsed / 1e9,
+                       same ? "ok" : "MISMATCH");
+            }
+        }
+    }
+
+    free(frame);
+    free(reference);
+    free(out);
+    return failures ? 1 : 0;
+}
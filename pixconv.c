@@ -0,0 +1,483 @@
+/**
+ * @file pixconv.c
+ * @brief Pixel format conversion kernels with runtime dispatch between scalar, SSE2, AVX2 and AVX-512 row functions.
+ *
+ * The vector versions are compiled with per-function target attributes, so the build needs no special flags and the
+ * binary still runs on CPUs without AVX. Packed formats are handled with a shift that depends on the format:
+ * in YUYV luma is the low byte of every 16-bit word and chroma the high byte, in UYVY the other way round.
+ */
+
+#include <string.h>
+#include <immintrin.h>
+#include <linux/videodev2.h>
+#include "pixconv.h"
+
+/* Row functions of one instruction set level. */
+struct row_kernels {
+    /* Two rows of a packed format: luma of both rows, and chroma averaged over the pair. */
+    void (*packed_pair)(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                        int width, int luma_shift);
+    /* Luma of one row of a packed format. */
+    void (*packed_gray)(const uint8_t *src, uint8_t *dst, int width, int luma_shift);
+    /* Deinterleaves pairs of (U, V) samples. */
+    void (*split_uv)(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs);
+    /* 2x2 box average of a pair of plane rows: width output samples from 2 * width samples of each row. */
+    void (*halve)(const uint8_t *row0, const uint8_t *row1, uint8_t *dst, int width);
+};
+
+/* --- SCALAR REFERENCE --- */
+
+static void packed_pair_scalar(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                               int width, int luma_shift) {
+    int ly = luma_shift / 8, lc = 1 - ly;
+
+    for (int x = 0; x < width; x += 2) {
+        const uint8_t *p0 = row0 + 2 * x, *p1 = row1 + 2 * x;
+        y0[x] = p0[ly];
+        y0[x + 1] = p0[ly + 2];
+        y1[x] = p1[ly];
+        y1[x + 1] = p1[ly + 2];
+        u[x / 2] = (uint8_t)((p0[lc] + p1[lc] + 1) >> 1);
+        v[x / 2] = (uint8_t)((p0[lc + 2] + p1[lc + 2] + 1) >> 1);
+    }
+}
+
+static void packed_gray_scalar(const uint8_t *src, uint8_t *dst, int width, int luma_shift) {
+    for (int x = 0; x < width; x++) dst[x] = src[2 * x + luma_shift / 8];
+}
+
+static void split_uv_scalar(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs) {
+    for (int i = 0; i < pairs; i++) {
+        u[i] = uv[2 * i];
+        v[i] = uv[2 * i + 1];
+    }
+}
+
+static void halve_scalar(const uint8_t *row0, const uint8_t *row1, uint8_t *dst, int width) {
+    for (int x = 0; x < width; x++)
+        dst[x] = (uint8_t)((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+}
+
+/* --- SSE2: 16 pixels per iteration --- */
+
+__attribute__((target("sse2")))
+static void packed_pair_sse2(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                             int width, int luma_shift) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    const __m128i low32 = _mm_set1_epi32(0x0000FFFF);
+    const __m128i ys = _mm_cvtsi32_si128(luma_shift), cs = _mm_cvtsi32_si128(8 - luma_shift);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + 2 * x));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(row0 + 2 * x + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(row1 + 2 * x));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + 2 * x + 16));
+        _mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(_mm_and_si128(_mm_srl_epi16(a0, ys), low),
+                                                               _mm_and_si128(_mm_srl_epi16(b0, ys), low)));
+        _mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(_mm_and_si128(_mm_srl_epi16(a1, ys), low),
+                                                               _mm_and_si128(_mm_srl_epi16(b1, ys), low)));
+        /* Chroma words alternate U, V; the average keeps them in 16 bits, 32-bit masks then separate U from V. */
+        __m128i ca = _mm_avg_epu16(_mm_and_si128(_mm_srl_epi16(a0, cs), low), _mm_and_si128(_mm_srl_epi16(a1, cs), low));
+        __m128i cb = _mm_avg_epu16(_mm_and_si128(_mm_srl_epi16(b0, cs), low), _mm_and_si128(_mm_srl_epi16(b1, cs), low));
+        __m128i uw = _mm_packs_epi32(_mm_and_si128(ca, low32), _mm_and_si128(cb, low32));
+        __m128i vw = _mm_packs_epi32(_mm_srli_epi32(ca, 16), _mm_srli_epi32(cb, 16));
+        __m128i uv = _mm_packus_epi16(uw, vw);
+        _mm_storel_epi64((__m128i *)(u + x / 2), uv);
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
+    }
+    packed_pair_scalar(row0 + 2 * x, row1 + 2 * x, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x, luma_shift);
+}
+
+__attribute__((target("sse2")))
+static void packed_gray_sse2(const uint8_t *src, uint8_t *dst, int width, int luma_shift) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    const __m128i ys = _mm_cvtsi32_si128(luma_shift);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * x + 16));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(_mm_and_si128(_mm_srl_epi16(a, ys), low),
+                                                                _mm_and_si128(_mm_srl_epi16(b, ys), low)));
+    }
+    packed_gray_scalar(src + 2 * x, dst + x, width - x, luma_shift);
+}
+
+__attribute__((target("sse2")))
+static void split_uv_sse2(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    int i = 0;
+
+    for (; i + 16 <= pairs; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(uv + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 16));
+        _mm_storeu_si128((__m128i *)(u + i), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+        _mm_storeu_si128((__m128i *)(v + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    split_uv_scalar(uv + 2 * i, u + i, v + i, pairs - i);
+}
+
+__attribute__((target("sse2")))
+static void halve_sse2(const uint8_t *row0, const uint8_t *row1, uint8_t *dst, int width) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    const __m128i two = _mm_set1_epi16(2);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + 2 * x));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(row0 + 2 * x + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(row1 + 2 * x));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + 2 * x + 16));
+        /* Even and odd samples of each row as 16-bit words; the sum of four fits easily. */
+        __m128i sa = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, low), _mm_srli_epi16(a0, 8)),
+                                   _mm_add_epi16(_mm_and_si128(a1, low), _mm_srli_epi16(a1, 8)));
+        __m128i sb = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(b0, low), _mm_srli_epi16(b0, 8)),
+                                   _mm_add_epi16(_mm_and_si128(b1, low), _mm_srli_epi16(b1, 8)));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(sa, two), 2),
+                                                                _mm_srli_epi16(_mm_add_epi16(sb, two), 2)));
+    }
+    halve_scalar(row0 + 2 * x, row1 + 2 * x, dst + x, width - x);
+}
+
+/* --- AVX2: 32 pixels per iteration. Packs work within 128-bit lanes, so a 64-bit permute restores the order. --- */
+
+__attribute__((target("avx2")))
+static void packed_pair_avx2(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                             int width, int luma_shift) {
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    const __m256i low32 = _mm256_set1_epi32(0x0000FFFF);
+    const __m128i ys = _mm_cvtsi32_si128(luma_shift), cs = _mm_cvtsi32_si128(8 - luma_shift);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(row0 + 2 * x));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(row0 + 2 * x + 32));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(row1 + 2 * x));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(row1 + 2 * x + 32));
+        __m256i luma0 = _mm256_packus_epi16(_mm256_and_si256(_mm256_srl_epi16(a0, ys), low),
+                                            _mm256_and_si256(_mm256_srl_epi16(b0, ys), low));
+        __m256i luma1 = _mm256_packus_epi16(_mm256_and_si256(_mm256_srl_epi16(a1, ys), low),
+                                            _mm256_and_si256(_mm256_srl_epi16(b1, ys), low));
+        _mm256_storeu_si256((__m256i *)(y0 + x), _mm256_permute4x64_epi64(luma0, 0xD8));
+        _mm256_storeu_si256((__m256i *)(y1 + x), _mm256_permute4x64_epi64(luma1, 0xD8));
+
+        __m256i ca = _mm256_avg_epu16(_mm256_and_si256(_mm256_srl_epi16(a0, cs), low),
+                                      _mm256_and_si256(_mm256_srl_epi16(a1, cs), low));
+        __m256i cb = _mm256_avg_epu16(_mm256_and_si256(_mm256_srl_epi16(b0, cs), low),
+                                      _mm256_and_si256(_mm256_srl_epi16(b1, cs), low));
+        __m256i uw = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(ca, low32), _mm256_and_si256(cb, low32)), 0xD8);
+        __m256i vw = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_srli_epi32(ca, 16), _mm256_srli_epi32(cb, 16)), 0xD8);
+        __m256i uv = _mm256_permute4x64_epi64(_mm256_packus_epi16(uw, vw), 0xD8);
+        _mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(uv));
+        _mm_storeu_si128((__m128i *)(v + x / 2), _mm256_extracti128_si256(uv, 1));
+    }
+    packed_pair_sse2(row0 + 2 * x, row1 + 2 * x, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x, luma_shift);
+}
+
+__attribute__((target("avx2")))
+static void packed_gray_avx2(const uint8_t *src, uint8_t *dst, int width, int luma_shift) {
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    const __m128i ys = _mm_cvtsi32_si128(luma_shift);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + 2 * x));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 2 * x + 32));
+        __m256i luma = _mm256_packus_epi16(_mm256_and_si256(_mm256_srl_epi16(a, ys), low),
+                                           _mm256_and_si256(_mm256_srl_epi16(b, ys), low));
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_permute4x64_epi64(luma, 0xD8));
+    }
+    packed_gray_sse2(src + 2 * x, dst + x, width - x, luma_shift);
+}
+
+__attribute__((target("avx2")))
+static void split_uv_avx2(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs) {
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    int i = 0;
+
+    for (; i + 32 <= pairs; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(uv + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 32));
+        __m256i us = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+        __m256i vs = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+        _mm256_storeu_si256((__m256i *)(u + i), _mm256_permute4x64_epi64(us, 0xD8));
+        _mm256_storeu_si256((__m256i *)(v + i), _mm256_permute4x64_epi64(vs, 0xD8));
+    }
+    split_uv_sse2(uv + 2 * i, u + i, v + i, pairs - i);
+}
+
+__attribute__((target("avx2")))
+static void halve_avx2(const uint8_t *row0, const uint8_t *row1, uint8_t *dst, int width) {
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    const __m256i two = _mm256_set1_epi16(2);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(row0 + 2 * x));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(row0 + 2 * x + 32));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(row1 + 2 * x));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(row1 + 2 * x + 32));
+        __m256i sa = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a0, low), _mm256_srli_epi16(a0, 8)),
+                                      _mm256_add_epi16(_mm256_and_si256(a1, low), _mm256_srli_epi16(a1, 8)));
+        __m256i sb = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(b0, low), _mm256_srli_epi16(b0, 8)),
+                                      _mm256_add_epi16(_mm256_and_si256(b1, low), _mm256_srli_epi16(b1, 8)));
+        __m256i out = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_add_epi16(sa, two), 2),
+                                          _mm256_srli_epi16(_mm256_add_epi16(sb, two), 2));
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_permute4x64_epi64(out, 0xD8));
+    }
+    halve_sse2(row0 + 2 * x, row1 + 2 * x, dst + x, width - x);
+}
+
+/* --- AVX-512: 32 pixels per 64-byte load. Truncating down-conversions (VPMOVWB, VPMOVDB) need no lane fix-ups. --- */
+
+__attribute__((target("avx512f,avx512bw")))
+static void packed_pair_avx512(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                               int width, int luma_shift) {
+    const __m512i low = _mm512_set1_epi16(0x00FF);
+    const __m512i low32 = _mm512_set1_epi32(0x0000FFFF);
+    const __m128i ys = _mm_cvtsi32_si128(luma_shift), cs = _mm_cvtsi32_si128(8 - luma_shift);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m512i a0 = _mm512_loadu_si512(row0 + 2 * x);
+        __m512i a1 = _mm512_loadu_si512(row1 + 2 * x);
+        _mm256_storeu_si256((__m256i *)(y0 + x), _mm512_cvtepi16_epi8(_mm512_and_si512(_mm512_srl_epi16(a0, ys), low)));
+        _mm256_storeu_si256((__m256i *)(y1 + x), _mm512_cvtepi16_epi8(_mm512_and_si512(_mm512_srl_epi16(a1, ys), low)));
+        __m512i c = _mm512_avg_epu16(_mm512_and_si512(_mm512_srl_epi16(a0, cs), low),
+                                     _mm512_and_si512(_mm512_srl_epi16(a1, cs), low));
+        _mm_storeu_si128((__m128i *)(u + x / 2), _mm512_cvtepi32_epi8(_mm512_and_si512(c, low32)));
+        _mm_storeu_si128((__m128i *)(v + x / 2), _mm512_cvtepi32_epi8(_mm512_srli_epi32(c, 16)));
+    }
+    packed_pair_avx2(row0 + 2 * x, row1 + 2 * x, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x, luma_shift);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void packed_gray_avx512(const uint8_t *src, uint8_t *dst, int width, int luma_shift) {
+    const __m512i low = _mm512_set1_epi16(0x00FF);
+    const __m128i ys = _mm_cvtsi32_si128(luma_shift);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m512i a = _mm512_loadu_si512(src + 2 * x);
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm512_cvtepi16_epi8(_mm512_and_si512(_mm512_srl_epi16(a, ys), low)));
+    }
+    packed_gray_avx2(src + 2 * x, dst + x, width - x, luma_shift);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void split_uv_avx512(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs) {
+    const __m512i low = _mm512_set1_epi16(0x00FF);
+    int i = 0;
+
+    for (; i + 32 <= pairs; i += 32) {
+        __m512i a = _mm512_loadu_si512(uv + 2 * i);
+        _mm256_storeu_si256((__m256i *)(u + i), _mm512_cvtepi16_epi8(_mm512_and_si512(a, low)));
+        _mm256_storeu_si256((__m256i *)(v + i), _mm512_cvtepi16_epi8(_mm512_srli_epi16(a, 8)));
+    }
+    split_uv_avx2(uv + 2 * i, u + i, v + i, pairs - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void halve_avx512(const uint8_t *row0, const uint8_t *row1, uint8_t *dst, int width) {
+    const __m512i low = _mm512_set1_epi16(0x00FF);
+    const __m512i two = _mm512_set1_epi16(2);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m512i a0 = _mm512_loadu_si512(row0 + 2 * x);
+        __m512i a1 = _mm512_loadu_si512(row1 + 2 * x);
+        __m512i s = _mm512_add_epi16(_mm512_add_epi16(_mm512_and_si512(a0, low), _mm512_srli_epi16(a0, 8)),
+                                     _mm512_add_epi16(_mm512_and_si512(a1, low), _mm512_srli_epi16(a1, 8)));
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm512_cvtepi16_epi8(_mm512_srli_epi16(_mm512_add_epi16(s, two), 2)));
+    }
+    halve_avx2(row0 + 2 * x, row1 + 2 * x, dst + x, width - x);
+}
+
+/* --- DISPATCH --- */
+
+static const struct row_kernels kernels[PIXCONV_LEVELS] = {
+    { packed_pair_scalar, packed_gray_scalar, split_uv_scalar, halve_scalar },
+    { packed_pair_sse2, packed_gray_sse2, split_uv_sse2, halve_sse2 },
+    { packed_pair_avx2, packed_gray_avx2, split_uv_avx2, halve_avx2 },
+    { packed_pair_avx512, packed_gray_avx512, split_uv_avx512, halve_avx512 },
+};
+static const char *level_names[PIXCONV_LEVELS] = { "scalar", "sse2", "avx2", "avx512" };
+
+/* Kernels in use. Selected on first use; concurrent first calls all store the same pointer. */
+static const struct row_kernels *active;
+
+int pixconv_best_level(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return PIXCONV_AVX512;
+    if (__builtin_cpu_supports("avx2")) return PIXCONV_AVX2;
+    if (__builtin_cpu_supports("sse2")) return PIXCONV_SSE2;
+    return PIXCONV_SCALAR;
+}
+
+int pixconv_select(int level) {
+    if (level < 0 || level > pixconv_best_level()) return -1;
+    active = &kernels[level];
+    return 0;
+}
+
+const char *pixconv_level_name(int level) {
+    return level >= 0 && level < PIXCONV_LEVELS ? level_names[level] : "unknown";
+}
+
+static const struct row_kernels *row_kernels(void) {
+    if (active == NULL) active = &kernels[pixconv_best_level()];
+    return active;
+}
+
+size_t pixconv_frame_size(uint32_t pixelformat, int width, int height) {
+    switch (pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_UYVY:
+        return (size_t)width * height * 2;
+    case V4L2_PIX_FMT_NV12:
+        return (size_t)width * height + (size_t)width * ((height + 1) / 2);
+    case V4L2_PIX_FMT_YUV420:
+        return (size_t)width * height + (size_t)(width / 2) * ((height + 1) / 2) * 2;
+    default:
+        return 0;
+    }
+}
+
+int pixconv_plane_offsets(uint32_t pixelformat, int width, int height, size_t offsets[3]) {
+    offsets[0] = 0;
+    switch (pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_UYVY:
+        return 1;
+    case V4L2_PIX_FMT_NV12:
+        offsets[1] = (size_t)width * height;
+        return 2;
+    case V4L2_PIX_FMT_YUV420:
+        offsets[1] = (size_t)width * height;
+        offsets[2] = offsets[1] + (size_t)(width / 2) * ((height + 1) / 2);
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+static void packed_to_i420(const uint8_t *src, int src_stride, uint8_t *y, int y_stride, uint8_t *u, uint8_t *v,
+                           int uv_stride, int width, int height, int luma_shift) {
+    const struct row_kernels *k = row_kernels();
+
+    for (int row = 0; row < height; row += 2) {
+        /* An odd last row is paired with itself. */
+        int next = row + 1 < height ? row + 1 : row;
+        k->packed_pair(src + (size_t)row * src_stride, src + (size_t)next * src_stride, y + (size_t)row * y_stride,
+                       y + (size_t)next * y_stride, u + (size_t)(row / 2) * uv_stride, v + (size_t)(row / 2) * uv_stride,
+                       width, luma_shift);
+    }
+}
+
+void pixconv_yuyv_to_i420(const uint8_t *src, int src_stride, uint8_t *y, int y_stride, uint8_t *u, uint8_t *v,
+                          int uv_stride, int width, int height) {
+    packed_to_i420(src, src_stride, y, y_stride, u, v, uv_stride, width, height, 0);
+}
+
+void pixconv_uyvy_to_i420(const uint8_t *src, int src_stride, uint8_t *y, int y_stride, uint8_t *u, uint8_t *v,
+                          int uv_stride, int width, int height) {
+    packed_to_i420(src, src_stride, y, y_stride, u, v, uv_stride, width, height, 8);
+}
+
+void pixconv_nv12_to_i420(const uint8_t *src_y, int src_y_stride, const uint8_t *src_uv, int src_uv_stride,
+                          uint8_t *y, int y_stride, uint8_t *u, uint8_t *v, int uv_stride, int width, int height) {
+    const struct row_kernels *k = row_kernels();
+
+    for (int row = 0; row < height; row++)
+        memcpy(y + (size_t)row * y_stride, src_y + (size_t)row * src_y_stride, width);
+    for (int row = 0; row < (height + 1) / 2; row++)
+        k->split_uv(src_uv + (size_t)row * src_uv_stride, u + (size_t)row * uv_stride, v + (size_t)row * uv_stride, width / 2);
+}
+
+static void packed_to_gray(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height, int luma_shift) {
+    const struct row_kernels *k = row_kernels();
+
+    for (int row = 0; row < height; row++)
+        k->packed_gray(src + (size_t)row * src_stride, dst + (size_t)row * dst_stride, width, luma_shift);
+}
+
+void pixconv_yuyv_to_gray(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height) {
+    packed_to_gray(src, src_stride, dst, dst_stride, width, height, 0);
+}
+
+void pixconv_uyvy_to_gray(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height) {
+    packed_to_gray(src, src_stride, dst, dst_stride, width, height, 8);
+}
+
+void pixconv_nv12_to_gray(const uint8_t *src_y, int src_y_stride, uint8_t *dst, int dst_stride, int width, int height) {
+    for (int row = 0; row < height; row++)
+        memcpy(dst + (size_t)row * dst_stride, src_y + (size_t)row * src_y_stride, width);
+}
+
+void pixconv_halve(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height) {
+    const struct row_kernels *k = row_kernels();
+
+    for (int row = 0; row < height; row++)
+        k->halve(src + (size_t)(2 * row) * src_stride, src + (size_t)(2 * row + 1) * src_stride,
+                 dst + (size_t)row * dst_stride, width);
+}
+
+/* Copies rows of one plane of an I420 frame. */
+static void copy_rows(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int rows) {
+    for (int row = 0; row < rows; row++)
+        memcpy(dst + (size_t)row * dst_stride, src + (size_t)row * src_stride, width);
+}
+
+int pixconv_rows_to_i420(uint32_t pixelformat, const uint8_t *frame, int width, int height, int first_row, int rows,
+                         uint8_t *y, int y_stride, uint8_t *u, uint8_t *v, int uv_stride) {
+    if (first_row + rows > height) rows = height - first_row;
+    if (rows <= 0) return 0;
+
+    switch (pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+        pixconv_yuyv_to_i420(frame + (size_t)first_row * width * 2, width * 2, y, y_stride, u, v, uv_stride, width, rows);
+        return 0;
+    case V4L2_PIX_FMT_UYVY:
+        pixconv_uyvy_to_i420(frame + (size_t)first_row * width * 2, width * 2, y, y_stride, u, v, uv_stride, width, rows);
+        return 0;
+    case V4L2_PIX_FMT_NV12:
+        pixconv_nv12_to_i420(frame + (size_t)first_row * width, width,
+                             frame + (size_t)width * height + (size_t)(first_row / 2) * width, width,
+                             y, y_stride, u, v, uv_stride, width, rows);
+        return 0;
+    case V4L2_PIX_FMT_YUV420: {
+        /* Already planar: the rows are copied, chroma rows first_row / 2 onwards. */
+        int uv_w = width / 2, uv_rows = (rows + 1) / 2;
+        const uint8_t *src_u = frame + (size_t)width * height + (size_t)(first_row / 2) * uv_w;
+        const uint8_t *src_v = src_u + (size_t)uv_w * ((height + 1) / 2);
+        copy_rows(frame + (size_t)first_row * width, width, y, y_stride, width, rows);
+        copy_rows(src_u, uv_w, u, uv_stride, uv_w, uv_rows);
+        copy_rows(src_v, uv_w, v, uv_stride, uv_w, uv_rows);
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+int pixconv_rows_to_gray(uint32_t pixelformat, const uint8_t *frame, int width, int height, int first_row, int rows,
+                         uint8_t *dst, int dst_stride) {
+    if (first_row + rows > height) rows = height - first_row;
+    if (rows <= 0) return 0;
+
+    switch (pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+        pixconv_yuyv_to_gray(frame + (size_t)first_row * width * 2, width * 2, dst, dst_stride, width, rows);
+        return 0;
+    case V4L2_PIX_FMT_UYVY:
+        pixconv_uyvy_to_gray(frame + (size_t)first_row * width * 2, width * 2, dst, dst_stride, width, rows);
+        return 0;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        pixconv_nv12_to_gray(frame + (size_t)first_row * width, width, dst, dst_stride, width, rows);
+        return 0;
+    default:
+        return -1;
+    }
+}
@@ -0,0 +1,92 @@
+/**
+ * @file pixconv.h
+ * @brief Pixel format conversion kernels for the raw formats cameras deliver (YUYV, UYVY, NV12) to planar I420 and grayscale,
+ * and the 2x2 box downscaler of the preview stream.
+ *
+ * Every kernel exists in a scalar reference version and in SSE2, AVX2 and AVX-512 versions; the fastest one the CPU
+ * supports is selected at runtime via CPUID. All versions produce bit-identical output.
+ * Chroma is subsampled vertically by averaging the two rows of each pair, rounding up ((a + b + 1) / 2).
+ * Widths must be even; an odd last row takes its chroma from that row alone.
+ */
+
+#ifndef PIXCONV_H
+#define PIXCONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Instruction set levels, from the portable reference to the widest vectors. */
+#define PIXCONV_SCALAR 0
+#define PIXCONV_SSE2 1
+#define PIXCONV_AVX2 2
+#define PIXCONV_AVX512 3
+#define PIXCONV_LEVELS 4
+
+/**
+ * @brief Returns the highest level supported by this CPU.
+ */
+int pixconv_best_level(void);
+
+/**
+ * @brief Forces the kernels of a given level (benchmarks and comparisons against the scalar reference).
+ * @return 0 on success, -1 if the CPU does not support that level.
+ */
+int pixconv_select(int level);
+
+/**
+ * @brief Name of a level ("scalar", "sse2", "avx2", "avx512").
+ */
+const char *pixconv_level_name(int level);
+
+/**
+ * @brief Size in bytes of a frame in one of the supported V4L2 pixel formats, or 0 if the format is not supported.
+ * Besides the camera formats, planar I420 (V4L2_PIX_FMT_YUV420) is accepted as input, which is what the preview
+ * stream hands to the JPEG encoder.
+ */
+size_t pixconv_frame_size(uint32_t pixelformat, int width, int height);
+
+/**
+ * @brief Byte offsets of the planes of a contiguous frame: one plane for packed formats, luma and interleaved chroma
+ * for NV12, luma, U and V for I420 (the layouts multi-planar NV12M and YUV420M buffers are sent in).
+ * @return Number of planes, or 0 if the format is not supported.
+ */
+int pixconv_plane_offsets(uint32_t pixelformat, int width, int height, size_t offsets[3]);
+
+/* Packed 4:2:2 to planar 4:2:0. The u and v planes have (width / 2) x ((height + 1) / 2) samples. */
+void pixconv_yuyv_to_i420(const uint8_t *src, int src_stride, uint8_t *y, int y_stride, uint8_t *u, uint8_t *v,
+                          int uv_stride, int width, int height);
+void pixconv_uyvy_to_i420(const uint8_t *src, int src_stride, uint8_t *y, int y_stride, uint8_t *u, uint8_t *v,
+                          int uv_stride, int width, int height);
+
+/* Semi-planar 4:2:0 (interleaved UV plane) to planar 4:2:0. */
+void pixconv_nv12_to_i420(const uint8_t *src_y, int src_y_stride, const uint8_t *src_uv, int src_uv_stride,
+                          uint8_t *y, int y_stride, uint8_t *u, uint8_t *v, int uv_stride, int width, int height);
+
+/* Luma only. */
+void pixconv_yuyv_to_gray(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height);
+void pixconv_uyvy_to_gray(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height);
+void pixconv_nv12_to_gray(const uint8_t *src_y, int src_y_stride, uint8_t *dst, int dst_stride, int width, int height);
+
+/**
+ * @brief Halves a plane in both directions, each output sample being the rounded average of a 2x2 block.
+ * width and height are the output size; the source must hold 2 * width by 2 * height samples.
+ * Larger factors are obtained by halving repeatedly.
+ */
+void pixconv_halve(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height);
+
+/**
+ * @brief Converts rows [first_row, first_row + rows) of a whole frame in any supported format (V4L2 fourcc) to I420.
+ * first_row must be even. The destination pointers address the converted rows (chroma row first_row / 2).
+ * @return 0 on success, -1 if the format is not supported.
+ */
+int pixconv_rows_to_i420(uint32_t pixelformat, const uint8_t *frame, int width, int height, int first_row, int rows,
+                         uint8_t *y, int y_stride, uint8_t *u, uint8_t *v, int uv_stride);
+
+/**
+ * @brief Converts rows [first_row, first_row + rows) of a whole frame in any supported format to grayscale.
+ * @return 0 on success, -1 if the format is not supported.
+ */
+int pixconv_rows_to_gray(uint32_t pixelformat, const uint8_t *frame, int width, int height, int first_row, int rows,
+                         uint8_t *dst, int dst_stride);
+
+#endif
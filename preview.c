@@ -0,0 +1,89 @@
+/**
+ * @file preview.c
+ * @brief Preview stream encoder: DC-domain or raw I420 source image, repeated SIMD 2x2 box halving, baseline JPEG.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include "encoder.h"
+#include "pixconv.h"
+#include "preview.h"
+
+/* Makes sure both work images can hold needed bytes. */
+static int reserve(struct preview_encoder *pe, size_t needed) {
+    if (needed <= pe->capacity) return 0;
+    for (int i = 0; i < 2; i++) {
+        uint8_t *plane = realloc(pe->planes[i], needed);
+        if (!plane) return -1;
+        pe->planes[i] = plane;
+    }
+    pe->capacity = needed;
+    return 0;
+}
+
+/* Locates the three planes of a contiguous I420 image, laid out as V4L2_PIX_FMT_YUV420. */
+static void i420_planes(uint8_t *image, int width, int height, uint8_t **y, uint8_t **u, uint8_t **v) {
+    *y = image;
+    *u = image + (size_t)width * height;
+    *v = *u + (size_t)(width / 2) * ((height + 1) / 2);
+}
+
+long preview_encode(struct preview_encoder *pe, const void *frame, size_t size, uint32_t pixelformat, int width, int height,
+                    int factor, int quality) {
+    uint8_t *y, *u, *v;
+    int scale;
+
+    if (pixelformat == V4L2_PIX_FMT_MJPEG) {
+        struct jpeg_image dc;
+        if (jpeg_decode_dc(frame, size, &dc) < 0) return -1;
+        /* Even dimensions, so that every later halving keeps whole chroma samples. */
+        width = ((dc.width + 7) / 8) & ~1;
+        height = ((dc.height + 7) / 8) & ~1;
+        if (width < 2 || height < 2 || reserve(pe, pixconv_frame_size(V4L2_PIX_FMT_YUV420, width, height)) < 0) {
+            jpeg_free(&dc);
+            return -1;
+        }
+        i420_planes(pe->planes[0], width, height, &y, &u, &v);
+        jpeg_dc_i420(&dc, width, height, y, u, v);
+        jpeg_free(&dc);
+        scale = 8;
+    } else {
+        size_t expected = pixconv_frame_size(pixelformat, width, height);
+        if (expected == 0 || size < expected || width % 2 || height < 1) return -1;
+        if (reserve(pe, pixconv_frame_size(V4L2_PIX_FMT_YUV420, width, height)) < 0) return -1;
+        i420_planes(pe->planes[0], width, height, &y, &u, &v);
+        pixconv_rows_to_i420(pixelformat, frame, width, height, 0, height, y, width, u, v, width / 2);
+        scale = 1;
+    }
+
+    /* Each step writes a contiguous image half the size (rounded down to even) into the other buffer. */
+    int cur = 0;
+    while (scale < factor && width >= 4 && height >= 4) {
+        int half_w = (width / 2) & ~1, half_h = (height / 2) & ~1;
+        uint8_t *dy, *du, *dv;
+        i420_planes(pe->planes[cur], width, height, &y, &u, &v);
+        i420_planes(pe->planes[1 - cur], half_w, half_h, &dy, &du, &dv);
+        pixconv_halve(y, width, dy, half_w, half_w, half_h);
+        pixconv_halve(u, width / 2, du, half_w / 2, half_w / 2, half_h / 2);
+        pixconv_halve(v, width / 2, dv, half_w / 2, half_w / 2, half_h / 2);
+        cur = 1 - cur;
+        width = half_w;
+        height = half_h;
+        scale *= 2;
+    }
+
+    if (encoder_frame_to_image(pe->planes[cur], V4L2_PIX_FMT_YUV420, width, height, quality, &pe->img) < 0)
+        return -1;
+    pe->width = width;
+    pe->height = height;
+    return jpeg_encode(&pe->img, &pe->out, &pe->out_cap);
+}
+
+void preview_free(struct preview_encoder *pe) {
+    free(pe->planes[0]);
+    free(pe->planes[1]);
+    jpeg_free(&pe->img);
+    free(pe->out);
+    memset(pe, 0, sizeof(*pe));
+}
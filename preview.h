@@ -0,0 +1,41 @@
+/**
+ * @file preview.h
+ * @brief Low-resolution JPEG copies of captured frames for the live preview stream.
+ *
+ * Raw frames are converted to I420 and halved with the SIMD 2x2 box filter of pixconv.h until the requested factor
+ * is reached. MJPEG frames start from their 1/8-scale DC image, which needs no inverse DCT at all, so their previews
+ * are at least 8 times smaller than the frame. The result is encoded by the software JPEG encoder of encoder.h.
+ */
+
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "jpeg.h"
+
+/* Work buffers of the preview encoder, reused from frame to frame. Zero-initialize before first use. */
+struct preview_encoder {
+    uint8_t *planes[2];     // Two I420 images, source and destination of each halving step
+    size_t capacity;
+    struct jpeg_image img;  // Coefficient planes of the preview
+    uint8_t *out;           // Encoded preview
+    size_t out_cap;
+    int width, height;      // Size of the last preview
+};
+
+/**
+ * @brief Encodes a downscaled copy of a frame (MJPEG or a raw format supported by pixconv.h).
+ * @param factor Downscale factor, a power of two; MJPEG frames are never scaled by less than 8.
+ * @param quality JPEG quality of the preview (1-100).
+ * @return Size of the JPEG left in pe->out (geometry in pe->width and pe->height), or -1 on error.
+ */
+long preview_encode(struct preview_encoder *pe, const void *frame, size_t size, uint32_t pixelformat, int width, int height,
+                    int factor, int quality);
+
+/**
+ * @brief Releases the buffers of a preview encoder.
+ */
+void preview_free(struct preview_encoder *pe);
+
+#endif
@@ -0,0 +1,234 @@
+/**
+ * @file protocol.h
+ * @brief Application-layer message formats shared by the client, the server and the query tool.
+ *
+ * A frame message starts with the (positive) length of its filename, as described in the README.
+ * Negative values in that same first field identify control messages, so both kinds can share one connection.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+/* Control message identifiers, sent in place of the filename length. */
+#define MSG_THUMBNAIL_REQUEST (-1)
+#define MSG_FRAME (-2)
+#define MSG_ACTIVITY_QUERY (-3)
+#define MSG_CAMERA_STATUS (-4)
+#define MSG_PREVIEW_REQUEST (-5)
+#define MSG_HELLO (-6)
+#define MSG_RESUME (-7)
+#define MSG_REPLICATION_STATUS (-8)
+#define MSG_STRIPE (-9)
+
+/* Version of the options exchanged with MSG_HELLO. */
+#define PROTOCOL_VERSION 1
+
+/* Streams a camera can send on its connection (frame_header.stream). */
+#define STREAM_RECORD 0         // Full frames, stored and indexed; never dropped by the client
+#define STREAM_PREVIEW 1        // Downscaled JPEG frames for live viewing; only the latest one is kept, in memory
+
+/* Lossless compression of raw payloads (frame_header.compression), see rawcodec.h. */
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ 1        // LZ77 block compression (LZ4 block format)
+#define COMPRESSION_LZ_DELTA 2  // Horizontal delta prediction of packed 4:2:2 samples, then LZ
+#define COMPRESSION_LZ_XOR 3    // Inter frame: XOR with the previous frame of the stream, then LZ
+
+/* Activity value meaning "not computed": the server then scores the frame itself. */
+#define ACTIVITY_UNKNOWN (-1)
+
+/**
+ * Body of MSG_FRAME, the extended frame message. Followed by name_len bytes of filename and size bytes of payload.
+ * Unlike the legacy frame message it carries the capture metadata, so frames buffered by the client keep their original timestamps.
+ */
+struct frame_header {
+    uint64_t sequence;          // Capture sequence number assigned by the client
+    int64_t capture_us;         // Capture time (microseconds since the epoch), derived from the driver timestamp
+    uint64_t size;              // Payload size in bytes
+    uint32_t name_len;          // Length of the filename that follows the header
+    uint32_t width, height;     // Frame geometry
+    uint32_t pixelformat;       // V4L2 fourcc of the payload
+    uint32_t camera_id;         // Camera identifier, selecting the stream index the frame is recorded in
+    int32_t activity;           // Motion score from the client's detector (see motion.h), or ACTIVITY_UNKNOWN
+    uint32_t stream;            // STREAM_RECORD or STREAM_PREVIEW
+    uint32_t compression;       // COMPRESSION_* method of the payload; only methods accepted in MSG_HELLO may be used
+    uint32_t planes;            // Planes of a raw frame (2 for NV12, 3 for I420), sent one after the other; 1 otherwise
+    uint32_t plane_offset[3];   // Byte offset of each plane in the raw frame (after decompression, if compressed)
+    uint64_t session;           // Client session the sequence number belongs to (0 for clients without sessions)
+    uint64_t order;             // Position of the frame in a striped stream, from 1 (see MSG_STRIPE); 0 when not striped
+};
+
+/* Body of MSG_THUMBNAIL_REQUEST: camera and position of the frame in its stream index (0 is the oldest frame). */
+struct thumbnail_request {
+    int64_t position;
+    uint32_t camera_id;
+    uint32_t reserved;
+};
+
+/* Reply to MSG_THUMBNAIL_REQUEST. Followed by width * height * 3 bytes of RGB when width is non-zero. */
+struct thumbnail_reply {
+    int64_t position;
+    int64_t frame_count;        // Frames currently in the index, so a scrubbing UI can size its timeline
+    int64_t timestamp_us;       // Capture time if the client sent one, otherwise the time the frame was stored
+    uint16_t width, height;     // Thumbnail size, 0 if the thumbnail is not available (yet)
+    uint8_t luma_mean;          // Brightness statistics computed from the 1/8-scale luma plane
+    uint8_t luma_min;
+    uint8_t luma_max;
+    uint8_t luma_contrast;      // Standard deviation of the luma plane
+};
+
+/**
+ * Downsampled activity of one camera over one interval (a second or a minute).
+ * Stored back to back in the summary files of each stream, and sent as-is in activity query replies.
+ */
+struct activity_summary {
+    int64_t start_us;           // Start of the interval (microseconds since the epoch)
+    int64_t first_position;     // Index position of the first frame in the interval
+    uint32_t frames;            // Frames recorded in the interval
+    uint16_t max_activity;      // Highest motion score of the interval
+    uint16_t mean_activity;     // Average motion score of the scored frames
+};
+
+/* Body of MSG_ACTIVITY_QUERY: finds the intervals of a camera whose peak activity reaches min_activity. */
+struct activity_query {
+    int64_t from_us, to_us;     // Time range to scan
+    uint32_t camera_id;
+    uint32_t resolution_s;      // Summary granularity: 1 (per second) or 60 (per minute)
+    int32_t min_activity;
+    uint32_t max_results;
+};
+
+/* Reply to MSG_ACTIVITY_QUERY, followed by count activity_summary records in time order. */
+struct activity_reply {
+    uint32_t count;
+    uint32_t reserved;
+};
+
+/* Body of MSG_CAMERA_STATUS: a uint32_t camera identifier. Reply: */
+struct camera_status {
+    uint64_t frames;            // Frames received since the server started
+    uint64_t duplicates;        // Frames identical to the previous one, recorded as references instead of files
+    uint64_t bytes_saved;       // Payload bytes not stored thanks to duplicate detection
+    uint32_t duplicate_run;     // Current number of consecutive duplicates
+    uint32_t frozen_events;     // Times the camera was declared frozen
+    uint32_t frozen;            // Non-zero while the camera keeps repeating the same frame
+    uint32_t reserved;
+};
+
+/**
+ * Body of MSG_HELLO, sent by a client before its first frame to agree on the options of its stream.
+ * Without it the server assumes the defaults (no compression).
+ */
+struct hello {
+    uint32_t version;           // PROTOCOL_VERSION
+    uint32_t camera_id;
+    uint32_t compression;       // Compression methods the client would like to use, as a mask of 1 << COMPRESSION_*
+    uint32_t flags;             // HELLO_*
+};
+
+/* Options of MSG_HELLO (hello.flags). */
+#define HELLO_REPLICATED 0x1    // The sender is a server replicating its frames: they are stored, not replicated again
+
+/* Reply to MSG_HELLO. */
+struct hello_reply {
+    uint32_t version;
+    uint32_t compression;       // Subset of the requested methods that the server accepts on this connection
+};
+
+/* Answers to MSG_RESUME (resume_reply.status). */
+#define RESUME_NONE 0           // Nothing is stored for the camera: every unacknowledged frame must be sent again
+#define RESUME_SESSION 1        // The last frame stored since the server started, with its session
+#define RESUME_INDEX 2          // The session is unknown (the server restarted): the last frame of the stream index
+
+/**
+ * Body of MSG_RESUME, sent by a client on every new connection before its frames. The server first waits for the
+ * earlier connections of the camera to finish storing what they received, then reports the last frame it stored, so
+ * the client sends again exactly the frames that came after it. From then on every stored frame is acknowledged.
+ */
+struct resume {
+    uint64_t session;           // Random identifier chosen by the client when it starts
+    uint32_t camera_id;
+    uint32_t reserved;
+};
+
+/* Reply to MSG_RESUME. */
+struct resume_reply {
+    uint32_t status;            // RESUME_*
+    uint32_t reserved;
+    uint64_t session;           // Session of the last stored frame (0 if unknown)
+    uint64_t sequence;          // Its sequence number and capture time, which identify it in the client's send history
+    int64_t capture_us;
+};
+
+/**
+ * Sent by the server on a resumed connection each time a recorded frame is stored, in arrival order. It is the only
+ * message the server sends unasked; the client forgets the frame and every frame it sent before it.
+ */
+struct frame_ack {
+    uint64_t session;
+    uint64_t sequence;
+    int64_t capture_us;
+};
+
+/* Body of MSG_PREVIEW_REQUEST: a uint32_t camera identifier. Reply, followed by size bytes of JPEG: */
+struct preview_reply {
+    int64_t capture_us;         // Capture time of the frame the preview was made from
+    uint64_t sequence;          // Its capture sequence number
+    uint32_t size;              // JPEG size, 0 if the camera has not sent a preview yet
+    uint16_t width, height;
+};
+
+/**
+ * Body of MSG_STRIPE (no reply). A client can spread the recorded frames of one stream over several connections to the
+ * same server, so a single TCP flow does not limit its throughput. The connection that resumed the stream announces the
+ * stripe group with index 0 once its resent frames are sent, and keeps receiving the acknowledgements of every frame of
+ * the group; each striped connection then sends MSG_HELLO and MSG_STRIPE with its index. The server stores the frames
+ * of the group in the order given by frame_header.order, whatever connection they arrived on.
+ */
+struct stripe_join {
+    uint64_t session;
+    uint64_t group;             // Chosen by the client for each connection to the server, shared by its stripes
+    uint32_t camera_id;
+    uint32_t index;             // 0 for the connection that resumed the stream, 1 to count for the striped connections
+    uint32_t count;             // Striped connections of the group
+    uint32_t reserved;
+};
+
+/**
+ * Live previews can also travel over UDP (see fec.h), to the server's port number, so a lost packet delays nothing
+ * behind it. A preview message (its frame_header, then its JPEG) is cut into data fragments of equal size, followed by
+ * parity fragments computed over blocks of data fragments; each fragment is one datagram starting with this header.
+ */
+#define UDP_MAGIC 0x56505546    // "FUPV"
+#define FEC_NONE 0
+#define FEC_XOR 1               // One parity fragment per block, the XOR of its data fragments: recovers one loss
+#define FEC_RS 2                // Reed-Solomon (Cauchy, GF(2^8)): parity fragments per block recover as many losses
+
+struct udp_fragment {
+    uint32_t magic;             // UDP_MAGIC
+    uint32_t camera_id;
+    uint32_t frame;             // Preview number, counted by the client
+    uint32_t size;              // Bytes of the message; the last data fragment is padded with zeros
+    uint16_t index;             // Data fragments first (0 to data - 1), then the parity fragments, block by block
+    uint16_t data;              // Data fragments of the message
+    uint16_t block;             // Data fragments per block (the last block may have fewer)
+    uint8_t parity;             // Parity fragments per block
+    uint8_t fec;                // FEC_NONE, FEC_XOR or FEC_RS
+};
+
+/* Reply to MSG_REPLICATION_STATUS (no body): state of the replication of this server's frames to its peer. */
+struct replication_status {
+    uint32_t enabled;           // Non-zero when the server replicates to a peer
+    uint32_t connected;         // Non-zero while the connection to the peer is up
+    uint64_t pending_frames;    // Frames stored here that the peer has not acknowledged yet
+    uint64_t pending_bytes;
+    int64_t lag_us;             // Time since the oldest of them was stored (0 when the peer is up to date)
+    int64_t lag_max_us;         // Largest lag since the server started
+    uint64_t frames;            // Frames the peer acknowledged
+    uint64_t bytes;             // Payload bytes sent to the peer
+    uint64_t dropped;           // Frames that will never be replicated (queue overflow, file removed, gap before a keyframe)
+    uint64_t reconnects;
+};
+
+#endif
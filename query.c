@@ -0,0 +1,287 @@
+/**
+ * @file query.c
+ * @brief Command-line tool for querying the storage server: thumbnails for timeline scrubbing, activity search,
+ * camera status, the live preview and the replication to a peer server.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "protocol.h"
+
+/* Server connection details. These must match the server configuration. */
+#define SERVER_IP "127.0.0.1"
+#define SERVER_PORT 8080
+/* Maximum number of intervals requested by an activity search. */
+#define MAX_RESULTS 4096
+
+/* Receives exactly len bytes from the server. */
+static int recv_all(int sock, void *data, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t r = recv(sock, (char *)data + received, len - received, 0);
+        if (r <= 0) return -1;
+        received += r;
+    }
+    return 0;
+}
+
+static int connect_server(void) {
+    struct sockaddr_in serv_addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        perror("Socket creation error");
+        exit(1);
+    }
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr);
+    if (connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        perror("Connection Failed");
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * @brief Fetches the thumbnails of frames first..last of a camera and saves each one as a binary PPM file (thumb_NNNNNN.ppm).
+ */
+static int fetch_thumbnails(int fd, unsigned int camera, long first, long last) {
+    for (long pos = first; pos <= last; pos++) {
+        int msg = MSG_THUMBNAIL_REQUEST;
+        struct thumbnail_request req = { pos, camera, 0 };
+        struct thumbnail_reply reply;
+
+        if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg) || send(fd, &req, sizeof(req), 0) != sizeof(req) ||
+            recv_all(fd, &reply, sizeof(reply)) < 0) {
+            perror("Query failed");
+            return -1;
+        }
+        if (pos >= reply.frame_count) {
+            printf("Frame %ld is beyond the end of the stream (%ld frames)\n", pos, (long)reply.frame_count);
+            break;
+        }
+        if (reply.width == 0) {
+            printf("Frame %ld: no thumbnail available\n", pos);
+            continue;
+        }
+
+        size_t size = (size_t)reply.width * reply.height * 3;
+        unsigned char *rgb = malloc(size);
+        if (rgb == NULL || recv_all(fd, rgb, size) < 0) {
+            free(rgb);
+            return -1;
+        }
+
+        char filename[64];
+        snprintf(filename, sizeof(filename), "thumb_%06ld.ppm", pos);
+        FILE *fp = fopen(filename, "wb");
+        if (fp) {
+            fprintf(fp, "P6\n%d %d\n255\n", reply.width, reply.height);
+            fwrite(rgb, 1, size, fp);
+            fclose(fp);
+        }
+        free(rgb);
+
+        printf("Frame %ld: %s %dx%d, stored at %ld us, luma mean %d min %d max %d contrast %d\n", pos, filename,
+               reply.width, reply.height, (long)reply.timestamp_us, reply.luma_mean, reply.luma_min, reply.luma_max,
+               reply.luma_contrast);
+    }
+    return 0;
+}
+
+/* Sends one activity query and receives the matching intervals into results. Returns their number, or -1 on error. */
+static int query_activity(int fd, struct activity_query *query, struct activity_summary *results) {
+    int msg = MSG_ACTIVITY_QUERY;
+    struct activity_reply reply;
+
+    if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg) || send(fd, query, sizeof(*query), 0) != sizeof(*query) ||
+        recv_all(fd, &reply, sizeof(reply)) < 0 || reply.count > query->max_results ||
+        recv_all(fd, results, reply.count * sizeof(*results)) < 0) {
+        perror("Query failed");
+        return -1;
+    }
+    return (int)reply.count;
+}
+
+static void print_time(int64_t us) {
+    char text[32];
+    time_t seconds = (time_t)(us / 1000000);
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+    printf("%s", text);
+}
+
+/**
+ * @brief Lists when anything happened on a camera during the last hours.
+ * The per-minute summaries locate the active minutes; each of them is then refined with the per-second summaries.
+ */
+static int search_activity(int fd, unsigned int camera, double hours, int min_activity) {
+    struct timeval now;
+    struct activity_summary *minutes = malloc(MAX_RESULTS * sizeof(*minutes));
+    struct activity_summary *seconds = malloc(60 * sizeof(*seconds));
+    int result = -1;
+
+    gettimeofday(&now, NULL);
+    int64_t now_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    struct activity_query query = { now_us - (int64_t)(hours * 3600e6), now_us + 1, camera, 60, min_activity, MAX_RESULTS };
+
+    int found = minutes && seconds ? query_activity(fd, &query, minutes) : -1;
+    if (found < 0) goto out;
+    printf("%d active minute(s) on camera %u in the last %.1f hour(s)\n", found, camera, hours);
+
+    for (int i = 0; i < found; i++) {
+        struct activity_query refine = { minutes[i].start_us, minutes[i].start_us + 60000000, camera, 1, min_activity, 60 };
+        int n = query_activity(fd, &refine, seconds);
+        if (n < 0) goto out;
+        for (int j = 0; j < n; j++) {
+            print_time(seconds[j].start_us);
+            printf("  frames %u  peak %.2f  mean %.2f  first position %ld\n", seconds[j].frames,
+                   seconds[j].max_activity / 100.0, seconds[j].mean_activity / 100.0, (long)seconds[j].first_position);
+        }
+    }
+    result = 0;
+
+out:
+    free(minutes);
+    free(seconds);
+    return result;
+}
+
+/* Prints the duplicate-frame and frozen-camera counters of a camera. */
+static int camera_status(int fd, unsigned int camera) {
+    int msg = MSG_CAMERA_STATUS;
+    uint32_t id = camera;
+    struct camera_status status;
+
+    if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg) || send(fd, &id, sizeof(id), 0) != sizeof(id) ||
+        recv_all(fd, &status, sizeof(status)) < 0) {
+        perror("Query failed");
+        return -1;
+    }
+    printf("Camera %u: %llu frames, %llu duplicates (%llu bytes not stored), %s, frozen %u time(s), current run %u\n",
+           camera, (unsigned long long)status.frames, (unsigned long long)status.duplicates,
+           (unsigned long long)status.bytes_saved, status.frozen ? "FROZEN" : "live", status.frozen_events,
+           status.duplicate_run);
+    return 0;
+}
+
+/* Saves the latest live preview of a camera as preview_<camera>.jpg. */
+static int fetch_preview(int fd, unsigned int camera) {
+    int msg = MSG_PREVIEW_REQUEST;
+    uint32_t id = camera;
+    struct preview_reply reply;
+    char name[64];
+
+    if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg) || send(fd, &id, sizeof(id), 0) != sizeof(id) ||
+        recv_all(fd, &reply, sizeof(reply)) < 0) {
+        perror("Query failed");
+        return -1;
+    }
+    if (reply.size == 0) {
+        printf("Camera %u has not sent a preview\n", camera);
+        return 0;
+    }
+
+    unsigned char *jpeg = malloc(reply.size);
+    if (jpeg == NULL || recv_all(fd, jpeg, reply.size) < 0) {
+        free(jpeg);
+        return -1;
+    }
+    snprintf(name, sizeof(name), "preview_%u.jpg", camera);
+    FILE *fp = fopen(name, "wb");
+    if (fp == NULL) {
+        perror("Cannot create preview file");
+        free(jpeg);
+        return -1;
+    }
+    fwrite(jpeg, 1, reply.size, fp);
+    fclose(fp);
+    free(jpeg);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long age_ms = (long)(((int64_t)now.tv_sec * 1000000 + now.tv_usec - reply.capture_us) / 1000);
+    printf("Camera %u: frame %llu, %ux%u, %u bytes, captured %ld ms ago -> %s\n", camera,
+           (unsigned long long)reply.sequence, reply.width, reply.height, reply.size, age_ms, name);
+    return 0;
+}
+
+/* Prints how far the peer server's copy is behind this server. */
+static int replication(int fd) {
+    int msg = MSG_REPLICATION_STATUS;
+    struct replication_status status;
+
+    if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg) || recv_all(fd, &status, sizeof(status)) < 0) {
+        perror("Query failed");
+        return -1;
+    }
+    if (!status.enabled) {
+        printf("The server does not replicate to a peer\n");
+        return 0;
+    }
+    printf("Replication %s: %llu frames pending (%llu bytes), lag %.3f s (max %.3f s)\n"
+           "  %llu frames replicated (%llu bytes sent), %llu dropped, %llu reconnections\n",
+           status.connected ? "connected" : "DISCONNECTED", (unsigned long long)status.pending_frames,
+           (unsigned long long)status.pending_bytes, status.lag_us / 1e6, status.lag_max_us / 1e6,
+           (unsigned long long)status.frames, (unsigned long long)status.bytes, (unsigned long long)status.dropped,
+           (unsigned long long)status.reconnects);
+    return 0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s thumb <camera> <first> [last]\n"
+                    "       %s activity <camera> <hours> [threshold_grey_levels]\n"
+                    "       %s status <camera>\n"
+                    "       %s preview <camera>\n"
+                    "       %s replication\n", program, program, program, program, program);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int result;
+
+    /* The only query that concerns the whole server rather than one camera. */
+    if (argc == 2 && strcmp(argv[1], "replication") == 0) {
+        int fd = connect_server();
+        result = replication(fd);
+        close(fd);
+        return result < 0 ? 1 : 0;
+    }
+    if (argc < 3) usage(argv[0]);
+    unsigned int camera = (unsigned int)atoi(argv[2]);
+
+    if (strcmp(argv[1], "status") == 0) {
+        int fd = connect_server();
+        result = camera_status(fd, camera);
+        close(fd);
+    } else if (strcmp(argv[1], "preview") == 0) {
+        int fd = connect_server();
+        result = fetch_preview(fd, camera);
+        close(fd);
+    } else if (argc < 4) {
+        usage(argv[0]);
+        return 1;
+    } else if (strcmp(argv[1], "thumb") == 0) {
+        long first = atol(argv[3]);
+        long last = argc > 4 ? atol(argv[4]) : first;
+        int fd = connect_server();
+        result = fetch_thumbnails(fd, camera, first, last);
+        close(fd);
+    } else if (strcmp(argv[1], "activity") == 0) {
+        int threshold = argc > 4 ? (int)(atof(argv[4]) * 100) : 100;
+        int fd = connect_server();
+        result = search_activity(fd, camera, atof(argv[3]), threshold);
+        close(fd);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    return result < 0 ? 1 : 0;
+}
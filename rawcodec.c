@@ -0,0 +1,335 @@
+/**
+ * @file rawcodec.c
+ * @brief LZ4-format block compressor and decompressor with an SSE2 delta prediction pre-pass for packed 4:2:2 frames.
+ *
+ * Compressed block layout (the LZ4 block format): a sequence is a token byte (literal count in the high nibble,
+ * match length - 4 in the low nibble, 15 meaning "more length bytes follow"), the literals, a 16-bit little-endian
+ * match offset and the extra match length bytes. The last sequence has literals only. As in LZ4, the last match
+ * starts at least 12 bytes before the end and the last 5 bytes are always literals.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+#include <linux/videodev2.h>
+#include "protocol.h"
+#include "rawcodec.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12     // No match may start in the last 12 bytes
+#define MAX_DISTANCE 65535
+/* Misses after which the match search starts skipping ahead faster through incompressible data. */
+#define SKIP_TRIGGER 6
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Multiplicative hash of a 4-byte sequence (Knuth's golden ratio constant). */
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - RAWCODEC_HASH_BITS);
+}
+
+/* Writes the continuation bytes of a length that did not fit in its nibble. */
+static uint8_t *write_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Writes one sequence: literals [anchor, anchor + literals), then a match (offset 0 ends the block without one). */
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *anchor, size_t literals, unsigned int offset, size_t match_len) {
+    uint8_t *token = op++;
+    size_t extra = match_len - MIN_MATCH;
+
+    *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) op = write_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (offset == 0) return op;
+
+    *token |= (uint8_t)(extra >= 15 ? 15 : extra);
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    if (extra >= 15) op = write_length(op, extra - 15);
+    return op;
+}
+
+/* Worst-case size of a sequence with the given literal count (match length bytes included). */
+static size_t sequence_bound(size_t literals, size_t match_len) {
+    return 1 + literals + literals / 255 + 1 + 2 + match_len / 255 + 1;
+}
+
+static long lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t cap, uint32_t *table) {
+    const uint8_t *ip = src, *anchor = src, *end = src + size;
+    const uint8_t *match_limit = end - LAST_LITERALS;
+    const uint8_t *find_limit = end - MATCH_FIND_LIMIT;
+    uint8_t *op = dst, *op_end = dst + cap;
+
+    memset(table, 0, sizeof(uint32_t) << RAWCODEC_HASH_BITS);
+    if (size > MATCH_FIND_LIMIT) {
+        ip++;
+        while (ip < find_limit) {
+            const uint8_t *ref;
+            unsigned int attempts = 1 << SKIP_TRIGGER;
+
+            /* Looks up the candidate at the hash of the next 4 bytes; the step grows after repeated misses. */
+            for (;;) {
+                uint32_t h = hash4(read32(ip));
+                ref = src + table[h];
+                table[h] = (uint32_t)(ip - src);
+                if (ref < ip && ip - ref <= MAX_DISTANCE && read32(ref) == read32(ip))
+                    break;
+                ip += attempts++ >> SKIP_TRIGGER;
+                if (ip >= find_limit)
+                    goto last_literals;
+            }
+
+            /* Extends the match backwards over pending literals, then forwards 8 bytes at a time. */
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+            while (mp + 8 <= match_limit) {
+                uint64_t diff = read64(mp) ^ read64(rp);
+                if (diff) {
+                    mp += __builtin_ctzll(diff) >> 3;
+                    goto extended;
+                }
+                mp += 8;
+                rp += 8;
+            }
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+        extended:;
+            size_t literals = ip - anchor, match_len = mp - ip;
+            if (sequence_bound(literals, match_len) > (size_t)(op_end - op))
+                return -1;
+            op = write_sequence(op, anchor, literals, (unsigned int)(ip - ref), match_len);
+            ip = anchor = mp;
+
+            /* Also indexes a position inside the match, which helps the next search at almost no cost. */
+            if (ip < find_limit)
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+last_literals:
+    if (sequence_bound(end - anchor, 0) > (size_t)(op_end - op))
+        return -1;
+    op = write_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+static long lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *end = src + size;
+    uint8_t *op = dst, *op_end = dst + cap;
+
+    while (ip < end) {
+        unsigned int token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned int b;
+            do {
+                if (ip >= end) return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == end) break; // Last sequence: literals only
+
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            unsigned int b;
+            do {
+                if (ip >= end) return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match_len > (size_t)(op_end - op)) return -1;
+
+        /* A match may overlap its own output (offset < length), which repeats a pattern of offset bytes. Copying the
+           whole span written so far since ref doubles the repeated part each time, and every copy is non-overlapping. */
+        const uint8_t *ref = op - offset;
+        while (match_len > (size_t)(op - ref)) {
+            size_t span = op - ref;
+            memcpy(op, ref, span);
+            op += span;
+            match_len -= span;
+        }
+        memcpy(op, ref, match_len);
+        op += match_len;
+    }
+    return op - dst;
+}
+
+/* --- DELTA PREDICTION --- */
+
+/**
+ * Replaces each sample of a packed 4:2:2 frame by its difference (mod 256) with the previous sample of the same
+ * channel: 2 bytes back for luma, 4 bytes back for chroma (U to U, V to V). The first 4 bytes are kept as they are.
+ * luma_offset is 0 for YUYV and 1 for UYVY.
+ */
+static void delta_encode(const uint8_t *src, uint8_t *dst, size_t size, int luma_offset) {
+    const __m128i luma = _mm_set1_epi16(luma_offset ? (short)0xFF00 : 0x00FF);
+    size_t i = size < 4 ? size : 4;
+
+    memcpy(dst, src, i);
+    for (; i + 16 <= size; i += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i back2 = _mm_loadu_si128((const __m128i *)(src + i - 2));
+        __m128i back4 = _mm_loadu_si128((const __m128i *)(src + i - 4));
+        __m128i pred = _mm_or_si128(_mm_and_si128(luma, back2), _mm_andnot_si128(luma, back4));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi8(cur, pred));
+    }
+    for (; i < size; i++)
+        dst[i] = (uint8_t)(src[i] - src[i - (((int)(i & 1) == luma_offset) ? 2 : 4)]);
+}
+
+/* Inverse of delta_encode(), in place. Each sample depends on the previous one of its channel, so this runs serially. */
+static void delta_decode(uint8_t *data, size_t size, int luma_offset) {
+    for (size_t i = 4; i < size; i++)
+        data[i] = (uint8_t)(data[i] + data[i - (((int)(i & 1) == luma_offset) ? 2 : 4)]);
+}
+
+/* Returns the luma byte offset of a packed 4:2:2 format, or -1 for formats without delta prediction. */
+static int packed_luma_offset(uint32_t pixelformat) {
+    if (pixelformat == V4L2_PIX_FMT_YUYV) return 0;
+    if (pixelformat == V4L2_PIX_FMT_UYVY) return 1;
+    return -1;
+}
+
+/* --- PUBLIC INTERFACE --- */
+
+/* Grows the pre-pass buffer of a compressor to at least size bytes. */
+static int reserve_delta(struct raw_compressor *rc, size_t size) {
+    if (size <= rc->delta_capacity) return 0;
+    uint8_t *delta = realloc(rc->delta, size);
+    if (delta == NULL) return -1;
+    rc->delta = delta;
+    rc->delta_capacity = size;
+    return 0;
+}
+
+/* Writes the payload header and LZ-compresses input behind it. */
+static long pack(struct raw_compressor *rc, const uint8_t *input, size_t size, uint32_t method, uint32_t pixelformat,
+                 void *dst, size_t cap) {
+    struct rawcodec_header header;
+
+    header.magic = RAWCODEC_MAGIC;
+    header.method = method;
+    header.pixelformat = pixelformat;
+    header.raw_size = (uint32_t)size;
+    memcpy(dst, &header, sizeof(header));
+    long packed = lz_compress(input, size, (uint8_t *)dst + sizeof(header), cap - sizeof(header), rc->table);
+    return packed < 0 ? -1 : (long)sizeof(header) + packed;
+}
+
+size_t rawcodec_bound(size_t size) {
+    return sizeof(struct rawcodec_header) + size + size / 255 + 16;
+}
+
+long rawcodec_compress(struct raw_compressor *rc, const void *src, size_t size, uint32_t method, uint32_t pixelformat,
+                       void *dst, size_t cap) {
+    const uint8_t *input = src;
+    int luma_offset = packed_luma_offset(pixelformat);
+
+    if (cap < sizeof(struct rawcodec_header) || size > UINT32_MAX) return -1;
+    if (rc->table == NULL && (rc->table = malloc(sizeof(uint32_t) << RAWCODEC_HASH_BITS)) == NULL) return -1;
+    if (method != COMPRESSION_LZ_DELTA || luma_offset < 0) method = COMPRESSION_LZ;
+
+    if (method == COMPRESSION_LZ_DELTA) {
+        if (reserve_delta(rc, size) < 0) return -1;
+        delta_encode(src, rc->delta, size, luma_offset);
+        input = rc->delta;
+    }
+    return pack(rc, input, size, method, pixelformat, dst, cap);
+}
+
+long rawcodec_compress_inter(struct raw_compressor *rc, const void *src, const void *prev, size_t size, uint32_t pixelformat,
+                             void *dst, size_t cap) {
+    if (cap < sizeof(struct rawcodec_header) || size > UINT32_MAX) return -1;
+    if (rc->table == NULL && (rc->table = malloc(sizeof(uint32_t) << RAWCODEC_HASH_BITS)) == NULL) return -1;
+    if (reserve_delta(rc, size) < 0) return -1;
+
+    memcpy(rc->delta, src, size);
+    rawcodec_xor(rc->delta, prev, size);
+    return pack(rc, rc->delta, size, COMPRESSION_LZ_XOR, pixelformat, dst, cap);
+}
+
+uint32_t rawcodec_method(const void *data, size_t size) {
+    struct rawcodec_header header;
+
+    if (size < sizeof(header)) return COMPRESSION_NONE;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != RAWCODEC_MAGIC || header.method < COMPRESSION_LZ || header.method > COMPRESSION_LZ_XOR)
+        return COMPRESSION_NONE;
+    return header.method;
+}
+
+size_t rawcodec_raw_size(const void *data, size_t size) {
+    struct rawcodec_header header;
+
+    if (rawcodec_method(data, size) == COMPRESSION_NONE) return 0;
+    memcpy(&header, data, sizeof(header));
+    return header.raw_size;
+}
+
+long rawcodec_decompress(const void *data, size_t size, void *dst, size_t cap) {
+    struct rawcodec_header header;
+    size_t raw_size = rawcodec_raw_size(data, size);
+
+    if (raw_size == 0 || raw_size > cap) return -1;
+    memcpy(&header, data, sizeof(header));
+    long out = lz_decompress((const uint8_t *)data + sizeof(header), size - sizeof(header), dst, raw_size);
+    if (out != (long)raw_size) return -1;
+    if (header.method == COMPRESSION_LZ_DELTA) {
+        int luma_offset = packed_luma_offset(header.pixelformat);
+        if (luma_offset < 0) return -1;
+        delta_decode(dst, raw_size, luma_offset);
+    }
+    return out;
+}
+
+void rawcodec_xor(void *dst, const void *src, size_t size) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(d + i));
+        _mm_storeu_si128((__m128i *)(d + i), _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(s + i))));
+    }
+    for (; i < size; i++)
+        d[i] ^= s[i];
+}
+
+void rawcodec_free(struct raw_compressor *rc) {
+    free(rc->table);
+    free(rc->delta);
+    memset(rc, 0, sizeof(*rc));
+}
@@ -0,0 +1,92 @@
+/**
+ * @file rawcodec.h
+ * @brief Fast lossless compression of raw frame payloads (YUYV, UYVY, NV12), for cameras that cannot deliver MJPEG.
+ *
+ * The compressor is a byte-oriented LZ77 coder producing the LZ4 block format (4-byte minimum matches found through
+ * a hash table, 64 KB window, no entropy stage), so it runs at several hundred MB/s on one core. For packed 4:2:2
+ * formats an optional predictive pre-pass replaces every sample by its difference with the previous sample of the
+ * same channel, which turns smooth image areas into runs of small repeated values that the LZ stage can match.
+ *
+ * Streams of nearly static scenes can also be inter-coded: a delta frame is the XOR of a frame with the previous one,
+ * which is zero wherever nothing changed and compresses to a small fraction of the frame. Delta frames are decoded
+ * by XORing their residual into the previous frame, so decoding starts at the last self-contained frame (keyframe).
+ *
+ * A compressed payload is self-describing: it starts with a struct rawcodec_header, so readers of stored frames can
+ * recognise it and decompress on demand.
+ */
+
+#ifndef RAWCODEC_H
+#define RAWCODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAWCODEC_MAGIC 0x315A4C52 // "RLZ1" in little-endian byte order
+
+/* Size of the LZ hash table: 2^16 entries of 32-bit positions. */
+#define RAWCODEC_HASH_BITS 16
+
+/* Prefix of every compressed payload. */
+struct rawcodec_header {
+    uint32_t magic;
+    uint32_t method;            // COMPRESSION_LZ, COMPRESSION_LZ_DELTA or COMPRESSION_LZ_XOR (see protocol.h)
+    uint32_t pixelformat;       // V4L2 fourcc of the raw frame, which selects the delta prediction
+    uint32_t raw_size;          // Size of the payload once decompressed
+};
+
+/* Work buffers of the compressor, reused from frame to frame. Zero-initialize before first use. */
+struct raw_compressor {
+    uint32_t *table;            // Hash table of recent 4-byte sequences
+    uint8_t *delta;             // Frame after the prediction pre-pass, or XOR residual
+    size_t delta_capacity;
+};
+
+/**
+ * @brief Largest possible compressed size of a payload of the given size (incompressible data grows slightly).
+ */
+size_t rawcodec_bound(size_t size);
+
+/**
+ * @brief Compresses a raw frame. The delta pre-pass of COMPRESSION_LZ_DELTA only applies to YUYV and UYVY;
+ * other formats fall back to COMPRESSION_LZ (the header records the method actually used).
+ * @return Compressed size including the header, or -1 if dst (of capacity cap) is too small or allocation fails.
+ */
+long rawcodec_compress(struct raw_compressor *rc, const void *src, size_t size, uint32_t method, uint32_t pixelformat,
+                       void *dst, size_t cap);
+
+/**
+ * @brief Compresses a delta frame: the XOR of src with prev (the previous frame of the stream, of the same size).
+ * @return Compressed size including the header (method COMPRESSION_LZ_XOR), or -1 on error.
+ */
+long rawcodec_compress_inter(struct raw_compressor *rc, const void *src, const void *prev, size_t size, uint32_t pixelformat,
+                             void *dst, size_t cap);
+
+/**
+ * @brief Returns the method of a compressed payload (COMPRESSION_*), or COMPRESSION_NONE if it is not one.
+ */
+uint32_t rawcodec_method(const void *data, size_t size);
+
+/**
+ * @brief Returns the decompressed size of a payload, or 0 if it is not a compressed payload.
+ */
+size_t rawcodec_raw_size(const void *data, size_t size);
+
+/**
+ * @brief Decompresses a payload into dst, which must hold rawcodec_raw_size() bytes. For delta frames the result is
+ * the XOR residual, to be applied to the previous frame with rawcodec_xor().
+ * Corrupt input is detected and never causes reads or writes out of bounds.
+ * @return The decompressed size, or -1 if the payload is corrupt or dst is too small.
+ */
+long rawcodec_decompress(const void *data, size_t size, void *dst, size_t cap);
+
+/**
+ * @brief XORs size bytes of src into dst (turns a previous frame into the next one given its residual, and back).
+ */
+void rawcodec_xor(void *dst, const void *src, size_t size);
+
+/**
+ * @brief Releases the buffers of a compressor.
+ */
+void rawcodec_free(struct raw_compressor *rc);
+
+#endif
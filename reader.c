@@ -0,0 +1,95 @@
+/**
+ * @file reader.c
+ * @brief Frame reader: keyframe search in the stream index, decompression and XOR residual application.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "rawcodec.h"
+#include "reader.h"
+
+/* Grows a buffer to at least needed bytes. */
+static int reserve(uint8_t **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) return 0;
+    uint8_t *grown = realloc(*buffer, needed);
+    if (grown == NULL) return -1;
+    *buffer = grown;
+    *capacity = needed;
+    return 0;
+}
+
+/* Reads a whole frame file into reader->payload. Returns its size, or -1 on error. */
+static long read_payload(struct frame_reader *reader, const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) return -1;
+
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    rewind(fp);
+    if (length <= 0 || reserve(&reader->payload, &reader->payload_capacity, length) < 0 ||
+        fread(reader->payload, 1, length, fp) != (size_t)length)
+        length = -1;
+    fclose(fp);
+    return length;
+}
+
+int reader_apply(struct frame_reader *reader, const uint8_t *payload, size_t size) {
+    uint32_t method = rawcodec_method(payload, size);
+    size_t raw_size = rawcodec_raw_size(payload, size);
+
+    reader->position = -1;
+    if (method == COMPRESSION_NONE) {
+        if (reserve(&reader->frame, &reader->capacity, size) < 0) return -1;
+        memcpy(reader->frame, payload, size);
+        reader->size = size;
+        return 0;
+    }
+    if (method != COMPRESSION_LZ_XOR) {
+        if (reserve(&reader->frame, &reader->capacity, raw_size) < 0) return -1;
+        reader->size = raw_size;
+        return rawcodec_decompress(payload, size, reader->frame, raw_size) == (long)raw_size ? 0 : -1;
+    }
+
+    /* Delta frame: the residual has the size of the frame it applies to. */
+    if (reader->frame == NULL || raw_size != reader->size) return -1;
+    if (reserve(&reader->residual, &reader->residual_capacity, raw_size) < 0) return -1;
+    if (rawcodec_decompress(payload, size, reader->residual, raw_size) != (long)raw_size) return -1;
+    rawcodec_xor(reader->frame, reader->residual, raw_size);
+    return 0;
+}
+
+int reader_load(struct frame_reader *reader, struct stream_index *idx, int64_t position) {
+    struct index_record rec;
+    int64_t start = position;
+
+    if (reader->idx == idx && reader->position == position) return 0;
+
+    /* Walks back to the keyframe, or only to the delta that follows the frame already decoded. */
+    if (index_read(idx, start, &rec) < 0) return -1;
+    while ((rec.flags & INDEX_DELTA) && !(reader->idx == idx && reader->position == start - 1)) {
+        if (--start < 0 || index_read(idx, start, &rec) < 0) return -1;
+    }
+
+    /* Decodes forwards; rec holds the record at start when the loop begins. */
+    reader->idx = idx;
+    for (int64_t p = start; p <= position; p++) {
+        long size;
+        if ((p != start && index_read(idx, p, &rec) < 0) || (size = read_payload(reader, rec.filename)) < 0 ||
+            reader_apply(reader, reader->payload, size) < 0) {
+            reader->position = -1;
+            return -1;
+        }
+        reader->position = p;
+    }
+    return 0;
+}
+
+void reader_free(struct frame_reader *reader) {
+    free(reader->frame);
+    free(reader->payload);
+    free(reader->residual);
+    memset(reader, 0, sizeof(*reader));
+    reader->position = -1;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file reader.h
+ * @brief Random access to the recorded frames of a stream index, decoding compressed and inter-coded payloads.
+ *
+ * A delta frame (INDEX_DELTA) only stores its difference with the previous frame, so reading it means walking back
+ * to the nearest keyframe and applying every delta from there. The reader keeps the last frame it produced, so
+ * reading frames in order costs a single decompression per frame.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "index.h"
+
+/* Last decoded frame and work buffers. Zero-initialize, then set position to -1 before first use. */
+struct frame_reader {
+    struct stream_index *idx;   // Index the cached frame belongs to
+    int64_t position;           // Position of the cached frame, -1 if none
+    uint8_t *frame;             // Decoded frame
+    size_t size;
+    size_t capacity;
+    uint8_t *payload;           // File contents being decoded
+    size_t payload_capacity;
+    uint8_t *residual;          // Decompressed XOR residual of a delta frame
+    size_t residual_capacity;
+};
+
+/**
+ * @brief Decodes the frame at the given position into reader->frame (reader->size bytes).
+ * @return 0 on success, -1 if a record or file of the chain is missing or corrupt.
+ */
+int reader_load(struct frame_reader *reader, struct stream_index *idx, int64_t position);
+
+/**
+ * @brief Decodes a payload that follows the cached frame (a frame being received, before it is indexed).
+ * Self-contained payloads replace the cached frame; delta payloads are applied to it. The cached position becomes -1
+ * until the caller sets it to the frame's record position.
+ * @return 0 on success, -1 if the payload is corrupt or a delta frame has no matching reference.
+ */
+int reader_apply(struct frame_reader *reader, const uint8_t *payload, size_t size);
+
+/**
+ * @brief Releases the buffers of a reader.
+ */
+void reader_free(struct frame_reader *reader);
+
+#endif
@@ -0,0 +1,428 @@
+/**
+ * @file replica.c
+ * @brief Replication fan-out. Each replica is a small state machine (connect, handshake, stream) advanced by
+ * replicas_poll() whenever select() reports its socket, or times out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "replica.h"
+
+/* Pause before reconnecting to a replica (ms), doubled after each failure up to the maximum. */
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 10000
+/* Longest wait (ms) for a connection, and (s) for the answers to the handshake. */
+#define CONNECT_TIMEOUT_MS 2000
+#define HANDSHAKE_TIMEOUT_S 5
+/* Poll interval (ms) while waiting for the replicas at start and exit. */
+#define REPLICA_POLL_MS 50
+
+static int64_t monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Closes a replica connection that failed; it is tried again after a pause that grows with each failure.
+ * The replica keeps holding its frames in the history, so it resumes without a gap if it is back soon enough.
+ * Called with the history lock held.
+ */
+static void replica_failed(struct replica *rep, const char *reason) {
+    fprintf(stderr, "[REPLICA] Connection to %s:%d lost (%s); retrying in %lld ms.\n", rep->host,
+            rep->port, reason, (long long)(rep->reconnect_delay_us / 1000));
+    if (rep->fd >= 0)
+        close(rep->fd);
+    rep->fd = -1;
+    rep->state = REPLICA_IDLE;
+    rep->prefix_len = 0;
+    rep->offset = 0;
+    rep->ack_received = 0;
+    rep->reconnect_at_us = monotonic_us() + rep->reconnect_delay_us;
+    rep->reconnect_delay_us = rep->reconnect_delay_us * 2 < RECONNECT_MAX_MS * 1000LL ? rep->reconnect_delay_us * 2
+                                                                                       : RECONNECT_MAX_MS * 1000LL;
+}
+
+/**
+ * @brief Starts a non-blocking connection to a replica.
+ */
+static void replica_connect(const struct replica_context *ctx, struct replica *rep) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(rep->port);
+    if (inet_pton(AF_INET, rep->host, &addr.sin_addr) <= 0) {
+        fprintf(stderr, "[REPLICA] Invalid address %s; replica disabled.\n", rep->host);
+        rep->state = REPLICA_DISABLED;
+        rep->holding = 0;
+        return;
+    }
+    rep->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (rep->fd < 0) {
+        perror("Socket creation error");
+        rep->reconnect_at_us = monotonic_us() + rep->reconnect_delay_us;
+        return;
+    }
+    fcntl(rep->fd, F_SETFL, O_NONBLOCK);
+    rep->state = REPLICA_CONNECTING;
+    rep->connect_deadline_us = monotonic_us() + CONNECT_TIMEOUT_MS * 1000LL;
+    if (connect(rep->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        pthread_mutex_lock(ctx->lock);
+        replica_failed(rep, strerror(errno));
+        pthread_mutex_unlock(ctx->lock);
+    }
+}
+
+/**
+ * @brief Once a replica connection is up, sends both handshake requests at once: MSG_HELLO (the replica must accept
+ * the coding the frames in the history already have) and MSG_RESUME. The answers are read by replica_handshake()
+ * as they come, so a replica that is slow to answer never blocks capture.
+ */
+static void replica_established(const struct replica_context *ctx, struct replica *rep) {
+    uint8_t request[2 * sizeof(int) + sizeof(struct hello) + sizeof(struct resume)];
+    struct hello hello;
+    struct resume resume;
+    size_t length = 0;
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    int msg;
+
+    if (getsockopt(rep->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+        pthread_mutex_lock(ctx->lock);
+        replica_failed(rep, strerror(error ? error : errno));
+        pthread_mutex_unlock(ctx->lock);
+        return;
+    }
+
+    rep->compression = ctx->compression();
+    if (rep->compression != 0) {
+        memset(&hello, 0, sizeof(hello));
+        hello.version = PROTOCOL_VERSION;
+        hello.camera_id = ctx->camera_id;
+        hello.compression = rep->compression;
+        msg = MSG_HELLO;
+        memcpy(request + length, &msg, sizeof(msg));
+        memcpy(request + length + sizeof(msg), &hello, sizeof(hello));
+        length += sizeof(msg) + sizeof(hello);
+    }
+    memset(&resume, 0, sizeof(resume));
+    resume.session = ctx->session;
+    resume.camera_id = ctx->camera_id;
+    msg = MSG_RESUME;
+    memcpy(request + length, &msg, sizeof(msg));
+    memcpy(request + length + sizeof(msg), &resume, sizeof(resume));
+    length += sizeof(msg) + sizeof(resume);
+
+    /* A fresh socket always has room for a few dozen bytes. */
+    if (send(rep->fd, request, length, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)length) {
+        pthread_mutex_lock(ctx->lock);
+        replica_failed(rep, "handshake not sent");
+        pthread_mutex_unlock(ctx->lock);
+        return;
+    }
+    rep->state = REPLICA_HANDSHAKE;
+    rep->reply_len = (rep->compression != 0 ? sizeof(struct hello_reply) : 0) + sizeof(struct resume_reply);
+    rep->reply_received = 0;
+    rep->connect_deadline_us = monotonic_us() + HANDSHAKE_TIMEOUT_S * 1000000LL;
+}
+
+/**
+ * @brief Reads the handshake answers of a replica. Once both are in, streaming resumes after the last frame the
+ * replica stored. If that frame is no longer in the history, the replica restarts at the next keyframe, as a delta
+ * frame is useless without the frame before it.
+ */
+static void replica_handshake(const struct replica_context *ctx, struct replica *rep) {
+    struct hello_reply hello_reply;
+    struct resume_reply reply;
+
+    ssize_t got = recv(rep->fd, rep->reply + rep->reply_received, rep->reply_len - rep->reply_received, MSG_DONTWAIT);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        pthread_mutex_lock(ctx->lock);
+        replica_failed(rep, got == 0 ? "closed during the handshake" : strerror(errno));
+        pthread_mutex_unlock(ctx->lock);
+        return;
+    }
+    if (got < 0 || (rep->reply_received += got) < rep->reply_len)
+        return;
+
+    pthread_mutex_lock(ctx->lock);
+    if (rep->compression != 0) {
+        memcpy(&hello_reply, rep->reply, sizeof(hello_reply));
+        if ((hello_reply.compression & rep->compression) != rep->compression) {
+            fprintf(stderr, "[REPLICA] %s:%d does not accept the compression of the stream; replica disabled.\n",
+                    rep->host, rep->port);
+            close(rep->fd);
+            rep->fd = -1;
+            rep->state = REPLICA_DISABLED;
+            rep->holding = 0;
+            ctx->trim();
+            pthread_mutex_unlock(ctx->lock);
+            return;
+        }
+    }
+    memcpy(&reply, rep->reply + rep->reply_len - sizeof(reply), sizeof(reply));
+
+    long found = reply.status != RESUME_NONE ? ctx->find(reply.session, reply.sequence, reply.capture_us) : -1;
+    unsigned int first = found >= 0 ? (unsigned int)found + 1 : 0;
+    if (found < 0 && reply.status != RESUME_NONE && reply.session == ctx->session) {
+        rep->gaps++;
+        fprintf(stderr, "[REPLICA] %s:%d holds frame %llu, no longer in the history; frames are missing there.\n",
+                rep->host, rep->port, (unsigned long long)reply.sequence);
+    }
+    rep->need_keyframe = found < 0;
+    rep->next = rep->acked = *ctx->history_first + first;
+    rep->prefix_len = rep->offset = 0;
+    rep->ack_received = 0;
+    rep->holding = 1;
+    rep->state = REPLICA_STREAMING;
+    rep->reconnect_delay_us = RECONNECT_MIN_MS * 1000LL;
+    ctx->trim();
+    unsigned int pending = (unsigned int)(*ctx->history_first + ctx->history->count - rep->next);
+    pthread_mutex_unlock(ctx->lock);
+    printf("[REPLICA] Streaming to %s:%d, %u frames of the history to send first.\n", rep->host,
+           rep->port, pending);
+}
+
+/**
+ * @brief Sends a replica the frames of the history it has not had yet, as far as its socket takes them without
+ * blocking. The frame in progress is resumed where the previous call stopped. Called with the history lock held.
+ */
+static void replica_pump(const struct replica_context *ctx, struct replica *rep) {
+    while (rep->next < *ctx->history_first + ctx->history->count) {
+        /* The history evicted a frame this replica was still sending: its stream cannot be completed. */
+        if (rep->next < *ctx->history_first) {
+            replica_failed(rep, "fell out of the resend history");
+            return;
+        }
+        const struct ring_entry *entry = ring_at(ctx->history, (unsigned int)(rep->next - *ctx->history_first));
+        if (rep->prefix_len == 0 && rep->need_keyframe && entry->header.compression == COMPRESSION_LZ_XOR) {
+            if (rep->acked == rep->next)
+                rep->acked++; // Nothing to wait for: the frame is not sent
+            rep->next++;
+            continue;
+        }
+        rep->need_keyframe = 0;
+        if (rep->prefix_len == 0) {
+            rep->prefix_len = ctx->message_prefix(&entry->header, (long)entry->header.size, rep->prefix);
+            rep->offset = 0;
+        }
+
+        ssize_t sent = ring_send_part(ctx->history, rep->fd, entry, rep->prefix, rep->prefix_len, rep->offset);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                replica_failed(rep, strerror(errno));
+            return;
+        }
+        rep->offset += sent;
+        if (rep->offset < rep->prefix_len + entry->header.size)
+            return;
+        rep->next++;
+        rep->prefix_len = 0;
+        rep->frames_sent++;
+    }
+}
+
+/**
+ * @brief Reads the acknowledgements a replica sent so far; acknowledged frames stop being held for it.
+ * Called with the history lock held.
+ */
+static void replica_read_acks(const struct replica_context *ctx, struct replica *rep) {
+    for (;;) {
+        ssize_t got = recv(rep->fd, rep->ack_buffer + rep->ack_received, sizeof(rep->ack_buffer) - rep->ack_received,
+                           MSG_DONTWAIT);
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            replica_failed(rep, got == 0 ? "closed by the server" : strerror(errno));
+            return;
+        }
+        if (got < 0)
+            return;
+        rep->ack_received += got;
+        if (rep->ack_received < sizeof(rep->ack_buffer))
+            continue;
+        rep->ack_received = 0;
+
+        struct frame_ack ack;
+        memcpy(&ack, rep->ack_buffer, sizeof(ack));
+        long found = ctx->find(ack.session, ack.sequence, ack.capture_us);
+        if (found >= 0 && *ctx->history_first + found + 1 > rep->acked) {
+            rep->acked = *ctx->history_first + found + 1;
+            ctx->trim();
+        }
+    }
+}
+
+/**
+ * @brief Declares a replica dead when the oldest frame it has not acknowledged was sent to the primary server more
+ * than ctx->max_lag_ms ago: from then on the history no longer keeps frames for it, so a slow or unreachable
+ * replica never holds back the primary stream. Called with the history lock held.
+ */
+static void replica_check_lag(const struct replica_context *ctx, struct replica *rep) {
+    uint64_t oldest = rep->acked > *ctx->history_first ? rep->acked : *ctx->history_first;
+
+    if (!rep->holding || oldest >= *ctx->history_first + ctx->history->count)
+        return;
+    const struct ring_entry *entry = ring_at(ctx->history, (unsigned int)(oldest - *ctx->history_first));
+    int64_t lag = monotonic_us() - ctx->sent_us[entry - ctx->history->entries];
+    if (lag > rep->lag_longest_us)
+        rep->lag_longest_us = lag;
+    if (lag <= ctx->max_lag_ms * 1000LL)
+        return;
+    fprintf(stderr, "[REPLICA] %s:%d is %lld ms behind; declared dead, the stream goes on without it.\n",
+            rep->host, rep->port, (long long)(lag / 1000));
+    rep->holding = 0;
+    rep->deaths++;
+    if (rep->state != REPLICA_IDLE)
+        replica_failed(rep, "declared dead");
+    ctx->trim();
+}
+
+int replicas_fds(struct replica_set *set, fd_set *readable, fd_set *writable, int nfds, int *busy) {
+    const struct replica_context *ctx = &set->ctx;
+
+    for (int i = 0; i < set->count; i++) {
+        struct replica *rep = &set->replicas[i];
+        if (rep->state == REPLICA_DISABLED)
+            continue;
+        if (rep->state != REPLICA_STREAMING || rep->holding)
+            *busy = 1;
+        if (rep->fd < 0)
+            continue;
+        if (rep->state == REPLICA_CONNECTING ||
+            (rep->state == REPLICA_STREAMING && rep->next < *ctx->history_first + ctx->history->count))
+            FD_SET(rep->fd, writable);
+        if (rep->state == REPLICA_HANDSHAKE || rep->state == REPLICA_STREAMING)
+            FD_SET(rep->fd, readable);
+        if (rep->fd >= nfds)
+            nfds = rep->fd + 1;
+    }
+    return nfds;
+}
+
+void replicas_poll(struct replica_set *set, const fd_set *readable, const fd_set *writable) {
+    const struct replica_context *ctx = &set->ctx;
+
+    for (int i = 0; i < set->count; i++) {
+        struct replica *rep = &set->replicas[i];
+        if (rep->state == REPLICA_IDLE && monotonic_us() >= rep->reconnect_at_us) {
+            replica_connect(ctx, rep);
+        } else if (rep->state == REPLICA_CONNECTING || rep->state == REPLICA_HANDSHAKE) {
+            if (rep->state == REPLICA_CONNECTING && writable != NULL && FD_ISSET(rep->fd, writable))
+                replica_established(ctx, rep);
+            else if (rep->state == REPLICA_HANDSHAKE && readable != NULL && FD_ISSET(rep->fd, readable))
+                replica_handshake(ctx, rep);
+            else if (monotonic_us() >= rep->connect_deadline_us) {
+                pthread_mutex_lock(ctx->lock);
+                replica_failed(rep, rep->state == REPLICA_CONNECTING ? "timed out" : "no answer to the handshake");
+                pthread_mutex_unlock(ctx->lock);
+            }
+        }
+        if (rep->state == REPLICA_DISABLED)
+            continue;
+        pthread_mutex_lock(ctx->lock);
+        if (rep->state == REPLICA_STREAMING && readable != NULL && FD_ISSET(rep->fd, readable))
+            replica_read_acks(ctx, rep);
+        if (rep->state == REPLICA_STREAMING)
+            replica_pump(ctx, rep);
+        replica_check_lag(ctx, rep);
+        pthread_mutex_unlock(ctx->lock);
+    }
+}
+
+void replicas_drain(struct replica_set *set) {
+    const struct replica_context *ctx = &set->ctx;
+    int64_t deadline_us = monotonic_us() + ctx->max_lag_ms * 1000LL;
+
+    for (;;) {
+        fd_set readable, writable;
+        int busy = 0, pending = 0;
+        pthread_mutex_lock(ctx->lock);
+        for (int i = 0; i < set->count; i++)
+            if (set->replicas[i].state != REPLICA_DISABLED && set->replicas[i].holding &&
+                set->replicas[i].acked < *ctx->history_first + ctx->history->count)
+                pending++;
+        pthread_mutex_unlock(ctx->lock);
+        if (pending == 0 || monotonic_us() >= deadline_us)
+            break;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        int nfds = replicas_fds(set, &readable, &writable, 0, &busy);
+        struct timeval tv = { 0, REPLICA_POLL_MS * 1000 };
+        if (select(nfds, &readable, &writable, NULL, &tv) < 0 && errno != EINTR)
+            break;
+        replicas_poll(set, &readable, &writable);
+    }
+    for (int i = 0; i < set->count; i++) {
+        struct replica *rep = &set->replicas[i];
+        if (rep->state != REPLICA_DISABLED && rep->holding && rep->acked < *ctx->history_first + ctx->history->count)
+            fprintf(stderr, "[REPLICA] %s:%d has not acknowledged %llu frames at exit.\n", rep->host,
+                    rep->port, (unsigned long long)(*ctx->history_first + ctx->history->count - rep->acked));
+        if (rep->fd >= 0)
+            close(rep->fd);
+        rep->fd = -1;
+    }
+}
+
+int replica_add(struct replica_set *set, const char *address) {
+    const char *colon = strrchr(address, ':');
+
+    if (set->count == MAX_REPLICAS || colon == NULL || colon - address >= (long)sizeof(set->replicas[0].host) ||
+        atoi(colon + 1) <= 0)
+        return -1;
+    struct replica *rep = &set->replicas[set->count++];
+    memcpy(rep->host, address, colon - address);
+    rep->host[colon - address] = '\0';
+    rep->port = atoi(colon + 1);
+    return 0;
+}
+
+void replicas_start(struct replica_set *set) {
+    for (int i = 0; i < set->count; i++) {
+        struct replica *rep = &set->replicas[i];
+        rep->fd = -1;
+        rep->state = REPLICA_IDLE;
+        rep->holding = 1;
+        rep->acked = *set->ctx.history_first;
+        rep->reconnect_delay_us = RECONNECT_MIN_MS * 1000LL;
+        replica_connect(&set->ctx, rep);
+    }
+    for (;;) {
+        fd_set readable, writable;
+        int busy = 0, waiting = 0;
+        for (int i = 0; i < set->count; i++)
+            if (set->replicas[i].state == REPLICA_CONNECTING || set->replicas[i].state == REPLICA_HANDSHAKE)
+                waiting = 1;
+        if (!waiting)
+            break;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        int nfds = replicas_fds(set, &readable, &writable, 0, &busy);
+        struct timeval tv = { 0, REPLICA_POLL_MS * 1000 };
+        if (select(nfds, &readable, &writable, NULL, &tv) <= 0) {
+            FD_ZERO(&readable);
+            FD_ZERO(&writable);
+        }
+        replicas_poll(set, &readable, &writable);
+    }
+}
+
+uint64_t replicas_acked(const struct replica_set *set, uint64_t keep) {
+    for (int i = 0; i < set->count; i++)
+        if (set->replicas[i].holding && set->replicas[i].acked < keep)
+            keep = set->replicas[i].acked;
+    return keep;
+}
+
+void replicas_report(const struct replica_set *set) {
+    for (int i = 0; i < set->count; i++)
+        printf("[INFO] Replica %s:%d: %ld frames sent, declared dead %ld times, %ld resumed with a gap, longest lag "
+               "%.0f ms.\n", set->replicas[i].host, set->replicas[i].port, set->replicas[i].frames_sent,
+               set->replicas[i].deaths, set->replicas[i].gaps, set->replicas[i].lag_longest_us / 1e3);
+}
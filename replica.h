@@ -0,0 +1,123 @@
+/**
+ * @file replica.h
+ * @brief Replication fan-out: every frame sent to the primary server also goes to a few replica servers.
+ *
+ * Each replica is sent the frames from the copy in the client's resend history, on a non-blocking connection of its
+ * own driven from the capture loop, so a replica that is slow or gone never delays capture or the primary stream.
+ * While a replica holds the history, frames stay there until it acknowledges them; a replica that lags more than
+ * max_lag_ms behind is declared dead and holds nothing until it is back. After a reconnection it resumes after the
+ * last frame it stored, as the primary server does.
+ */
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include "protocol.h"
+#include "ring.h"
+
+/* Most replica servers. */
+#define MAX_REPLICAS 4
+
+enum replica_state { REPLICA_IDLE, REPLICA_CONNECTING, REPLICA_HANDSHAKE, REPLICA_STREAMING, REPLICA_DISABLED };
+
+/* One replica server and its progress through the history. */
+struct replica {
+    char host[64];
+    int port;
+    int fd;
+    int state;
+    int holding;                // Frames stay in the history until this replica acknowledges them
+    int need_keyframe;          // Delta frames are skipped until the next keyframe (after a gap)
+    int64_t connect_deadline_us, reconnect_at_us, reconnect_delay_us;
+    uint32_t compression;       // Compression methods the replica must accept (0: no negotiation)
+    uint8_t reply[sizeof(struct hello_reply) + sizeof(struct resume_reply)]; // Handshake answers, as they arrive
+    size_t reply_len, reply_received;
+    uint64_t next;              // Number of the next frame to send
+    uint8_t prefix[sizeof(int) + sizeof(struct frame_header) + 64]; // Message type, header and filename of that frame
+    size_t prefix_len;          // 0 until the frame is started
+    size_t offset;              // Bytes of its message already sent
+    uint64_t acked;             // Number of the first frame not acknowledged
+    uint8_t ack_buffer[sizeof(struct frame_ack)];
+    size_t ack_received;
+    long frames_sent, deaths, gaps;
+    int64_t lag_longest_us;
+};
+
+/* What the replicas need from the client: its resend history and the stream they replicate. Frames are numbered from
+   the start of the run; the history holds the frames *history_first to *history_first + history->count - 1. Every
+   access to the history is made with lock held, and the callbacks are called with it held. */
+struct replica_context {
+    struct frame_ring *history;
+    const uint64_t *history_first;
+    const int64_t *sent_us;     // Time each entry of the history was sent to the primary server, by entry slot
+    pthread_mutex_t *lock;
+    uint64_t session;
+    uint32_t camera_id;
+    int max_lag_ms;             // Lag after which a replica is declared dead
+    /* Compression methods the frames of the history are coded with, which a replica must accept. */
+    uint32_t (*compression)(void);
+    /* Drops the frames no holder of the history needs any more (see replicas_acked()). */
+    void (*trim)(void);
+    /* Position in the history of the frame a server reported it stored, or -1. */
+    long (*find)(uint64_t session, uint64_t sequence, int64_t capture_us);
+    /* Writes the message type, header and filename of a frame, returns their length. */
+    size_t (*message_prefix)(const struct frame_header *meta, long file_size, uint8_t *out);
+};
+
+/* Zero-initialize before first use, then fill ctx before replicas_start(). */
+struct replica_set {
+    struct replica replicas[MAX_REPLICAS];
+    int count;
+    struct replica_context ctx;
+};
+
+/**
+ * @brief Adds a replica given as address:port.
+ * @return 0 on success, -1 if the address is malformed or the set is full.
+ */
+int replica_add(struct replica_set *set, const char *address);
+
+/**
+ * @brief Connects to the replicas, giving them the chance to be there for the first frame: returns once each one
+ * streams or failed. Those that failed keep being retried by replicas_poll().
+ */
+void replicas_start(struct replica_set *set);
+
+/**
+ * @brief Returns the number of the first frame some replica still holding the history has not acknowledged, or keep
+ * if they all acknowledged it. Called with the history lock held.
+ */
+uint64_t replicas_acked(const struct replica_set *set, uint64_t keep);
+
+/**
+ * @brief Adds the replica sockets to the sets of a select(): connections in progress and replicas with frames to send
+ * wait for writability, streaming replicas for acknowledgements.
+ * @param busy Set when a replica needs attention without any socket event (reconnection, lag check).
+ * @return The new nfds.
+ */
+int replicas_fds(struct replica_set *set, fd_set *readable, fd_set *writable, int nfds, int *busy);
+
+/**
+ * @brief Keeps the replicas going: reconnects, completes connections, reads acknowledgements, sends pending frames
+ * and checks the lag. Sending is attempted whatever select() reported, as frames may have arrived since.
+ * @param readable, writable Sets select() returned, or NULL when it timed out.
+ */
+void replicas_poll(struct replica_set *set, const fd_set *readable, const fd_set *writable);
+
+/**
+ * @brief Lets the replicas catch up before the client exits: they keep being polled until each one that still holds
+ * the history has acknowledged all of it, or for max_lag_ms at most, when the lag check would declare the late ones
+ * dead anyway. Their connections are closed afterwards.
+ */
+void replicas_drain(struct replica_set *set);
+
+/**
+ * @brief Prints the statistics of each replica.
+ */
+void replicas_report(const struct replica_set *set);
+
+#endif
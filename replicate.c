@@ -0,0 +1,484 @@
+/**
+ * @file replicate.c
+ * @brief Replication to a peer server. Stored frames wait in a queue until the peer acknowledges them; a single thread
+ * sends them with sendfile() over one connection and reads the acknowledgements.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+#include "replicate.h"
+
+/* Highest camera identifier replicated (exclusive), as in the server. */
+#define MAX_CAMERAS 256
+/* Reconnection delay: doubled after every failed attempt, from the first value up to the second (ms). */
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 10000
+/* A send to the peer that makes no progress for this long (s) is taken as a dead connection. */
+#define SEND_TIMEOUT_S 5
+/* Compression methods offered to the peer: stored frames are sent exactly as they were received. */
+#define REPLICATED_COMPRESSION ((1u << COMPRESSION_LZ) | (1u << COMPRESSION_LZ_DELTA) | (1u << COMPRESSION_LZ_XOR))
+
+enum job_state { JOB_QUEUED, JOB_SENT, JOB_DONE };
+
+struct job {
+    struct frame_header header;
+    char name[128];             // Name the frame is stored under, here and on the peer
+    char source[128];           // File holding the payload
+    int64_t stored_us;          // Time the frame was stored here, the start of its replication lag
+    enum job_state state;
+};
+
+/* Last frame of a camera the peer is known to hold. */
+struct camera_mark {
+    int valid;
+    uint64_t session;
+    uint64_t sequence;
+    int64_t capture_us;
+};
+
+/* Jobs are numbered from the start: [head, next) were sent (or are done), [next, tail) wait to be sent. */
+static struct job *queue;
+static unsigned long long queue_head, queue_next, queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static struct sockaddr_in peer_address;
+static char peer_name[80];
+static int enabled;
+static int connected;
+static uint32_t peer_compression;           // Methods the peer accepted on the current connection
+static struct camera_mark acked[MAX_CAMERAS];
+static uint8_t need_keyframe[MAX_CAMERAS];   // Frames of the camera were lost: delta frames are skipped until a keyframe
+static uint8_t resumed[MAX_CAMERAS];         // MSG_RESUME was sent for the camera on the current connection
+static struct replication_status stats;
+
+static int64_t now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Gives up a job that will never reach the peer. Called with the queue locked. */
+static void drop_job(struct job *job) {
+    stats.dropped++;
+    stats.pending_frames--;
+    stats.pending_bytes -= job->header.size;
+    need_keyframe[job->header.camera_id] = 1;
+    job->state = JOB_DONE;
+}
+
+/* Marks a job acknowledged by the peer. Called with the queue locked. */
+static void complete_job(struct job *job) {
+    struct camera_mark *mark = &acked[job->header.camera_id];
+    int64_t lag = now_us() - job->stored_us;
+
+    stats.frames++;
+    stats.pending_frames--;
+    stats.pending_bytes -= job->header.size;
+    if (lag > stats.lag_max_us)
+        stats.lag_max_us = lag;
+    mark->valid = 1;
+    mark->session = job->header.session;
+    mark->sequence = job->header.sequence;
+    mark->capture_us = job->header.capture_us;
+    job->state = JOB_DONE;
+}
+
+/* Moves the head past the jobs that are done. Called with the queue locked. */
+static void advance_head(void) {
+    while (queue_head < queue_tail && queue[queue_head % REPLICATION_QUEUE].state == JOB_DONE)
+        queue_head++;
+    if (queue_next < queue_head)
+        queue_next = queue_head;
+}
+
+void replication_submit(const struct frame_header *header, const char *name, const char *source) {
+    if (!enabled || header->camera_id >= MAX_CAMERAS)
+        return;
+    pthread_mutex_lock(&queue_lock);
+    /* The peer has been away for too long: its copy gets a gap rather than the server running out of memory. */
+    if (queue_tail - queue_head == REPLICATION_QUEUE) {
+        struct job *oldest = &queue[queue_head % REPLICATION_QUEUE];
+        if (oldest->state != JOB_DONE)
+            drop_job(oldest);
+        advance_head();
+    }
+    struct job *job = &queue[queue_tail % REPLICATION_QUEUE];
+    job->header = *header;
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    snprintf(job->source, sizeof(job->source), "%s", source);
+    job->stored_us = now_us();
+    job->state = JOB_QUEUED;
+    queue_tail++;
+    stats.pending_frames++;
+    stats.pending_bytes += header->size;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void replication_status(struct replication_status *status) {
+    pthread_mutex_lock(&queue_lock);
+    *status = stats;
+    status->enabled = enabled;
+    status->connected = connected;
+    status->lag_us = 0;
+    if (queue_head < queue_tail) {
+        status->lag_us = now_us() - queue[queue_head % REPLICATION_QUEUE].stored_us;
+        if (status->lag_us > status->lag_max_us)
+            status->lag_max_us = status->lag_us;
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* Receives exactly len bytes on the blocking socket. */
+static int recv_exact(int sock, void *data, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t r = recv(sock, (char *)data + received, len - received, 0);
+        if (r <= 0) return -1;
+        received += r;
+    }
+    return 0;
+}
+
+/* Connects to the peer and announces the connection as replication (MSG_HELLO with HELLO_REPLICATED). */
+static int peer_connect(void) {
+    struct hello hello;
+    struct hello_reply reply;
+    struct timeval timeout = { SEND_TIMEOUT_S, 0 };
+    int msg = MSG_HELLO;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("[REPLICATION] Socket creation failed");
+        return -1;
+    }
+    /* Also bounds the wait for the hello reply, so a peer that accepts but never answers is not waited for forever. */
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, (struct sockaddr *)&peer_address, sizeof(peer_address)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    memset(&hello, 0, sizeof(hello));
+    hello.version = PROTOCOL_VERSION;
+    hello.compression = REPLICATED_COMPRESSION;
+    hello.flags = HELLO_REPLICATED;
+    if (send(sock, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) ||
+        send(sock, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) || recv_exact(sock, &reply, sizeof(reply)) < 0) {
+        close(sock);
+        return -1;
+    }
+    peer_compression = reply.compression;
+    return sock;
+}
+
+/**
+ * @brief Asks the peer for the last frame it holds of a camera (MSG_RESUME) and marks the frames up to it as done.
+ * The reply cannot be told apart from acknowledgements, so this is only called when no frame is in flight.
+ * If the peer's last frame is neither in the queue nor the last one it acknowledged, its copy has a gap (frames were
+ * dropped here, or the peer lost some): delta frames are then skipped until the next keyframe.
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int resume_camera(int sock, uint32_t camera_id) {
+    struct resume req;
+    struct resume_reply reply;
+    int msg = MSG_RESUME;
+
+    memset(&req, 0, sizeof(req));
+    req.camera_id = camera_id;
+    if (send(sock, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) ||
+        send(sock, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) || recv_exact(sock, &reply, sizeof(reply)) < 0)
+        return -1;
+
+    pthread_mutex_lock(&queue_lock);
+    resumed[camera_id] = 1;
+    struct camera_mark *mark = &acked[camera_id];
+    unsigned long long found = queue_tail;
+    for (unsigned long long i = queue_head; reply.status != RESUME_NONE && i < queue_tail; i++) {
+        const struct frame_header *h = &queue[i % REPLICATION_QUEUE].header;
+        if (h->camera_id == camera_id && h->sequence == reply.sequence && h->capture_us == reply.capture_us &&
+            (reply.session == 0 || h->session == reply.session))
+            found = i;
+    }
+    if (found < queue_tail) {
+        /* The peer already stored these frames, before a connection broke or from the camera itself. */
+        for (unsigned long long i = queue_head; i <= found; i++) {
+            struct job *job = &queue[i % REPLICATION_QUEUE];
+            if (job->state != JOB_DONE && job->header.camera_id == camera_id)
+                complete_job(job);
+        }
+        need_keyframe[camera_id] = 0;
+        advance_head();
+    } else if (mark->valid && (reply.status == RESUME_NONE || reply.sequence != mark->sequence ||
+                               reply.capture_us != mark->capture_us)) {
+        printf("[REPLICATION] Peer %s is missing frames of camera %u; resuming at the next keyframe.\n", peer_name, camera_id);
+        need_keyframe[camera_id] = 1;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+/**
+ * @brief Sends one stored frame as MSG_FRAME. The payload goes from the file to the socket with sendfile(), without
+ * being copied through this process. The size comes from the open file: the optimizer may have replaced the frame
+ * with a smaller version since it was queued, and the descriptor keeps whichever version it opened.
+ * @return 0 on success, 1 if the file is gone, -1 if the connection failed.
+ */
+static int send_job(int sock, const struct job *job) {
+    struct frame_header header = job->header;
+    struct stat st;
+    uint8_t prefix[sizeof(int) + sizeof(header) + sizeof(job->name)];
+    int msg = MSG_FRAME;
+
+    int fd = open(job->source, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return 1;
+    }
+    header.size = st.st_size;
+    header.name_len = strlen(job->name);
+    header.order = 0; // Frames of a striped stream were stored in order here; the peer stores them as they arrive
+    memcpy(prefix, &msg, sizeof(msg));
+    memcpy(prefix + sizeof(msg), &header, sizeof(header));
+    memcpy(prefix + sizeof(msg) + sizeof(header), job->name, header.name_len);
+    size_t prefix_len = sizeof(msg) + sizeof(header) + header.name_len;
+
+    /* MSG_MORE keeps the prefix in the socket until the payload follows, so small frames leave in one segment. */
+    int result = send(sock, prefix, prefix_len, MSG_NOSIGNAL | MSG_MORE) == (ssize_t)prefix_len ? 0 : -1;
+    off_t offset = 0;
+    while (result == 0 && offset < st.st_size) {
+        ssize_t n = sendfile(sock, fd, &offset, st.st_size - offset);
+        if (n <= 0) {
+            /* A shorter file was truncated behind our back; the stream cannot be completed. */
+            if (n < 0)
+                perror("[REPLICATION] Error sending frame to peer");
+            result = -1;
+        }
+    }
+    close(fd);
+    if (result == 0) {
+        pthread_mutex_lock(&queue_lock);
+        stats.bytes += st.st_size;
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return result;
+}
+
+/**
+ * @brief Processes the acknowledgements that have arrived, without waiting for more.
+ * The peer stores the frames of the connection in order, so an acknowledgement also covers every frame sent before it.
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int read_acks(int sock, struct frame_ack *buffer, size_t *have) {
+    while (1) {
+        ssize_t r = recv(sock, (uint8_t *)buffer + *have, sizeof(*buffer) - *have, MSG_DONTWAIT);
+        if (r == 0) return -1;
+        if (r < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        *have += r;
+        if (*have < sizeof(*buffer)) continue;
+        *have = 0;
+
+        pthread_mutex_lock(&queue_lock);
+        for (unsigned long long i = queue_head; i < queue_next; i++) {
+            const struct job *job = &queue[i % REPLICATION_QUEUE];
+            if (job->state == JOB_SENT && job->header.session == buffer->session &&
+                job->header.sequence == buffer->sequence && job->header.capture_us == buffer->capture_us) {
+                for (unsigned long long j = queue_head; j <= i; j++)
+                    if (queue[j % REPLICATION_QUEUE].state == JOB_SENT)
+                        complete_job(&queue[j % REPLICATION_QUEUE]);
+                break;
+            }
+        }
+        advance_head();
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
+
+/* Frames sent on the current connection and not acknowledged yet. Called with the queue locked. */
+static int in_flight(void) {
+    int count = 0;
+    for (unsigned long long i = queue_head; i < queue_next; i++)
+        if (queue[i % REPLICATION_QUEUE].state == JOB_SENT)
+            count++;
+    return count;
+}
+
+/**
+ * @brief Streams the queue to the peer until the connection fails.
+ * Each turn reads the acknowledgements, then sends the next frame if the window allows it, or waits for either a new
+ * frame or an acknowledgement.
+ */
+static void stream_to_peer(int sock) {
+    struct frame_ack ack_buffer;
+    size_t ack_have = 0;
+    struct job job;
+
+    while (read_acks(sock, &ack_buffer, &ack_have) == 0) {
+        pthread_mutex_lock(&queue_lock);
+        int flight = in_flight();
+        /* Frames acknowledged by a resume, and delta frames that cannot be decoded after a gap, are passed over. */
+        while (queue_next < queue_tail) {
+            struct job *next = &queue[queue_next % REPLICATION_QUEUE];
+            if (next->state == JOB_DONE) {
+                queue_next++;
+            } else if (next->header.compression == COMPRESSION_LZ_XOR && need_keyframe[next->header.camera_id]) {
+                drop_job(next);
+                queue_next++;
+            } else if (next->header.compression != COMPRESSION_NONE && !(peer_compression & (1u << next->header.compression))) {
+                printf("[REPLICATION] Peer %s does not accept compression method %u; frame %s not replicated.\n",
+                       peer_name, next->header.compression, next->name);
+                drop_job(next);
+                queue_next++;
+            } else {
+                break;
+            }
+        }
+        advance_head();
+
+        if (queue_next == queue_tail || flight >= REPLICATION_WINDOW) {
+            /* Nothing to send: waits for a new frame, or for acknowledgements while frames are in flight. */
+            if (flight == 0) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 1;
+                if (queue_next == queue_tail)
+                    pthread_cond_timedwait(&queue_ready, &queue_lock, &deadline);
+                pthread_mutex_unlock(&queue_lock);
+            } else {
+                pthread_mutex_unlock(&queue_lock);
+                struct pollfd pfd = { sock, POLLIN, 0 };
+                poll(&pfd, 1, queue_next == queue_tail ? 100 : 1000);
+            }
+            continue;
+        }
+
+        job = queue[queue_next % REPLICATION_QUEUE];
+        uint32_t camera_id = job.header.camera_id;
+        if (!resumed[camera_id]) {
+            /* First frame of the camera on this connection: the peer says where its copy stands, once nothing is in flight. */
+            pthread_mutex_unlock(&queue_lock);
+            if (flight > 0) {
+                struct pollfd pfd = { sock, POLLIN, 0 };
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            if (resume_camera(sock, camera_id) < 0)
+                return;
+            continue;
+        }
+        if (job.header.compression != COMPRESSION_LZ_XOR)
+            need_keyframe[camera_id] = 0;
+        queue[queue_next % REPLICATION_QUEUE].state = JOB_SENT;
+        queue_next++;
+        pthread_mutex_unlock(&queue_lock);
+
+        int result = send_job(sock, &job);
+        if (result < 0)
+            return;
+        if (result > 0) {
+            /* The file was removed (or replaced and removed) before it could be sent. */
+            pthread_mutex_lock(&queue_lock);
+            for (unsigned long long i = queue_head; i < queue_next; i++) {
+                struct job *sent = &queue[i % REPLICATION_QUEUE];
+                if (sent->state == JOB_SENT && sent->header.sequence == job.header.sequence &&
+                    sent->header.session == job.header.session && sent->header.camera_id == camera_id)
+                    drop_job(sent);
+            }
+            advance_head();
+            pthread_mutex_unlock(&queue_lock);
+        }
+    }
+}
+
+static void *replication_thread(void *arg) {
+    int delay_ms = RECONNECT_MIN_MS;
+    (void)arg;
+
+    while (1) {
+        int sock = peer_connect();
+        if (sock < 0) {
+            usleep(delay_ms * 1000);
+            delay_ms = delay_ms * 2 > RECONNECT_MAX_MS ? RECONNECT_MAX_MS : delay_ms * 2;
+            continue;
+        }
+        delay_ms = RECONNECT_MIN_MS;
+
+        /* Frames sent on an earlier connection without an acknowledgement are sent again, unless a resume shows the
+           peer has them. */
+        pthread_mutex_lock(&queue_lock);
+        for (unsigned long long i = queue_head; i < queue_next; i++)
+            if (queue[i % REPLICATION_QUEUE].state == JOB_SENT)
+                queue[i % REPLICATION_QUEUE].state = JOB_QUEUED;
+        queue_next = queue_head;
+        memset(resumed, 0, sizeof(resumed));
+        connected = 1;
+        pthread_mutex_unlock(&queue_lock);
+        printf("[REPLICATION] Connected to peer %s.\n", peer_name);
+
+        stream_to_peer(sock);
+
+        pthread_mutex_lock(&queue_lock);
+        connected = 0;
+        stats.reconnects++;
+        pthread_mutex_unlock(&queue_lock);
+        close(sock);
+        printf("[REPLICATION] Connection to peer %s lost; %llu frames pending.\n", peer_name,
+               (unsigned long long)stats.pending_frames);
+    }
+    return NULL;
+}
+
+int replication_start(const char *peer) {
+    pthread_t thread;
+    char host[64];
+
+    const char *colon = strrchr(peer, ':');
+    if (colon == NULL || colon - peer >= (long)sizeof(host) || atoi(colon + 1) <= 0) {
+        fprintf(stderr, "The peer must be given as address:port\n");
+        return -1;
+    }
+    memcpy(host, peer, colon - peer);
+    host[colon - peer] = '\0';
+    memset(&peer_address, 0, sizeof(peer_address));
+    peer_address.sin_family = AF_INET;
+    peer_address.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &peer_address.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid peer address %s\n", host);
+        return -1;
+    }
+    snprintf(peer_name, sizeof(peer_name), "%s", peer);
+
+    queue = calloc(REPLICATION_QUEUE, sizeof(*queue));
+    if (queue == NULL) {
+        perror("[REPLICATION] Queue allocation failed");
+        return -1;
+    }
+    /* Until the peer reports where its copy stands, its first frame of every camera must be a keyframe. */
+    memset(need_keyframe, 1, sizeof(need_keyframe));
+    enabled = 1;
+    if (pthread_create(&thread, NULL, replication_thread, NULL) != 0) {
+        perror("[REPLICATION] Thread creation failed");
+        enabled = 0;
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("[REPLICATION] Replicating stored frames to %s.\n", peer_name);
+    return 0;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file replicate.h
+ * @brief Asynchronous server-to-server replication: every frame stored here is copied to a peer server.
+ *
+ * A second copy made by the server costs no camera uplink bandwidth, unlike client fan-out. Once a frame is stored and
+ * indexed its file no longer changes, so it is queued and a background thread sends it to the peer with sendfile()
+ * as an ordinary MSG_FRAME, straight from the page cache. The peer stores and indexes it like any frame, with the
+ * activity score computed here, so its index follows this one. The peer acknowledges every frame (MSG_RESUME, then
+ * struct frame_ack); the age of the oldest unacknowledged frame is the replication lag.
+ */
+
+#ifndef REPLICATE_H
+#define REPLICATE_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+/* Frames waiting for the peer's acknowledgement; when the queue is full the oldest ones are given up. */
+#define REPLICATION_QUEUE 8192
+/* Frames sent to the peer and not yet acknowledged. */
+#define REPLICATION_WINDOW 256
+
+/**
+ * @brief Starts the replication thread, which connects to the peer (address:port) and keeps reconnecting.
+ * @return 0 on success, -1 if the address is invalid or the thread could not be created.
+ */
+int replication_start(const char *peer);
+
+/**
+ * @brief Queues a stored frame. Never blocks.
+ * @param header Frame as received (camera, sequence, coding), with the activity score of its index record.
+ * @param name Name the frame is stored under.
+ * @param source File holding the payload: the frame's own file, or the stored copy a duplicate refers to.
+ */
+void replication_submit(const struct frame_header *header, const char *name, const char *source);
+
+/**
+ * @brief Fills in the replication counters and the current lag.
+ */
+void replication_status(struct replication_status *status);
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * @file ring.c
+ * @brief Frame ring. Payloads are stored contiguously in a circular byte area; a frame that does not fit before the end wraps to offset 0.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "ring.h"
+
+int ring_init(struct frame_ring *ring, size_t capacity, unsigned int max_entries) {
+    memset(ring, 0, sizeof(*ring));
+
+    /* MAP_POPULATE faults every page in now, so capturing never pays for page faults and memory use is fixed from the start. */
+    ring->data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring->data == MAP_FAILED) {
+        ring->data = NULL;
+        return -1;
+    }
+    ring->entries = calloc(max_entries, sizeof(*ring->entries));
+    if (ring->entries == NULL) {
+        munmap(ring->data, capacity);
+        ring->data = NULL;
+        return -1;
+    }
+    ring->capacity = capacity;
+    ring->max_entries = max_entries;
+    return 0;
+}
+
+void ring_clear(struct frame_ring *ring) {
+    ring->head = ring->tail = 0;
+    ring->first = ring->count = 0;
+}
+
+void ring_drop_oldest(struct frame_ring *ring) {
+    if (ring->count == 0) return;
+    ring->first = (ring->first + 1) % ring->max_entries;
+    ring->count--;
+    if (ring->count == 0) ring_clear(ring);
+    else ring->tail = ring->entries[ring->first].offset;
+}
+
+void ring_drop_before(struct frame_ring *ring, int64_t capture_us) {
+    while (ring->count > 0 && ring->entries[ring->first].header.capture_us < capture_us)
+        ring_drop_oldest(ring);
+}
+
+/* Finds where a payload of the given size can be written without overwriting live entries. Returns -1 if eviction is needed. */
+static long find_space(const struct frame_ring *ring, size_t size) {
+    if (ring->count == 0) return 0;
+    if (ring->count == ring->max_entries) return -1;
+
+    if (ring->head > ring->tail) {
+        /* Live data occupies [tail, head): free space is after head, or before tail after wrapping. */
+        if (ring->capacity - ring->head >= size) return (long)ring->head;
+        if (ring->tail >= size) return 0;
+        return -1;
+    }
+    /* Wrapped: live data occupies [tail, end) and [0, head). */
+    return ring->tail - ring->head >= size ? (long)ring->head : -1;
+}
+
+int ring_push(struct frame_ring *ring, const void *frame, size_t size, const struct frame_header *header) {
+    struct iovec piece = { (void *)frame, size };
+    return ring_pushv(ring, &piece, 1, header);
+}
+
+int ring_pushv(struct frame_ring *ring, const struct iovec *pieces, int count, const struct frame_header *header) {
+    size_t size = 0;
+    long offset;
+
+    for (int i = 0; i < count; i++)
+        size += pieces[i].iov_len;
+    if (size == 0 || size > ring->capacity) return -1;
+    while ((offset = find_space(ring, size)) < 0)
+        ring_drop_oldest(ring);
+
+    uint8_t *out = ring->data + offset;
+    for (int i = 0; i < count; i++) {
+        memcpy(out, pieces[i].iov_base, pieces[i].iov_len);
+        out += pieces[i].iov_len;
+    }
+    struct ring_entry *entry = &ring->entries[(ring->first + ring->count) % ring->max_entries];
+    entry->header = *header;
+    entry->header.size = size;
+    entry->offset = (size_t)offset;
+    if (ring->count == 0) ring->tail = (size_t)offset;
+    ring->count++;
+    ring->head = (size_t)offset + size;
+    return 0;
+}
+
+const struct ring_entry *ring_at(const struct frame_ring *ring, unsigned int i) {
+    if (i >= ring->count) return NULL;
+    return &ring->entries[(ring->first + i) % ring->max_entries];
+}
+
+const void *ring_payload(const struct frame_ring *ring, const struct ring_entry *entry) {
+    return ring->data + entry->offset;
+}
+
+ssize_t ring_send_part(const struct frame_ring *ring, int fd, const struct ring_entry *entry, const uint8_t *prefix,
+                       size_t prefix_len, size_t offset) {
+    struct iovec iov[2];
+    struct msghdr message;
+    int pieces = 0;
+
+    if (offset < prefix_len) {
+        iov[pieces].iov_base = (uint8_t *)prefix + offset;
+        iov[pieces++].iov_len = prefix_len - offset;
+    }
+    size_t done = offset > prefix_len ? offset - prefix_len : 0;
+    iov[pieces].iov_base = ring->data + entry->offset + done;
+    iov[pieces++].iov_len = entry->header.size - done;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = pieces;
+    return sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
@@ -0,0 +1,82 @@
+/**
+ * @file ring.h
+ * @brief Bounded in-memory ring of recent frames. All memory is allocated up front; the oldest frames are evicted when space runs out.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "protocol.h"
+
+/* Location and metadata of one buffered frame. */
+struct ring_entry {
+    struct frame_header header; // Capture metadata (sequence, original capture time, activity), header.size is the payload size
+    size_t offset;              // Position of the payload in the data area
+};
+
+struct frame_ring {
+    uint8_t *data;          // Preallocated payload area
+    size_t capacity;
+    size_t head;            // Next write position
+    size_t tail;            // Payload offset of the oldest entry
+    struct ring_entry *entries;
+    unsigned int max_entries;
+    unsigned int first;     // Slot of the oldest entry
+    unsigned int count;
+};
+
+/**
+ * @brief Allocates and pre-faults the payload area (capacity bytes) and the entry table.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int ring_init(struct frame_ring *ring, size_t capacity, unsigned int max_entries);
+
+/**
+ * @brief Copies a frame into the ring, evicting the oldest frames until it fits.
+ * @return 0 on success, -1 if the frame is larger than the whole ring.
+ */
+int ring_push(struct frame_ring *ring, const void *frame, size_t size, const struct frame_header *header);
+
+/**
+ * @brief Same as ring_push() for a frame in several pieces (the planes of a multi-planar buffer), stored contiguously.
+ */
+int ring_pushv(struct frame_ring *ring, const struct iovec *pieces, int count, const struct frame_header *header);
+
+/**
+ * @brief Returns the i-th buffered entry (0 is the oldest), or NULL if out of range.
+ */
+const struct ring_entry *ring_at(const struct frame_ring *ring, unsigned int i);
+
+/**
+ * @brief Returns the payload of an entry.
+ */
+const void *ring_payload(const struct frame_ring *ring, const struct ring_entry *entry);
+
+/**
+ * @brief Sends the message of an entry (a prefix, then its payload) on a non-blocking socket, starting offset bytes in,
+ * as far as the socket takes it.
+ * @return The bytes sent, or -1 with errno set (EAGAIN when the socket is full).
+ */
+ssize_t ring_send_part(const struct frame_ring *ring, int fd, const struct ring_entry *entry, const uint8_t *prefix,
+                       size_t prefix_len, size_t offset);
+
+/**
+ * @brief Evicts the oldest entry.
+ */
+void ring_drop_oldest(struct frame_ring *ring);
+
+/**
+ * @brief Evicts all entries captured before the given time.
+ */
+void ring_drop_before(struct frame_ring *ring, int64_t capture_us);
+
+/**
+ * @brief Empties the ring without releasing its memory.
+ */
+void ring_clear(struct frame_ring *ring);
+
+#endif
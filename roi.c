@@ -0,0 +1,109 @@
+/**
+ * @file roi.c
+ * @brief Region-of-interest cropper: row copies for raw formats, block copies in the coefficient domain for MJPEG.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include "pixconv.h"
+#include "roi.h"
+
+int roi_align(uint32_t pixelformat, int width, int height, struct roi *r) {
+    int x1 = r->x + r->width, y1 = r->y + r->height;
+
+    if (r->x < 0) r->x = 0;
+    if (r->y < 0) r->y = 0;
+    if (x1 > width) x1 = width;
+    if (y1 > height) y1 = height;
+    if (pixelformat != V4L2_PIX_FMT_MJPEG && pixconv_frame_size(pixelformat, width, height) == 0) return -1;
+
+    /* Chroma is shared by pairs of columns (and of rows in 4:2:0), so the region keeps whole pairs: the origin
+       moves back to an even position and the size is rounded down to even. */
+    if (pixelformat != V4L2_PIX_FMT_MJPEG) {
+        int planar = pixelformat == V4L2_PIX_FMT_NV12 || pixelformat == V4L2_PIX_FMT_YUV420;
+        r->x &= ~1;
+        x1 = r->x + ((x1 - r->x) & ~1);
+        if (planar) {
+            r->y &= ~1;
+            y1 = r->y + ((y1 - r->y) & ~1);
+        }
+    }
+    r->width = x1 - r->x;
+    r->height = y1 - r->y;
+    return r->width > 0 && r->height > 0 ? 0 : -1;
+}
+
+/* Makes sure the output buffer can hold needed bytes. */
+static int reserve(struct roi_cropper *rc, size_t needed) {
+    if (needed <= rc->out_cap) return 0;
+    uint8_t *grown = realloc(rc->out, needed);
+    if (!grown) return -1;
+    rc->out = grown;
+    rc->out_cap = needed;
+    return 0;
+}
+
+/* Copies rows of bytes from one plane to another. */
+static void copy_rows(const uint8_t *src, size_t src_stride, uint8_t *dst, size_t dst_stride, size_t bytes, int rows) {
+    for (int row = 0; row < rows; row++)
+        memcpy(dst + row * dst_stride, src + row * src_stride, bytes);
+}
+
+long roi_crop(struct roi_cropper *rc, const void *frame, size_t size, uint32_t pixelformat, int width, int height,
+              const struct roi *r) {
+    const uint8_t *src = frame;
+
+    if (pixelformat == V4L2_PIX_FMT_MJPEG) {
+        long encoded;
+        if (jpeg_decode(frame, size, &rc->img) < 0) return -1;
+        if (jpeg_crop(&rc->img, r->x, r->y, r->width, r->height, &rc->crop) < 0) {
+            jpeg_free(&rc->img);
+            return -1;
+        }
+        encoded = jpeg_encode(&rc->crop, &rc->out, &rc->out_cap);
+        rc->width = rc->crop.width;
+        rc->height = rc->crop.height;
+        jpeg_free(&rc->img);
+        jpeg_free(&rc->crop);
+        return encoded;
+    }
+
+    size_t expected = pixconv_frame_size(pixelformat, width, height);
+    size_t cropped = pixconv_frame_size(pixelformat, r->width, r->height);
+    if (expected == 0 || size < expected || r->x + r->width > width || r->y + r->height > height) return -1;
+    if (reserve(rc, cropped) < 0) return -1;
+
+    switch (pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_UYVY:
+        copy_rows(src + ((size_t)r->y * width + r->x) * 2, (size_t)width * 2, rc->out, (size_t)r->width * 2,
+                  (size_t)r->width * 2, r->height);
+        break;
+    case V4L2_PIX_FMT_NV12:
+        copy_rows(src + (size_t)r->y * width + r->x, width, rc->out, r->width, r->width, r->height);
+        copy_rows(src + (size_t)width * height + (size_t)(r->y / 2) * width + r->x, width,
+                  rc->out + (size_t)r->width * r->height, r->width, r->width, r->height / 2);
+        break;
+    case V4L2_PIX_FMT_YUV420: {
+        size_t chroma = (size_t)(width / 2) * ((height + 1) / 2);
+        size_t crop_chroma = (size_t)(r->width / 2) * (r->height / 2);
+        const uint8_t *u = src + (size_t)width * height;
+        uint8_t *out_u = rc->out + (size_t)r->width * r->height;
+        copy_rows(src + (size_t)r->y * width + r->x, width, rc->out, r->width, r->width, r->height);
+        for (int plane = 0; plane < 2; plane++)
+            copy_rows(u + plane * chroma + (size_t)(r->y / 2) * (width / 2) + r->x / 2, width / 2,
+                      out_u + plane * crop_chroma, r->width / 2, r->width / 2, r->height / 2);
+        break;
+    }
+    }
+    rc->width = r->width;
+    rc->height = r->height;
+    return (long)cropped;
+}
+
+void roi_free(struct roi_cropper *rc) {
+    free(rc->out);
+    rc->out = NULL;
+    rc->out_cap = 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * @file roi.h
+ * @brief Software cropping of captured frames to a region of interest, for cameras whose driver cannot crop.
+ *
+ * Raw frames are cropped by copying rows, with the rectangle aligned to the chroma subsampling of the format.
+ * MJPEG frames are cropped in the DCT coefficient domain (see jpeg_crop()): whole blocks are copied and only the
+ * entropy coding is redone, so there is no inverse DCT and no generation loss.
+ */
+
+#ifndef ROI_H
+#define ROI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "jpeg.h"
+
+/* Rectangle of the frame to keep, in pixels of the captured frame. */
+struct roi {
+    int x, y;
+    int width, height;
+};
+
+/* Work buffers of the cropper, reused from frame to frame. Zero-initialize before first use. */
+struct roi_cropper {
+    uint8_t *out;           // Cropped frame
+    size_t out_cap;
+    struct jpeg_image img;  // Decoded MJPEG frame and its cropped coefficients
+    struct jpeg_image crop;
+    int width, height;      // Geometry of the last cropped frame
+};
+
+/**
+ * @brief Clips a region to the frame and aligns it to what the pixel format allows: even x and width for packed
+ * 4:2:2, even x, y, width and height for 4:2:0 formats. MJPEG regions are aligned per frame by roi_crop().
+ * @return 0 on success, -1 if the region does not overlap the frame or the format is not supported.
+ */
+int roi_align(uint32_t pixelformat, int width, int height, struct roi *r);
+
+/**
+ * @brief Crops a frame (MJPEG or a raw format supported by pixconv.h) to an aligned region.
+ * @return Size of the cropped frame left in rc->out (geometry in rc->width and rc->height), or -1 on error.
+ */
+long roi_crop(struct roi_cropper *rc, const void *frame, size_t size, uint32_t pixelformat, int width, int height,
+              const struct roi *r);
+
+/**
+ * @brief Releases the buffers of a cropper.
+ */
+void roi_free(struct roi_cropper *rc);
+
+#endif
@@ -6,14 +6,825 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
+#include "protocol.h"
+#include "index.h"
+#include "optimizer.h"
+#include "thumbnail.h"
+#include "motion.h"
+#include "hash.h"
+#include "rawcodec.h"
+#include "reader.h"
+#include "replicate.h"
+#include "fec.h"
 
 /* Defines port 8080 as the listening port. This must match the configuration in the client. */
 #define PORT 8080
 /* Defines a 4KB buffer for reading data chunks. This matches the standard page size, offering a balance between memory usage and system call overhead. */
 #define BUFFER_SIZE 4096
+/* Share of one CPU core (in percent) that the background Huffman optimizer may use for re-encoding stored frames. */
+#define OPTIMIZER_CPU_BUDGET 25
+/* Number of threads producing DC-only thumbnails for stored frames. */
+#define THUMBNAIL_WORKERS 2
+/* Base name of the per-camera stream index files (stream_<camera>.idx, .thm, .sec and .min). */
+#define INDEX_NAME "stream"
+/* Highest camera identifier accepted (exclusive). Legacy clients are recorded as camera 0. */
+#define MAX_CAMERAS 256
+/* Upper bound on the intervals returned by one activity query. */
+#define MAX_ACTIVITY_RESULTS 4096
+/* Consecutive identical frames after which a camera is reported as frozen (about 2 seconds at 15 fps). */
+#define FROZEN_THRESHOLD 30
+/* Largest preview frame accepted. Previews are small JPEGs kept in memory, one per camera. */
+#define MAX_PREVIEW_BYTES (1 << 20)
+/* Longest wait (ms) of a resuming connection for the earlier connections of its camera to store what they received. */
+#define RESUME_WAIT_MS 3000
+/* Connections recording a camera that a resume of the same session can end (the stripes of a group and its server
+   connection, and one more for the connection being replaced). */
+#define MAX_SESSION_WRITERS (MAX_STRIPE_SENDERS + 2)
+/* Keepalive of client connections: a peer that vanished (powered off, cable pulled) is detected after about
+   KEEPALIVE_IDLE_S + KEEPALIVE_INTERVAL_S * KEEPALIVE_PROBES seconds without traffic, or that long without its
+   acknowledgement of the data sent to it. */
+#define KEEPALIVE_IDLE_S 10
+#define KEEPALIVE_INTERVAL_S 2
+#define KEEPALIVE_PROBES 3
+/* Striped streams (MSG_STRIPE) that can be received at once. */
+#define MAX_STRIPE_GROUPS 32
+/* Longest wait (ms) of a striped frame for the frames ordered before it, which arrive on other connections. */
+#define STRIPE_WAIT_MS 5000
+/* Striped connections a group may have (as many as the client can open). */
+#define MAX_STRIPE_SENDERS 16
+/* Time (ms) a preview sent over UDP may take to arrive complete, or rebuildable from its parity, before it is dropped. */
+#define PREVIEW_DEADLINE_MS 150
+/* Receive buffer of the UDP preview socket, enough for bursts of datagrams from every camera. */
+#define PREVIEW_UDP_BUFFER (4 << 20)
+/* Interval (s) of the UDP preview report, printed while previews arrive. */
+#define PREVIEW_REPORT_S 10
+/* Compression methods of raw payloads this server can store and decompress (mask of 1 << COMPRESSION_*). */
+#define SUPPORTED_COMPRESSION ((1u << COMPRESSION_LZ) | (1u << COMPRESSION_LZ_DELTA) | (1u << COMPRESSION_LZ_XOR))
+
+/* Per-camera indices of stored frames, opened on first use and shared by every connection. */
+struct stream_index *camera_indices[MAX_CAMERAS];
+pthread_mutex_t camera_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Last stored payload of each camera, against which new frames are compared, and the duplicate counters. */
+struct duplicate_state {
+    int have_last;
+    uint64_t last_hash;
+    uint64_t last_size;
+    int64_t last_position;      // Index position of the record whose file holds the last payload
+    char last_file[128];
+    struct camera_status status;
+};
+struct duplicate_state duplicates[MAX_CAMERAS];
+pthread_mutex_t duplicate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Last frame stored for each camera since the server started, reported to a client resuming its stream, and the
+   connections currently recording the camera after a resume. */
+struct session_state {
+    int stored;
+    uint64_t session;
+    uint64_t sequence;
+    int64_t capture_us;
+    int writers;
+    struct {
+        int socket;             // 0: free (a connection's socket is never the standard input)
+        uint64_t session;       // Session the connection records
+    } writer[MAX_SESSION_WRITERS]; // The connections counted in writers, as far as there is room
+};
+struct session_state sessions[MAX_CAMERAS];
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t session_done = PTHREAD_COND_INITIALIZER; // Signalled when a recording connection ends
+
+/* Striped streams. Each connection of a group writes the frames it receives to disk as they arrive, then waits for
+   their turn: duplicate check, activity score, index record and acknowledgement follow frame_header.order. A connection
+   waiting for its turn stops reading, so TCP flow control holds the client back; the reorder buffer is therefore at
+   most one frame per connection, and it is on disk rather than in memory. */
+struct stripe_group {
+    int connections;            // Connections attached, including the one that resumed the stream (0: slot free)
+    int senders;                // Striped connections attached, and how many joined in total out of count
+    int joined;
+    int count;
+    int waiting;                // Striped connections waiting for their turn, and the frames they hold
+    uint64_t waiting_orders[MAX_STRIPE_SENDERS];
+    uint64_t session;
+    uint64_t group;
+    uint32_t camera_id;
+    uint64_t next_order;        // Order of the next frame to store, 0 until the connection that resumed the stream joins
+    int ack_socket;             // That connection, which receives the acknowledgements (-1 once it is gone)
+    struct motion_detector detector; // Activity reference and last decoded frame of the stream, shared by its connections
+    struct frame_reader reader;
+};
+struct stripe_group stripe_groups[MAX_STRIPE_GROUPS];
+pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stripe_turn = PTHREAD_COND_INITIALIZER; // Signalled when a frame of a group is stored or a connection leaves
+
+/* Latest preview frame of each camera. Previews are for live viewing only: they are neither stored nor indexed. */
+struct preview_state {
+    uint8_t *jpeg;
+    uint32_t size;
+    struct frame_header header;
+};
+struct preview_state previews[MAX_CAMERAS];
+pthread_mutex_t preview_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Returns the stream index of a camera, opening (or creating) it on first use.
+ * @return The index, or NULL if the camera identifier is out of range or the files cannot be opened.
+ */
+struct stream_index *camera_index(uint32_t camera_id) {
+    char name[64];
+
+    if (camera_id >= MAX_CAMERAS)
+        return NULL;
+    pthread_mutex_lock(&camera_lock);
+    if (camera_indices[camera_id] == NULL) {
+        snprintf(name, sizeof(name), "%s_%u", INDEX_NAME, camera_id);
+        camera_indices[camera_id] = index_open(name);
+    }
+    pthread_mutex_unlock(&camera_lock);
+    return camera_indices[camera_id];
+}
+
+/**
+ * @brief Receives exactly len bytes. recv() may return a partial message, which would desynchronize the protocol.
+ * @return 1 on success, 0 if the peer disconnected, -1 on error.
+ */
+int recv_all(int sock, void *data, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t r = recv(sock, (char *)data + received, len - received, 0);
+        if (r <= 0) return r;
+        received += r;
+    }
+    return 1;
+}
+
+/**
+ * @brief Answers a thumbnail request for timeline scrubbing.
+ * The reply always carries the current frame count; the image itself follows only if the thumbnail has already been computed.
+ */
+int serve_thumbnail(int client_socket) {
+    struct thumbnail_request req;
+    struct thumbnail_reply reply;
+    struct index_record rec;
+    uint8_t *rgb = NULL;
+
+    if (recv_all(client_socket, &req, sizeof(req)) <= 0)
+        return -1;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.position = req.position;
+    struct stream_index *idx = camera_index(req.camera_id);
+    if (idx != NULL && index_read(idx, req.position, &rec) == 0) {
+        reply.timestamp_us = rec.capture_us ? rec.capture_us : rec.timestamp_us;
+        /* A duplicate shows the picture and statistics of the stored copy it refers to. */
+        if ((rec.flags & INDEX_DUPLICATE) && index_read(idx, rec.reference, &rec) < 0)
+            memset(&rec, 0, sizeof(rec));
+        reply.luma_mean = rec.luma_mean;
+        reply.luma_min = rec.luma_min;
+        reply.luma_max = rec.luma_max;
+        reply.luma_contrast = rec.luma_contrast;
+        rgb = malloc((size_t)rec.thumb_width * rec.thumb_height * 3);
+        if (rgb && index_load_thumbnail(idx, &rec, rgb) == 0) {
+            reply.width = rec.thumb_width;
+            reply.height = rec.thumb_height;
+        }
+    }
+    if (idx != NULL)
+        reply.frame_count = idx->count;
+
+    int result = send(client_socket, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply) ? 0 : -1;
+    size_t size = (size_t)reply.width * reply.height * 3;
+    if (result == 0 && size > 0 && send(client_socket, rgb, size, MSG_NOSIGNAL) != (ssize_t)size)
+        result = -1;
+    free(rgb);
+    return result;
+}
+
+/**
+ * @brief Answers an activity query by scanning the per-second or per-minute summaries of a camera.
+ * Finding when anything happened over a whole day reads about 35 KB of minute summaries, without touching any frame.
+ */
+int serve_activity_query(int client_socket) {
+    struct activity_query query;
+    struct activity_reply reply;
+    struct activity_summary *results = NULL;
+    int found = 0;
+
+    if (recv_all(client_socket, &query, sizeof(query)) <= 0)
+        return -1;
+
+    struct stream_index *idx = camera_index(query.camera_id);
+    int max_results = query.max_results < MAX_ACTIVITY_RESULTS ? (int)query.max_results : MAX_ACTIVITY_RESULTS;
+    int level = query.resolution_s >= 60 ? INDEX_SUMMARY_MINUTE : INDEX_SUMMARY_SECOND;
+    if (idx != NULL && max_results > 0 && (results = malloc(max_results * sizeof(*results))) != NULL) {
+        found = index_search_activity(idx, level, query.from_us, query.to_us, query.min_activity, results, max_results);
+        if (found < 0) found = 0;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    reply.count = (uint32_t)found;
+    int result = send(client_socket, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply) ? 0 : -1;
+    size_t size = found * sizeof(*results);
+    if (result == 0 && size > 0 && send(client_socket, results, size, MSG_NOSIGNAL) != (ssize_t)size)
+        result = -1;
+    free(results);
+    return result;
+}
+
+/**
+ * @brief Answers a camera status request with the duplicate and frozen-camera counters.
+ */
+int serve_camera_status(int client_socket) {
+    uint32_t camera_id;
+    struct camera_status status;
+
+    if (recv_all(client_socket, &camera_id, sizeof(camera_id)) <= 0)
+        return -1;
+
+    memset(&status, 0, sizeof(status));
+    if (camera_id < MAX_CAMERAS) {
+        pthread_mutex_lock(&duplicate_lock);
+        status = duplicates[camera_id].status;
+        pthread_mutex_unlock(&duplicate_lock);
+    }
+    return send(client_socket, &status, sizeof(status), MSG_NOSIGNAL) == sizeof(status) ? 0 : -1;
+}
+
+/**
+ * @brief Answers a preview request with the latest preview frame of a camera.
+ */
+int serve_preview(int client_socket) {
+    uint32_t camera_id;
+    struct preview_reply reply;
+    uint8_t *jpeg = NULL;
+
+    if (recv_all(client_socket, &camera_id, sizeof(camera_id)) <= 0)
+        return -1;
+
+    /* Copies the frame, so a preview arriving meanwhile can replace it without waiting for this send. */
+    memset(&reply, 0, sizeof(reply));
+    if (camera_id < MAX_CAMERAS) {
+        pthread_mutex_lock(&preview_lock);
+        struct preview_state *p = &previews[camera_id];
+        if (p->size > 0 && (jpeg = malloc(p->size)) != NULL) {
+            memcpy(jpeg, p->jpeg, p->size);
+            reply.size = p->size;
+            reply.capture_us = p->header.capture_us;
+            reply.sequence = p->header.sequence;
+            reply.width = (uint16_t)p->header.width;
+            reply.height = (uint16_t)p->header.height;
+        }
+        pthread_mutex_unlock(&preview_lock);
+    }
+
+    int result = send(client_socket, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply) ? 0 : -1;
+    if (result == 0 && reply.size > 0 && send(client_socket, jpeg, reply.size, MSG_NOSIGNAL) != (ssize_t)reply.size)
+        result = -1;
+    free(jpeg);
+    return result;
+}
+
+/**
+ * @brief Makes a preview the camera's latest one, taking ownership of its JPEG. A preview older than the current one
+ * (a UDP preview overtaken by the next) is discarded, unless the current one is over a minute newer: the camera's clock
+ * was set back.
+ */
+void store_preview(const struct frame_header *header, uint8_t *jpeg) {
+    pthread_mutex_lock(&preview_lock);
+    struct preview_state *p = &previews[header->camera_id];
+    int64_t newer_by = p->header.capture_us - header->capture_us;
+    if (p->size > 0 && newer_by > 0 && newer_by < 60000000) {
+        pthread_mutex_unlock(&preview_lock);
+        free(jpeg);
+        return;
+    }
+    free(p->jpeg);
+    p->jpeg = jpeg;
+    p->size = (uint32_t)header->size;
+    p->header = *header;
+    pthread_mutex_unlock(&preview_lock);
+}
+
+/**
+ * @brief Receives the filename and payload of a preview frame and makes it the camera's latest preview.
+ * @return 0 on success, -1 if the frame is invalid or the connection failed.
+ */
+int receive_preview(int client_socket, const struct frame_header *header) {
+    char filename[128];
+
+    if (header->camera_id >= MAX_CAMERAS || header->name_len == 0 || header->name_len >= sizeof(filename) ||
+        header->size == 0 || header->size > MAX_PREVIEW_BYTES) {
+        printf("[SERVER] Invalid preview frame (camera %u, %llu bytes), closing connection.\n", header->camera_id,
+               (unsigned long long)header->size);
+        return -1;
+    }
+    uint8_t *jpeg = malloc(header->size);
+    if (jpeg == NULL) {
+        perror("[SERVER] Preview allocation failed");
+        return -1;
+    }
+    if (recv_all(client_socket, filename, header->name_len) <= 0 || recv_all(client_socket, jpeg, header->size) <= 0) {
+        perror("[SERVER] Error receiving preview frame");
+        free(jpeg);
+        return -1;
+    }
+    store_preview(header, jpeg);
+    return 0;
+}
+
+/**
+ * @brief Delivery callback of the UDP preview receiver: a reassembled message is a frame_header followed by its JPEG.
+ */
+void deliver_preview(const uint8_t *message, size_t size, void *arg) {
+    struct frame_header header;
+    (void)arg;
+
+    if (size < sizeof(header))
+        return;
+    memcpy(&header, message, sizeof(header));
+    if (header.camera_id >= MAX_CAMERAS || header.stream != STREAM_PREVIEW || header.size == 0 ||
+        header.size > MAX_PREVIEW_BYTES || header.size != size - sizeof(header))
+        return;
+    uint8_t *jpeg = malloc(header.size);
+    if (jpeg == NULL) {
+        perror("[SERVER] Preview allocation failed");
+        return;
+    }
+    memcpy(jpeg, message + sizeof(header), header.size);
+    store_preview(&header, jpeg);
+}
+
+/**
+ * @brief Receives the previews cameras send over UDP (see fec.h) on the server's port number, and reports how many
+ * arrived whole, rebuilt from parity, or too late, every PREVIEW_REPORT_S seconds while previews arrive.
+ */
+void *preview_udp_thread(void *arg) {
+    static struct fec_receiver receiver; // Large: holds the receive buffers of a whole batch
+    int fd = (int)(intptr_t)arg;
+    long reported = 0;
+    time_t report_at = time(NULL) + PREVIEW_REPORT_S;
+
+    receiver.deadline_us = PREVIEW_DEADLINE_MS * 1000LL;
+    receiver.deliver = deliver_preview;
+    for (;;) {
+        if (fec_receive(&receiver, fd) < 0) {
+            perror("[SERVER] UDP preview receive failed");
+            sleep(1);
+        }
+        if (time(NULL) >= report_at) {
+            if (receiver.datagrams != reported)
+                printf("[SERVER] UDP previews: %ld datagrams, %ld frames delivered (%ld rebuilt from parity), "
+                       "%ld dropped incomplete, %ld invalid datagrams.\n", receiver.datagrams, receiver.frames,
+                       receiver.recovered, receiver.dropped, receiver.invalid);
+            reported = receiver.datagrams;
+            report_at = time(NULL) + PREVIEW_REPORT_S;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens the UDP preview socket on the server's port and starts its receiving thread.
+ * @return 0 on success, -1 on failure (previews then only arrive over TCP).
+ */
+int preview_udp_start(int port) {
+    struct sockaddr_in address;
+    int buffer = PREVIEW_UDP_BUFFER;
+    struct timeval timeout = {0, PREVIEW_DEADLINE_MS * 1000 / 2}; // Wakes up to drop expired frames when nothing arrives
+    pthread_t thread;
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("[SERVER] UDP preview socket creation failed");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("[SERVER] UDP preview bind failed");
+        close(fd);
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, preview_udp_thread, (void *)(intptr_t)fd) != 0) {
+        perror("[SERVER] UDP preview thread creation failed");
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * @brief Answers MSG_HELLO: accepts the requested stream options that this server supports.
+ * @param accepted Receives the compression methods the connection may use from now on.
+ * @param flags Receives the HELLO_* options of the connection.
+ */
+int serve_hello(int client_socket, uint32_t *accepted, uint32_t *flags) {
+    struct hello hello;
+    struct hello_reply reply;
+
+    if (recv_all(client_socket, &hello, sizeof(hello)) <= 0)
+        return -1;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.version = PROTOCOL_VERSION;
+    reply.compression = hello.compression & SUPPORTED_COMPRESSION;
+    *accepted = reply.compression;
+    *flags = hello.flags;
+    if (hello.flags & HELLO_REPLICATED)
+        printf("[SERVER] A peer server replicates its frames here (compression methods 0x%x).\n", reply.compression);
+    else
+        printf("[SERVER] Camera %u negotiated its stream (compression methods 0x%x).\n", hello.camera_id, reply.compression);
+    return send(client_socket, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply) ? 0 : -1;
+}
+
+/**
+ * @brief Answers MSG_REPLICATION_STATUS with the state of the replication to the peer server.
+ */
+int serve_replication_status(int client_socket) {
+    struct replication_status status;
+
+    replication_status(&status);
+    return send(client_socket, &status, sizeof(status), MSG_NOSIGNAL) == sizeof(status) ? 0 : -1;
+}
+
+/**
+ * @brief Answers MSG_RESUME with the last frame stored for the camera, so the client only sends again what came after.
+ * A connection that broke may still have frames in its socket buffer, which its thread keeps storing until it reads
+ * the end of the stream; the answer waits for those threads (up to RESUME_WAIT_MS), or it would be out of date.
+ * Connections of the same session are ended first (see evict_writers()), so the wait is only for them to store what
+ * they already received, however long their client takes to be noticed as gone.
+ * @param camera Set to the camera of the connection (the last one resumed, when it carries several).
+ * @param resumed Bitmap of the cameras the connection resumed, one bit per camera: each of them counts the connection
+ * as recording it until it ends, once however many times it is resumed.
+ */
+/**
+ * @brief Counts a connection as recording a camera. Called with session_lock held.
+ */
+void add_writer(struct session_state *state, int client_socket, uint64_t session) {
+    state->writers++;
+    for (int i = 0; i < MAX_SESSION_WRITERS; i++) {
+        if (state->writer[i].socket == 0) {
+            state->writer[i].socket = client_socket;
+            state->writer[i].session = session;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Stops counting a connection that ended as recording a camera. Called with session_lock held.
+ */
+void remove_writer(struct session_state *state, int client_socket) {
+    state->writers--;
+    for (int i = 0; i < MAX_SESSION_WRITERS; i++)
+        if (state->writer[i].socket == client_socket)
+            state->writer[i].socket = 0;
+}
+
+/**
+ * @brief Ends the other connections recording a camera for the given session: the client resumes it on a new
+ * connection, so they are stale. Their threads still store what they received, then read the end of the stream
+ * instead of waiting for data that will never come. Called with session_lock held.
+ * @return Number of connections ended.
+ */
+int evict_writers(struct session_state *state, int client_socket, uint64_t session) {
+    int evicted = 0;
+
+    for (int i = 0; i < MAX_SESSION_WRITERS; i++) {
+        if (state->writer[i].socket != 0 && state->writer[i].socket != client_socket &&
+            state->writer[i].session == session) {
+            shutdown(state->writer[i].socket, SHUT_RD);
+            state->writer[i].session = 0; // Shut down once
+            evicted++;
+        }
+    }
+    return evicted;
+}
+
+int serve_resume(int client_socket, int *camera, uint8_t *resumed) {
+    struct resume req;
+    struct resume_reply reply;
+    struct index_record rec;
+    struct timespec deadline;
+
+    if (recv_all(client_socket, &req, sizeof(req)) <= 0)
+        return -1;
+    struct stream_index *idx = camera_index(req.camera_id);
+    if (idx == NULL) {
+        printf("[SERVER] Invalid camera identifier %u in resume request, closing connection.\n", req.camera_id);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RESUME_WAIT_MS / 1000;
+    deadline.tv_nsec += (RESUME_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    pthread_mutex_lock(&session_lock);
+    struct session_state *state = &sessions[req.camera_id];
+    int own = (resumed[req.camera_id / 8] >> (req.camera_id % 8)) & 1; // This connection, which is not waited for
+    if (req.session != 0 && evict_writers(state, client_socket, req.session) > 0)
+        printf("[SERVER] Camera %u: earlier connections of session %016llx ended.\n", req.camera_id,
+               (unsigned long long)req.session);
+    while (state->writers > own && pthread_cond_timedwait(&session_done, &session_lock, &deadline) == 0)
+        ;
+    if (state->stored) {
+        reply.status = RESUME_SESSION;
+        reply.session = state->session;
+        reply.sequence = state->sequence;
+        reply.capture_us = state->capture_us;
+    } else if (idx->count > 0 && index_read(idx, idx->count - 1, &rec) == 0) {
+        /* Nothing stored since the server started: the last record of the index, whose session is not recorded. */
+        reply.status = RESUME_INDEX;
+        reply.sequence = rec.sequence;
+        reply.capture_us = rec.capture_us;
+    }
+    if (!own) {
+        resumed[req.camera_id / 8] |= 1u << (req.camera_id % 8);
+        add_writer(state, client_socket, req.session);
+    }
+    *camera = (int)req.camera_id;
+    pthread_mutex_unlock(&session_lock);
+
+    printf("[SERVER] Camera %u resumes session %016llx after frame %llu.\n", req.camera_id, (unsigned long long)req.session,
+           (unsigned long long)reply.sequence);
+    return send(client_socket, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply) ? 0 : -1;
+}
+
+/**
+ * @brief Records the last frame stored for a camera, once its index record is written.
+ */
+void remember_stored(const struct frame_header *header) {
+    pthread_mutex_lock(&session_lock);
+    struct session_state *state = &sessions[header->camera_id];
+    state->stored = 1;
+    state->session = header->session;
+    state->sequence = header->sequence;
+    state->capture_us = header->capture_us;
+    pthread_mutex_unlock(&session_lock);
+}
+
+/**
+ * @brief Acknowledges a stored frame on a resumed connection (struct frame_ack), so the client can forget it.
+ * A failure is left to the receive loop, which notices the broken connection with its next read.
+ */
+void acknowledge_frame(int client_socket, const struct frame_header *header) {
+    struct frame_ack ack;
+
+    ack.session = header->session;
+    ack.sequence = header->sequence;
+    ack.capture_us = header->capture_us;
+    send(client_socket, &ack, sizeof(ack), MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Answers MSG_STRIPE: attaches the connection to its stripe group, creating the group on first use.
+ * The connection that resumed the stream (index 0) starts the ordering and receives the acknowledgements; the striped
+ * connections count as recording the camera, like a resumed connection.
+ */
+int serve_stripe(int client_socket, struct stripe_group **group, int *camera, uint8_t *resumed) {
+    struct stripe_join join;
+    struct stripe_group *g = NULL;
+
+    if (recv_all(client_socket, &join, sizeof(join)) <= 0)
+        return -1;
+    if (join.camera_id >= MAX_CAMERAS || *group != NULL || (join.index != 0 && *camera >= 0) ||
+        join.count > MAX_STRIPE_SENDERS || join.index > join.count) {
+        printf("[SERVER] Invalid stripe request for camera %u, closing connection.\n", join.camera_id);
+        return -1;
+    }
+
+    pthread_mutex_lock(&stripe_lock);
+    for (int i = 0; i < MAX_STRIPE_GROUPS && g == NULL; i++) {
+        struct stripe_group *candidate = &stripe_groups[i];
+        if (candidate->connections > 0 && candidate->session == join.session && candidate->group == join.group &&
+            candidate->camera_id == join.camera_id)
+            g = candidate;
+    }
+    for (int i = 0; i < MAX_STRIPE_GROUPS && g == NULL; i++) {
+        if (stripe_groups[i].connections == 0) {
+            g = &stripe_groups[i];
+            memset(g, 0, sizeof(*g));
+            g->session = join.session;
+            g->group = join.group;
+            g->camera_id = join.camera_id;
+            g->count = (int)join.count;
+            g->ack_socket = -1;
+            g->reader.position = -1;
+        }
+    }
+    if (g == NULL) {
+        pthread_mutex_unlock(&stripe_lock);
+        printf("[SERVER] Too many striped streams, closing connection.\n");
+        return -1;
+    }
+    g->connections++;
+    if (join.index == 0) {
+        g->ack_socket = client_socket;
+        g->next_order = 1;
+    } else if (g->senders == MAX_STRIPE_SENDERS) {
+        g->connections--;
+        pthread_mutex_unlock(&stripe_lock);
+        printf("[SERVER] Too many striped connections in group %llu, closing connection.\n",
+               (unsigned long long)join.group);
+        return -1;
+    } else {
+        g->senders++;
+        g->joined++;
+    }
+    pthread_cond_broadcast(&stripe_turn);
+    pthread_mutex_unlock(&stripe_lock);
+    *group = g;
+
+    if (join.index != 0) {
+        pthread_mutex_lock(&session_lock);
+        resumed[join.camera_id / 8] |= 1u << (join.camera_id % 8);
+        add_writer(&sessions[join.camera_id], client_socket, join.session);
+        *camera = (int)join.camera_id;
+        pthread_mutex_unlock(&session_lock);
+    }
+    printf("[SERVER] Camera %u: connection %u of stripe group %llu (%u striped connections).\n", join.camera_id,
+           join.index, (unsigned long long)join.group, join.count);
+    return 0;
+}
+
+/**
+ * @brief Waits until every frame of the group ordered before this one is stored.
+ * Gives up after STRIPE_WAIT_MS, or at once when every striped connection of the group is waiting and none of them
+ * holds the next frame (it was lost with a connection); the client then resumes the stream on new connections.
+ * A connection holding the next frame may not have woken up yet, so it still counts as making progress.
+ * @return 0 when it is the frame's turn, -1 otherwise.
+ */
+int stripe_wait_turn(struct stripe_group *g, uint64_t order) {
+    struct timespec deadline;
+    int result = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += STRIPE_WAIT_MS / 1000;
+    deadline.tv_nsec += (STRIPE_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&stripe_lock);
+    if (g->waiting == MAX_STRIPE_SENDERS) {
+        pthread_mutex_unlock(&stripe_lock);
+        return -1; // Only a client sending ordered frames on its resuming connection as well gets here
+    }
+    g->waiting_orders[g->waiting++] = order;
+    while (g->next_order != order) {
+        int due = 0;
+        for (int i = 0; i < g->waiting; i++)
+            due |= g->waiting_orders[i] == g->next_order;
+        int stuck = g->next_order != 0 && g->joined >= g->count && g->waiting == g->senders && !due;
+        if (g->next_order > order || stuck || pthread_cond_timedwait(&stripe_turn, &stripe_lock, &deadline) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    /* Removes this waiter's order, moving the last one into its place. */
+    for (int i = 0; i < g->waiting; i++) {
+        if (g->waiting_orders[i] == order) {
+            g->waiting_orders[i] = g->waiting_orders[--g->waiting];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return result;
+}
+
+/**
+ * @brief Ends the turn of a stored frame: acknowledges it on the connection that resumed the stream, and lets the next
+ * frame of the group be stored.
+ */
+void stripe_end_turn(struct stripe_group *g, const struct frame_header *header) {
+    pthread_mutex_lock(&stripe_lock);
+    if (g->ack_socket >= 0)
+        acknowledge_frame(g->ack_socket, header);
+    g->next_order++;
+    pthread_cond_broadcast(&stripe_turn);
+    pthread_mutex_unlock(&stripe_lock);
+}
+
+/* Detaches a connection that ends from its stripe group, and frees the group with its last connection. */
+void stripe_leave(struct stripe_group *g, int client_socket) {
+    pthread_mutex_lock(&stripe_lock);
+    if (g->ack_socket == client_socket)
+        g->ack_socket = -1;
+    else
+        g->senders--;
+    if (--g->connections == 0) {
+        free(g->detector.prev);
+        free(g->detector.cur);
+        free(g->detector.strip);
+        reader_free(&g->reader);
+    }
+    pthread_cond_broadcast(&stripe_turn);
+    pthread_mutex_unlock(&stripe_lock);
+}
+
+/**
+ * @brief Compares a received frame with the last payload stored for its camera and updates the counters.
+ * A frame with the same size and hash is a duplicate: rec is turned into a reference to the stored copy.
+ * Otherwise the frame becomes the new copy to compare against once its record position is known (see remember_payload()).
+ * @return 1 if the frame is a duplicate, 0 otherwise.
+ */
+int check_duplicate(uint32_t camera_id, struct index_record *rec) {
+    struct duplicate_state *state = &duplicates[camera_id];
+    int duplicate;
+
+    pthread_mutex_lock(&duplicate_lock);
+    state->status.frames++;
+    duplicate = state->have_last && state->last_size == rec->size && state->last_hash == rec->hash;
+    if (duplicate) {
+        rec->flags |= INDEX_DUPLICATE;
+        rec->reference = state->last_position;
+        snprintf(rec->filename, sizeof(rec->filename), "%s", state->last_file);
+        state->status.duplicates++;
+        state->status.bytes_saved += rec->size;
+        if (++state->status.duplicate_run == FROZEN_THRESHOLD) {
+            state->status.frozen = 1;
+            state->status.frozen_events++;
+            printf("[SERVER] Camera %u appears frozen: %d identical frames in a row.\n", camera_id, FROZEN_THRESHOLD);
+        }
+    } else {
+        if (state->status.frozen)
+            printf("[SERVER] Camera %u recovered after %u identical frames.\n", camera_id, state->status.duplicate_run);
+        state->status.frozen = 0;
+        state->status.duplicate_run = 0;
+        state->have_last = 0; // Until the record is appended there is no position to refer to
+    }
+    pthread_mutex_unlock(&duplicate_lock);
+    return duplicate;
+}
+
+/* Makes a newly stored frame the reference copy for the following frames of its camera. */
+void remember_payload(uint32_t camera_id, const struct index_record *rec, int64_t position) {
+    struct duplicate_state *state = &duplicates[camera_id];
+
+    pthread_mutex_lock(&duplicate_lock);
+    state->have_last = 1;
+    state->last_hash = rec->hash;
+    state->last_size = rec->size;
+    state->last_position = position;
+    snprintf(state->last_file, sizeof(state->last_file), "%s", rec->filename);
+    pthread_mutex_unlock(&duplicate_lock);
+}
+
+/**
+ * @brief Scores a stored frame against the previous frame of the same connection, for clients that do not run a motion detector.
+ * The file was just written, so mapping it reads from the page cache rather than the disk. Compressed raw frames are
+ * decoded by the connection's frame reader for the analysis only; the file keeps the payload as received. A delta
+ * frame is applied to the previous frame of the stream, which the reader normally still holds.
+ * @param decoded Set to 1 if the reader now holds the decoded frame, so it can serve as the reference of the next one.
+ */
+int32_t compute_activity(struct motion_detector *detector, struct frame_reader *reader, struct stream_index *idx,
+                         const char *filename, const struct frame_header *header, int *decoded) {
+    struct stat st;
+    int32_t score = ACTIVITY_UNKNOWN;
+
+    *decoded = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return score;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            if (header->compression == COMPRESSION_NONE) {
+                score = motion_score(detector, data, st.st_size, header->pixelformat, header->width, header->height);
+            } else if ((header->compression != COMPRESSION_LZ_XOR || reader_load(reader, idx, idx->count - 1) == 0) &&
+                       reader_apply(reader, data, st.st_size) == 0) {
+                *decoded = 1;
+                score = motion_score(detector, reader->frame, reader->size, header->pixelformat, header->width, header->height);
+            }
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+    return score < 0 ? ACTIVITY_UNKNOWN : score;
+}
 
 /**
  * @brief Encapsulates the logic for handling a single connected client.
@@ -21,11 +832,25 @@
  */
 void handle_client(int client_socket) {
     int name_len;
-    char filename[256];
+    char filename[128]; // Matches the filename column of the stream index
     long file_size;
     long total_received;
     int bytes_read;
     char buffer[BUFFER_SIZE];
+    struct frame_header header;
+    struct motion_detector detector; // Reference luma plane for frames that arrive without an activity score
+    struct hash64_state hash;
+    uint32_t accepted_compression = 0; // Compression methods agreed with MSG_HELLO
+    uint32_t hello_flags = 0; // HELLO_* options of the connection; frames from a peer server are not replicated again
+    struct frame_reader reader; // Last decoded frame, the reference of inter-coded frames that must be scored here
+    int resumed_camera = -1; // Camera this connection records after MSG_RESUME, -1 before
+    uint8_t resumed_cameras[MAX_CAMERAS / 8]; // Every camera it resumed (a peer server replicates several on one connection)
+    struct stripe_group *group = NULL; // Stripe group of the connection after MSG_STRIPE
+
+    memset(&detector, 0, sizeof(detector));
+    memset(&reader, 0, sizeof(reader));
+    memset(resumed_cameras, 0, sizeof(resumed_cameras));
+    reader.position = -1;
 
     /* Enters an infinite loop to continuously process files sent by the client. Terminates only upon client disconnection or network error. */
     while(1) {
@@ -33,22 +858,107 @@ void handle_client(int client_socket) {
         /* --- METADATA RECEPTION PHASE --- */
 
         /* Attempts to read the integer representing the filename length. Since TCP is a stream protocol, knowing the exact length is necessary to parse the subsequent string. Returns <= 0 on disconnection. */
-        if (recv(client_socket, &name_len, sizeof(name_len), 0) <= 0) {
+        if (recv_all(client_socket, &name_len, sizeof(name_len)) <= 0) {
             printf("[SERVER] Client disconnected or handshake failed.\n");
             break;
         }
 
+        /* Negative lengths identify control messages, which are answered on the same connection. */
+        if (name_len == MSG_THUMBNAIL_REQUEST) {
+            if (serve_thumbnail(client_socket) < 0)
+                break;
+            continue;
+        }
+        if (name_len == MSG_ACTIVITY_QUERY) {
+            if (serve_activity_query(client_socket) < 0)
+                break;
+            continue;
+        }
+        if (name_len == MSG_CAMERA_STATUS) {
+            if (serve_camera_status(client_socket) < 0)
+                break;
+            continue;
+        }
+        if (name_len == MSG_PREVIEW_REQUEST) {
+            if (serve_preview(client_socket) < 0)
+                break;
+            continue;
+        }
+        if (name_len == MSG_HELLO) {
+            if (serve_hello(client_socket, &accepted_compression, &hello_flags) < 0)
+                break;
+            continue;
+        }
+        if (name_len == MSG_RESUME) {
+            if (serve_resume(client_socket, &resumed_camera, resumed_cameras) < 0)
+                break;
+            continue;
+        }
+        if (name_len == MSG_STRIPE) {
+            if (serve_stripe(client_socket, &group, &resumed_camera, resumed_cameras) < 0)
+                break;
+            continue;
+        }
+        if (name_len == MSG_REPLICATION_STATUS) {
+            if (serve_replication_status(client_socket) < 0)
+                break;
+            continue;
+        }
+
+        /* Extended frames carry a header with capture metadata; its filename length and size replace the legacy fields. */
+        memset(&header, 0, sizeof(header));
+        int extended = name_len == MSG_FRAME;
+        if (extended) {
+            if (recv_all(client_socket, &header, sizeof(header)) <= 0) {
+                perror("[SERVER] Error receiving frame header");
+                break;
+            }
+            name_len = (int)header.name_len;
+            /* Payloads compressed with a method that was not agreed on could not be read back. */
+            if (header.compression != COMPRESSION_NONE &&
+                (header.compression >= 32 || !(accepted_compression & (1u << header.compression)))) {
+                printf("[SERVER] Frame uses compression method %u, which was not negotiated; closing connection.\n",
+                       header.compression);
+                break;
+            }
+            /* Preview frames share the connection with the recorded stream but only replace the camera's live picture. */
+            if (header.stream == STREAM_PREVIEW) {
+                if (receive_preview(client_socket, &header) < 0)
+                    break;
+                continue;
+            }
+        } else {
+            /* Legacy clients only ever sent MJPEG and never scored their frames. */
+            header.pixelformat = V4L2_PIX_FMT_MJPEG;
+            header.activity = ACTIVITY_UNKNOWN;
+        }
+
+        /* Resolves the index of the sending camera before any data is written. */
+        struct stream_index *idx = camera_index(header.camera_id);
+        if (idx == NULL) {
+            printf("[SERVER] Invalid camera identifier %u, closing connection.\n", header.camera_id);
+            break;
+        }
+
+        /* Rejects lengths that would overflow the filename buffer or leave it unterminated. */
+        if (name_len <= 0 || name_len >= (int)sizeof(filename)) {
+            printf("[SERVER] Invalid filename length %d, closing connection.\n", name_len);
+            break;
+        }
+
         /* Clears the filename buffer to ensure no residual data affects the new string. */
         memset(filename, 0, sizeof(filename));
 
         /* Reads the exact number of bytes specified by name_len to retrieve the filename string. This ensures correct alignment for the subsequent file size data. */
-        if (recv(client_socket, filename, name_len, 0) <= 0) {
+        if (recv_all(client_socket, filename, name_len) <= 0) {
             perror("[SERVER] Error receiving filename string");
             break; 
         }
 
         /* Reads the long integer representing the total size of the incoming raw image. This value determines when to stop reading data for the current file. */
-        if (recv(client_socket, &file_size, sizeof(file_size), 0) <= 0) {
+        if (extended) {
+            file_size = (long)header.size;
+        } else if (recv_all(client_socket, &file_size, sizeof(file_size)) <= 0) {
             perror("[SERVER] Error receiving file size");
             break;
         }
@@ -61,13 +971,14 @@ void handle_client(int client_socket) {
         FILE *fp = fopen(filename, "wb");
         if (fp == NULL) {
             perror("[SERVER] Critical error creating file on disk");
-            return;
+            break;
         }
 
         /* --- PAYLOAD RECEPTION PHASE --- */
 
-        /* Resets the counter to track the bytes received for the current image. */
+        /* Resets the counter to track the bytes received for the current image, and the payload hash used to spot repeated frames. */
         total_received = 0;
+        hash64_init(&hash);
 
         /* Enters a nested loop to handle file transfer. Since the file may exceed the TCP buffer size, reception occurs in chunks until the total bytes match file_size. */
         while (total_received < file_size) {
@@ -89,7 +1000,8 @@ void handle_client(int client_socket) {
 
             /* Writes the received data chunk directly to disk. This minimizes memory usage by avoiding loading the entire file into RAM. */
             fwrite(buffer, 1, bytes_read, fp);
-            
+            hash64_update(&hash, buffer, bytes_read);
+
             /* Updates the progress counter. */
             total_received += bytes_read;
         }
@@ -97,17 +1009,129 @@ void handle_client(int client_socket) {
         /* Closes the file handle to flush write buffers and ensure physical storage on disk. */
         fclose(fp);
         printf("[SERVER] Successfully saved: %s\n", filename);
+
+        if (total_received < file_size)
+            break;
+
+        /* A striped frame is stored once the frames ordered before it, received on other connections, are stored. */
+        int ordered = group != NULL && header.order != 0;
+        if (ordered && stripe_wait_turn(group, header.order) < 0) {
+            printf("[SERVER] Frames before %s did not arrive on the other striped connections, closing connection.\n",
+                   filename);
+            unlink(filename);
+            break;
+        }
+        struct motion_detector *frame_detector = ordered ? &group->detector : &detector;
+        struct frame_reader *frame_reader = ordered ? &group->reader : &reader;
+
+        /* Records the frame in the stream index and schedules its thumbnail, which is computed by the worker pool. */
+        struct index_record rec;
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        memset(&rec, 0, sizeof(rec));
+        snprintf(rec.filename, sizeof(rec.filename), "%s", filename);
+        rec.timestamp_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+        rec.size = file_size;
+        rec.capture_us = header.capture_us;
+        rec.sequence = header.sequence;
+        rec.hash = hash64_final(&hash);
+        rec.reference = -1;
+        if (header.compression != COMPRESSION_NONE)
+            rec.flags |= INDEX_COMPRESSED;
+        /* In an inter-coded stream, every frame that is not a delta is a keyframe where decoding can start. */
+        if (header.compression == COMPRESSION_LZ_XOR)
+            rec.flags |= INDEX_DELTA;
+        else if (accepted_compression & (1u << COMPRESSION_LZ_XOR))
+            rec.flags |= INDEX_KEYFRAME;
+
+        /* A frame identical to the previous one only gets a record pointing at the stored copy. Its own file is
+           removed right away, normally before the page cache has written it back, so it costs no disk space.
+           A client reusing the name of the stored copy has just rewritten it with the same bytes, so that one is kept. */
+        if (check_duplicate(header.camera_id, &rec)) {
+            if (strcmp(filename, rec.filename) != 0)
+                unlink(filename);
+            rec.activity = 0;
+            if (index_append(idx, &rec) >= 0) {
+                remember_stored(&header);
+                /* The peer gets the payload again from the stored copy, and finds the duplicate itself. */
+                header.activity = rec.activity;
+                if (!(hello_flags & HELLO_REPLICATED))
+                    replication_submit(&header, filename, rec.filename);
+            }
+            if (ordered)
+                stripe_end_turn(group, &header);
+            else if (resumed_camera >= 0)
+                acknowledge_frame(client_socket, &header);
+            continue;
+        }
+
+        int decoded = 0;
+        rec.activity = header.activity;
+        if (rec.activity < 0)
+            rec.activity = compute_activity(frame_detector, frame_reader, idx, filename, &header, &decoded);
+        int64_t position = index_append(idx, &rec);
+        if (position >= 0) {
+            if (decoded) {
+                frame_reader->idx = idx;
+                frame_reader->position = position;
+            }
+            remember_payload(header.camera_id, &rec, position);
+            remember_stored(&header);
+            thumbnail_submit(idx, position, filename);
+            /* Sent with the score computed here, so the peer's index and activity summaries match this one. */
+            header.activity = rec.activity;
+            if (!(hello_flags & HELLO_REPLICATED))
+                replication_submit(&header, filename, filename);
+        }
+        if (ordered)
+            stripe_end_turn(group, &header);
+        else if (resumed_camera >= 0)
+            acknowledge_frame(client_socket, &header);
+
+        /* Hands complete frames to the background optimizer, which shrinks them for cold storage when the CPU is otherwise idle. */
+        if (position >= 0)
+            optimizer_submit(idx, position);
+    }
+
+    if (group != NULL)
+        stripe_leave(group, client_socket);
+
+    /* Everything this connection received is stored: a resume of its camera waiting for it can answer now. */
+    if (resumed_camera >= 0) {
+        pthread_mutex_lock(&session_lock);
+        for (int i = 0; i < MAX_CAMERAS; i++)
+            if (resumed_cameras[i / 8] & (1u << (i % 8)))
+                remove_writer(&sessions[i], client_socket);
+        pthread_cond_broadcast(&session_done);
+        pthread_mutex_unlock(&session_lock);
     }
 
     /* Closes the client socket to release the file descriptor resource back to the operating system. */
     close(client_socket);
+    free(detector.prev);
+    free(detector.cur);
+    free(detector.strip);
+    reader_free(&reader);
+}
+
+/**
+ * @brief Thread entry point for one connection. Cameras stream continuously, so each connection needs its own thread for queries to be served alongside them.
+ */
+void *client_thread(void *arg) {
+    int client_socket = (int)(intptr_t)arg;
+
+    handle_client(client_socket);
+    printf("[SERVER] Client session ended.\n");
+    return NULL;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     int server_fd;
     int new_socket;
     struct sockaddr_in address;
     int addrlen = sizeof(address);
+    int port = argc > 1 ? atoi(argv[1]) : PORT; // A second server on the same host (for failover) listens on another port
+    const char *peer = argc > 2 ? argv[2] : NULL; // Server (address:port) every stored frame is replicated to
 
     /* Creates a socket endpoint. AF_INET specifies IPv4, and SOCK_STREAM specifies TCP for reliable, ordered data delivery. */
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -115,10 +1139,15 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    /* A server restarted after a crash must listen again at once, although connections of its previous run may still
+       hold the port in TIME_WAIT: clients fail over and replicas resume as soon as it is back. */
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     /* Configures the address structure to bind the socket to all available network interfaces (INADDR_ANY) and the specific port. htons converts the port number to network byte order. */
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons(port);
 
     /* Binds the socket to the address and port, instructing the OS to forward packets destined for this port to the process. */
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
@@ -132,9 +1161,16 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    printf("[SERVER] Service started. Listening on port %d...\n", PORT);
+    printf("[SERVER] Service started. Listening on port %d...\n", port);
+
+    /* Starts the low-priority stage that losslessly re-encodes stored frames, and the thumbnail workers. */
+    optimizer_start(OPTIMIZER_CPU_BUDGET, camera_indices, MAX_CAMERAS);
+    thumbnail_start(THUMBNAIL_WORKERS);
+    if (peer != NULL && replication_start(peer) < 0)
+        exit(EXIT_FAILURE);
+    preview_udp_start(port);
 
-    /* Main server loop handles incoming connections sequentially. */
+    /* Main server loop accepts connections and serves each one in its own thread. */
     while (1) {
         /* Extracts the first connection request from the queue, creates a new connected socket, and returns a new file descriptor. Blocks the process until a client connects. */
         if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
@@ -143,11 +1179,25 @@ int main() {
         }
 
         printf("[SERVER] New client connected.\n");
+
+        /* A client that vanished without closing its connection would otherwise keep it, and the camera it records,
+           forever: its thread waits for data that never comes. */
+        int keepalive = 1, idle = KEEPALIVE_IDLE_S, interval = KEEPALIVE_INTERVAL_S, probes = KEEPALIVE_PROBES;
+        unsigned int user_timeout = (KEEPALIVE_IDLE_S + KEEPALIVE_INTERVAL_S * KEEPALIVE_PROBES) * 1000;
+        setsockopt(new_socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+        setsockopt(new_socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(new_socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(new_socket, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+        setsockopt(new_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
         
-        /* Passes the new connection descriptor to the handler function for data processing. */
-        handle_client(new_socket);
-        
-        printf("[SERVER] Client session ended.\n");
+        /* Passes the new connection descriptor to a handler thread for data processing. */
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_thread, (void *)(intptr_t)new_socket) != 0) {
+            perror("Thread creation failed");
+            close(new_socket);
+            continue;
+        }
+        pthread_detach(thread);
     }
 
     return 0;
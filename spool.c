@@ -0,0 +1,152 @@
+/**
+ * @file spool.c
+ * @brief Offline spool. Records are stored contiguously in a circular area of a mapped file; a record that does not fit
+ * before the end leaves a wrap marker and continues at offset 0.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spool.h"
+
+/* The header has a page of its own, so the data area is page-aligned. */
+#define SPOOL_HEADER_SIZE 4096
+
+/* Bytes taken by a record with the given payload size. */
+static size_t record_size(uint64_t payload) {
+    return (sizeof(struct spool_record) + payload + 7) & ~(size_t)7;
+}
+
+/* Moves the tail past a wrap marker, or past an end too short to hold a record. */
+static void skip_wrap(struct spool *sp) {
+    struct spool_file *f = sp->file;
+    if (f->count == 0) {
+        f->head = f->tail = 0;
+        return;
+    }
+    if (f->capacity - f->tail < sizeof(struct spool_record) ||
+        ((struct spool_record *)(sp->data + f->tail))->magic == SPOOL_WRAP)
+        f->tail = 0;
+}
+
+/* Checks that the header left by a previous run describes this file. */
+static int header_valid(const struct spool_file *f, size_t capacity) {
+    return f->magic == SPOOL_MAGIC && f->version == SPOOL_VERSION && f->capacity == capacity &&
+           f->head <= capacity && f->tail <= capacity && f->bytes <= capacity;
+}
+
+int spool_open(struct spool *sp, const char *path, size_t capacity) {
+    struct stat st;
+
+    memset(sp, 0, sizeof(*sp));
+    capacity &= ~(size_t)7;
+    sp->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (sp->fd < 0) {
+        perror("Spool file cannot be opened");
+        return -1;
+    }
+
+    /* Reserves the disk blocks now, so an outage cannot fail on a full disk halfway through. */
+    sp->map_size = SPOOL_HEADER_SIZE + capacity;
+    if (fstat(sp->fd, &st) < 0 || ((size_t)st.st_size != sp->map_size && ftruncate(sp->fd, 0) < 0) ||
+        posix_fallocate(sp->fd, 0, (off_t)sp->map_size) != 0) {
+        perror("Spool file cannot be preallocated");
+        close(sp->fd);
+        return -1;
+    }
+    sp->map = mmap(NULL, sp->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, 0);
+    if (sp->map == MAP_FAILED) {
+        perror("Spool file cannot be mapped");
+        sp->map = NULL;
+        close(sp->fd);
+        return -1;
+    }
+    sp->file = (struct spool_file *)sp->map;
+    sp->data = sp->map + SPOOL_HEADER_SIZE;
+
+    if (!header_valid(sp->file, capacity)) {
+        memset(sp->file, 0, sizeof(*sp->file));
+        sp->file->magic = SPOOL_MAGIC;
+        sp->file->version = SPOOL_VERSION;
+        sp->file->capacity = capacity;
+    }
+    return 0;
+}
+
+/* Finds where a record of the given size can be written without overwriting live records. Returns -1 if eviction is needed. */
+static long find_space(const struct spool *sp, size_t size) {
+    const struct spool_file *f = sp->file;
+
+    if (f->count == 0) return 0;
+    if (f->head > f->tail) {
+        /* Live records occupy [tail, head): free space is after head, or before tail after wrapping. */
+        if (f->capacity - f->head >= size) return (long)f->head;
+        if (f->tail >= size) return 0;
+        return -1;
+    }
+    /* Wrapped: live records occupy [tail, end) and [0, head). */
+    return f->tail - f->head >= size ? (long)f->head : -1;
+}
+
+int spool_append(struct spool *sp, const struct iovec *pieces, int count, const struct frame_header *header) {
+    struct spool_file *f = sp->file;
+    struct spool_record *rec;
+    uint64_t payload = 0;
+    long offset;
+
+    for (int i = 0; i < count; i++)
+        payload += pieces[i].iov_len;
+    size_t size = record_size(payload);
+    if (size > f->capacity) return -1;
+    while ((offset = find_space(sp, size)) < 0) {
+        spool_drop_oldest(sp);
+        sp->evicted++;
+    }
+
+    /* Leaves a marker where the records stop before the end, unless the gap is too short for a record header anyway. */
+    if (offset == 0 && f->count > 0 && f->capacity - f->head >= sizeof(struct spool_record))
+        ((struct spool_record *)(sp->data + f->head))->magic = SPOOL_WRAP;
+
+    rec = (struct spool_record *)(sp->data + offset);
+    rec->magic = SPOOL_RECORD;
+    rec->reserved = 0;
+    rec->header = *header;
+    rec->header.size = payload;
+    uint8_t *out = (uint8_t *)(rec + 1);
+    for (int i = 0; i < count; i++) {
+        memcpy(out, pieces[i].iov_base, pieces[i].iov_len);
+        out += pieces[i].iov_len;
+    }
+
+    if (f->count == 0) f->tail = (uint64_t)offset;
+    f->head = (uint64_t)offset + size;
+    f->bytes += payload;
+    f->count++;
+    return 0;
+}
+
+const struct spool_record *spool_oldest(const struct spool *sp) {
+    if (sp->file == NULL || sp->file->count == 0) return NULL;
+    return (const struct spool_record *)(sp->data + sp->file->tail);
+}
+
+void spool_drop_oldest(struct spool *sp) {
+    struct spool_file *f = sp->file;
+    const struct spool_record *rec = spool_oldest(sp);
+
+    if (rec == NULL) return;
+    f->tail += record_size(rec->header.size);
+    f->bytes -= rec->header.size;
+    f->count--;
+    skip_wrap(sp);
+}
+
+void spool_close(struct spool *sp) {
+    if (sp->map == NULL) return;
+    munmap(sp->map, sp->map_size);
+    close(sp->fd);
+    memset(sp, 0, sizeof(*sp));
+}
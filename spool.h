@@ -0,0 +1,79 @@
+/**
+ * @file spool.h
+ * @brief Offline spool: frames that cannot be sent are kept in a preallocated, memory-mapped file until the server is back.
+ *
+ * The spool is a circular byte area like the pre-event ring (see ring.h), but it lives in a file mapped with MAP_SHARED,
+ * so its content survives a crash or restart of the client and is sent at the next start. Each record carries its
+ * frame header, so the file describes itself. When the spool is full, the oldest frames are evicted.
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "protocol.h"
+
+#define SPOOL_MAGIC 0x4C4F5053 // "SPOL" in little-endian byte order
+#define SPOOL_VERSION 2         // 2: frame headers carry the stripe order
+#define SPOOL_RECORD 0x43455253 // "SREC": a spooled frame
+#define SPOOL_WRAP 0x50415257   // "WRAP": the records continue at the start of the data area
+
+/* File header, in the first page of the file. head, tail and count are updated after the record they cover is
+   complete, so the file stays consistent if the client stops at any point. */
+struct spool_file {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;          // Size of the data area that follows the first page
+    uint64_t head;              // Next write position in the data area
+    uint64_t tail;              // Position of the oldest record
+    uint64_t count;             // Records held
+    uint64_t bytes;             // Payload bytes held
+};
+
+/* Record header; the payload follows, padded to 8 bytes. */
+struct spool_record {
+    uint32_t magic;
+    uint32_t reserved;
+    struct frame_header header; // Frame as it will be sent; header.size is the payload size
+};
+
+struct spool {
+    int fd;
+    uint8_t *map;               // Whole file mapping: header page, then the data area
+    size_t map_size;
+    struct spool_file *file;
+    uint8_t *data;
+    long evicted;               // Frames dropped to make room since the spool was opened
+};
+
+/**
+ * @brief Opens the spool file, creating and preallocating it (capacity bytes of data) if needed.
+ * Records left by a previous run are kept when the file has the same capacity.
+ * @return 0 on success, -1 on error.
+ */
+int spool_open(struct spool *sp, const char *path, size_t capacity);
+
+/**
+ * @brief Copies a frame (in pieces, like a multi-planar buffer) into the spool, evicting the oldest frames until it fits.
+ * @return 0 on success, -1 if the frame is larger than the whole spool.
+ */
+int spool_append(struct spool *sp, const struct iovec *pieces, int count, const struct frame_header *header);
+
+/**
+ * @brief Returns the oldest record (its payload follows it), or NULL if the spool is empty.
+ */
+const struct spool_record *spool_oldest(const struct spool *sp);
+
+/**
+ * @brief Removes the oldest record, once it has been sent.
+ */
+void spool_drop_oldest(struct spool *sp);
+
+/**
+ * @brief Unmaps and closes the spool; its records stay in the file.
+ */
+void spool_close(struct spool *sp);
+
+#endif
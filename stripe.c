@@ -0,0 +1,178 @@
+/**
+ * @file stripe.c
+ * @brief Striped sending. One thread per connection writes the frame message it was given, then waits for the next.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include "stripe.h"
+
+static void *stripe_thread(void *arg) {
+    struct stripe *st = arg;
+    struct stripe_set *set = st->set;
+
+    pthread_mutex_lock(&set->lock);
+    for (;;) {
+        while (st->length == 0 && !set->stopping)
+            pthread_cond_wait(&set->work, &set->lock);
+        if (st->length == 0)
+            break;
+        size_t length = st->length;
+        pthread_mutex_unlock(&set->lock);
+
+        /* Blocking writes, bounded by the socket's send timeout: a server that stops reading counts as gone. */
+        size_t sent = 0;
+        while (sent < length) {
+            ssize_t n = send(st->fd, st->buffer + sent, length - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+
+        pthread_mutex_lock(&set->lock);
+        if (sent < length) {
+            if (!set->failed && !set->stopping)
+                perror("[NET] Striped connection failed");
+            set->failed = 1;
+        } else {
+            st->frames++;
+            st->bytes += length;
+        }
+        st->length = 0;
+        pthread_cond_broadcast(&set->idle);
+    }
+    pthread_mutex_unlock(&set->lock);
+    return NULL;
+}
+
+int stripe_start(struct stripe_set *set, const int *fds, int count) {
+    if (!set->initialized) {
+        pthread_mutex_init(&set->lock, NULL);
+        pthread_cond_init(&set->work, NULL);
+        pthread_cond_init(&set->idle, NULL);
+        set->initialized = 1;
+    }
+
+    pthread_mutex_lock(&set->lock);
+    set->failed = 0;
+    set->stopping = 0;
+    set->count = 0;
+    pthread_mutex_unlock(&set->lock);
+    for (int i = 0; i < count; i++) {
+        struct stripe *st = &set->stripes[i];
+        st->fd = fds[i];
+        st->length = 0;
+        st->set = set;
+        if (pthread_create(&st->thread, NULL, stripe_thread, st) != 0) {
+            perror("[NET] Stripe thread creation failed");
+            for (int j = i; j < count; j++)
+                close(fds[j]);
+            stripe_close(set, 0);
+            return -1;
+        }
+        set->count = i + 1;
+    }
+    return 0;
+}
+
+int stripe_send(struct stripe_set *set, const void *prefix, size_t prefix_len, const struct iovec *pieces, int count) {
+    struct stripe *best = NULL;
+    size_t length = prefix_len;
+
+    for (int i = 0; i < count; i++)
+        length += pieces[i].iov_len;
+
+    pthread_mutex_lock(&set->lock);
+    for (;;) {
+        if (set->failed || set->count == 0) {
+            pthread_mutex_unlock(&set->lock);
+            return -1;
+        }
+        /* SIOCOUTQ gives the bytes the server has not acknowledged yet: the idle connection with the fewest is the one
+           whose flow is moving best. The scan starts after the last connection used, so ties go round-robin. */
+        int best_queued = 0;
+        for (int k = 1; k <= set->count; k++) {
+            struct stripe *st = &set->stripes[(set->last + k) % set->count];
+            int queued = 0;
+            if (st->length != 0)
+                continue;
+            ioctl(st->fd, SIOCOUTQ, &queued);
+            if (best == NULL || queued < best_queued) {
+                best = st;
+                best_queued = queued;
+            }
+        }
+        if (best != NULL)
+            break;
+        pthread_cond_wait(&set->idle, &set->lock);
+    }
+    set->last = (int)(best - set->stripes);
+    pthread_mutex_unlock(&set->lock);
+
+    /* The thread of an idle connection does not touch its buffer, so the copy is made without the lock. */
+    if (best->capacity < length) {
+        uint8_t *bigger = realloc(best->buffer, length);
+        if (bigger == NULL) {
+            perror("[NET] Stripe buffer allocation failed");
+            return -1;
+        }
+        best->buffer = bigger;
+        best->capacity = length;
+    }
+    memcpy(best->buffer, prefix, prefix_len);
+    size_t offset = prefix_len;
+    for (int i = 0; i < count; i++) {
+        memcpy(best->buffer + offset, pieces[i].iov_base, pieces[i].iov_len);
+        offset += pieces[i].iov_len;
+    }
+
+    pthread_mutex_lock(&set->lock);
+    best->length = length;
+    pthread_cond_broadcast(&set->work);
+    pthread_mutex_unlock(&set->lock);
+    return 0;
+}
+
+void stripe_close(struct stripe_set *set, int flush) {
+    if (!set->initialized)
+        return;
+    pthread_mutex_lock(&set->lock);
+    if (flush) {
+        for (int i = 0; i < set->count; i++)
+            while (set->stripes[i].length != 0 && !set->failed)
+                pthread_cond_wait(&set->idle, &set->lock);
+    }
+    /* Shutting the sockets down wakes up the threads blocked in a send. */
+    set->stopping = 1;
+    for (int i = 0; i < set->count; i++)
+        shutdown(set->stripes[i].fd, SHUT_RDWR);
+    pthread_cond_broadcast(&set->work);
+    int count = set->count;
+    pthread_mutex_unlock(&set->lock);
+
+    for (int i = 0; i < count; i++) {
+        pthread_join(set->stripes[i].thread, NULL);
+        close(set->stripes[i].fd);
+        set->stripes[i].fd = -1;
+    }
+    pthread_mutex_lock(&set->lock);
+    set->count = 0;
+    pthread_mutex_unlock(&set->lock);
+}
+
+int stripe_failed(struct stripe_set *set) {
+    if (!set->initialized)
+        return 0;
+    pthread_mutex_lock(&set->lock);
+    int failed = set->failed;
+    pthread_mutex_unlock(&set->lock);
+    return failed;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file stripe.h
+ * @brief Striped sending: the frames of one stream are spread over several TCP connections to the same server.
+ *
+ * A single TCP flow is limited by the one core that copies its data in the sender and in the receiver, which is far
+ * below a 10G link for raw 4K capture. Each connection of the set has its own sender thread; a frame is copied into
+ * the buffer of the least loaded idle connection (the one with the fewest bytes still queued in its socket) and the
+ * caller returns at once, so the copies into the kernel, and the server threads receiving them, run in parallel.
+ * Each frame carries its position in the stream (frame_header.order), by which the server puts them back in order.
+ */
+
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/* Most connections a stream can be striped over. */
+#define MAX_STRIPES 16
+
+/* One connection of the set and the frame message it is sending. */
+struct stripe {
+    int fd;
+    pthread_t thread;
+    uint8_t *buffer;            // Frame message being sent: message type, header, filename and payload
+    size_t capacity;
+    size_t length;              // Bytes of the message, 0 while the connection is idle
+    long frames;                // Frames sent on this connection since the program started
+    uint64_t bytes;
+    struct stripe_set *set;
+};
+
+/* Zero-initialize before first use. */
+struct stripe_set {
+    struct stripe stripes[MAX_STRIPES];
+    int count;                  // Connections of the set, 0 while it is closed
+    int last;                   // Connection given the last frame
+    int failed;                 // A connection failed: the set must be closed and opened again
+    int stopping;
+    int initialized;            // The lock and conditions below are initialized (by the first stripe_start())
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // A frame was handed to a connection, or the set is closing
+    pthread_cond_t idle;        // A connection finished its frame
+};
+
+/**
+ * @brief Starts a sender thread on each of the given connected sockets, which the set then owns.
+ * @return 0 on success, -1 if a thread could not be created (the sockets are closed).
+ */
+int stripe_start(struct stripe_set *set, const int *fds, int count);
+
+/**
+ * @brief Copies a frame message (prefix, then the payload pieces) to the least loaded connection, waiting for one to
+ * be idle if they are all busy. The caller's buffers can be reused as soon as it returns. Called by one thread at a time.
+ * @return 0 on success, -1 if a connection of the set failed.
+ */
+int stripe_send(struct stripe_set *set, const void *prefix, size_t prefix_len, const struct iovec *pieces, int count);
+
+/**
+ * @brief Closes the set. With flush set, the frames being sent are completed first; otherwise the connections are
+ * shut down at once (after a failure).
+ */
+void stripe_close(struct stripe_set *set, int flush);
+
+/**
+ * @brief Tells whether a connection of the set failed, so the stream must move to new connections.
+ */
+int stripe_failed(struct stripe_set *set);
+
+#endif
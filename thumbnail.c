@@ -0,0 +1,138 @@
+/**
+ * @file thumbnail.c
+ * @brief Thumbnail workers. Frames are entropy-decoded keeping only DC coefficients, which directly give the 8x8 block averages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "jpeg.h"
+#include "thumbnail.h"
+
+/* Number of pending frames the queue can hold. */
+#define QUEUE_SIZE 1024
+
+struct thumbnail_job {
+    struct stream_index *idx;
+    int64_t position;
+    char filename[128];
+};
+
+static struct thumbnail_job queue[QUEUE_SIZE];
+static unsigned int queue_head, queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+void thumbnail_submit(struct stream_index *idx, int64_t position, const char *filename) {
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail - queue_head < QUEUE_SIZE) {
+        struct thumbnail_job *job = &queue[queue_tail % QUEUE_SIZE];
+        job->idx = idx;
+        job->position = position;
+        snprintf(job->filename, sizeof(job->filename), "%s", filename);
+        queue_tail++;
+        pthread_cond_signal(&queue_ready);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static uint8_t *load_file(const char *filename, size_t *size) {
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) return NULL;
+
+    uint8_t *data = NULL;
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    rewind(fp);
+    if (length > 0 && (data = malloc(length)) != NULL && fread(data, 1, length, fp) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    *size = data ? (size_t)length : 0;
+    fclose(fp);
+    return data;
+}
+
+static unsigned int isqrt(unsigned long v) {
+    unsigned long r = 0;
+    while ((r + 1) * (r + 1) <= v) r++;
+    return (unsigned int)r;
+}
+
+/* Computes mean, range and standard deviation of the luma plane and stores them in the record. */
+static void luma_statistics(const uint8_t *luma, int pixels, struct index_record *rec) {
+    unsigned long sum = 0, sum_sq = 0;
+    int lo = 255, hi = 0;
+
+    for (int i = 0; i < pixels; i++) {
+        sum += luma[i];
+        sum_sq += (unsigned long)luma[i] * luma[i];
+        if (luma[i] < lo) lo = luma[i];
+        if (luma[i] > hi) hi = luma[i];
+    }
+    unsigned long mean = sum / pixels;
+    rec->luma_mean = (uint8_t)mean;
+    rec->luma_min = (uint8_t)lo;
+    rec->luma_max = (uint8_t)hi;
+    rec->luma_contrast = (uint8_t)isqrt(sum_sq / pixels - mean * mean);
+}
+
+static void process_job(const struct thumbnail_job *job) {
+    struct jpeg_image img;
+    struct index_record rec;
+    size_t size;
+
+    uint8_t *data = load_file(job->filename, &size);
+    if (data == NULL) return;
+    int decoded = jpeg_decode_dc(data, size, &img);
+    free(data);
+    if (decoded < 0) return; // Not an MJPEG frame: no thumbnail
+
+    int width = (img.width + 7) / 8;
+    int height = (img.height + 7) / 8;
+    uint8_t *luma = malloc((size_t)width * height);
+    uint8_t *rgb = malloc((size_t)width * height * 3);
+
+    if (luma && rgb && index_read(job->idx, job->position, &rec) == 0) {
+        jpeg_dc_thumbnail(&img, luma, rgb);
+        luma_statistics(luma, width * height, &rec);
+        if (index_store_thumbnail(job->idx, &rec, rgb, width, height) == 0)
+            index_update_thumbnail(job->idx, job->position, &rec);
+    }
+    free(luma);
+    free(rgb);
+    jpeg_free(&img);
+}
+
+static void *thumbnail_thread(void *arg) {
+    struct thumbnail_job job;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == queue_tail)
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        job = queue[queue_head % QUEUE_SIZE];
+        queue_head++;
+        pthread_mutex_unlock(&queue_lock);
+
+        process_job(&job);
+    }
+    return NULL;
+}
+
+int thumbnail_start(int workers) {
+    int started = 0;
+
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, thumbnail_thread, NULL) != 0) {
+            perror("[THUMBNAIL] Thread creation failed");
+            continue;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+    return started > 0 ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+/**
+ * @file thumbnail.h
+ * @brief Worker pool producing 1/8-scale thumbnails and brightness statistics for stored frames from their DC coefficients.
+ */
+
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include <stdint.h>
+#include "index.h"
+
+/**
+ * @brief Starts the worker threads.
+ * @return 0 on success, -1 if no worker could be created.
+ */
+int thumbnail_start(int workers);
+
+/**
+ * @brief Queues the frame stored at the given index position. Never blocks: if the queue is full the frame gets no thumbnail.
+ */
+void thumbnail_submit(struct stream_index *idx, int64_t position, const char *filename);
+
+#endif
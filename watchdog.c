@@ -0,0 +1,71 @@
+/**
+ * @file watchdog.c
+ * @brief Capture stall watchdog: smoothed frame interval, deadline, escalation and outage accounting.
+ */
+
+#include <string.h>
+#include "watchdog.h"
+
+/* Frame interval assumed until the driver or the first frames tell otherwise. */
+#define DEFAULT_INTERVAL_US 100000
+
+/* Time allowed for the next frame: a few frame intervals, never less than the lower bound. */
+static int64_t frame_deadline(const struct watchdog *wd) {
+    int64_t allowed = wd->interval_us * WATCHDOG_MISSED_FRAMES;
+    return allowed > WATCHDOG_MIN_MS * 1000LL ? allowed : WATCHDOG_MIN_MS * 1000LL;
+}
+
+void watchdog_init(struct watchdog *wd, int64_t nominal_interval_us, int64_t now_us) {
+    memset(wd, 0, sizeof(*wd));
+    wd->interval_us = nominal_interval_us > 0 ? nominal_interval_us : DEFAULT_INTERVAL_US;
+    wd->last_frame_us = now_us;
+    /* The first frame of a stream usually takes longer (sensor start-up, auto exposure). */
+    wd->deadline_us = now_us + frame_deadline(wd) + WATCHDOG_RECOVERY_MS * 1000LL;
+}
+
+int64_t watchdog_frame(struct watchdog *wd, int64_t now_us) {
+    int64_t outage = 0;
+
+    if (wd->outage_start_us != 0) {
+        outage = now_us - wd->outage_start_us;
+        wd->outages++;
+        wd->outage_total_us += outage;
+        if (outage > wd->outage_longest_us)
+            wd->outage_longest_us = outage;
+        wd->outage_start_us = 0;
+        wd->level = 0;
+    } else {
+        /* Exponential average over about 8 frames; a gap long enough to trip the deadline is not a frame interval. */
+        int64_t gap = now_us - wd->last_frame_us;
+        if (gap > 0 && gap < frame_deadline(wd))
+            wd->interval_us += (gap - wd->interval_us) / 8;
+    }
+    wd->last_frame_us = now_us;
+    wd->deadline_us = now_us + frame_deadline(wd);
+    return outage;
+}
+
+int64_t watchdog_remaining(const struct watchdog *wd, int64_t now_us) {
+    return wd->deadline_us > now_us ? wd->deadline_us - now_us : 0;
+}
+
+int watchdog_check(struct watchdog *wd, int64_t now_us) {
+    if (now_us < wd->deadline_us)
+        return 0;
+
+    if (wd->outage_start_us == 0) {
+        wd->outage_start_us = wd->last_frame_us;
+        wd->backoff_us = WATCHDOG_RECOVERY_MS * 1000LL;
+    } else if (wd->level == WATCHDOG_REOPEN && wd->backoff_us < WATCHDOG_MAX_BACKOFF_MS * 1000LL) {
+        wd->backoff_us *= 2; // A device that keeps failing is retried less and less often
+    }
+    if (wd->level < WATCHDOG_REOPEN)
+        wd->level++;
+    wd->deadline_us = now_us + wd->backoff_us;
+    return wd->level;
+}
+
+void watchdog_defer(struct watchdog *wd, int64_t now_us, int64_t delay_us) {
+    if (wd->deadline_us < now_us + delay_us)
+        wd->deadline_us = now_us + delay_us;
+}
@@ -0,0 +1,66 @@
+/**
+ * @file watchdog.h
+ * @brief Capture stall detection: frame-interval deadlines and escalating recovery steps.
+ *
+ * The watchdog only keeps time and decides; the caller performs the recovery step it is told to take.
+ * A stall is declared when no frame arrived for WATCHDOG_MISSED_FRAMES frame intervals (at least WATCHDOG_MIN_MS).
+ * Each further missed deadline escalates to the next step, and the outage lasts until the next frame arrives.
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>
+
+/* Recovery steps, from the cheapest to the most thorough. */
+#define WATCHDOG_RESTREAM 1     // STREAMOFF then STREAMON with the same buffers
+#define WATCHDOG_REALLOCATE 2   // Buffers released, format negotiated again and buffers reallocated
+#define WATCHDOG_REOPEN 3       // Device closed and opened again, as after an unplug
+
+/* Deadlines: frame intervals missed before a stall is declared, lower bound, and time given to each recovery step
+   (doubled at every repeated reopen, up to the maximum). */
+#define WATCHDOG_MISSED_FRAMES 5
+#define WATCHDOG_MIN_MS 250
+#define WATCHDOG_RECOVERY_MS 1000
+#define WATCHDOG_MAX_BACKOFF_MS 8000
+
+struct watchdog {
+    int64_t interval_us;        // Smoothed interval between frames
+    int64_t last_frame_us;      // Monotonic time of the last frame
+    int64_t deadline_us;        // Time by which the next frame must have arrived
+    int64_t backoff_us;         // Time given to the current recovery step
+    int64_t outage_start_us;    // Time of the last frame before the stall, 0 while capture is healthy
+    int level;                  // Last recovery step taken in the current outage
+    long outages;               // Stalls since start-up, with their total and longest duration
+    int64_t outage_total_us;
+    int64_t outage_longest_us;
+};
+
+/**
+ * @brief Arms the watchdog. nominal_interval_us is the frame interval the driver announced (0 if unknown).
+ */
+void watchdog_init(struct watchdog *wd, int64_t nominal_interval_us, int64_t now_us);
+
+/**
+ * @brief Records the arrival of a frame.
+ * @return Duration of the outage this frame ends (from the last frame before it), or 0 if capture was healthy.
+ */
+int64_t watchdog_frame(struct watchdog *wd, int64_t now_us);
+
+/**
+ * @brief Microseconds left until the deadline (0 if it has passed), to bound the wait for the next frame.
+ */
+int64_t watchdog_remaining(const struct watchdog *wd, int64_t now_us);
+
+/**
+ * @brief Checks the deadline. When it has passed, the outage starts (or continues) and the next deadline is set.
+ * @return The recovery step to take now (WATCHDOG_*), or 0 if the deadline has not passed.
+ */
+int watchdog_check(struct watchdog *wd, int64_t now_us);
+
+/**
+ * @brief Pushes the deadline back by delay_us at least, for an expected pause in capture (a restart after a source change).
+ */
+void watchdog_defer(struct watchdog *wd, int64_t now_us, int64_t delay_us);
+
+#endif